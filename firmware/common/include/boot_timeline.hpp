@@ -0,0 +1,67 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef COMMON_BOOT_TIMELINE
+#define COMMON_BOOT_TIMELINE
+
+// in the order they usually happen
+typedef enum {
+  // tud_init done, the computer can start enumerating the pedal
+  BOOT_DEVICE_STACK = 0,
+  // tuh_init done on core1, plugged in devices can start enumerating
+  BOOT_HOST_STACK,
+  // first keyboard or mouse mounted
+  BOOT_HOST_MOUNT,
+  // first report in from it
+  BOOT_FIRST_REPORT,
+  // first report handed on to the computer
+  BOOT_FIRST_FORWARD,
+  // settings read out of the EEPROM
+  BOOT_SETTINGS,
+  // the saved FX slot is initialized, the pedal is all the way up
+  BOOT_FX_READY,
+  BOOT_PHASE_COUNT
+} boot_phase_t;
+
+static const char *const boot_phase_names[BOOT_PHASE_COUNT] = {
+    "device_stack", "host_stack", "host_mount", "first_report",
+    "first_forward", "settings", "fx_ready"};
+
+// When each boot phase first happened, in us since boot. Always built in, a
+// mark is a compare and, the first time, a store. Phases get marked from both
+// cores, 32 bit stores don't tear, and if both cores race for the first
+// forward either time is good enough.
+class BootTimeline {
+ public:
+  // only the first mark of a phase counts
+  inline void mark(boot_phase_t phase, uint32_t time_us) {
+    if (marks[phase] == 0) marks[phase] = time_us == 0 ? 1 : time_us;
+  }
+
+  inline bool has(boot_phase_t phase) const { return marks[phase] != 0; }
+
+  // 0 if it hasn't happened
+  inline uint32_t get(boot_phase_t phase) const { return marks[phase]; }
+
+  // One line per phase that happened, in phase order. Returns false once
+  // there's nothing left, *line is the caller's cursor and starts at 0.
+  bool format_line(size_t *line, char *buf, size_t len) const {
+    while (*line < BOOT_PHASE_COUNT) {
+      boot_phase_t phase = (boot_phase_t)*line;
+      (*line)++;
+      uint32_t t = marks[phase];
+      if (t == 0) continue;
+      snprintf(buf, len, "boot %s: %lu.%03lums", boot_phase_names[phase],
+               (unsigned long)(t / 1000), (unsigned long)(t % 1000));
+      return true;
+    }
+    *line = 0;
+    return false;
+  }
+
+ private:
+  volatile uint32_t marks[BOOT_PHASE_COUNT] = {0};
+};
+
+#endif
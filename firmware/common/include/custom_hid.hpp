@@ -5,6 +5,12 @@
 #ifndef CUSTOM_HID_H
 #define CUSTOM_HID_H
 
+// tinyusb isn't available when building common code for the host, so match
+// its definition from tusb_compiler.h (keep identical to avoid redefinition)
+#ifndef TU_ATTR_PACKED
+#define TU_ATTR_PACKED __attribute__ ((packed))
+#endif
+
 // should absolutely always be 6, according to spec
 #define REPORT_KEYCODE_COUNT 6
 
@@ -21,6 +27,7 @@
 #define HID_KEY_ARROW_UP 0x52
 #define HID_KEY_SPACE 0x2C
 #define HID_KEY_ENTER 0x28
+#define HID_KEY_SCROLL_LOCK 0x47
 
 // IMPORTANT!!! should be identical to hid_mouse_report_t:
 // https://github.com/hathach/tinyusb/blob/master/src/class/hid/hid.h
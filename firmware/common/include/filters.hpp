@@ -0,0 +1,198 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifndef COMMON_FILTERS
+#define COMMON_FILTERS
+
+// Streaming integer filters, every push() is O(1). Samples are the int16
+// values that come out of HID reports, any internal state that needs more
+// precision is kept in fixed point.
+
+#define FILTER_FRAC_BITS 8
+#define FILTER_ONE (1 << FILTER_FRAC_BITS)
+#define FILTER_PI 3.14159265f
+
+// rounds towards zero, so state decays all the way to 0 in both directions
+static inline int32_t filter_q16_mul(int32_t v, uint32_t q16) {
+  int64_t r = ((int64_t)v * q16) / 65536;
+  return (int32_t)r;
+}
+
+// Moving average over the last `window` samples, kept as a running sum.
+template <size_t N>
+class MovingAverage {
+ public:
+  void reset() {
+    for (size_t i = 0; i < N; i++) buf[i] = 0;
+    head = 0;
+    sum = 0;
+  }
+
+  // O(window), only call when the setting changes
+  void set_window(size_t w) {
+    window = w < 1 ? 1 : (w > N ? N : w);
+    sum = 0;
+    size_t i = head;
+    for (size_t j = 0; j < window; j++) {
+      sum += buf[i];
+      i = i == 0 ? N - 1 : i - 1;
+    }
+  }
+
+  size_t get_window() { return window; }
+
+  int16_t push(int16_t v) {
+    if (++head == N) head = 0;
+    // the sample that just fell out of the window
+    size_t out = head >= window ? head - window : head + N - window;
+    sum += v - buf[out];
+    buf[head] = v;
+    return average();
+  }
+
+  // Time-aware decay: pushes `samples` worth of silence. Returns the sum of
+  // the averages that would have been output along the way. Never costs more
+  // than the window, after that the output is 0 anyway.
+  int32_t decay(uint32_t samples) {
+    if (samples > window) samples = window;
+    int32_t total = 0;
+    for (uint32_t i = 0; i < samples; i++) total += push(0);
+    return total;
+  }
+
+  int32_t get_sum() { return sum; }
+  int16_t average() { return (int16_t)(sum / (int32_t)window); }
+
+ private:
+  int16_t buf[N] = {0};
+  size_t head = 0;
+  size_t window = N;
+  int32_t sum = 0;
+};
+
+// Exponential moving average, alpha is Q16.
+class Ema {
+ public:
+  void reset() { state = 0; }
+  void set_alpha(float alpha) { this->alpha = (uint32_t)(alpha * 65536.0f); }
+  // alpha for a time constant, given the rate push() is called at
+  void set_time_constant(uint32_t tau_ms, uint32_t sample_ms) {
+    alpha = (uint32_t)(((uint64_t)sample_ms << 16) / (tau_ms + sample_ms));
+  }
+
+  int16_t push(int16_t v) {
+    int32_t target = v * FILTER_ONE;
+    state += filter_q16_mul(target - state, alpha);
+    return value();
+  }
+
+  // time-aware decay towards 0 over `samples` periods of silence
+  void decay(uint32_t samples) {
+    for (uint32_t i = 0; i < samples && state != 0; i++) {
+      int32_t step = filter_q16_mul(state, alpha);
+      // always make progress, tiny states would otherwise round to no change
+      if (step == 0) step = state > 0 ? 1 : -1;
+      state -= step;
+    }
+  }
+
+  int16_t value() { return (int16_t)(state / FILTER_ONE); }
+  int32_t raw() { return state; }
+
+ private:
+  uint32_t alpha = 65536;
+  // Q8
+  int32_t state = 0;
+};
+
+// One-euro filter (Casiez et al.), integer flavor. Heavily smoothed while the
+// signal is slow, less so as it speeds up, so jitter drops without lag when
+// moving fast. Expressed as time constants rather than cutoff frequencies,
+// which keeps it free of trig and floats.
+class OneEuro {
+ public:
+  void reset() {
+    state = 0;
+    last = 0;
+    speed.reset();
+  }
+
+  // min_tau_ms: smoothing at rest, beta: how quickly smoothing drops off with
+  // speed (Q8), d_tau_ms: smoothing of the speed estimate itself
+  void configure(uint32_t min_tau_ms, uint32_t beta, uint32_t d_tau_ms) {
+    this->min_tau_ms = min_tau_ms;
+    this->beta = beta;
+    this->d_tau_ms = d_tau_ms;
+  }
+
+  int16_t push(int16_t v, uint32_t dt_ms) {
+    if (dt_ms == 0) dt_ms = 1;
+    int32_t target = v * FILTER_ONE;
+    speed.set_time_constant(d_tau_ms, dt_ms);
+    int32_t dx = speed.push((int16_t)((target - last) / FILTER_ONE));
+    last = target;
+    uint32_t tau = (min_tau_ms * FILTER_ONE) / (FILTER_ONE + beta * abs(dx));
+    uint32_t alpha = (uint32_t)(((uint64_t)dt_ms << 16) / (tau + dt_ms));
+    state += filter_q16_mul(target - state, alpha);
+    return (int16_t)(state / FILTER_ONE);
+  }
+
+ private:
+  uint32_t min_tau_ms = 30;
+  uint32_t beta = 16;
+  uint32_t d_tau_ms = 10;
+  Ema speed;
+  int32_t state = 0;
+  int32_t last = 0;
+};
+
+// Second order IIR section, direct form 1 with Q14 coefficients. Coefficients
+// are computed in float, but only when the setting changes.
+class Biquad {
+ public:
+  void reset() { x1 = x2 = y1 = y2 = 0; }
+
+  // RBJ cookbook low pass
+  void set_lowpass(float cutoff_hz, float sample_hz, float q) {
+    float w0 = 2.0f * FILTER_PI * cutoff_hz / sample_hz;
+    float alpha = sinf(w0) / (2.0f * q);
+    float cosw0 = cosf(w0);
+    float a0 = 1.0f + alpha;
+    set_coefficients((1.0f - cosw0) / 2.0f / a0, (1.0f - cosw0) / a0,
+                     (1.0f - cosw0) / 2.0f / a0, -2.0f * cosw0 / a0,
+                     (1.0f - alpha) / a0);
+  }
+
+  void set_coefficients(float b0, float b1, float b2, float a1, float a2) {
+    this->b0 = (int32_t)lroundf(b0 * 16384.0f);
+    this->b1 = (int32_t)lroundf(b1 * 16384.0f);
+    this->b2 = (int32_t)lroundf(b2 * 16384.0f);
+    this->a1 = (int32_t)lroundf(a1 * 16384.0f);
+    this->a2 = (int32_t)lroundf(a2 * 16384.0f);
+  }
+
+  int16_t push(int16_t v) {
+    int32_t x0 = v * FILTER_ONE;
+    int64_t acc = (int64_t)b0 * x0 + (int64_t)b1 * x1 + (int64_t)b2 * x2 -
+                  (int64_t)a1 * y1 - (int64_t)a2 * y2;
+    int32_t y0 = (int32_t)(acc / 16384);
+    x2 = x1;
+    x1 = x0;
+    y2 = y1;
+    y1 = y0;
+    return (int16_t)(y0 / FILTER_ONE);
+  }
+
+  // time-aware decay towards 0 over `samples` periods of silence
+  void decay(uint32_t samples) {
+    for (uint32_t i = 0; i < samples && (x1 || x2 || y1 || y2); i++) push(0);
+  }
+
+ private:
+  int32_t b0 = 16384, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
+  // Q8
+  int32_t x1 = 0, x2 = 0, y1 = 0, y2 = 0;
+};
+
+#endif
@@ -0,0 +1,89 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <new>
+
+#include "util.h"
+
+#ifndef COMMON_FX_ARENA
+#define COMMON_FX_ARENA
+
+#define FX_ARENA_ALIGN 8
+
+// Memory for the state of whichever FX is running. Only one FX per device is
+// initialized at a time, so every mouse FX shares one arena and every
+// keyboard FX another: state is constructed in initialize(), destroyed in
+// deinit(), and switching slots reuses the same bytes instead of every FX
+// holding its buffers for the life of the firmware.
+class FxArena {
+ public:
+  FxArena(void *memory, size_t capacity)
+      : memory(memory), capacity(capacity) {}
+
+  // nullptr if another FX still holds the arena or T doesn't fit
+  template <typename T, typename... Args>
+  T *create(const void *owner, Args... args) {
+    // initialized twice, start over
+    if (occupant == owner) release(owner);
+    if (occupant) {
+      log_line("fx arena busy, %u bytes still held", (unsigned)used);
+      return nullptr;
+    }
+    if (sizeof(T) > capacity) {
+      log_line("fx state needs %u bytes, arena has %u", (unsigned)sizeof(T),
+               (unsigned)capacity);
+      return nullptr;
+    }
+    occupant = owner;
+    used = sizeof(T);
+    if (used > high_water) high_water = used;
+    destructor = destroy<T>;
+    return new (memory) T(args...);
+  }
+
+  // destroys owner's state, does nothing if owner doesn't hold the arena
+  void release(const void *owner) {
+    if (!occupant || occupant != owner) return;
+    destructor(memory);
+    occupant = nullptr;
+    used = 0;
+  }
+
+  inline size_t get_capacity() { return capacity; }
+  inline size_t get_used() { return used; }
+  // biggest state that's been constructed here
+  inline size_t get_high_water() { return high_water; }
+  inline const void *get_occupant() { return occupant; }
+
+ private:
+  void *memory;
+  size_t capacity;
+  size_t used = 0;
+  size_t high_water = 0;
+  const void *occupant = nullptr;
+  void (*destructor)(void *) = nullptr;
+
+  template <typename T>
+  static void destroy(void *state) {
+    static_cast<T *>(state)->~T();
+  }
+};
+
+template <size_t N>
+class StaticFxArena : public FxArena {
+ public:
+  StaticFxArena() : FxArena(storage, N) {}
+
+ private:
+  alignas(FX_ARENA_ALIGN) uint8_t storage[N];
+};
+
+// size an arena has to be to hold any of the given states
+template <typename... T>
+constexpr size_t fx_arena_size() {
+  size_t size = 0;
+  ((size = sizeof(T) > size ? sizeof(T) : size), ...);
+  return size;
+}
+
+#endif
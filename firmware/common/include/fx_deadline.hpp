@@ -0,0 +1,76 @@
+#include <stdint.h>
+
+#include "fx_time.hpp"
+
+#ifndef COMMON_FX_DEADLINE
+#define COMMON_FX_DEADLINE
+
+// an FX call taking longer than this is an overrun. A 1 kHz device sends a
+// report every ms, 2 ms lets an FX have a slow call without input piling up.
+#define FX_DEADLINE_BUDGET_US 2000
+// overruns in a row, each within FX_DEADLINE_WINDOW_MS of the one before,
+// before the FX gets bypassed
+#define FX_DEADLINE_STRIKES 3
+// an overrun this long after the last one starts the count over. On time calls
+// in between don't, a tick running every ms would pay back every slow report.
+#define FX_DEADLINE_WINDOW_MS 1000
+// how long the first bypass lasts, each one after that lasts twice as long
+#define FX_DEADLINE_BACKOFF_MS 1000
+#define FX_DEADLINE_MAX_BACKOFF_MS 32000
+
+// Times the calls into one FX and bypasses it once it keeps running over its
+// budget, so input goes through passthrough at bounded latency instead of
+// waiting on it (or tripping the watchdog). After the back-off the FX gets
+// another go, with its state left the way it was, like the foot switch turning
+// it off and on.
+class FxDeadline {
+ public:
+  // times one call, true if this overrun is the one that bypasses the FX
+  bool check(fx_time_t start_us, fx_time_t end_us) {
+    uint32_t end_ms = fx_ms(end_us);
+    // back-off is over, this was the FX's retry
+    if (bypassed && !is_bypassed(end_ms)) bypassed = false;
+    if (end_us - start_us <= FX_DEADLINE_BUDGET_US || bypassed) return false;
+    if (strikes > 0 && end_ms - last_overrun_ms >= FX_DEADLINE_WINDOW_MS) {
+      strikes = 0;
+    }
+    last_overrun_ms = end_ms;
+    if (++strikes < FX_DEADLINE_STRIKES) return false;
+    strikes = 0;
+    retry_at_ms = end_ms + backoff_ms;
+    bypassed = true;
+    last_backoff_ms = backoff_ms;
+    backoff_ms = backoff_ms * 2 > FX_DEADLINE_MAX_BACKOFF_MS
+                     ? FX_DEADLINE_MAX_BACKOFF_MS
+                     : backoff_ms * 2;
+    failovers++;
+    return true;
+  }
+
+  inline bool is_bypassed(uint32_t time_ms) const {
+    return bypassed && (int32_t)(time_ms - retry_at_ms) < 0;
+  }
+
+  // a different FX, it starts with a clean slate
+  void reset() {
+    bypassed = false;
+    strikes = 0;
+    backoff_ms = FX_DEADLINE_BACKOFF_MS;
+  }
+
+  // how long the latest bypass lasts
+  inline uint32_t get_backoff_ms() const { return last_backoff_ms; }
+
+  inline uint32_t get_failovers() const { return failovers; }
+
+ private:
+  bool bypassed = false;
+  uint32_t retry_at_ms = 0;
+  uint8_t strikes = 0;
+  uint32_t last_overrun_ms = 0;
+  uint32_t backoff_ms = FX_DEADLINE_BACKOFF_MS;
+  uint32_t last_backoff_ms = 0;
+  uint32_t failovers = 0;
+};
+
+#endif
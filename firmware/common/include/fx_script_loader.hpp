@@ -0,0 +1,181 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fx_vm.hpp"
+#include "kbd_fx/kbd_fx_script.hpp"
+#include "mouse_fx/mouse_fx_script.hpp"
+#include "pedal_engine.hpp"
+#include "script_store.hpp"
+#include "util.h"
+
+#ifndef COMMON_FX_SCRIPT_LOADER
+#define COMMON_FX_SCRIPT_LOADER
+
+// Takes a script image uploaded over the REPL in hex chunks, verifies it,
+// swaps it into the FX slot its header names and saves it so it's back after
+// a reboot. One script at a time, a new one puts back the FX the last one
+// replaced first.
+class ScriptLoader {
+ public:
+  ScriptLoader(PedalEngine *engine, IScriptStore *store, MouseScript *mouse,
+               KeyboardScript *keyboard)
+      : engine(engine), store(store), mouse(mouse), keyboard(keyboard) {}
+
+  // installs the saved script, if there is one. Before the engine is
+  // initialized, so a script in the saved slot is what starts.
+  void initialize() {
+    store->initialize();
+    uint32_t len = 0;
+    const uint8_t *stored = store->getScript(&len);
+    if (!stored || len > sizeof(image)) return;
+    memcpy(image, stored, len);
+    image_len = len;
+    if (install()) log_installed("stored script");
+  }
+
+  // throws away anything uploaded so far
+  void begin() {
+    upload_len = 0;
+    uploading = true;
+  }
+
+  // the next chunk of the image, as hex
+  bool append_hex(const char *hex) {
+    if (!uploading) {
+      log_line("no script upload in progress, start with cmd:script:begin");
+      return false;
+    }
+    uint8_t *out = (uint8_t *)upload;
+    for (; hex[0] != 0; hex += 2) {
+      int high = hex_digit(hex[0]);
+      int low = hex[1] ? hex_digit(hex[1]) : -1;
+      if (high < 0 || low < 0 || upload_len >= sizeof(upload)) {
+        log_line(upload_len >= sizeof(upload) ? "script too big"
+                                              : "bad hex in script");
+        uploading = false;
+        return false;
+      }
+      out[upload_len++] = (uint8_t)((high << 4) | low);
+    }
+    return true;
+  }
+
+  // verifies the upload and swaps it in
+  bool finish() {
+    if (!uploading) {
+      log_line("no script upload in progress, start with cmd:script:begin");
+      return false;
+    }
+    uploading = false;
+    vm_program_t checked;
+    vm_error_t err =
+        vm_verify((const uint8_t *)upload, upload_len, MAX_FX, &checked);
+    if (err != VM_OK) {
+      log_line("script rejected: %s", vm_error_names[err]);
+      return false;
+    }
+    // the store may still be writing out of image
+    if (store->isBusy()) {
+      log_line("script store busy, try again");
+      return false;
+    }
+    if (!uninstall()) return false;
+    memcpy(image, upload, upload_len);
+    image_len = upload_len;
+    if (!install()) return false;
+    store->saveScript((const uint8_t *)image, image_len);
+    log_installed("script");
+    return true;
+  }
+
+  // puts back the FX the script replaced and forgets it
+  bool clear() {
+    if (store->isBusy()) {
+      log_line("script store busy, try again");
+      return false;
+    }
+    if (!uninstall()) return false;
+    image_len = 0;
+    store->eraseScript();
+    log_line("script cleared");
+    return true;
+  }
+
+  // the native FX behind the script was swapped for another (the keyboard
+  // looper setting), the script gives back the new one when it goes
+  void swap_replaced_keyboard_fx(IKeyboardFx *from, IKeyboardFx *to) {
+    if (replaced_keyboard == from) replaced_keyboard = to;
+  }
+
+  inline bool is_installed() const {
+    return replaced_mouse != nullptr || replaced_keyboard != nullptr;
+  }
+
+  inline vm_program_t const *get_program() const {
+    return is_installed() ? &program : nullptr;
+  }
+
+ private:
+  PedalEngine *engine;
+  IScriptStore *store;
+  MouseScript *mouse;
+  KeyboardScript *keyboard;
+  // word aligned, the VM reads instructions straight out of them
+  uint32_t upload[VM_MAX_IMAGE_SIZE / 4];
+  size_t upload_len = 0;
+  bool uploading = false;
+  // the installed script, what program points into
+  uint32_t image[VM_MAX_IMAGE_SIZE / 4];
+  size_t image_len = 0;
+  vm_program_t program;
+  // the native FX the script took the place of, nullptr while none is
+  // installed
+  IMouseFx *replaced_mouse = nullptr;
+  IKeyboardFx *replaced_keyboard = nullptr;
+
+  static inline int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  }
+
+  inline uint8_t slot() const { return program.header.slot - 1; }
+
+  bool install() {
+    if (vm_verify((const uint8_t *)image, image_len, MAX_FX, &program) !=
+        VM_OK) {
+      return false;
+    }
+    if (program.header.device == VM_DEVICE_MOUSE) {
+      mouse->set_program(&program);
+      replaced_mouse = engine->replace_mouse_fx(slot(), mouse);
+    } else {
+      keyboard->set_program(&program);
+      replaced_keyboard = engine->replace_keyboard_fx(slot(), keyboard);
+    }
+    if (!is_installed()) log_line("fx slot %u is busy, try again", slot() + 1);
+    return is_installed();
+  }
+
+  bool uninstall() {
+    if (replaced_mouse && engine->replace_mouse_fx(slot(), replaced_mouse)) {
+      replaced_mouse = nullptr;
+    }
+    if (replaced_keyboard &&
+        engine->replace_keyboard_fx(slot(), replaced_keyboard)) {
+      replaced_keyboard = nullptr;
+    }
+    if (is_installed()) log_line("fx slot %u is busy, try again", slot() + 1);
+    return !is_installed();
+  }
+
+  void log_installed(const char *what) {
+    log_line("%s in %s fx slot %u, %lu cycles max", what,
+             program.header.device == VM_DEVICE_MOUSE ? "mouse" : "keyboard",
+             slot() + 1, (unsigned long)program.max_cycles);
+  }
+};
+
+#endif
@@ -0,0 +1,24 @@
+#include <stdint.h>
+
+#ifndef COMMON_FX_TIME
+#define COMMON_FX_TIME
+
+// FX are handed microseconds since boot. A 1 kHz mouse sends a report every
+// millisecond, so in whole ms two reports in a row can land on the same
+// timestamp and anything timed off them is off by up to a report. 64 bits
+// never wrap.
+typedef uint64_t fx_time_t;
+
+#define FX_US_PER_MS 1000
+
+// for the things that still run in ms: LED animations, the tempo clock and
+// the key sequencer. Wraps after 49 days like the old ms clock did.
+static inline uint32_t fx_ms(fx_time_t time_us) {
+  return (uint32_t)(time_us / FX_US_PER_MS);
+}
+
+static inline fx_time_t fx_us(uint32_t time_ms) {
+  return (fx_time_t)time_ms * FX_US_PER_MS;
+}
+
+#endif
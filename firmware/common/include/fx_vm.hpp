@@ -0,0 +1,547 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fx_time.hpp"
+#include "util.h"
+
+#ifndef COMMON_FX_VM
+#define COMMON_FX_VM
+
+// IMPORTANT!!! the image format below is what gets uploaded and stored in
+// flash, changing it means scripts have to be assembled again
+#define VM_MAGIC 0x4D564148  // "HAVM"
+#define VM_VERSION 1
+
+#define VM_REGISTERS 16
+// words a script keeps between runs, a power of two so indexes can be masked
+#define VM_STATE_WORDS 64
+#define VM_MAX_CODE 256
+#define VM_MAX_LOOP_DEPTH 2
+// Most instructions one run may take, counting every loop iteration. The
+// verifier proves a script stays under it before it's ever run. Sized so even
+// a worst case run fits FX_DEADLINE_BUDGET_US on the pedal, see the
+// script_worst bench row.
+#define VM_MAX_CYCLES 2048
+// reports one run can send
+#define VM_MAX_SENDS 4
+// for entry points a script doesn't have
+#define VM_NO_ENTRY 0xFFFF
+
+typedef enum {
+  VM_DEVICE_MOUSE = 0,
+  VM_DEVICE_KEYBOARD,
+} vm_device_t;
+
+typedef struct {
+  uint32_t magic;
+  uint8_t version;
+  // vm_device_t
+  uint8_t device;
+  // FX slot it replaces, 1 to MAX_FX
+  uint8_t slot;
+  uint8_t reserved;
+  // instruction index each run starts at
+  uint16_t on_report;
+  uint16_t on_tick;
+  // instructions following the header
+  uint16_t code_len;
+  uint16_t reserved2;
+} vm_header_t;
+
+#define VM_MAX_IMAGE_SIZE (sizeof(vm_header_t) + (VM_MAX_CODE * 4))
+
+// Instructions are 32 bits, little endian:
+//   bits 0-7 op, 8-11 register a, 12-15 register b, 16-31 signed immediate
+typedef enum {
+  VM_HALT = 0,
+  // a = imm
+  VM_LDI,
+  // top half of a = imm, after an LDI for 32 bit constants
+  VM_LDIH,
+  // a = b
+  VM_MOV,
+  // a = a op b
+  VM_ADD,
+  VM_SUB,
+  VM_MUL,
+  // dividing by 0 gives 0
+  VM_DIV,
+  VM_MOD,
+  VM_AND,
+  VM_OR,
+  VM_XOR,
+  VM_SHL,
+  // arithmetic
+  VM_SHR,
+  VM_MIN,
+  VM_MAX,
+  // a = 1 if a < b else 0
+  VM_SLT,
+  // a = 1 if a == b else 0
+  VM_SEQ,
+  // a = a op imm
+  VM_ADDI,
+  VM_MULI,
+  VM_SHLI,
+  VM_SHRI,
+  // a = op a
+  VM_ABS,
+  VM_NEG,
+  // a = random, 0 to imm
+  VM_RAND,
+  // skip imm instructions forward, jumps never go backwards
+  VM_JMP,
+  // same, if a is 0 / isn't
+  VM_JZ,
+  VM_JNZ,
+  // Runs the next (imm >> 8) instructions (imm & 0xFF) times. The only way to
+  // repeat anything, so every run ends.
+  VM_LOOP,
+  // a = one of the vm_field_t inputs
+  VM_IN,
+  // a report field of what gets sent = a
+  VM_OUT,
+  // a = state[imm], state[imm] = a
+  VM_LD,
+  VM_ST,
+  // a = state[b], state[b] = a, b wraps around the state
+  VM_LDX,
+  VM_STX,
+  // sends the output report
+  VM_SEND,
+  VM_OP_COUNT
+} vm_op_t;
+
+// what IN reads and OUT writes. Report fields start out as the report being
+// processed, on a tick as the last one with no motion.
+typedef enum {
+  VM_FIELD_BUTTONS = 0,
+  VM_FIELD_X,
+  VM_FIELD_Y,
+  VM_FIELD_WHEEL,
+  VM_FIELD_PAN,
+  VM_FIELD_MODIFIER,
+  VM_FIELD_KEY0,
+  VM_FIELD_KEY5 = VM_FIELD_KEY0 + 5,
+  // report fields above, read only below
+  VM_FIELD_REPORT_COUNT,
+  // knob, 0 to 1000
+  VM_FIELD_PARAM = VM_FIELD_REPORT_COUNT,
+  // ms since the FX was initialized
+  VM_FIELD_TIME_MS,
+  // ms since the previous run
+  VM_FIELD_DT_MS,
+  // 0 for a report, 1 for a tick
+  VM_FIELD_EVENT,
+  // a beat at the pedal's tempo, in ms
+  VM_FIELD_BEAT_MS,
+  VM_FIELD_COUNT
+} vm_field_t;
+
+typedef enum {
+  VM_OK = 0,
+  VM_ERR_SIZE,
+  VM_ERR_MAGIC,
+  VM_ERR_VERSION,
+  VM_ERR_DEVICE,
+  VM_ERR_SLOT,
+  VM_ERR_ENTRY,
+  VM_ERR_OPCODE,
+  VM_ERR_FIELD,
+  VM_ERR_STATE,
+  VM_ERR_JUMP,
+  VM_ERR_LOOP,
+  VM_ERR_CYCLES,
+  VM_ERR_COUNT
+} vm_error_t;
+
+static const char *const vm_error_names[VM_ERR_COUNT] = {
+    "ok",           "bad size",       "not a script",  "wrong version",
+    "bad device",   "bad slot",       "bad entry",     "bad opcode",
+    "bad field",    "state out of range", "bad jump",  "bad loop",
+    "too many cycles"};
+
+static inline uint32_t vm_encode(vm_op_t op, uint8_t a, uint8_t b,
+                                 int16_t imm) {
+  return (uint32_t)op | ((uint32_t)(a & 0xF) << 8) |
+         ((uint32_t)(b & 0xF) << 12) | ((uint32_t)(uint16_t)imm << 16);
+}
+
+static inline uint8_t vm_op(uint32_t ins) { return ins & 0xFF; }
+static inline uint8_t vm_a(uint32_t ins) { return (ins >> 8) & 0xF; }
+static inline uint8_t vm_b(uint32_t ins) { return (ins >> 12) & 0xF; }
+static inline int16_t vm_imm(uint32_t ins) { return (int16_t)(ins >> 16); }
+
+// the body of a LOOP, [start, end)
+typedef struct {
+  uint16_t start;
+  uint16_t end;
+  uint8_t count;
+} vm_loop_t;
+
+// A verified script, pointing into the image it came from.
+typedef struct {
+  vm_header_t header;
+  const uint32_t *code;
+  // worst case instructions per run, from the verifier
+  uint32_t max_cycles;
+} vm_program_t;
+
+// Checks everything the VM relies on, so it never has to check at run time:
+// fields and state indexes are in range, jumps only go forward and stay inside
+// their loop, loops nest at most VM_MAX_LOOP_DEPTH deep, and the worst case
+// run, every instruction taken every iteration, fits VM_MAX_CYCLES.
+static vm_error_t vm_verify(const uint8_t *image, size_t len, uint8_t max_slot,
+                            vm_program_t *program) {
+  if (len < sizeof(vm_header_t)) return VM_ERR_SIZE;
+  vm_header_t h;
+  memcpy(&h, image, sizeof(h));
+  if (h.magic != VM_MAGIC) return VM_ERR_MAGIC;
+  if (h.version != VM_VERSION) return VM_ERR_VERSION;
+  if (h.device > VM_DEVICE_KEYBOARD) return VM_ERR_DEVICE;
+  if (h.slot < 1 || h.slot > max_slot) return VM_ERR_SLOT;
+  if (h.code_len == 0 || h.code_len > VM_MAX_CODE ||
+      len != sizeof(vm_header_t) + (h.code_len * 4u)) {
+    return VM_ERR_SIZE;
+  }
+  // the image is copied to a word aligned buffer before it gets here
+  const uint32_t *code = (const uint32_t *)(image + sizeof(vm_header_t));
+
+  // loops first, everything else is checked against them
+  vm_loop_t loops[VM_MAX_CODE];
+  size_t loop_count = 0;
+  uint16_t open[VM_MAX_LOOP_DEPTH];
+  size_t depth = 0;
+  for (uint16_t pc = 0; pc < h.code_len; pc++) {
+    while (depth > 0 && loops[open[depth - 1]].end <= pc) depth--;
+    if (vm_op(code[pc]) != VM_LOOP) continue;
+    uint16_t imm = (uint16_t)vm_imm(code[pc]);
+    vm_loop_t l = {(uint16_t)(pc + 1), (uint16_t)(pc + 1 + (imm >> 8)),
+                   (uint8_t)(imm & 0xFF)};
+    if (l.count == 0 || l.end == l.start || l.end > h.code_len) {
+      return VM_ERR_LOOP;
+    }
+    if (depth == VM_MAX_LOOP_DEPTH) return VM_ERR_LOOP;
+    if (depth > 0 && l.end > loops[open[depth - 1]].end) return VM_ERR_LOOP;
+    open[depth++] = loop_count;
+    loops[loop_count++] = l;
+  }
+
+  // innermost loop a position is in, or -1
+  auto loop_of = [&](uint16_t pc) -> int {
+    int found = -1;
+    for (size_t i = 0; i < loop_count; i++) {
+      if (pc >= loops[i].start && pc < loops[i].end) found = (int)i;
+    }
+    return found;
+  };
+
+  if (h.on_report >= h.code_len || loop_of(h.on_report) >= 0) {
+    return VM_ERR_ENTRY;
+  }
+  if (h.on_tick != VM_NO_ENTRY &&
+      (h.on_tick >= h.code_len || loop_of(h.on_tick) >= 0)) {
+    return VM_ERR_ENTRY;
+  }
+
+  uint32_t cycles = 0;
+  for (uint16_t pc = 0; pc < h.code_len; pc++) {
+    uint32_t ins = code[pc];
+    uint8_t op = vm_op(ins);
+    int16_t imm = vm_imm(ins);
+    if (op >= VM_OP_COUNT) return VM_ERR_OPCODE;
+    switch (op) {
+      case VM_IN:
+        if (imm < 0 || imm >= VM_FIELD_COUNT) return VM_ERR_FIELD;
+        break;
+      case VM_OUT:
+        if (imm < 0 || imm >= VM_FIELD_REPORT_COUNT) return VM_ERR_FIELD;
+        break;
+      case VM_LD:
+      case VM_ST:
+        if (imm < 0 || imm >= VM_STATE_WORDS) return VM_ERR_STATE;
+        break;
+      case VM_SHLI:
+      case VM_SHRI:
+        if (imm < 0 || imm > 31) return VM_ERR_FIELD;
+        break;
+      case VM_RAND:
+        if (imm <= 0) return VM_ERR_FIELD;
+        break;
+      case VM_JMP:
+      case VM_JZ:
+      case VM_JNZ: {
+        if (imm < 0) return VM_ERR_JUMP;
+        uint32_t target = pc + 1 + imm;
+        if (target > h.code_len) return VM_ERR_JUMP;
+        // can land on the end of its own loops (the next iteration), can't
+        // jump into or out of one
+        for (size_t i = 0; i < loop_count; i++) {
+          bool from = pc >= loops[i].start && pc < loops[i].end;
+          bool to = target >= loops[i].start && target < loops[i].end;
+          if (from != to && !(from && target == loops[i].end)) {
+            return VM_ERR_JUMP;
+          }
+        }
+        break;
+      }
+    }
+    // every instruction as if it ran on every iteration of its loops
+    uint32_t weight = 1;
+    for (size_t i = 0; i < loop_count; i++) {
+      if (pc >= loops[i].start && pc < loops[i].end) weight *= loops[i].count;
+    }
+    cycles += weight;
+    if (cycles > VM_MAX_CYCLES) return VM_ERR_CYCLES;
+  }
+
+  program->header = h;
+  program->code = code;
+  program->max_cycles = cycles;
+  return VM_OK;
+}
+
+// what a run sees and changes
+typedef struct {
+  int32_t fields[VM_FIELD_COUNT];
+  int32_t state[VM_STATE_WORDS];
+} vm_io_t;
+
+// Runs verified programs. Keeps nothing between runs, the caller owns the
+// state words. Returns the reports sent through send(), which the caller
+// handles.
+class FxVm {
+ public:
+  // a verified program only, see vm_verify()
+  template <typename Send>
+  uint32_t run(vm_program_t const *program, uint16_t entry, vm_io_t *io,
+               Send send) {
+    int32_t r[VM_REGISTERS] = {0};
+    vm_loop_t loops[VM_MAX_LOOP_DEPTH];
+    size_t depth = 0;
+    uint32_t sends = 0;
+    uint32_t cycles = 0;
+    const uint32_t *code = program->code;
+    uint16_t len = program->header.code_len;
+    uint16_t pc = entry;
+    while (pc < len && cycles++ < VM_MAX_CYCLES) {
+      uint32_t ins = code[pc];
+      int32_t *a = &r[vm_a(ins)];
+      int32_t b = r[vm_b(ins)];
+      int16_t imm = vm_imm(ins);
+      pc++;
+      switch (vm_op(ins)) {
+        case VM_HALT:
+          // out of every loop too, a loop can end where the code does
+          pc = len;
+          depth = 0;
+          break;
+        case VM_LDI:
+          *a = imm;
+          break;
+        case VM_LDIH:
+          *a = (int32_t)(((uint32_t)*a & 0xFFFF) | ((uint32_t)imm << 16));
+          break;
+        case VM_MOV:
+          *a = b;
+          break;
+        case VM_ADD:
+          *a = (int32_t)((uint32_t)*a + (uint32_t)b);
+          break;
+        case VM_SUB:
+          *a = (int32_t)((uint32_t)*a - (uint32_t)b);
+          break;
+        case VM_MUL:
+          *a = (int32_t)((uint32_t)*a * (uint32_t)b);
+          break;
+        case VM_DIV:
+          *a = divide(*a, b, false);
+          break;
+        case VM_MOD:
+          *a = divide(*a, b, true);
+          break;
+        case VM_AND:
+          *a &= b;
+          break;
+        case VM_OR:
+          *a |= b;
+          break;
+        case VM_XOR:
+          *a ^= b;
+          break;
+        case VM_SHL:
+          *a = (int32_t)((uint32_t)*a << (b & 31));
+          break;
+        case VM_SHR:
+          *a >>= (b & 31);
+          break;
+        case VM_MIN:
+          if (b < *a) *a = b;
+          break;
+        case VM_MAX:
+          if (b > *a) *a = b;
+          break;
+        case VM_SLT:
+          *a = *a < b;
+          break;
+        case VM_SEQ:
+          *a = *a == b;
+          break;
+        case VM_ADDI:
+          *a = (int32_t)((uint32_t)*a + (uint32_t)(int32_t)imm);
+          break;
+        case VM_MULI:
+          *a = (int32_t)((uint32_t)*a * (uint32_t)(int32_t)imm);
+          break;
+        case VM_SHLI:
+          *a = (int32_t)((uint32_t)*a << imm);
+          break;
+        case VM_SHRI:
+          *a >>= imm;
+          break;
+        case VM_ABS:
+          if (*a < 0) *a = (int32_t)(0u - (uint32_t)*a);
+          break;
+        case VM_NEG:
+          *a = (int32_t)(0u - (uint32_t)*a);
+          break;
+        case VM_RAND: {
+          uint32_t v = get_random_byte() | (get_random_byte() << 8);
+          *a = (int32_t)(v % ((uint32_t)imm + 1));
+          break;
+        }
+        case VM_JMP:
+          pc += imm;
+          break;
+        case VM_JZ:
+          if (*a == 0) pc += imm;
+          break;
+        case VM_JNZ:
+          if (*a != 0) pc += imm;
+          break;
+        case VM_LOOP: {
+          uint16_t body = (uint16_t)imm;
+          loops[depth++] = {pc, (uint16_t)(pc + (body >> 8)),
+                            (uint8_t)(body & 0xFF)};
+          break;
+        }
+        case VM_IN:
+          *a = io->fields[imm];
+          break;
+        case VM_OUT:
+          io->fields[imm] = *a;
+          break;
+        case VM_LD:
+          *a = io->state[imm];
+          break;
+        case VM_ST:
+          io->state[imm] = *a;
+          break;
+        case VM_LDX:
+          *a = io->state[b & (VM_STATE_WORDS - 1)];
+          break;
+        case VM_STX:
+          io->state[b & (VM_STATE_WORDS - 1)] = *a;
+          break;
+        case VM_SEND:
+          if (sends < VM_MAX_SENDS) {
+            sends++;
+            send(io);
+          }
+          break;
+      }
+      // the end of a loop body, round again or carry on after it. Nested
+      // loops can end on the same instruction.
+      while (depth > 0 && pc == loops[depth - 1].end) {
+        if (--loops[depth - 1].count > 0) {
+          pc = loops[depth - 1].start;
+          break;
+        }
+        depth--;
+      }
+    }
+    last_cycles = cycles;
+    return sends;
+  }
+
+  // instructions the last run took
+  inline uint32_t get_last_cycles() const { return last_cycles; }
+
+ private:
+  uint32_t last_cycles = 0;
+
+  static inline int32_t divide(int32_t a, int32_t b, bool remainder) {
+    if (b == 0) return 0;
+    // the one division that overflows
+    if (a == INT32_MIN && b == -1) return remainder ? 0 : INT32_MIN;
+    return remainder ? a % b : a / b;
+  }
+};
+
+// What the FX adapters share: the VM, the io a script sees and the state it
+// keeps, and the read only fields kept up to date for every run.
+class FxScriptRunner {
+ public:
+  inline void set_program(vm_program_t const *p) { program = p; }
+
+  inline vm_program_t const *get_program() const { return program; }
+
+  // a fresh start, state and report fields cleared
+  void begin(fx_time_t time_us, float param_percentage) {
+    memset(&io, 0, sizeof(io));
+    start_us = time_us;
+    last_run_us = time_us;
+    last_tick_ms = fx_ms(time_us);
+    set_param(param_percentage);
+  }
+
+  inline void set_param(float percentage) {
+    io.fields[VM_FIELD_PARAM] = (int32_t)(percentage * 1000.0f + 0.5f);
+  }
+
+  // Ticks come every main loop pass, scripts get at most one per ms. False
+  // without an on_tick entry.
+  inline bool tick_due(fx_time_t time_us) {
+    if (!program || program->header.on_tick == VM_NO_ENTRY) return false;
+    uint32_t time_ms = fx_ms(time_us);
+    if (time_ms == last_tick_ms) return false;
+    last_tick_ms = time_ms;
+    return true;
+  }
+
+  // runs the report or tick entry, send(io) for every SEND
+  template <typename Send>
+  uint32_t run(bool on_tick, fx_time_t time_us, uint32_t beat_ms, Send send) {
+    if (!program) return 0;
+    io.fields[VM_FIELD_TIME_MS] = (int32_t)fx_ms(time_us - start_us);
+    io.fields[VM_FIELD_DT_MS] = (int32_t)fx_ms(time_us - last_run_us);
+    io.fields[VM_FIELD_EVENT] = on_tick ? 1 : 0;
+    io.fields[VM_FIELD_BEAT_MS] = (int32_t)beat_ms;
+    last_run_us = time_us;
+    uint16_t entry =
+        on_tick ? program->header.on_tick : program->header.on_report;
+    return vm.run(program, entry, &io, send);
+  }
+
+  inline int32_t *fields() { return io.fields; }
+
+  // what a report field ends up as in an 8 bit report
+  static inline int8_t to_axis(int32_t v) {
+    return (int8_t)(v > 127 ? 127 : (v < -127 ? -127 : v));
+  }
+
+  static inline uint8_t to_byte(int32_t v) { return (uint8_t)(v & 0xFF); }
+
+  inline uint32_t get_last_cycles() const { return vm.get_last_cycles(); }
+
+ private:
+  vm_program_t const *program = nullptr;
+  FxVm vm;
+  vm_io_t io = {};
+  fx_time_t start_us = 0;
+  fx_time_t last_run_us = 0;
+  uint32_t last_tick_ms = 0;
+};
+
+#endif
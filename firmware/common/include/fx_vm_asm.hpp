@@ -0,0 +1,356 @@
+#include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fx_vm.hpp"
+
+#ifndef COMMON_FX_VM_ASM
+#define COMMON_FX_VM_ASM
+
+// Host side only: test/vm_asm.cpp and the tests, not built into the firmware.
+#define VM_ASM_MAX_LABELS 64
+#define VM_ASM_MAX_NAME 32
+#define VM_ASM_MAX_LINE 128
+
+// Turns FX script source into an image vm_verify() takes. One instruction or
+// directive per line, ';' starts a comment:
+//
+//   .device mouse          ; or keyboard
+//   .slot 2                ; FX slot it replaces, 1-4
+//   .on_report main        ; entry points, on_report defaults to the first
+//   .on_tick idle          ; instruction, without on_tick ticks do nothing
+//   main:
+//     in r0, x             ; r0 = the report's x
+//     muli r0, -1
+//     out x, r0
+//     send
+//     halt
+//
+// Registers are r0-r15, immediates are 16 bit except ldi's, which takes
+// anything 32 bit and becomes ldi + ldih when it has to. Jumps take a label
+// and only go forward. "loop n" repeats everything up to its "end" n times,
+// n from 1 to 255.
+class VmAssembler {
+ public:
+  // false with a message in err if the source doesn't assemble
+  bool assemble(const char *src, uint8_t *out, size_t cap, size_t *len,
+                char *err, size_t err_len) {
+    this->err = err;
+    this->err_len = err_len;
+    if (err_len > 0) err[0] = 0;
+    header = {VM_MAGIC, VM_VERSION, 0xFF, 0, 0, 0, VM_NO_ENTRY, 0, 0};
+    code_len = 0;
+    label_count = 0;
+    fixup_count = 0;
+    loop_depth = 0;
+    report_label[0] = 0;
+    tick_label[0] = 0;
+    line_number = 0;
+
+    const char *line = src;
+    while (*line) {
+      line_number++;
+      const char *next = strchr(line, '\n');
+      size_t n = next ? (size_t)(next - line) : strlen(line);
+      if (n >= VM_ASM_MAX_LINE) return fail("line too long");
+      char buf[VM_ASM_MAX_LINE];
+      memcpy(buf, line, n);
+      buf[n] = 0;
+      if (!parse_line(buf)) return false;
+      line = next ? next + 1 : line + n;
+    }
+    if (loop_depth > 0) return fail("loop without an end");
+    if (header.device == 0xFF) return fail("missing .device");
+    if (header.slot == 0) return fail("missing .slot");
+    if (code_len == 0) return fail("no instructions");
+    for (size_t i = 0; i < fixup_count; i++) {
+      line_number = fixups[i].line;
+      int target = find_label(fixups[i].name);
+      if (target < 0) return fail("unknown label %s", fixups[i].name);
+      int offset = target - (fixups[i].pc + 1);
+      if (offset < 0) return fail("jumps only go forward");
+      code[fixups[i].pc] |= (uint32_t)(uint16_t)offset << 16;
+    }
+    line_number = 0;
+    if (report_label[0]) {
+      int target = find_label(report_label);
+      if (target < 0) return fail("unknown label %s", report_label);
+      header.on_report = target;
+    }
+    if (tick_label[0]) {
+      int target = find_label(tick_label);
+      if (target < 0) return fail("unknown label %s", tick_label);
+      header.on_tick = target;
+    }
+    header.code_len = code_len;
+    size_t size = sizeof(header) + (code_len * 4);
+    if (size > cap) return fail("image doesn't fit");
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + sizeof(header), code, code_len * 4);
+    *len = size;
+    return true;
+  }
+
+ private:
+  typedef struct {
+    char name[VM_ASM_MAX_NAME];
+    uint16_t pc;
+  } label_t;
+
+  typedef struct {
+    char name[VM_ASM_MAX_NAME];
+    uint16_t pc;
+    uint32_t line;
+  } fixup_t;
+
+  char *err;
+  size_t err_len;
+  uint32_t line_number;
+  vm_header_t header;
+  uint32_t code[VM_MAX_CODE];
+  uint16_t code_len;
+  label_t labels[VM_ASM_MAX_LABELS];
+  size_t label_count;
+  fixup_t fixups[VM_MAX_CODE];
+  size_t fixup_count;
+  uint16_t loop_starts[VM_MAX_LOOP_DEPTH];
+  size_t loop_depth;
+  char report_label[VM_ASM_MAX_NAME];
+  char tick_label[VM_ASM_MAX_NAME];
+
+  bool fail(const char *format, ...) {
+    if (err_len == 0) return false;
+    size_t n = 0;
+    if (line_number > 0) {
+      n = snprintf(err, err_len, "line %lu: ", (unsigned long)line_number);
+      if (n >= err_len) return false;
+    }
+    va_list args;
+    va_start(args, format);
+    vsnprintf(err + n, err_len - n, format, args);
+    va_end(args);
+    return false;
+  }
+
+  int find_label(const char *name) {
+    for (size_t i = 0; i < label_count; i++) {
+      if (strcmp(labels[i].name, name) == 0) return labels[i].pc;
+    }
+    return -1;
+  }
+
+  bool emit(vm_op_t op, uint8_t a, uint8_t b, int32_t imm) {
+    if (code_len >= VM_MAX_CODE) return fail("more than %d instructions",
+                                             VM_MAX_CODE);
+    code[code_len++] = vm_encode(op, a, b, (int16_t)imm);
+    return true;
+  }
+
+  static bool parse_int(const char *s, int32_t *v) {
+    char *end = NULL;
+    long long n = strtoll(s, &end, 0);
+    if (end == s || *end != 0 || n < INT32_MIN || n > UINT32_MAX) return false;
+    *v = (int32_t)(uint32_t)n;
+    return true;
+  }
+
+  bool reg(const char *s, uint8_t *r) {
+    int32_t n;
+    if ((s[0] != 'r' && s[0] != 'R') || !parse_int(s + 1, &n) || n < 0 ||
+        n >= VM_REGISTERS) {
+      return fail("expected a register, got %s", s);
+    }
+    *r = n;
+    return true;
+  }
+
+  bool imm16(const char *s, int32_t *v) {
+    if (!parse_int(s, v) || *v < INT16_MIN || *v > INT16_MAX) {
+      return fail("expected a 16 bit number, got %s", s);
+    }
+    return true;
+  }
+
+  bool field(const char *s, int32_t *f) {
+    static const char *const names[VM_FIELD_COUNT] = {
+        "buttons", "x",     "y",       "wheel", "pan",   "modifier",
+        "key0",    "key1",  "key2",    "key3",  "key4",  "key5",
+        "param",   "time_ms", "dt_ms", "event", "beat_ms"};
+    for (int32_t i = 0; i < VM_FIELD_COUNT; i++) {
+      if (strcmp(s, names[i]) == 0) {
+        *f = i;
+        return true;
+      }
+    }
+    return fail("unknown field %s", s);
+  }
+
+  bool name(const char *s, char *out) {
+    size_t n = strlen(s);
+    if (n == 0 || n >= VM_ASM_MAX_NAME) return fail("bad label %s", s);
+    for (size_t i = 0; i < n; i++) {
+      if (!isalnum((unsigned char)s[i]) && s[i] != '_') {
+        return fail("bad label %s", s);
+      }
+    }
+    memcpy(out, s, n + 1);
+    return true;
+  }
+
+  bool jump_to(vm_op_t op, uint8_t a, const char *label) {
+    if (fixup_count >= VM_MAX_CODE) return fail("too many jumps");
+    fixup_t *f = &fixups[fixup_count];
+    if (!name(label, f->name)) return false;
+    f->pc = code_len;
+    f->line = line_number;
+    fixup_count++;
+    return emit(op, a, 0, 0);
+  }
+
+  bool parse_line(char *line) {
+    char *comment = strchr(line, ';');
+    if (comment) *comment = 0;
+    char *t[4] = {NULL};
+    size_t n = 0;
+    for (char *tok = strtok(line, " \t\r,"); tok; tok = strtok(NULL, " \t\r,")) {
+      if (n == 4) return fail("too many operands");
+      t[n++] = tok;
+    }
+    if (n == 0) return true;
+    size_t first_len = strlen(t[0]);
+    if (t[0][first_len - 1] == ':') {
+      if (n > 1) return fail("a label goes on its own line");
+      t[0][first_len - 1] = 0;
+      if (label_count >= VM_ASM_MAX_LABELS) return fail("too many labels");
+      if (!name(t[0], labels[label_count].name)) return false;
+      if (find_label(t[0]) >= 0) return fail("label %s defined twice", t[0]);
+      labels[label_count++].pc = code_len;
+      return true;
+    }
+    if (t[0][0] == '.') return directive(t, n);
+    return instruction(t, n);
+  }
+
+  bool directive(char **t, size_t n) {
+    if (n != 2) return fail("%s takes one argument", t[0]);
+    if (strcmp(t[0], ".device") == 0) {
+      if (strcmp(t[1], "mouse") == 0) {
+        header.device = VM_DEVICE_MOUSE;
+      } else if (strcmp(t[1], "keyboard") == 0) {
+        header.device = VM_DEVICE_KEYBOARD;
+      } else {
+        return fail(".device is mouse or keyboard");
+      }
+    } else if (strcmp(t[0], ".slot") == 0) {
+      int32_t slot;
+      if (!parse_int(t[1], &slot) || slot < 1 || slot > 255) {
+        return fail("bad slot %s", t[1]);
+      }
+      header.slot = slot;
+    } else if (strcmp(t[0], ".on_report") == 0) {
+      return name(t[1], report_label);
+    } else if (strcmp(t[0], ".on_tick") == 0) {
+      return name(t[1], tick_label);
+    } else {
+      return fail("unknown directive %s", t[0]);
+    }
+    return true;
+  }
+
+  bool instruction(char **t, size_t n) {
+    static const struct {
+      const char *name;
+      vm_op_t op;
+    } reg_reg[] = {{"mov", VM_MOV}, {"add", VM_ADD}, {"sub", VM_SUB},
+                   {"mul", VM_MUL}, {"div", VM_DIV}, {"mod", VM_MOD},
+                   {"and", VM_AND}, {"or", VM_OR},   {"xor", VM_XOR},
+                   {"shl", VM_SHL}, {"shr", VM_SHR}, {"min", VM_MIN},
+                   {"max", VM_MAX}, {"slt", VM_SLT}, {"seq", VM_SEQ},
+                   {"ldx", VM_LDX}},
+      reg_imm[] = {{"addi", VM_ADDI}, {"muli", VM_MULI}, {"shli", VM_SHLI},
+                   {"shri", VM_SHRI}, {"rand", VM_RAND}, {"ld", VM_LD}},
+      reg_only[] = {{"abs", VM_ABS}, {"neg", VM_NEG}};
+    const char *op = t[0];
+    uint8_t a, b;
+    int32_t v;
+    for (auto const &i : reg_reg) {
+      if (strcmp(op, i.name) != 0) continue;
+      if (n != 3) return fail("%s takes two registers", op);
+      return reg(t[1], &a) && reg(t[2], &b) && emit(i.op, a, b, 0);
+    }
+    for (auto const &i : reg_imm) {
+      if (strcmp(op, i.name) != 0) continue;
+      if (n != 3) return fail("%s takes a register and a number", op);
+      return reg(t[1], &a) && imm16(t[2], &v) && emit(i.op, a, 0, v);
+    }
+    for (auto const &i : reg_only) {
+      if (strcmp(op, i.name) != 0) continue;
+      if (n != 2) return fail("%s takes a register", op);
+      return reg(t[1], &a) && emit(i.op, a, 0, 0);
+    }
+    if (strcmp(op, "halt") == 0 || strcmp(op, "send") == 0) {
+      if (n != 1) return fail("%s takes nothing", op);
+      return emit(op[0] == 'h' ? VM_HALT : VM_SEND, 0, 0, 0);
+    } else if (strcmp(op, "ldi") == 0) {
+      if (n != 3) return fail("ldi takes a register and a number");
+      if (!reg(t[1], &a)) return false;
+      if (!parse_int(t[2], &v)) return fail("expected a number, got %s", t[2]);
+      if (v >= INT16_MIN && v <= INT16_MAX) return emit(VM_LDI, a, 0, v);
+      return emit(VM_LDI, a, 0, (int16_t)(v & 0xFFFF)) &&
+             emit(VM_LDIH, a, 0, (int16_t)((uint32_t)v >> 16));
+    } else if (strcmp(op, "in") == 0) {
+      if (n != 3) return fail("in takes a register and a field");
+      return reg(t[1], &a) && field(t[2], &v) && emit(VM_IN, a, 0, v);
+    } else if (strcmp(op, "out") == 0) {
+      if (n != 3) return fail("out takes a field and a register");
+      if (!field(t[1], &v) || !reg(t[2], &a)) return false;
+      if (v >= VM_FIELD_REPORT_COUNT) return fail("%s is read only", t[1]);
+      return emit(VM_OUT, a, 0, v);
+    } else if (strcmp(op, "st") == 0) {
+      if (n != 3) return fail("st takes a number and a register");
+      return imm16(t[1], &v) && reg(t[2], &a) && emit(VM_ST, a, 0, v);
+    } else if (strcmp(op, "stx") == 0) {
+      // state[b] = a
+      if (n != 3) return fail("stx takes two registers");
+      return reg(t[1], &b) && reg(t[2], &a) && emit(VM_STX, a, b, 0);
+    } else if (strcmp(op, "jmp") == 0) {
+      if (n != 2) return fail("jmp takes a label");
+      return jump_to(VM_JMP, 0, t[1]);
+    } else if (strcmp(op, "jz") == 0 || strcmp(op, "jnz") == 0) {
+      if (n != 3) return fail("%s takes a register and a label", op);
+      return reg(t[1], &a) && jump_to(op[1] == 'z' ? VM_JZ : VM_JNZ, a, t[2]);
+    } else if (strcmp(op, "loop") == 0) {
+      if (n != 2) return fail("loop takes a count");
+      if (!parse_int(t[1], &v) || v < 1 || v > 255) {
+        return fail("loop count is 1 to 255");
+      }
+      if (loop_depth >= VM_MAX_LOOP_DEPTH) {
+        return fail("loops nest %d deep at most", VM_MAX_LOOP_DEPTH);
+      }
+      loop_starts[loop_depth++] = code_len;
+      return emit(VM_LOOP, 0, 0, v);
+    } else if (strcmp(op, "end") == 0) {
+      if (n != 1) return fail("end takes nothing");
+      if (loop_depth == 0) return fail("end without a loop");
+      uint16_t start = loop_starts[--loop_depth];
+      uint32_t body = code_len - (start + 1);
+      if (body == 0 || body > 255) return fail("loop body is 1 to 255 long");
+      code[start] |= (body << 8) << 16;
+      return true;
+    }
+    return fail("unknown instruction %s", op);
+  }
+};
+
+// see VmAssembler
+static inline bool vm_assemble(const char *src, uint8_t *out, size_t cap,
+                               size_t *len, char *err, size_t err_len) {
+  static VmAssembler assembler;
+  return assembler.assemble(src, out, cap, len, err, err_len);
+}
+
+#endif
@@ -1,25 +1,66 @@
 #include "custom_hid.hpp"
+#include "fx_arena.hpp"
+#include "fx_time.hpp"
 #include "hid_output.hpp"
+#include "led_compositor.hpp"
+#include "tempo_clock.hpp"
 
 #ifndef HID_FX
 #define HID_FX
 
 class IFx {
  public:
-  explicit IFx(IHIDOutput *hid_output) { this->hid_output = hid_output; }
-  virtual void initialize(uint32_t time_ms, float param_percentage);
-  virtual void deinit();
-  virtual uint32_t get_current_pixel_value(uint32_t time_ms);
-  virtual void update_parameter(float percentage);
-  virtual void tick(uint32_t time_ms);
+  // FX with buffers construct them in arena, see fx_arena.hpp
+  explicit IFx(IHIDOutput *hid_output, FxArena *arena = nullptr) {
+    this->hid_output = hid_output;
+    this->arena = arena;
+  }
+  virtual ~IFx() { release_state(); }
+  // every time_us is microseconds since boot, see fx_time.hpp
+  virtual void initialize(fx_time_t time_us, float param_percentage) = 0;
+  virtual void deinit() = 0;
+  virtual void update_parameter(float percentage) = 0;
+  virtual void tick(fx_time_t time_us) = 0;
 
   uint32_t get_indicator_color() { return indicator_color; }
 
-  void set_indicator_color(uint32_t c) { indicator_color = c; }
+  void set_indicator_color(uint32_t c) {
+    indicator_color = c;
+    led.set_color(c);
+  }
+
+  // what the LED shows while this FX is on
+  LedLayer *get_led_layer() { return &led; }
+
+  // the tempo time based FX follow, shared by every FX
+  inline void set_tempo_clock(TempoClock const *clock) {
+    tempo = clock ? clock : default_tempo_clock();
+  }
+
+  // bytes initialize() takes out of the arena
+  virtual size_t get_state_size() { return 0; }
+
+  // false while something outside the FX still reads its state, it can't be
+  // deinit'd until then
+  virtual bool can_release() { return true; }
 
  protected:
   uint32_t indicator_color = 0xFF666666;
+  // set up when something changes, the compositor draws it every frame
+  LedLayer led;
   IHIDOutput *hid_output;
+  FxArena *arena;
+  TempoClock const *tempo = default_tempo_clock();
+
+  // nullptr without an arena, or if the state doesn't fit
+  template <typename T, typename... Args>
+  T *create_state(Args... args) {
+    return arena ? arena->create<T>(this, args...) : nullptr;
+  }
+
+  inline void release_state() {
+    if (arena) arena->release(this);
+  }
 };
 
 class IMouseFx : public IFx {
@@ -27,7 +68,9 @@ class IMouseFx : public IFx {
 
  public:
   virtual void process_mouse_report(ha_mouse_report_t const *report,
-                                    uint32_t time_ms) = 0;
+                                    fx_time_t time_us) = 0;
+  // a report handed over now would make it out to the computer
+  inline bool output_ready() { return hid_output && hid_output->mouse_ready(); }
   virtual ~IMouseFx() {}
 };
 
@@ -36,7 +79,11 @@ class IKeyboardFx : public IFx {
 
  public:
   virtual void process_keyboard_report(ha_keyboard_report_t const *report,
-                                       uint32_t time_ms) = 0;
+                                       fx_time_t time_us) = 0;
+  // a report handed over now would make it out to the computer
+  inline bool output_ready() {
+    return hid_output && hid_output->keyboard_ready();
+  }
   virtual ~IKeyboardFx() {}
 };
 
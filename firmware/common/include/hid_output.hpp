@@ -1,5 +1,7 @@
 #include <stdint.h>
 
+#include "key_state.hpp"
+
 #ifndef COMMON_HID_OUTPUT
 #define COMMON_HID_OUTPUT
 class IHIDOutput {
@@ -10,6 +12,19 @@ class IHIDOutput {
       bool process = false) = 0;
   virtual void send_keyboard_report(uint8_t modifier, uint8_t reserved,
                                     const uint8_t keycode[6]) = 0;
+  // Sends every key in `keys` as held, in a single report. Outputs that can
+  // only do 6KRO send the lowest max_keys() codes.
+  virtual void send_keys(uint8_t modifier, KeySet const &keys) {
+    uint8_t keycode[REPORT_KEYCODE_COUNT];
+    keys.to_keycodes(keycode, REPORT_KEYCODE_COUNT);
+    send_keyboard_report(modifier, 0, keycode);
+  }
+  // false while the host hasn't picked up the last keyboard report yet
+  virtual bool keyboard_ready() { return true; }
+  // same for the mouse, a report sent before then gets dropped
+  virtual bool mouse_ready() { return true; }
+  // how many non-modifier keys can be held in one report right now
+  virtual size_t max_keys() { return REPORT_KEYCODE_COUNT; }
   virtual ~IHIDOutput() = default;
 };
-#endif
\ No newline at end of file
+#endif
@@ -3,184 +3,328 @@
 
 #include "custom_hid.hpp"
 #include "hid_fx.hpp"
+#include "key_sequencer.hpp"
+#include "key_state.hpp"
+#include "persistence.hpp"
 
-// this one we can change
-#define DELAY_SLOT_COUNT 6
+// max number of keystrokes with echoes in flight at once, this one we can
+// change. The pool only takes up RAM while the delay is running.
+#define DELAY_EVENT_POOL_SIZE 128
 
+// how long each echo is held down for
 #define FLUSH_THRESHOLD_MS 20
+// accelerating echoes never get closer together than this
+#define DELAY_MIN_SPACING_MS 40
+// LED level at the bottom of each sawtooth cycle
+#define DELAY_LED_MIN 90
+// most echoes the knob picks, all the way up past it repeats forever
+#define DELAY_KNOB_MAX_REPEATS 11
 
+// how the time between repeats evolves
+enum DelayCurve {
+  DELAY_CURVE_FLAT = 0,
+  // alternates short/long gaps, like a stereo ping-pong delay
+  DELAY_CURVE_PING_PONG,
+  // each gap is 4/5 of the previous one, like a bouncing ball
+  DELAY_CURVE_ACCELERATING,
+  // each gap is 5/4 of the previous one
+  DELAY_CURVE_DECELERATING,
+  DELAY_CURVE_COUNT
+};
+
+// Echoes are scheduled on the tempo clock's ticks rather than in ms, so gaps
+// are exact subdivisions however many echoes there are, and echoes already in
+// flight follow along when the tempo changes.
 typedef struct {
-  uint32_t init_time;
+  // wrap-safe, low 32 bits of the clock position
+  uint32_t due_tick;
+  uint16_t spacing_ticks;
   uint8_t code;
   uint8_t count;
-  bool awaiting_release;
-} delay_slot_t;
+} delay_event_t;
 
 class KeyboardDelay : public IKeyboardFx {
-  using IKeyboardFx::IKeyboardFx;
-  ha_keyboard_report_t latest_report;
-  delay_slot_t slots[DELAY_SLOT_COUNT];
-  float cycle_progress = 0.0;
+ public:
+  // lives in the arena while the delay is running
+  struct State {
+    KeySequencer sequencer;
+    KeyStateTracker key_state;
+    key_events_t key_events;
+    // min-heap of pending echoes, ordered by due time
+    delay_event_t heap[DELAY_EVENT_POOL_SIZE];
+    size_t heap_len = 0;
+
+    explicit State(IHIDOutput *hid_output) : sequencer(hid_output) {}
+  };
+
+ private:
+  State *state = nullptr;
+  // echoes per key, < 0 repeats forever
   int16_t max_delay_count = 1;
-  uint32_t pixel_last_update = 0;
+  // what the knob picked, used unless the setting says otherwise
+  int16_t knob_delay_count = 1;
+  uint8_t repeats = DELAY_REPEATS_KNOB;
+  uint32_t led_cycle_start_ms = 0;
+  uint16_t delay_ticks = TEMPO_QUARTER;
+  // delay_ticks at the current tempo
   uint16_t delay_ms = 500;
-  uint8_t last_report_key_count = 0;
-  uint8_t slot_index = 0;
+  // when heap[0] is due, cached so an idle tick doesn't touch the clock
+  uint32_t next_due_ms = 0;
+  uint32_t tempo_generation = 0;
   uint16_t remaining_repeats = 0;
+  uint8_t curve = DELAY_CURVE_FLAT;
+  uint32_t dropped_echoes = 0;
+
+  // wrap-safe "a is due before b"
+  static inline bool before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+  }
 
-  inline void resend_latest_report() {
-    hid_output->send_keyboard_report(
-        latest_report.modifier, latest_report.reserved, latest_report.keycode);
+  void heap_push(delay_event_t e) {
+    size_t i = state->heap_len++;
+    while (i > 0) {
+      size_t parent = (i - 1) / 2;
+      if (!before(e.due_tick, state->heap[parent].due_tick)) break;
+      state->heap[i] = state->heap[parent];
+      i = parent;
+    }
+    state->heap[i] = e;
   }
 
-  void release_all(bool allow_blank_report) {
-    bool fire_blank_report = false;
-    for (size_t i = 0; i < DELAY_SLOT_COUNT; i++) {
-      if (slots[i].awaiting_release) {
-        fire_blank_report = true;
+  delay_event_t heap_pop() {
+    delay_event_t top = state->heap[0];
+    delay_event_t last = state->heap[--state->heap_len];
+    size_t i = 0;
+    while (true) {
+      size_t child = (2 * i) + 1;
+      if (child >= state->heap_len) break;
+      if (child + 1 < state->heap_len &&
+          before(state->heap[child + 1].due_tick,
+                 state->heap[child].due_tick)) {
+        child++;
       }
-      slots[i].awaiting_release = false;
+      if (!before(state->heap[child].due_tick, last.due_tick)) break;
+      state->heap[i] = state->heap[child];
+      i = child;
     }
-    if (allow_blank_report && fire_blank_report) {
-      resend_latest_report();
+    if (state->heap_len > 0) state->heap[i] = last;
+    return top;
+  }
+
+  // gap before the echo after `e`, in ticks
+  inline uint16_t next_spacing(delay_event_t const &e) {
+    switch (curve) {
+      case DELAY_CURVE_PING_PONG:
+        return (e.count & 1) ? (delay_ticks * 2) / 3 : (delay_ticks * 4) / 3;
+      case DELAY_CURVE_ACCELERATING:
+        return std::max<uint16_t>(tempo->ticks_for(DELAY_MIN_SPACING_MS),
+                                  (e.spacing_ticks * 4) / 5);
+      case DELAY_CURVE_DECELERATING:
+        return std::min<uint32_t>(delay_ticks * 4, (e.spacing_ticks * 5) / 4);
+      default:
+        return delay_ticks;
     }
   }
 
-  inline void add_keycode_at(uint8_t index, uint8_t keycode, uint32_t time_ms) {
-    slots[index].code = keycode;
-    slots[index].init_time = time_ms;
-    slots[index].count = 0;
+  // full clock position of a due_tick, which only keeps the low 32 bits
+  inline uint32_t due_ms(uint32_t due_tick, uint64_t now_ticks) {
+    int32_t ahead = (int32_t)(due_tick - (uint32_t)now_ticks);
+    return tempo->time_at(now_ticks + ahead);
   }
 
-  void add_keycode_to_next_slot(uint8_t keycode, uint32_t time_ms) {
-    add_keycode_at(slot_index, keycode, time_ms);
-    if (++slot_index == DELAY_SLOT_COUNT) {
-      slot_index = 0;
-    }
+  inline void update_next_due(uint32_t time_ms) {
+    if (state->heap_len == 0) return;
+    next_due_ms = due_ms(state->heap[0].due_tick, tempo->ticks_at(time_ms));
   }
 
- public:
-  void initialize(uint32_t time_ms, float param_percentage) {
-    log_line("Keyboard delay initialized");
-    update_parameter(param_percentage);
-    pixel_last_update = time_ms;
-    cycle_progress = 0.0;
-    for (size_t i = 0; i < DELAY_SLOT_COUNT; i++) {
-      slots[i].code = 0;
+  // sawtooth once per delay, its peak drops as the echoes run out
+  void show_cycle() {
+    uint8_t peak = 255;
+    // max_delay_count < 0 means we're repeating infinitely
+    if (max_delay_count > 0 && remaining_repeats <= max_delay_count) {
+      peak = DELAY_LED_MIN +
+             ((remaining_repeats * (255 - DELAY_LED_MIN)) / max_delay_count);
     }
+    led.ramp(DELAY_LED_MIN, peak, delay_ms, led_cycle_start_ms, true);
   }
 
-  uint32_t get_current_pixel_value(uint32_t time_ms) {
-    float delta = (float)(time_ms - pixel_last_update) / (float)delay_ms;
-    pixel_last_update = time_ms;
-    cycle_progress += delta;
-    // sawtooth loop forever
-    if (cycle_progress > 1.0) {
-      cycle_progress = 0.0;
+  void schedule_echo(uint8_t keycode, uint32_t time_ms) {
+    if (state->heap_len == DELAY_EVENT_POOL_SIZE) {
+      // never overwrite an echo that's already in flight
+      if (dropped_echoes++ == 0) log_line("Keyboard delay pool full");
+      return;
     }
+    delay_event_t e = {0, delay_ticks, keycode, 0};
+    if (curve == DELAY_CURVE_PING_PONG) e.spacing_ticks = next_spacing(e);
+    e.due_tick = (uint32_t)tempo->ticks_at(time_ms) + e.spacing_ticks;
+    heap_push(e);
+    update_next_due(time_ms);
+  }
 
-    // get dimmer as remaining repeats approaches 0
-    float repeat_brightness = (float)remaining_repeats / (float)max_delay_count;
-    // repeat_brightness < 0 means we're repeating infinitely
-    if (repeat_brightness < 0.0 || repeat_brightness > 1.0f) {
-      repeat_brightness = 1.0f;
+  void apply_repeats() {
+    int16_t last_delay_count = max_delay_count;
+    if (repeats == DELAY_REPEATS_KNOB) {
+      max_delay_count = knob_delay_count;
+    } else if (repeats == DELAY_REPEATS_FOREVER) {
+      max_delay_count = -1;
+    } else {
+      max_delay_count = repeats;
     }
-    float adj_brightness = (cycle_progress * repeat_brightness * 0.9f) + 0.1f;
-    return color_at_brightness(indicator_color, adj_brightness);
+    if (last_delay_count != max_delay_count) {
+      log_line("Keyboard delay repeats: %d", max_delay_count);
+    }
+  }
+
+  // the LED and the accelerating curve's floor work in ms
+  void follow_tempo() {
+    tempo_generation = tempo->get_generation();
+    delay_ms = tempo->ms_for(delay_ticks);
+  }
+
+ public:
+  using IKeyboardFx::IKeyboardFx;
+
+  size_t get_state_size() { return sizeof(State); }
+
+  void initialize(fx_time_t time_us, float param_percentage) {
+    log_line("Keyboard delay initialized");
+    state = create_state<State>(hid_output);
+    remaining_repeats = 0;
+    led_cycle_start_ms = fx_ms(time_us);
+    update_parameter(param_percentage);
+    dropped_echoes = 0;
+    if (state) state->sequencer.set_timing(FLUSH_THRESHOLD_MS, 0);
   }
 
   void update_parameter(float percentage) {
     uint16_t int_p = std::lroundf(percentage * 99.0f);
     switch (int_p) {
       case 0 ... 24:
-        delay_ms = 100;
+        delay_ticks = TEMPO_SIXTEENTH;
         break;
       case 25 ... 49:
-        delay_ms = 300;
+        delay_ticks = TEMPO_DOTTED_EIGHTH;
         break;
       case 50 ... 74:
-        delay_ms = 650;
+        delay_ticks = TEMPO_QUARTER;
         break;
       default:
-        delay_ms = 1200;
+        delay_ticks = TEMPO_HALF;
         break;
     }
-    int16_t last_delay_count = max_delay_count;
-    max_delay_count = ((int_p % 25) / 2) + 1;
-    if (max_delay_count > 11) {
-      max_delay_count = -1;
-    }
-    if (last_delay_count != max_delay_count) {
-      log_line("Keyboard delay repeats: %d", max_delay_count);
-    }
+    follow_tempo();
+    knob_delay_count = ((int_p % 25) / 2) + 1;
+    if (knob_delay_count > DELAY_KNOB_MAX_REPEATS) knob_delay_count = -1;
+    apply_repeats();
+    show_cycle();
+  }
+
+  // DELAY_REPEATS_KNOB leaves the count to the knob, DELAY_REPEATS_FOREVER
+  // never stops, anything else is that many echoes per key
+  void set_repeats(uint8_t r) {
+    repeats = r;
+    apply_repeats();
+    show_cycle();
   }
 
+  void set_spacing_curve(uint8_t c) {
+    curve = c < DELAY_CURVE_COUNT ? c : (uint8_t)DELAY_CURVE_FLAT;
+  }
+
+  size_t get_pending_echo_count() { return state ? state->heap_len : 0; }
+
   void deinit() {
-    latest_report.modifier = 0;
-    for (size_t i = 0; i < REPORT_KEYCODE_COUNT; i++) {
-      latest_report.keycode[i] = 0;
+    if (state) {
+      // let go of everything before the sequencer goes away
+      state->key_state.reset();
+      state->sequencer.set_base(0, state->key_state.get_held());
+      state->sequencer.clear();
     }
-
-    resend_latest_report();
+    release_state();
+    state = nullptr;
   }
 
-  void tick(uint32_t time_ms) {
-    static uint32_t last_flush_ms = 0;
-    if (time_ms - last_flush_ms >= FLUSH_THRESHOLD_MS) {
-      release_all(true);
-      last_flush_ms = time_ms;
+  void tick(fx_time_t time_us) {
+    if (!state) return;
+    // echoes are on the tempo clock's grid, which is plenty fine in ms
+    uint32_t time_ms = fx_ms(time_us);
+    state->sequencer.task(time_ms);
+    if (tempo_generation != tempo->get_generation()) {
+      follow_tempo();
+      update_next_due(time_ms);
+      show_cycle();
+    }
+
+    // nothing due, the common case, costs one comparison
+    if (state->heap_len == 0) {
+      if (remaining_repeats != 0) {
+        remaining_repeats = 0;
+        show_cycle();
+      }
+      return;
     }
+    if (before(time_ms, next_due_ms)) return;
+    uint16_t shown_repeats = remaining_repeats;
+    uint64_t now_ticks = tempo->ticks_at(time_ms);
 
-    // keep track of the key with the most remaining repeats left for animation
-    int16_t local_remaining_max = 0;
-    for (size_t i = 0; i < DELAY_SLOT_COUNT; i++) {
-      if (slots[i].code > 0) {
-        int16_t remaining = max_delay_count - slots[i].count;
-        if (abs(remaining) > local_remaining_max) {
-          local_remaining_max = remaining;
-        }
-
-        // this key is due for a repeat emission
-        if (time_ms - slots[i].init_time >= delay_ms) {
-          last_flush_ms = time_ms;
-          slots[i].count = slots[i].count + 1;
-          slots[i].awaiting_release = true;
-          slots[i].init_time = time_ms;
-          uint8_t index = last_report_key_count == REPORT_KEYCODE_COUNT
-                              ? REPORT_KEYCODE_COUNT - 1
-                              : last_report_key_count;
-          latest_report.keycode[index] = slots[i].code;
-          resend_latest_report();
-          latest_report.keycode[index] = 0;
-          // key has repeated enough times, turn it off
-          // max_delay_count < 0 means repeat forever, so don't reset
-          if (slots[i].count >= max_delay_count && max_delay_count > 0) {
-            slots[i].code = 0;
-            slots[i].count = 0;
-          }
-        }
+    // everything that's due gets pressed together, on top of held keys, and
+    // released together FLUSH_THRESHOLD_MS later
+    uint8_t echo_codes[DELAY_EVENT_POOL_SIZE];
+    KeySequencer &sequencer = state->sequencer;
+    size_t key_count =
+        sequencer.get_held_count() + (sequencer.get_queue_depth() / 2);
+    size_t capacity = hid_output->max_keys();
+    size_t emitted = 0;
+    while (state->heap_len > 0 &&
+           !before((uint32_t)now_ticks, state->heap[0].due_tick)) {
+      // report or queue is full, whatever is left goes out on the next tick
+      if (key_count >= capacity) break;
+      if (sequencer.get_free_space() < 2 * (emitted + 1)) break;
+      delay_event_t e = heap_pop();
+      echo_codes[emitted++] = e.code;
+      key_count++;
+      e.count++;
+      remaining_repeats = max_delay_count - e.count;
+      // key has repeated enough times, let it go
+      // max_delay_count < 0 means repeat forever
+      if (max_delay_count < 0 || e.count < max_delay_count) {
+        // from when it was due, not when it went out, so late ticks don't
+        // push every following echo back
+        e.spacing_ticks = next_spacing(e);
+        e.due_tick += e.spacing_ticks;
+        heap_push(e);
       }
     }
-    remaining_repeats = local_remaining_max;
+    update_next_due(time_ms);
+    for (size_t i = 0; i < emitted; i++) sequencer.press(echo_codes[i]);
+    for (size_t i = 0; i < emitted; i++) sequencer.release(echo_codes[i]);
+    // don't wait for the next loop to send the presses
+    if (emitted > 0) sequencer.task(time_ms);
+    if (remaining_repeats != shown_repeats) show_cycle();
   }
 
   void process_keyboard_report(ha_keyboard_report_t const *report,
-                               uint32_t time_ms) {
-    release_all(false);
-    latest_report.modifier = report->modifier;
-    latest_report.reserved = report->reserved;
-    last_report_key_count = 0;
-    hid_output->send_keyboard_report(report->modifier, report->reserved,
-                                     report->keycode);
-    for (size_t i = 0; i < REPORT_KEYCODE_COUNT; i++) {
-      uint8_t code = report->keycode[i];
-      latest_report.keycode[i] = code;
-      if (code > 0) {
-        // restart animation if any key is pressed
-        cycle_progress = 0.0;
-        last_report_key_count = i + 1;
-        add_keycode_to_next_slot(code, time_ms);
-      }
+                               fx_time_t time_us) {
+    if (!state) {
+      hid_output->send_keyboard_report(report->modifier, report->reserved,
+                                       report->keycode);
+      return;
+    }
+    uint32_t time_ms = fx_ms(time_us);
+    // only fresh presses get echoes, keys that are still held don't
+    state->key_state.update(report, &state->key_events);
+    state->sequencer.set_base(report->modifier, state->key_state.get_held());
+    bool pressed = false;
+    state->key_events.pressed.for_each([&](uint8_t code) {
+      pressed = true;
+      schedule_echo(code, time_ms);
+    });
+    // restart animation if any key is pressed
+    if (pressed) {
+      // every echo of it is still to come
+      remaining_repeats = max_delay_count;
+      led_cycle_start_ms = time_ms;
+      show_cycle();
     }
   }
-};
\ No newline at end of file
+};
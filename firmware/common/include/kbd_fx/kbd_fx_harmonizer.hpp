@@ -1,52 +1,46 @@
 #include "custom_hid.hpp"
 #include "hid_fx.hpp"
+#include "key_state.hpp"
 
 #define PRESSED_KEYS_COUNT REPORT_KEYCODE_COUNT / 2
+// flashes alternate between these LED levels, then it settles back on the
+// harmony offset's level
+#define HARMONIZER_LED_FLASH_ON 230
+#define HARMONIZER_LED_FLASH_OFF 90
+#define HARMONIZER_LED_FLASH_MS 32
+#define HARMONIZER_LED_MIN 65
+#define HARMONIZER_LED_MAX 237
 
 class KeyboardHarmonizer : public IKeyboardFx {
   using IKeyboardFx::IKeyboardFx;
+  // harmonized keys, in the order they were pressed
   uint8_t pressed_keys[PRESSED_KEYS_COUNT] = {0};
-  uint8_t report_code_buffer[REPORT_KEYCODE_COUNT] = {0};
+  KeyStateTracker key_state;
+  key_events_t key_events;
   uint8_t harmony_offset = 1;
   uint8_t harmonics = 0;
+  // flashes waiting for the next tick to start them
   uint8_t led_flash_count = 0;
-  uint32_t last_flash_time = 0;
-  float led_brightness = 0.3;
+  uint8_t led_level = HARMONIZER_LED_MIN;
 
-  int8_t index_of(uint8_t keycode, const uint8_t* array) {
-    uint8_t n = sizeof(array);
-    for (size_t i = 0; i < n; i++) {
-      if (array[i] == keycode) {
+  int8_t index_of(uint8_t keycode) {
+    for (size_t i = 0; i < PRESSED_KEYS_COUNT; i++) {
+      if (pressed_keys[i] == keycode) {
         return i;
       }
     }
     return -1;
   }
 
-  inline int8_t free_slot_index() { return index_of(0, pressed_keys); }
-
  public:
 
-  void initialize(uint32_t time_ms, float param_percentage) {
-    (void)time_ms;
+  void initialize(fx_time_t time_us, float param_percentage) {
+    (void)time_us;
     (void)param_percentage;
     log_line("Keyboard harmonizer initialized");
     update_parameter(param_percentage);
   }
 
-  uint32_t get_current_pixel_value(uint32_t time_ms) {
-    if (led_flash_count == 0 || time_ms - last_flash_time < 32) {
-      return color_at_brightness(indicator_color, led_brightness);
-    }
-    last_flash_time = time_ms;
-    led_flash_count--;
-    if (led_flash_count & 1) {
-      return color_at_brightness(indicator_color, 0.1f);
-    } else {
-      return color_at_brightness(indicator_color, 0.8f);
-    }
-  }
-
   void update_parameter(float percentage) {
     uint8_t raw_percentage = (uint8_t)(percentage * 98.0);
     harmony_offset = raw_percentage % 33;
@@ -58,63 +52,74 @@ class KeyboardHarmonizer : public IKeyboardFx {
       led_flash_count = (2 * harmonics) + 2;
       log_line("Keyboard harmonics: %u", harmonics);
     }
-    led_brightness = (((float)harmony_offset / 33.0) * 0.8) + 0.05;
+    led_level = HARMONIZER_LED_MIN +
+                ((harmony_offset * (HARMONIZER_LED_MAX - HARMONIZER_LED_MIN)) /
+                 33);
   }
 
-  void tick(uint32_t time_ms) { (void)time_ms; }
+  void tick(fx_time_t time_us) {
+    uint32_t time_ms = fx_ms(time_us);
+    if (led_flash_count > 0) {
+      led.blink(HARMONIZER_LED_FLASH_ON, HARMONIZER_LED_FLASH_OFF,
+                HARMONIZER_LED_FLASH_MS, led_flash_count, led_level, time_ms);
+      led_flash_count = 0;
+    } else if (led.get_mode() != LED_ANIM_BLINK || led.is_done(time_ms)) {
+      // picks up knob moves that didn't cross into a new zone
+      led.set_level(led_level);
+    }
+  }
 
-  void deinit() {}
+  void deinit() {
+    key_state.reset();
+    for (size_t i = 0; i < PRESSED_KEYS_COUNT; i++) pressed_keys[i] = 0;
+  }
 
   void process_keyboard_report(ha_keyboard_report_t const* report,
-                               uint32_t time_ms) {
-    (void)time_ms;
-    for (size_t i = 0; i < REPORT_KEYCODE_COUNT; i++) {
-      uint8_t keycode = report->keycode[i];
-      if (keycode == 0) break;
-      int8_t free_slot = free_slot_index();
-      if (free_slot < 0) break;
-      int8_t pressed_key_index = index_of(keycode, pressed_keys);
-      if (pressed_key_index < 0) {
-        pressed_keys[free_slot] = keycode;
-      }
+                               fx_time_t time_us) {
+    (void)time_us;
+    key_state.update(report, &key_events);
+    key_events.released.for_each([&](uint8_t code) {
+      int8_t index = index_of(code);
+      if (index >= 0) pressed_keys[index] = 0;
+    });
+    // fresh presses first, then anything still held that didn't fit before
+    key_events.pressed.for_each([&](uint8_t code) {
+      int8_t free_slot = index_of(0);
+      if (free_slot >= 0) pressed_keys[free_slot] = code;
+    });
+    if (key_events.released.any()) {
+      key_state.get_held().for_each([&](uint8_t code) {
+        int8_t free_slot = index_of(0);
+        if (free_slot >= 0 && index_of(code) < 0) {
+          pressed_keys[free_slot] = code;
+        }
+      });
     }
 
+    // earlier keys win, a chord only goes out if all of it fits
+    KeySet out;
+    size_t chord_size = harmonics == 0 ? 1 : harmonics + 1;
+    size_t capacity = hid_output->max_keys();
     for (size_t i = 0; i < PRESSED_KEYS_COUNT; i++) {
-      int8_t currently_pressed_index =
-          index_of(pressed_keys[i], report->keycode);
-      if (currently_pressed_index == -1) {
-        pressed_keys[i] = 0;
-      }
-    }
-
-    size_t j = 0;
-    for (size_t i = 0; i < PRESSED_KEYS_COUNT && j < REPORT_KEYCODE_COUNT;
-         i++) {
       uint8_t pressed_key = pressed_keys[i];
-      if (pressed_key > 0) {
-        if (harmonics == 0) {
-          // execute one key press
-          report_code_buffer[j++] = pressed_key + harmony_offset;
-          led_flash_count = 3;
-        } else {
-          // execute two keys
-          led_flash_count = 5;
-          report_code_buffer[j++] = pressed_key;
-          report_code_buffer[j++] = pressed_key + harmony_offset;
-          // execute three keys
-          if (harmonics == 2) {
-            report_code_buffer[j++] = pressed_key + (harmony_offset * 2);
-            led_flash_count = 7;
-          }
+      if (pressed_key == 0) continue;
+      if (out.count() + chord_size > capacity) break;
+      if (harmonics == 0) {
+        // execute one key press
+        out.set(pressed_key + harmony_offset);
+        led_flash_count = 3;
+      } else {
+        // execute two keys
+        led_flash_count = 5;
+        out.set(pressed_key);
+        out.set(pressed_key + harmony_offset);
+        // execute three keys
+        if (harmonics == 2) {
+          out.set(pressed_key + (harmony_offset * 2));
+          led_flash_count = 7;
         }
       }
     }
-
-    while (j < REPORT_KEYCODE_COUNT) {
-      report_code_buffer[j] = 0;
-      ++j;
-    }
-    hid_output->send_keyboard_report(report->modifier, report->reserved,
-                         report_code_buffer);
+    hid_output->send_keys(report->modifier, out);
   }
 };
\ No newline at end of file
@@ -0,0 +1,392 @@
+#include <algorithm>
+#include <cmath>
+
+#include "custom_hid.hpp"
+#include "hid_fx.hpp"
+#include "key_loop.hpp"
+#include "key_sequencer.hpp"
+#include "key_state.hpp"
+
+// only takes up RAM while the looper runs (see fx_arena.hpp). At typing speed
+// a keystroke packs into about 5 bytes, so this holds over 1500 of them.
+#define KBD_LOOP_BUFFER_SIZE 8192
+// kept free once recording's done, so every event still fits back into the
+// ring as it plays (one per pass can come back a byte longer) and so the
+// releases for keys overdubbed into the loop always make it in
+#define KBD_LOOP_RESERVE_BYTES 64
+// starts and stops recording and overdubs, never goes through to the host
+#define KBD_LOOP_RECORD_KEY HID_KEY_SCROLL_LOCK
+// holding the record key this long throws the loop away
+#define KBD_LOOP_CLEAR_HOLD_MS 1000
+
+// LED flashes while recording, then ramps over each pass of the loop
+#define KBD_LOOP_LED_IDLE 123
+#define KBD_LOOP_LED_RECORD 243
+#define KBD_LOOP_LED_FLASH_MS 25
+// slower and brighter while overdubbing
+#define KBD_LOOP_LED_OVERDUB_FLASH_MS 100
+
+enum KeyboardLoopMode {
+  KBD_LOOP_EMPTY = 0,
+  KBD_LOOP_RECORDING,
+  KBD_LOOP_PLAYING,
+  // playing, and recording on top of it
+  KBD_LOOP_OVERDUB,
+};
+
+// Records keystrokes and plays them back in a loop, on top of whatever the
+// user is typing. Each press of the record key moves it along from empty to
+// recording, playing, overdubbing, and back to playing.
+//
+// Loops play back either as they were played or with every event moved to
+// the nearest 1/16, 1/8 or 1/4 note on the tempo clock. Offsets in the loop
+// are always the recorded ones, so changing the grid or the tempo never
+// drifts. Events go out through a KeySequencer, which waits for the host to
+// pick up each report, and are only taken out of the loop when there's room
+// for them, so a busy host makes them late but never drops any.
+//
+// Modifiers are recorded with the keys they're held down with.
+class KeyboardLooper : public IKeyboardFx {
+ public:
+  // lives in the arena while the looper is running
+  struct State {
+    KeySequencer sequencer;
+    KeyStateTracker key_state;
+    key_events_t key_events;
+    KeyLoop<KBD_LOOP_BUFFER_SIZE> loop;
+    // keys pressed into the loop that haven't been released in it yet
+    KeySet open_keys;
+    // modifier each looped key went down with, it comes up with the same one
+    uint8_t press_modifier[256];
+
+    explicit State(IHIDOutput *hid_output) : sequencer(hid_output) {}
+  };
+
+ private:
+  State *state = nullptr;
+  uint8_t mode = KBD_LOOP_EMPTY;
+  uint32_t record_start_ms = 0;
+  // length as recorded, the offsets in the loop go up to this
+  uint32_t loop_len_ms = 0;
+  uint32_t pass_start_ms = 0;
+  // 0 plays the loop as it was recorded
+  uint16_t grid_ticks = 0;
+  // grid_ticks at the current tempo
+  uint32_t grid_ms = 0;
+  uint32_t tempo_generation = 0;
+  bool record_key_held = false;
+  uint32_t record_key_down_ms = 0;
+  uint32_t latest_time_ms = 0;
+  uint32_t dropped_events = 0;
+
+  // how long a pass takes to play, a whole number of grid steps when
+  // quantized
+  inline uint32_t pass_len() {
+    if (grid_ms == 0) return loop_len_ms;
+    uint32_t steps = (loop_len_ms + (grid_ms / 2)) / grid_ms;
+    return std::max<uint32_t>(1, steps) * grid_ms;
+  }
+
+  // when a recorded offset plays within the pass
+  inline uint32_t due_at(uint32_t offset_ms) {
+    if (grid_ms == 0) return offset_ms;
+    uint32_t snapped = ((offset_ms + (grid_ms / 2)) / grid_ms) * grid_ms;
+    return std::min(snapped, pass_len());
+  }
+
+  // where in the recorded loop the pass is up to, for overdubs
+  inline uint32_t loop_offset(uint32_t time_ms) {
+    uint32_t len = pass_len();
+    uint32_t elapsed = std::min(time_ms - pass_start_ms, len);
+    if (len == 0) return 0;
+    return (uint32_t)(((uint64_t)elapsed * loop_len_ms) / len);
+  }
+
+  void show_progress(uint32_t time_ms) {
+    switch (mode) {
+      case KBD_LOOP_RECORDING:
+        led.blink(KBD_LOOP_LED_RECORD, KBD_LOOP_LED_IDLE,
+                  KBD_LOOP_LED_FLASH_MS, 0, KBD_LOOP_LED_IDLE, time_ms);
+        break;
+      case KBD_LOOP_PLAYING:
+        led.ramp(KBD_LOOP_LED_IDLE, 255, pass_len(), pass_start_ms, true);
+        break;
+      case KBD_LOOP_OVERDUB:
+        led.blink(255, KBD_LOOP_LED_IDLE, KBD_LOOP_LED_OVERDUB_FLASH_MS, 0,
+                  KBD_LOOP_LED_IDLE, time_ms);
+        break;
+      default:
+        led.set_level(KBD_LOOP_LED_IDLE);
+        break;
+    }
+  }
+
+  // changes the grid, or follows a tempo change, keeping how far through the
+  // pass playback is so it carries on from the same spot
+  void set_grid(uint16_t ticks, uint32_t time_ms) {
+    uint32_t old_len = pass_len();
+    uint32_t elapsed = std::min(time_ms - pass_start_ms, old_len);
+    grid_ticks = ticks;
+    tempo_generation = tempo->get_generation();
+    grid_ms = grid_ticks ? std::max<uint32_t>(1, tempo->ms_for(grid_ticks)) : 0;
+    if (mode != KBD_LOOP_PLAYING && mode != KBD_LOOP_OVERDUB) return;
+    if (old_len > 0) {
+      pass_start_ms =
+          time_ms - (uint32_t)(((uint64_t)elapsed * pass_len()) / old_len);
+    }
+    show_progress(time_ms);
+  }
+
+  void capture(uint8_t kind, uint8_t code, uint8_t modifier,
+               uint32_t time_ms) {
+    if (mode != KBD_LOOP_RECORDING && mode != KBD_LOOP_OVERDUB) return;
+    uint32_t offset = mode == KBD_LOOP_RECORDING ? time_ms - record_start_ms
+                                                 : loop_offset(time_ms);
+    if (kind == KEY_LOOP_RELEASE) {
+      // a key held from before recording started isn't in the loop
+      if (!state->open_keys.test(code)) return;
+      // fits in the reserve, a press in the loop always gets its release
+      state->open_keys.clear(code);
+      state->loop.push({offset, KEY_LOOP_RELEASE, code, 0});
+      return;
+    }
+    if (state->loop.get_free() <
+        KBD_LOOP_RESERVE_BYTES + KEY_LOOP_MAX_EVENT_BYTES) {
+      if (mode == KBD_LOOP_RECORDING) {
+        log_line("Keyboard loop full, playing what's recorded");
+        stop_recording(time_ms);
+      } else if (dropped_events++ == 0) {
+        log_line("Keyboard loop full, overdubs dropped");
+      }
+      return;
+    }
+    state->open_keys.set(code);
+    state->loop.push({offset, KEY_LOOP_PRESS, code, modifier});
+  }
+
+  // lets go of everything still down in the loop, so nothing sticks when it
+  // plays back
+  void close_open_keys(uint32_t time_ms) {
+    KeySet open = state->open_keys;
+    open.for_each([&](uint8_t code) {
+      capture(KEY_LOOP_RELEASE, code, 0, time_ms);
+    });
+  }
+
+  void start_recording(uint32_t time_ms) {
+    state->loop.clear();
+    state->open_keys.clear_all();
+    dropped_events = 0;
+    record_start_ms = time_ms;
+    mode = KBD_LOOP_RECORDING;
+    log_line("Keyboard looper recording");
+    show_progress(time_ms);
+  }
+
+  void stop_recording(uint32_t time_ms) {
+    close_open_keys(time_ms);
+    loop_len_ms = time_ms - record_start_ms;
+    if (state->loop.get_event_count() == 0 || loop_len_ms == 0) {
+      clear_loop(time_ms);
+      return;
+    }
+    state->loop.push({loop_len_ms, KEY_LOOP_PASS_END, 0, 0});
+    mode = KBD_LOOP_PLAYING;
+    pass_start_ms = time_ms;
+    log_line("Keyboard loop %u ms, %u events in %u bytes",
+             (unsigned int)loop_len_ms,
+             (unsigned int)state->loop.get_event_count() - 1,
+             (unsigned int)state->loop.get_used());
+    show_progress(time_ms);
+  }
+
+  void clear_loop(uint32_t time_ms) {
+    state->loop.clear();
+    state->open_keys.clear_all();
+    state->sequencer.clear();
+    loop_len_ms = 0;
+    mode = KBD_LOOP_EMPTY;
+    log_line("Keyboard loop cleared");
+    show_progress(time_ms);
+  }
+
+  void on_record_key(uint32_t time_ms) {
+    switch (mode) {
+      case KBD_LOOP_EMPTY:
+        start_recording(time_ms);
+        break;
+      case KBD_LOOP_RECORDING:
+        stop_recording(time_ms);
+        break;
+      case KBD_LOOP_PLAYING:
+        mode = KBD_LOOP_OVERDUB;
+        show_progress(time_ms);
+        break;
+      default:
+        close_open_keys(time_ms);
+        mode = KBD_LOOP_PLAYING;
+        show_progress(time_ms);
+        break;
+    }
+  }
+
+  // sends everything that's due and puts it back on the end of the loop
+  void play(uint32_t time_ms) {
+    KeySequencer &sequencer = state->sequencer;
+    size_t capacity = hid_output->max_keys();
+    key_loop_event_t e;
+    while (state->loop.peek(&e)) {
+      bool pass_end = e.kind == KEY_LOOP_PASS_END;
+      uint32_t due = pass_end ? pass_len() : due_at(e.offset_ms);
+      if ((int32_t)(time_ms - (pass_start_ms + due)) < 0) break;
+      // queue or report is full, it goes out when there's room again
+      if (!pass_end && sequencer.get_free_space() == 0) break;
+      if (e.kind == KEY_LOOP_PRESS &&
+          sequencer.get_held_count() + (sequencer.get_queue_depth() / 2) >=
+              capacity) {
+        break;
+      }
+      state->loop.pop();
+      if (e.kind == KEY_LOOP_PRESS) {
+        state->press_modifier[e.code] = e.modifier;
+        sequencer.press(e.code, e.modifier);
+      } else if (e.kind == KEY_LOOP_RELEASE) {
+        sequencer.release(e.code, state->press_modifier[e.code]);
+      } else {
+        pass_start_ms += due;
+      }
+      if (!state->loop.push(e) && dropped_events++ == 0) {
+        log_line("Keyboard loop full, overdubs dropped");
+      }
+    }
+  }
+
+ public:
+  using IKeyboardFx::IKeyboardFx;
+
+  size_t get_state_size() { return sizeof(State); }
+
+  void initialize(fx_time_t time_us, float param_percentage) {
+    log_line("Keyboard looper initialized");
+    state = create_state<State>(hid_output);
+    latest_time_ms = fx_ms(time_us);
+    record_key_held = false;
+    dropped_events = 0;
+    mode = KBD_LOOP_EMPTY;
+    loop_len_ms = 0;
+    if (state) {
+      state->loop.clear();
+      state->open_keys.clear_all();
+      state->sequencer.set_timing(0, 0);
+    }
+    set_grid(grid_ticks, latest_time_ms);
+    update_parameter(param_percentage);
+    show_progress(latest_time_ms);
+  }
+
+  void update_parameter(float percentage) {
+    uint16_t ticks;
+    switch (std::lroundf(percentage * 99.0f)) {
+      case 0 ... 24:
+        ticks = 0;
+        break;
+      case 25 ... 49:
+        ticks = TEMPO_SIXTEENTH;
+        break;
+      case 50 ... 74:
+        ticks = TEMPO_EIGHTH;
+        break;
+      default:
+        ticks = TEMPO_QUARTER;
+        break;
+    }
+    if (ticks == grid_ticks) return;
+    set_grid(ticks, latest_time_ms);
+    log_line("Keyboard looper grid: %s",
+             ticks == 0 ? "off"
+                        : (ticks == TEMPO_SIXTEENTH
+                               ? "1/16"
+                               : (ticks == TEMPO_EIGHTH ? "1/8" : "1/4")));
+  }
+
+  inline uint8_t get_mode() { return mode; }
+
+  inline uint32_t get_loop_length_ms() { return loop_len_ms; }
+
+  // events in the loop, not counting the end of the pass
+  size_t get_event_count() {
+    if (!state || state->loop.get_event_count() == 0) return 0;
+    size_t count = state->loop.get_event_count();
+    return mode == KBD_LOOP_RECORDING ? count : count - 1;
+  }
+
+  size_t get_loop_bytes() { return state ? state->loop.get_used() : 0; }
+
+  void deinit() {
+    if (state) {
+      // let go of everything before the sequencer goes away
+      state->key_state.reset();
+      state->sequencer.set_base(0, state->key_state.get_held());
+      state->sequencer.clear();
+    }
+    release_state();
+    state = nullptr;
+    mode = KBD_LOOP_EMPTY;
+    loop_len_ms = 0;
+  }
+
+  void tick(fx_time_t time_us) {
+    if (!state) return;
+    uint32_t time_ms = fx_ms(time_us);
+    latest_time_ms = time_ms;
+    if (record_key_held &&
+        time_ms - record_key_down_ms >= KBD_LOOP_CLEAR_HOLD_MS) {
+      record_key_held = false;
+      clear_loop(time_ms);
+    }
+    if (mode == KBD_LOOP_PLAYING || mode == KBD_LOOP_OVERDUB) {
+      if (grid_ticks && tempo_generation != tempo->get_generation()) {
+        set_grid(grid_ticks, time_ms);
+      }
+      play(time_ms);
+    }
+    state->sequencer.task(time_ms);
+  }
+
+  void process_keyboard_report(ha_keyboard_report_t const *report,
+                               fx_time_t time_us) {
+    if (!state) {
+      hid_output->send_keyboard_report(report->modifier, report->reserved,
+                                       report->keycode);
+      return;
+    }
+    uint32_t time_ms = fx_ms(time_us);
+    latest_time_ms = time_ms;
+    state->key_state.update(report, &state->key_events);
+    bool record_key = state->key_events.pressed.test(KBD_LOOP_RECORD_KEY);
+    if (record_key) {
+      record_key_held = true;
+      record_key_down_ms = time_ms;
+    }
+    // Starting to record or overdub goes first and stopping goes last, so keys
+    // pressed along with the record key make it into the loop either way
+    bool starts = mode == KBD_LOOP_EMPTY || mode == KBD_LOOP_PLAYING;
+    if (record_key && starts) on_record_key(time_ms);
+    state->key_events.released.for_each([&](uint8_t code) {
+      if (code == KBD_LOOP_RECORD_KEY) {
+        record_key_held = false;
+        return;
+      }
+      capture(KEY_LOOP_RELEASE, code, 0, time_ms);
+    });
+    state->key_events.pressed.for_each([&](uint8_t code) {
+      if (code == KBD_LOOP_RECORD_KEY) return;
+      capture(KEY_LOOP_PRESS, code, report->modifier, time_ms);
+    });
+    // everything the user types goes through as it is, bar the record key
+    KeySet held = state->key_state.get_held();
+    held.clear(KBD_LOOP_RECORD_KEY);
+    state->sequencer.set_base(report->modifier, held);
+    if (record_key && !starts) on_record_key(time_ms);
+  }
+};
@@ -3,25 +3,20 @@
 
 class KeyboardPassthrough : public IKeyboardFx {
   using IKeyboardFx::IKeyboardFx;
-  void initialize(uint32_t time_ms, float param_percentage) {
-    (void)time_ms;
+  void initialize(fx_time_t time_us, float param_percentage) {
+    (void)time_us;
     (void)param_percentage;
   }
 
-  uint32_t get_current_pixel_value(uint32_t time_ms) {
-    (void)time_ms;
-    return indicator_color;
-  }
-
   void update_parameter(float percentage) { (void)percentage; }
 
-  void tick(uint32_t time_ms) { (void)time_ms; }
+  void tick(fx_time_t time_us) { (void)time_us; }
 
   void deinit() {}
 
   void process_keyboard_report(ha_keyboard_report_t const *report,
-                               uint32_t time_ms) {
-    (void)time_ms;
+                               fx_time_t time_us) {
+    (void)time_us;
     hid_output->send_keyboard_report(report->modifier, report->reserved,
                                      report->keycode);
   }
@@ -0,0 +1,58 @@
+#include "custom_hid.hpp"
+#include "fx_vm.hpp"
+#include "hid_fx.hpp"
+
+// Runs an uploaded script in place of a native keyboard FX, see fx_vm.hpp and
+// mouse_fx_script.hpp.
+class KeyboardScript : public IKeyboardFx {
+  using IKeyboardFx::IKeyboardFx;
+
+ private:
+  FxScriptRunner runner;
+
+  void send(vm_io_t const *io) {
+    int32_t const *f = io->fields;
+    uint8_t keycode[6];
+    for (size_t i = 0; i < 6; i++) {
+      keycode[i] = FxScriptRunner::to_byte(f[VM_FIELD_KEY0 + i]);
+    }
+    hid_output->send_keyboard_report(
+        FxScriptRunner::to_byte(f[VM_FIELD_MODIFIER]), 0, keycode);
+  }
+
+  inline uint32_t beat_ms() { return tempo->ms_for(TEMPO_QUARTER); }
+
+ public:
+  // a verified keyboard program, or nullptr to do nothing at all
+  inline void set_program(vm_program_t const *program) {
+    runner.set_program(program);
+  }
+
+  void initialize(fx_time_t time_us, float param_percentage) {
+    runner.begin(time_us, param_percentage);
+    led.set_level(255);
+    log_line("Keyboard script initialized");
+  }
+
+  void update_parameter(float percentage) { runner.set_param(percentage); }
+
+  // starts from the keys of the last report
+  void tick(fx_time_t time_us) {
+    if (!runner.tick_due(time_us)) return;
+    runner.run(true, time_us, beat_ms(),
+               [&](vm_io_t const *io) { send(io); });
+  }
+
+  void deinit() {}
+
+  void process_keyboard_report(ha_keyboard_report_t const *report,
+                               fx_time_t time_us) {
+    int32_t *f = runner.fields();
+    f[VM_FIELD_MODIFIER] = report->modifier;
+    for (size_t i = 0; i < 6; i++) f[VM_FIELD_KEY0 + i] = report->keycode[i];
+    runner.run(false, time_us, beat_ms(),
+               [&](vm_io_t const *io) { send(io); });
+  }
+
+  inline uint32_t get_last_cycles() const { return runner.get_last_cycles(); }
+};
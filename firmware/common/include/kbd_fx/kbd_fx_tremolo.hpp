@@ -4,33 +4,26 @@
 #include "hid_fx.hpp"
 
 #define SHIFT_FLAG 0b00100000
-#define DUTY_CYCLE_MAX 0xFFFF
+// LED levels while shift is off and on
+#define TREMOLO_LED_OFF 148
+#define TREMOLO_LED_ON 255
 
 class KeyboardTremolo : public IKeyboardFx {
   using IKeyboardFx::IKeyboardFx;
-  uint32_t off_color = 0;
-  uint16_t duty_cycle_ms = 0;
+  // shift goes on every other step of the tempo
+  TempoStep step;
+  bool always_on = false;
   bool sarcastic_mode = false;
   bool timer_engaged = false;
 
  public:
 
-  void set_indicator_color(uint32_t c) {
-    IKeyboardFx::set_indicator_color(c);
-    off_color = color_at_brightness(indicator_color, 0.3);
-  }
-
-  void initialize(uint32_t time_ms, float param_percentage) {
-    (void)time_ms;
+  void initialize(fx_time_t time_us, float param_percentage) {
     update_parameter(param_percentage);
+    step.follow(tempo, step.get_step_ticks(), fx_ms(time_us));
     log_line("Keyboard tremolo initialized");
   }
 
-  uint32_t get_current_pixel_value(uint32_t time_ms) {
-    (void)time_ms;
-    return timer_engaged ? indicator_color : off_color;
-  }
-
   void update_parameter(float percentage) {
     uint8_t int_p = round(percentage * 100);
     if (int_p < 5) {
@@ -38,46 +31,50 @@ class KeyboardTremolo : public IKeyboardFx {
       return;
     }
     sarcastic_mode = false;
+    always_on = false;
     switch (int_p) {
       case 5 ... 20:
-        duty_cycle_ms = 50;
+        step.set_step_ticks(TEMPO_THIRTY_SECOND);
         break;
       case 21 ... 35:
-        duty_cycle_ms = 250;
+        step.set_step_ticks(TEMPO_EIGHTH);
         break;
       case 36 ... 50:
-        duty_cycle_ms = 500;
+        step.set_step_ticks(TEMPO_QUARTER);
         break;
       case 51 ... 70:
-        duty_cycle_ms = 1000;
+        step.set_step_ticks(TEMPO_HALF);
         break;
       case 71 ... 85:
-        duty_cycle_ms = 2000;
+        step.set_step_ticks(TEMPO_WHOLE);
         break;
       default:
-        duty_cycle_ms = DUTY_CYCLE_MAX;
+        always_on = true;
         break;
     }
   }
 
-  void tick(uint32_t time_ms) {
+  void tick(fx_time_t time_us) {
     if (!sarcastic_mode) {
-      if (duty_cycle_ms == DUTY_CYCLE_MAX) {
+      if (always_on) {
         timer_engaged = true;
       } else {
-        timer_engaged = (time_ms % (2 * duty_cycle_ms)) > duty_cycle_ms;
+        step.poll(fx_ms(time_us));
+        timer_engaged = (step.get_step() & 1) != 0;
       }
+      led.set_level(timer_engaged ? TREMOLO_LED_ON : TREMOLO_LED_OFF);
     }
   }
 
   void deinit() {}
 
   void process_keyboard_report(ha_keyboard_report_t const *report,
-                               uint32_t time_ms) {
-    (void)time_ms;
+                               fx_time_t time_us) {
+    (void)time_us;
     uint8_t modifier_flag = 0;
     if (sarcastic_mode) {
       timer_engaged = (get_random_byte() & 0b01);
+      led.set_level(timer_engaged ? TREMOLO_LED_ON : TREMOLO_LED_OFF);
     }
     modifier_flag |= timer_engaged ? SHIFT_FLAG : 0;
     hid_output->send_keyboard_report(report->modifier | modifier_flag, report->reserved,
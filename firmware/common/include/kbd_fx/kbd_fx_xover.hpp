@@ -2,10 +2,15 @@
 
 #include "custom_hid.hpp"
 #include "hid_fx.hpp"
+#include "key_state.hpp"
 
 // random velocities to send the cursor around the screen when keys are pressed
 static const int8_t skate_values[] = {-10, 12,  -18, 15,  -29, 35, -40,
                                       66,  -74, 80,  -90, 40,  -50};
+// LED follows cursor speed, up to a bit over the fastest skate value
+#define KBD_XOVER_LED_MIN 90
+#define KBD_XOVER_LED_STEER 243
+#define KBD_XOVER_LED_FULL_SPEED 95
 
 class KeyboardXOver : public IKeyboardFx {
   using IKeyboardFx::IKeyboardFx;
@@ -13,33 +18,35 @@ class KeyboardXOver : public IKeyboardFx {
   ha_mouse_report_t mouse_report;
   ha_mouse_report_t last_report;
   float acceleration = 1.0;
+  KeyStateTracker key_state;
+  key_events_t key_events;
+
+  // brightest while steering or clicking
+  inline void update_led() {
+    if (mouse_override || mouse_report.buttons) {
+      led.set_level(KBD_XOVER_LED_STEER);
+      return;
+    }
+    int32_t d = std::max(abs(mouse_report.x), abs(mouse_report.y));
+    int32_t level =
+        KBD_XOVER_LED_MIN +
+        ((d * (255 - KBD_XOVER_LED_MIN)) / KBD_XOVER_LED_FULL_SPEED);
+    led.set_level((uint8_t)std::min<int32_t>(255, level));
+  }
 
  public:
-  void initialize(uint32_t time_ms, float param_percentage) {
-    (void)time_ms;
+  void initialize(fx_time_t time_us, float param_percentage) {
+    (void)time_us;
     update_parameter(param_percentage);
     log_line("Keyboard crossover initialized");
   }
 
-  uint32_t get_current_pixel_value(uint32_t time_ms) {
-    (void)time_ms;
-    float brightness = 0.2f;
-    if (mouse_override || mouse_report.buttons) {
-      brightness = 0.9f;
-    } else {
-      float d = std::max(abs(mouse_report.x), abs(mouse_report.y));
-      // ensure that divisor is > skate_values.max { abs(it) }
-      brightness = std::max(0.1f, d / 95.0f);
-    }
-    return color_at_brightness(indicator_color, brightness);
-  }
-
   void update_parameter(float percentage) { acceleration = percentage; }
 
-  void tick(uint32_t time_ms) {
-    static uint32_t last_time = 0;
-    if (time_ms - last_time < 24) return;
-    last_time = time_ms;
+  void tick(fx_time_t time_us) {
+    static fx_time_t last_time = 0;
+    if (time_us - last_time < 24 * FX_US_PER_MS) return;
+    last_time = time_us;
     if (mouse_override || mouse_report.x != last_report.x ||
         mouse_report.y != last_report.y ||
         mouse_report.buttons != last_report.buttons) {
@@ -54,41 +61,48 @@ class KeyboardXOver : public IKeyboardFx {
       if (mouse_report.y != 0) mouse_report.y *= 0.9;
       if (mouse_report.x != 0) mouse_report.x *= 0.9;
     }
+    update_led();
   }
 
-  void deinit() {}
+  void deinit() { key_state.reset(); }
 
   void process_keyboard_report(ha_keyboard_report_t const *report,
-                               uint32_t time_ms) {
-    (void)time_ms;
+                               fx_time_t time_us) {
+    (void)time_us;
     static int8_t last_x = 0;
     static int8_t last_y = 0;
     static bool sent_modifier_keys;
     int8_t x = 0, y = 0;
     uint8_t buttons = 0;
-    uint8_t override_buttons_count = REPORT_KEYCODE_COUNT;
+    key_state.update(report, &key_events);
+    // freshly pressed keys send the cursor skating, last one wins
+    key_events.pressed.for_each([&](uint8_t key) {
+      if (key >= HID_KEY_ARROW_RIGHT && key <= HID_KEY_ARROW_UP) return;
+      if (key == HID_KEY_ENTER) return;
+      // pseudo random x and y vals, scaled by acceleration
+      x = (int8_t)((float)skate_values[key % 10] * acceleration) + 1;
+      y = (int8_t)((float)skate_values[key % 13] * acceleration) + 1;
+    });
+
+    // held arrow keys steer the cursor directly, enter clicks
     // speed for when we're holding arrow keys
     int8_t override_velocity = (int8_t)(25.0 * acceleration) + 1;
-    for (size_t i = 0; i < REPORT_KEYCODE_COUNT; i++) {
-      uint8_t key = report->keycode[i];
-      if (key == HID_KEY_ARROW_DOWN) {
-        y += override_velocity;
-      } else if (key == HID_KEY_ARROW_UP) {
-        y -= override_velocity;
-      } else if (key == HID_KEY_ARROW_LEFT) {
-        x -= override_velocity;
-      } else if (key == HID_KEY_ARROW_RIGHT) {
-        x += override_velocity;
-      } else if (key == HID_KEY_ENTER) {
-        buttons = 1;
-      } else {
-        override_buttons_count--;
-        if (key > 0) {
-          // pseudo random x and y vals, scaled by acceleration
-          x = (int8_t)((float)skate_values[key % 10] * acceleration) + 1;
-          y = (int8_t)((float)skate_values[key % 13] * acceleration) + 1;
-        }
-      }
+    bool override_held = false;
+    if (key_state.is_held(HID_KEY_ARROW_DOWN) ||
+        key_state.is_held(HID_KEY_ARROW_UP) ||
+        key_state.is_held(HID_KEY_ARROW_LEFT) ||
+        key_state.is_held(HID_KEY_ARROW_RIGHT)) {
+      x = 0;
+      y = 0;
+      override_held = true;
+    }
+    if (key_state.is_held(HID_KEY_ARROW_DOWN)) y += override_velocity;
+    if (key_state.is_held(HID_KEY_ARROW_UP)) y -= override_velocity;
+    if (key_state.is_held(HID_KEY_ARROW_LEFT)) x -= override_velocity;
+    if (key_state.is_held(HID_KEY_ARROW_RIGHT)) x += override_velocity;
+    if (key_state.is_held(HID_KEY_ENTER)) {
+      buttons = 1;
+      override_held = true;
     }
 
     if ((x != 0 && x != last_x) || (y != 0 && y != last_y) ||
@@ -103,7 +117,8 @@ class KeyboardXOver : public IKeyboardFx {
 
     // if we're holding an arrow key, we want to keep sending the same message
     // as long as its held
-    mouse_override = override_buttons_count > 0;
+    mouse_override = override_held;
+    update_led();
 
     if (report->modifier || sent_modifier_keys) {
       const uint8_t dummy_keys[6] = {0, 0, 0, 0, 0, 0};
@@ -0,0 +1,174 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef COMMON_KEY_LOOP
+#define COMMON_KEY_LOOP
+
+// longest an event gets once encoded: a 5 byte varint, keycode and modifier
+#define KEY_LOOP_MAX_EVENT_BYTES 7
+
+typedef enum {
+  KEY_LOOP_PRESS = 0,
+  KEY_LOOP_RELEASE,
+  // the end of a pass, offset_ms is the loop's length
+  KEY_LOOP_PASS_END,
+} key_loop_kind_t;
+
+typedef struct {
+  // ms since the pass started
+  uint32_t offset_ms;
+  // key_loop_kind_t
+  uint8_t kind;
+  uint8_t code;
+  // held with a press, 0 for anything else
+  uint8_t modifier;
+} key_loop_event_t;
+
+// Recorded key events, packed into a byte ring. Each one is a varint of the
+// ms since the previous event, shifted up to make room for what kind of event
+// it is, and then its keycode and modifier only if it needs them:
+//   press             varint, code
+//   press + modifier  varint, code, modifier
+//   release           varint, code
+//   release of the key pressed last (most of them, when typing)   varint
+//   end of a pass     varint
+// A keystroke at typing speed comes to about 5 bytes, where whole reports
+// would take 16.
+//
+// Playing a loop pops each event off the front and pushes it back on the end,
+// so the loop goes round the ring and anything overdubbed gets pushed between
+// them in time order. Offsets are worked out from the pass ends as events come
+// off, nothing in the ring has to move or be rewritten in place.
+template <size_t N>
+class KeyLoop {
+  static_assert((N & (N - 1)) == 0, "loop size must be a power of two");
+
+ public:
+  void clear() {
+    head = tail = 0;
+    events = 0;
+    writer = {0, 0};
+    reader = {0, 0};
+    peeked_len = 0;
+  }
+
+  // Appends an event to the pass being written, false if it doesn't fit.
+  // Offsets earlier than the previous event's are taken as the same time.
+  bool push(key_loop_event_t const &e) {
+    uint8_t buf[KEY_LOOP_MAX_EVENT_BYTES];
+    cursor_t next = writer;
+    size_t len = encode(e, &next, buf);
+    if (len > get_free()) return false;
+    for (size_t i = 0; i < len; i++) ring[(tail + i) & (N - 1)] = buf[i];
+    tail += len;
+    writer = next;
+    events++;
+    return true;
+  }
+
+  // the oldest event, false if there's none. Stays put until pop().
+  bool peek(key_loop_event_t *e) {
+    if (head == tail) return false;
+    peeked_next = reader;
+    peeked_len = decode(&peeked_next, e);
+    return true;
+  }
+
+  // done with what peek() returned
+  inline void pop() {
+    head += peeked_len;
+    reader = peeked_next;
+    peeked_len = 0;
+    events--;
+  }
+
+  inline size_t get_used() const { return tail - head; }
+
+  inline size_t get_free() const { return N - get_used(); }
+
+  inline size_t get_event_count() const { return events; }
+
+ private:
+  // where an end of the ring is up to within the pass
+  typedef struct {
+    uint32_t offset_ms;
+    // the last key pressed, a release of it goes without its keycode
+    uint8_t last_press;
+  } cursor_t;
+
+  enum {
+    TAG_PRESS = 0,
+    TAG_PRESS_MODIFIER,
+    TAG_RELEASE,
+    TAG_RELEASE_LAST,
+    TAG_PASS_END,
+  };
+  static const uint8_t TAG_BITS = 3;
+
+  uint8_t ring[N];
+  // only ever count up, the difference is how many bytes are in use
+  uint32_t head = 0;
+  uint32_t tail = 0;
+  uint32_t events = 0;
+  cursor_t writer = {0, 0};
+  cursor_t reader = {0, 0};
+  cursor_t peeked_next = {0, 0};
+  size_t peeked_len = 0;
+
+  static size_t encode(key_loop_event_t const &e, cursor_t *c, uint8_t *buf) {
+    uint32_t delta = e.offset_ms > c->offset_ms ? e.offset_ms - c->offset_ms : 0;
+    uint8_t tag = TAG_PASS_END;
+    if (e.kind == KEY_LOOP_PRESS) {
+      tag = e.modifier ? TAG_PRESS_MODIFIER : TAG_PRESS;
+    } else if (e.kind == KEY_LOOP_RELEASE) {
+      tag = e.code == c->last_press ? TAG_RELEASE_LAST : TAG_RELEASE;
+    }
+    uint64_t v = ((uint64_t)delta << TAG_BITS) | tag;
+    size_t len = 0;
+    while (v >= 0x80) {
+      buf[len++] = (uint8_t)(v | 0x80);
+      v >>= 7;
+    }
+    buf[len++] = (uint8_t)v;
+    if (tag == TAG_PRESS || tag == TAG_PRESS_MODIFIER || tag == TAG_RELEASE) {
+      buf[len++] = e.code;
+    }
+    if (tag == TAG_PRESS_MODIFIER) buf[len++] = e.modifier;
+    advance(c, tag, delta, e.code);
+    return len;
+  }
+
+  size_t decode(cursor_t *c, key_loop_event_t *e) const {
+    uint64_t v = 0;
+    size_t len = 0;
+    uint8_t b;
+    do {
+      b = ring[(head + len) & (N - 1)];
+      v |= (uint64_t)(b & 0x7F) << (7 * len);
+      len++;
+    } while (b & 0x80);
+    uint8_t tag = v & ((1 << TAG_BITS) - 1);
+    uint32_t delta = (uint32_t)(v >> TAG_BITS);
+    e->kind = tag == TAG_PASS_END
+                  ? KEY_LOOP_PASS_END
+                  : (tag <= TAG_PRESS_MODIFIER ? KEY_LOOP_PRESS
+                                                : KEY_LOOP_RELEASE);
+    e->code = tag == TAG_RELEASE_LAST ? c->last_press : 0;
+    e->modifier = 0;
+    if (tag == TAG_PRESS || tag == TAG_PRESS_MODIFIER || tag == TAG_RELEASE) {
+      e->code = ring[(head + len++) & (N - 1)];
+    }
+    if (tag == TAG_PRESS_MODIFIER) e->modifier = ring[(head + len++) & (N - 1)];
+    e->offset_ms = c->offset_ms + delta;
+    advance(c, tag, delta, e->code);
+    return len;
+  }
+
+  static inline void advance(cursor_t *c, uint8_t tag, uint32_t delta,
+                             uint8_t code) {
+    c->offset_ms = tag == TAG_PASS_END ? 0 : c->offset_ms + delta;
+    if (tag == TAG_PRESS || tag == TAG_PRESS_MODIFIER) c->last_press = code;
+  }
+};
+
+#endif
@@ -0,0 +1,144 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hid_output.hpp"
+#include "key_state.hpp"
+
+#ifndef COMMON_KEY_SEQUENCER
+#define COMMON_KEY_SEQUENCER
+
+// must be a power of 2
+#define KEY_SEQUENCER_QUEUE_SIZE 64
+#define KEY_SEQUENCER_QUEUE_MASK (KEY_SEQUENCER_QUEUE_SIZE - 1)
+
+typedef struct {
+  uint8_t code;
+  uint8_t modifier;
+  bool press;
+} key_sequencer_event_t;
+
+// Plays synthesized key presses/releases out at wall-clock rates instead of
+// once per loop iteration. Every event waits for the previous one's hold (after
+// a press) or gap (after a release) time, and for the host to be ready.
+// Back to back events of the same kind go out together in one report.
+//
+// Synthesized keys are layered on top of a "base" state, the keys the user is
+// actually holding, so FX can mix real and synthesized typing.
+class KeySequencer {
+ public:
+  explicit KeySequencer(IHIDOutput *hid_output) : hid_output(hid_output) {}
+
+  void set_timing(uint16_t min_hold_ms, uint16_t min_gap_ms) {
+    this->min_hold_ms = min_hold_ms;
+    this->min_gap_ms = min_gap_ms;
+  }
+
+  // false if the queue is full, nothing was queued
+  bool press(uint8_t code, uint8_t modifier = 0) {
+    return push({code, modifier, true});
+  }
+
+  bool release(uint8_t code, uint8_t modifier = 0) {
+    return push({code, modifier, false});
+  }
+
+  // press + release, all or nothing
+  bool tap(uint8_t code, uint8_t modifier = 0) {
+    if (get_free_space() < 2) return false;
+    press(code, modifier);
+    release(code, modifier);
+    return true;
+  }
+
+  // keys the user is really holding, these go out right away
+  void set_base(uint8_t modifier, KeySet const &keys) {
+    base_modifier = modifier;
+    base_keys = keys;
+    send();
+  }
+
+  // drops anything queued and lets go of every synthesized key
+  void clear() {
+    head = tail;
+    deadline_armed = false;
+    bool held = synth_keys.any() || synth_modifier;
+    synth_keys.clear_all();
+    synth_modifier = 0;
+    if (held) send();
+  }
+
+  void task(uint32_t time_ms) {
+    // wrap-safe, wait out the last event's hold/gap
+    bool waiting = deadline_armed && (int32_t)(time_ms - next_event_ms) < 0;
+    if (head == tail) {
+      // don't let the deadline go stale while there's nothing to send
+      if (!waiting) deadline_armed = false;
+      return;
+    }
+    if (waiting) return;
+    if (!hid_output->keyboard_ready()) return;
+
+    bool press = queue[tail].press;
+    while (tail != head && queue[tail].press == press) {
+      key_sequencer_event_t const &e = queue[tail];
+      if (press) {
+        synth_keys.set(e.code);
+        synth_modifier |= e.modifier;
+      } else {
+        synth_keys.clear(e.code);
+        synth_modifier &= ~e.modifier;
+      }
+      tail = (tail + 1) & KEY_SEQUENCER_QUEUE_MASK;
+    }
+    send();
+    next_event_ms = time_ms + (press ? min_hold_ms : min_gap_ms);
+    deadline_armed = true;
+  }
+
+  inline size_t get_queue_depth() {
+    return (head - tail) & KEY_SEQUENCER_QUEUE_MASK;
+  }
+
+  // one slot always stays empty to tell full from empty
+  inline size_t get_free_space() {
+    return KEY_SEQUENCER_QUEUE_SIZE - 1 - get_queue_depth();
+  }
+
+  // synthesized + real keys currently reported as held
+  inline size_t get_held_count() { return composed().count(); }
+
+ private:
+  IHIDOutput *hid_output;
+  key_sequencer_event_t queue[KEY_SEQUENCER_QUEUE_SIZE];
+  size_t head = 0;
+  size_t tail = 0;
+  uint32_t next_event_ms = 0;
+  bool deadline_armed = false;
+  uint16_t min_hold_ms = 0;
+  uint16_t min_gap_ms = 0;
+  KeySet base_keys;
+  KeySet synth_keys;
+  uint8_t base_modifier = 0;
+  uint8_t synth_modifier = 0;
+
+  bool push(key_sequencer_event_t e) {
+    if (get_free_space() == 0) return false;
+    queue[head] = e;
+    head = (head + 1) & KEY_SEQUENCER_QUEUE_MASK;
+    return true;
+  }
+
+  inline KeySet composed() {
+    KeySet keys = base_keys;
+    for (size_t w = 0; w < KEY_SET_WORDS; w++) {
+      keys.words[w] |= synth_keys.words[w];
+    }
+    return keys;
+  }
+
+  void send() {
+    hid_output->send_keys(base_modifier | synth_modifier, composed());
+  }
+};
+
+#endif
@@ -0,0 +1,134 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "custom_hid.hpp"
+
+#ifndef COMMON_KEY_STATE
+#define COMMON_KEY_STATE
+
+#define KEY_SET_WORDS (256 / 32)
+
+// reported in every keycode slot when too many keys are down to tell which
+// ones are real (phantom/ghosted state), see HID usage tables section 10
+#define HID_KEY_ERROR_ROLLOVER 0x01
+#define HID_KEY_POST_FAIL 0x02
+#define HID_KEY_ERROR_UNDEFINED 0x03
+
+// One bit per HID keyboard usage, all 256 of them.
+class KeySet {
+ public:
+  inline void clear_all() {
+    for (size_t w = 0; w < KEY_SET_WORDS; w++) words[w] = 0;
+  }
+
+  inline void set(uint8_t code) { words[code >> 5] |= 1u << (code & 31); }
+
+  inline void clear(uint8_t code) {
+    words[code >> 5] &= ~(1u << (code & 31));
+  }
+
+  inline bool test(uint8_t code) const {
+    return (words[code >> 5] >> (code & 31)) & 1;
+  }
+
+  bool any() const {
+    uint32_t acc = 0;
+    for (size_t w = 0; w < KEY_SET_WORDS; w++) acc |= words[w];
+    return acc != 0;
+  }
+
+  size_t count() const {
+    size_t n = 0;
+    for (size_t w = 0; w < KEY_SET_WORDS; w++) {
+      n += __builtin_popcount(words[w]);
+    }
+    return n;
+  }
+
+  // calls fn(code) for every set key, lowest code first
+  template <typename F>
+  void for_each(F fn) const {
+    for (size_t w = 0; w < KEY_SET_WORDS; w++) {
+      uint32_t bits = words[w];
+      while (bits) {
+        uint8_t bit = __builtin_ctz(bits);
+        bits &= bits - 1;
+        fn((uint8_t)((w << 5) | bit));
+      }
+    }
+  }
+
+  // fills a boot protocol keycode array, returns how many keys fit
+  size_t to_keycodes(uint8_t *keycode, size_t len) const {
+    size_t n = 0;
+    for_each([&](uint8_t code) {
+      if (n < len) keycode[n++] = code;
+    });
+    for (size_t i = n; i < len; i++) keycode[i] = 0;
+    return n;
+  }
+
+  uint32_t words[KEY_SET_WORDS] = {0};
+};
+
+// What changed between two reports.
+typedef struct {
+  KeySet pressed;
+  KeySet released;
+  uint8_t modifiers_pressed;
+  uint8_t modifiers_released;
+  // the report was a phantom state, key state was held as-is
+  bool rollover;
+} key_events_t;
+
+// Tracks which keys are down and turns each incoming boot report into
+// press/release events, so FX never have to compare keycode arrays.
+class KeyStateTracker {
+ public:
+  void reset() {
+    held.clear_all();
+    modifier = 0;
+  }
+
+  // returns true if any key or modifier changed
+  bool update(ha_keyboard_report_t const *report, key_events_t *events) {
+    events->rollover = false;
+    uint8_t mod_changed = modifier ^ report->modifier;
+    events->modifiers_pressed = mod_changed & report->modifier;
+    events->modifiers_released = mod_changed & modifier;
+    modifier = report->modifier;
+
+    KeySet next;
+    for (size_t i = 0; i < REPORT_KEYCODE_COUNT; i++) {
+      uint8_t code = report->keycode[i];
+      if (code == HID_KEY_ERROR_ROLLOVER) {
+        // keyboard can't tell what's down, don't invent presses or releases
+        events->rollover = true;
+      } else if (code > HID_KEY_ERROR_UNDEFINED) {
+        next.set(code);
+      }
+    }
+
+    uint32_t acc = mod_changed;
+    for (size_t w = 0; w < KEY_SET_WORDS; w++) {
+      uint32_t changed = events->rollover ? 0 : held.words[w] ^ next.words[w];
+      events->pressed.words[w] = changed & next.words[w];
+      events->released.words[w] = changed & held.words[w];
+      held.words[w] ^= changed;
+      acc |= changed;
+    }
+    return acc != 0;
+  }
+
+  inline bool is_held(uint8_t code) const { return held.test(code); }
+
+  inline KeySet const &get_held() const { return held; }
+
+  inline uint8_t get_modifier() const { return modifier; }
+
+ private:
+  KeySet held;
+  uint8_t modifier = 0;
+};
+
+#endif
@@ -0,0 +1,266 @@
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef COMMON_LED_COMPOSITOR
+#define COMMON_LED_COMPOSITOR
+
+// Levels are perceptual, 0 - 255. The compositor's table turns them into PWM
+// duty with gamma correction, so 128 looks about half as bright as 255 and
+// fades stay smooth all the way down instead of jumping at the dim end.
+#define LED_GAMMA 2.2f
+// table output, 256 == full duty
+#define LED_SCALE_SHIFT 8
+#define LED_SCALE_ONE (1 << LED_SCALE_SHIFT)
+#define LED_MAX_KEYFRAMES 6
+// ramp slopes are Q16 levels per ms
+#define LED_SLOPE_SHIFT 16
+
+typedef struct {
+  // ms it takes to get here from the previous keyframe, ignored on the first
+  uint32_t ms;
+  uint8_t level;
+} led_keyframe_t;
+
+typedef enum {
+  LED_ANIM_LEVEL = 0,
+  LED_ANIM_KEYFRAMES,
+  LED_ANIM_BLINK,
+} led_anim_mode_t;
+
+// A level over time, set up when something happens instead of worked out
+// every frame. Slopes are divided out here, so level_at() is a subtraction,
+// a compare or two and a multiply.
+class LedAnimation {
+ public:
+  // holds one level
+  void set_level(uint8_t level) {
+    mode = LED_ANIM_LEVEL;
+    rest_level = level;
+  }
+
+  // straight ramps between keyframes, the first one is the starting level.
+  // One shots hold the last level once they're done.
+  void play(led_keyframe_t const *keyframes, uint8_t count, uint32_t start_ms,
+            bool loop) {
+    if (count == 0) return;
+    if (count > LED_MAX_KEYFRAMES) count = LED_MAX_KEYFRAMES;
+    mode = LED_ANIM_KEYFRAMES;
+    frame_count = count;
+    this->start_ms = start_ms;
+    total_ms = 0;
+    for (uint8_t i = 0; i < count; i++) {
+      frames[i] = keyframes[i];
+      slopes[i] = 0;
+      if (i == 0) continue;
+      total_ms += frames[i].ms;
+      if (frames[i].ms > 0) {
+        int32_t rise = (int32_t)frames[i].level - (int32_t)frames[i - 1].level;
+        slopes[i] = (rise * (1 << LED_SLOPE_SHIFT)) / (int32_t)frames[i].ms;
+      }
+    }
+    rest_level = frames[count - 1].level;
+    this->loop = loop && total_ms > 0;
+  }
+
+  void ramp(uint8_t from, uint8_t to, uint32_t ms, uint32_t start_ms,
+            bool loop) {
+    led_keyframe_t keyframes[] = {{0, from}, {ms, to}};
+    play(keyframes, 2, start_ms, loop);
+  }
+
+  // alternates on and off every half_period_ms, starting on. Settles on rest
+  // after `toggles` halves, 0 toggles blinks until something else is set.
+  void blink(uint8_t on, uint8_t off, uint16_t half_period_ms, uint8_t toggles,
+             uint8_t rest, uint32_t start_ms) {
+    mode = LED_ANIM_BLINK;
+    on_level = on;
+    off_level = off;
+    this->half_period_ms = half_period_ms > 0 ? half_period_ms : 1;
+    this->toggles = toggles;
+    rest_level = rest;
+    this->start_ms = start_ms;
+  }
+
+  uint8_t level_at(uint32_t time_ms) const {
+    uint32_t elapsed = time_ms - start_ms;
+    switch (mode) {
+      case LED_ANIM_BLINK: {
+        uint32_t half = elapsed / half_period_ms;
+        if (toggles > 0 && half >= toggles) return rest_level;
+        return (half & 1) ? off_level : on_level;
+      }
+      case LED_ANIM_KEYFRAMES:
+        if (elapsed >= total_ms) {
+          if (!loop) return rest_level;
+          elapsed %= total_ms;
+        }
+        for (uint8_t i = 1; i < frame_count; i++) {
+          if (elapsed < frames[i].ms) {
+            // elapsed * slope never exceeds the rise << LED_SLOPE_SHIFT
+            int32_t step = ((int32_t)elapsed * slopes[i]) >> LED_SLOPE_SHIFT;
+            return (uint8_t)(frames[i - 1].level + step);
+          }
+          elapsed -= frames[i].ms;
+        }
+        return rest_level;
+      default:
+        return rest_level;
+    }
+  }
+
+  // a one shot has settled, a held level or a loop never is
+  bool is_done(uint32_t time_ms) const {
+    uint32_t elapsed = time_ms - start_ms;
+    switch (mode) {
+      case LED_ANIM_BLINK:
+        return toggles > 0 && elapsed / half_period_ms >= toggles;
+      case LED_ANIM_KEYFRAMES:
+        return !loop && elapsed >= total_ms;
+      default:
+        return false;
+    }
+  }
+
+  inline led_anim_mode_t get_mode() const { return mode; }
+
+ private:
+  led_anim_mode_t mode = LED_ANIM_LEVEL;
+  uint8_t rest_level = 255;
+  uint32_t start_ms = 0;
+  // keyframes
+  led_keyframe_t frames[LED_MAX_KEYFRAMES];
+  int32_t slopes[LED_MAX_KEYFRAMES];
+  uint32_t total_ms = 0;
+  uint8_t frame_count = 0;
+  bool loop = false;
+  // blink
+  uint8_t on_level = 255;
+  uint8_t off_level = 0;
+  uint16_t half_period_ms = 1;
+  uint8_t toggles = 0;
+};
+
+typedef enum {
+  // replaces what's underneath, by opacity
+  LED_BLEND_OVER = 0,
+  // adds to what's underneath, clipping at full
+  LED_BLEND_ADD,
+} led_blend_t;
+
+// One color with an animated level. Every FX owns one and the compositor
+// owns the ones drawn on top of it.
+class LedLayer : public LedAnimation {
+ public:
+  // 0x00RRGGBB, anything in the top byte is ignored
+  inline void set_color(uint32_t c) { color = c & 0x00FFFFFF; }
+  inline uint32_t get_color() const { return color; }
+  inline void show() { visible = true; }
+  inline void hide() { visible = false; }
+  inline bool is_visible() const { return visible; }
+  inline void set_opacity(uint8_t o) { opacity = o; }
+  inline uint8_t get_opacity() const { return opacity; }
+  inline void set_blend(led_blend_t b) { blend = b; }
+  inline led_blend_t get_blend() const { return blend; }
+  // hides the layer once a one shot animation is done, for overlays
+  inline void set_auto_hide(bool a) { auto_hide = a; }
+  inline bool is_auto_hide() const { return auto_hide; }
+
+ private:
+  uint32_t color = 0x00666666;
+  bool visible = true;
+  bool auto_hide = false;
+  uint8_t opacity = 255;
+  led_blend_t blend = LED_BLEND_OVER;
+};
+
+// bottom to top
+typedef enum {
+  // the active FX's own layer
+  LED_LAYER_FX = 0,
+  // set mode's slot color
+  LED_LAYER_MODE,
+  // flashes when a command fails
+  LED_LAYER_ERROR,
+  LED_LAYER_COUNT
+} led_layer_id_t;
+
+// Stacks the LED layers into one pixel. Gamma and the brightness setting are
+// baked into a table that's only rebuilt when the brightness changes, so a
+// frame costs a lookup and three integer multiplies per visible layer.
+class LedCompositor {
+ public:
+  LedCompositor() {
+    for (size_t i = 0; i < LED_LAYER_COUNT; i++) layers[i] = nullptr;
+    layers[LED_LAYER_MODE] = &mode_layer;
+    layers[LED_LAYER_ERROR] = &error_layer;
+    mode_layer.hide();
+    error_layer.hide();
+    error_layer.set_auto_hide(true);
+    set_brightness(1.0f);
+  }
+
+  // rebuilds the table if the brightness changed, returns true if it did
+  bool set_brightness(float brightness) {
+    if (built && brightness == current_brightness) return false;
+    built = true;
+    current_brightness = brightness;
+    for (size_t i = 0; i < 256; i++) {
+      float duty = powf((float)i / 255.0f, LED_GAMMA) * brightness;
+      lut[i] = (uint16_t)((duty * (float)LED_SCALE_ONE) + 0.5f);
+    }
+    return true;
+  }
+
+  // duty a level is shown at, LED_SCALE_ONE == full
+  inline uint16_t get_scale(uint8_t level) const { return lut[level]; }
+
+  // the active FX's layer, nullptr while FX are off. Without animation it's
+  // drawn at full level, for when flashing is turned off.
+  inline void set_fx_layer(LedLayer *layer, bool animate) {
+    layers[LED_LAYER_FX] = layer;
+    animate_fx = animate;
+  }
+
+  inline LedLayer *get_layer(led_layer_id_t id) { return layers[id]; }
+
+  uint32_t render(uint32_t time_ms) {
+    int32_t rgb[3] = {0, 0, 0};
+    for (size_t i = 0; i < LED_LAYER_COUNT; i++) {
+      LedLayer *layer = layers[i];
+      if (!layer || !layer->is_visible()) continue;
+      if (layer->is_auto_hide() && layer->is_done(time_ms)) {
+        layer->hide();
+        continue;
+      }
+      bool animate = i != LED_LAYER_FX || animate_fx;
+      int32_t scale = lut[animate ? layer->level_at(time_ms) : 255];
+      // 0 - 256 so fully opaque is exact
+      int32_t alpha = layer->get_opacity() + (layer->get_opacity() >> 7);
+      uint32_t color = layer->get_color();
+      for (size_t c = 0; c < 3; c++) {
+        int32_t channel = (color >> (16 - (8 * c))) & 0xFF;
+        int32_t lit = (channel * scale) >> LED_SCALE_SHIFT;
+        if (layer->get_blend() == LED_BLEND_ADD) {
+          rgb[c] += (lit * alpha) >> LED_SCALE_SHIFT;
+          if (rgb[c] > 255) rgb[c] = 255;
+        } else {
+          rgb[c] += ((lit - rgb[c]) * alpha) / LED_SCALE_ONE;
+        }
+      }
+    }
+    return ((uint32_t)rgb[0] << 16) | ((uint32_t)rgb[1] << 8) |
+           (uint32_t)rgb[2];
+  }
+
+ private:
+  LedLayer *layers[LED_LAYER_COUNT];
+  LedLayer mode_layer;
+  LedLayer error_layer;
+  bool animate_fx = true;
+  uint16_t lut[256];
+  float current_brightness = 0.0f;
+  bool built = false;
+};
+
+#endif
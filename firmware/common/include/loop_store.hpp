@@ -0,0 +1,37 @@
+#include <stdint.h>
+
+#ifndef COMMON_LOOP_STORE
+#define COMMON_LOOP_STORE
+
+// IMPORTANT!!! this is the on-flash layout of a recorded loop sample, changing
+// it will invalidate any loops users have saved
+typedef struct {
+  // us since recording started
+  uint32_t time_us_offset;
+  int8_t x;
+  int8_t y;
+  uint16_t reserved;
+} mouse_loop_sample_t;
+
+class ILoopStore {
+ public:
+  virtual void initialize() = 0;
+  virtual uint8_t getSlotCount() = 0;
+  // most samples a slot holds
+  virtual uint32_t getSlotCapacity() = 0;
+  // Stages a loop to be written. The samples must stay untouched until
+  // isBusy() returns false. Returns false if a write is already in progress.
+  virtual bool saveLoop(uint8_t slot, const mouse_loop_sample_t *samples,
+                        uint32_t count, uint32_t duration_us) = 0;
+  // Stages the removal of a loop, returns false if a write is in progress.
+  virtual bool eraseLoop(uint8_t slot) = 0;
+  // Returns a pointer straight into storage, or NULL if the slot is empty or
+  // being written. Valid until the next saveLoop/eraseLoop of that slot.
+  virtual const mouse_loop_sample_t *getLoop(uint8_t slot, uint32_t *count,
+                                             uint32_t *duration_us) = 0;
+  virtual bool isBusy() = 0;
+  // Performs at most one unit of pending work, call from the main loop.
+  virtual void task() = 0;
+  virtual ~ILoopStore() = default;
+};
+#endif
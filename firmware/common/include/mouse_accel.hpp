@@ -0,0 +1,159 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "persistence.hpp"
+
+#ifndef COMMON_MOUSE_ACCEL
+#define COMMON_MOUSE_ACCEL
+
+// one gain per input speed, counts per report, faster input clamps to the top
+#define MOUSE_ACCEL_LUT_SIZE 128
+// gains are Q8, 256 == 1x
+#define MOUSE_ACCEL_FRAC_BITS 8
+#define MOUSE_ACCEL_ONE (1 << MOUSE_ACCEL_FRAC_BITS)
+#define MOUSE_ACCEL_MIN_GAIN 0.125f
+#define MOUSE_ACCEL_MAX_GAIN 8.0f
+// power curve is 1x at this speed, slower is finer, faster is coarser
+#define MOUSE_ACCEL_POWER_PIVOT 8.0f
+// sigmoid ramps from 1x up to 1x + boost around the midpoint speed
+#define MOUSE_ACCEL_SIGMOID_MID 16.0f
+#define MOUSE_ACCEL_SIGMOID_WIDTH 4.0f
+#define MOUSE_ACCEL_SIGMOID_MAX_BOOST 3.0f
+
+enum MouseAccelCurve {
+  MOUSE_ACCEL_LINEAR = 0,
+  MOUSE_ACCEL_POWER,
+  MOUSE_ACCEL_SIGMOID,
+  MOUSE_ACCEL_CUSTOM,
+  MOUSE_ACCEL_CURVE_COUNT
+};
+
+typedef struct {
+  uint8_t curve;
+  // 0-100, how hard power/sigmoid bend
+  uint8_t strength;
+  // m_speed level, 0-4 scales every gain by 0.5x - 1.5x
+  uint8_t speed_level;
+  // custom curve, {speed, gain * 10}
+  uint8_t points[MOUSE_ACCEL_POINTS][2];
+} mouse_accel_config_t;
+
+// Pointer acceleration as an integer lookup table over input speed. The
+// table is built with float math whenever the config changes, after that a
+// report costs a lookup and an integer multiply per axis. Sub-pixel
+// remainders carry over to the next report instead of being rounded away.
+class MouseAccel {
+ public:
+  static mouse_accel_config_t config_from(IPersistence *settings) {
+    mouse_accel_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.curve = settings->getMouseAccelCurve();
+    config.strength = settings->getMouseAccelStrength();
+    config.speed_level = settings->getMouseSpeedLevel();
+    for (uint8_t i = 0; i < MOUSE_ACCEL_POINTS; i++) {
+      config.points[i][0] = settings->getMouseAccelPointSpeed(i);
+      config.points[i][1] = settings->getMouseAccelPointGain(i);
+    }
+    return config;
+  }
+
+  // rebuilds the table if anything changed, returns true if it did
+  bool configure(mouse_accel_config_t const &next) {
+    if (configured && memcmp(&next, &config, sizeof(config)) == 0) {
+      return false;
+    }
+    config = next;
+    configured = true;
+    float base = (config.speed_level * 0.25f) + 0.5f;
+    for (size_t v = 0; v < MOUSE_ACCEL_LUT_SIZE; v++) {
+      float gain = base * curve_gain((float)v);
+      gain = gain < MOUSE_ACCEL_MIN_GAIN ? MOUSE_ACCEL_MIN_GAIN : gain;
+      gain = gain > MOUSE_ACCEL_MAX_GAIN ? MOUSE_ACCEL_MAX_GAIN : gain;
+      lut[v] = (uint16_t)(gain * MOUSE_ACCEL_ONE + 0.5f);
+    }
+    reset_carry();
+    return true;
+  }
+
+  // scales one report in place
+  void apply(int8_t *x, int8_t *y) {
+    int32_t ax = abs(*x);
+    int32_t ay = abs(*y);
+    // octagonal |v|, within ~8% of the real magnitude, no sqrt
+    int32_t speed = ax > ay ? ax + (ay >> 1) : ay + (ax >> 1);
+    if (speed >= MOUSE_ACCEL_LUT_SIZE) speed = MOUSE_ACCEL_LUT_SIZE - 1;
+    int32_t gain = lut[speed];
+    *x = scale(*x, gain, &carry_x);
+    *y = scale(*y, gain, &carry_y);
+  }
+
+  inline void reset_carry() {
+    carry_x = 0;
+    carry_y = 0;
+  }
+
+  // Q8 gain at an input speed
+  inline uint16_t get_gain(uint8_t speed) {
+    return lut[speed < MOUSE_ACCEL_LUT_SIZE ? speed : MOUSE_ACCEL_LUT_SIZE - 1];
+  }
+
+ private:
+  uint16_t lut[MOUSE_ACCEL_LUT_SIZE];
+  int32_t carry_x = 0;
+  int32_t carry_y = 0;
+  mouse_accel_config_t config;
+  bool configured = false;
+
+  static inline int8_t scale(int8_t v, int32_t gain, int32_t *carry) {
+    int32_t scaled = (v * gain) + *carry;
+    // truncates towards zero, the remainder keeps the sign of the motion
+    int32_t px = scaled / MOUSE_ACCEL_ONE;
+    if (px > 127 || px < -127) {
+      // can't report it anyway, don't bank it either
+      *carry = 0;
+      return px > 0 ? 127 : -127;
+    }
+    *carry = scaled - (px * MOUSE_ACCEL_ONE);
+    return (int8_t)px;
+  }
+
+  float curve_gain(float speed) {
+    float strength = config.strength / 100.0f;
+    switch (config.curve) {
+      case MOUSE_ACCEL_POWER:
+        return powf(speed / MOUSE_ACCEL_POWER_PIVOT, strength);
+      case MOUSE_ACCEL_SIGMOID:
+        return 1.0f + (strength * MOUSE_ACCEL_SIGMOID_MAX_BOOST) /
+                          (1.0f + expf(-(speed - MOUSE_ACCEL_SIGMOID_MID) /
+                                       MOUSE_ACCEL_SIGMOID_WIDTH));
+      case MOUSE_ACCEL_CUSTOM:
+        return custom_gain(speed);
+      default:
+        return 1.0f;
+    }
+  }
+
+  // straight lines between the points (in any order), flat past either end
+  float custom_gain(float speed) {
+    int lo = -1;
+    int hi = -1;
+    for (int i = 0; i < MOUSE_ACCEL_POINTS; i++) {
+      float s = config.points[i][0];
+      if (s <= speed && (lo < 0 || s >= config.points[lo][0])) lo = i;
+      if (s >= speed && (hi < 0 || s < config.points[hi][0])) hi = i;
+    }
+    if (lo < 0) return config.points[hi][1] / 10.0f;
+    if (hi < 0 || config.points[hi][0] == config.points[lo][0]) {
+      return config.points[lo][1] / 10.0f;
+    }
+    float t = (speed - config.points[lo][0]) /
+              (float)(config.points[hi][0] - config.points[lo][0]);
+    return (config.points[lo][1] +
+            t * (config.points[hi][1] - config.points[lo][1])) /
+           10.0f;
+  }
+};
+
+#endif
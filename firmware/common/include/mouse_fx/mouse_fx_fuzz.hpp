@@ -1,9 +1,22 @@
+#include <math.h>
+
 #include <algorithm>
 
 #include "custom_hid.hpp"
+#include "filters.hpp"
 #include "hid_fx.hpp"
 
 #define FILTER_BUF_SIZE 50
+// once the mouse has been quiet this long, start draining the filter
+#define FILTER_IDLE_US 25000
+// rate the filter drains at while the mouse is quiet
+#define FILTER_DRAIN_US 5000
+// LED range, the filter's level tops out at this share of full scale motion
+#define FUZZ_LED_MIN 65
+#define FUZZ_LED_MAX 243
+#define FUZZ_LED_FULL_PERCENT 70
+// noise flickers the LED up and back down for this long each
+#define FUZZ_LED_FLICKER_MS 30
 
 class MouseFuzz : public IMouseFx {
   using IMouseFx::IMouseFx;
@@ -14,137 +27,126 @@ class MouseFuzz : public IMouseFx {
     int8_t y;
   } sample_t;
 
-  uint32_t last_mouse_report_time = 0;
-  // hold last FILTER_BUF_SIZE x + y samples for simple low pass filter
-  sample_t filter_buf[FILTER_BUF_SIZE];
-  size_t filter_index = 0;
+  fx_time_t last_mouse_report_time = 0;
+  fx_time_t last_drain_time = 0;
+  // running averages of the last FILTER_BUF_SIZE x + y samples, low pass
+  MovingAverage<FILTER_BUF_SIZE> filter_x;
+  MovingAverage<FILTER_BUF_SIZE> filter_y;
   // whether to add or remove "noise" (this is effectively [heh] two fx in one)
   bool add_noise;
   float noise_param;
   float filter_param;
-  float last_noise_value;
+  // where the LED rests between flickers
+  uint8_t led_low = FUZZ_LED_MIN;
   ha_mouse_report_t last_report;
 
-  inline void add_filter_sample(int8_t x, int8_t y) {
-    filter_buf[filter_index] = {x, y};
-    if (++filter_index >= FILTER_BUF_SIZE) {
-      filter_index = 0;
-    }
+  static inline int8_t clamp_report(int32_t v) {
+    return (int8_t)(v > 127 ? 127 : (v < -127 ? -127 : v));
   }
 
   inline sample_t get_filtered_samples() {
-    size_t count = (size_t)(filter_param * (float)FILTER_BUF_SIZE);
-    if (count < 1) count = 1;
-    int16_t sum_x = 0, sum_y = 0;
-    for (size_t i = filter_index + (FILTER_BUF_SIZE - count), j = 0; j < count;
-         i++, j++) {
-      sample_t s = filter_buf[i % FILTER_BUF_SIZE];
-      sum_x += s.x;
-      sum_y += s.y;
-    }
-    int8_t x_ave = sum_x / (int16_t)count;
-    int8_t y_ave = sum_y / (int16_t)count;
-    return {x_ave, y_ave};
+    return {clamp_report(filter_x.average()), clamp_report(filter_y.average())};
   }
 
-  inline float get_filtered_average() {
-    size_t count = (size_t)(filter_param * (float)FILTER_BUF_SIZE);
-    if (count < 1) count = 1;
-    float sum_x = 0.0f, sum_y = 0.0f;
-    for (size_t i = filter_index + (FILTER_BUF_SIZE - count), j = 0; j < count;
-         i++, j++) {
-      sample_t s = filter_buf[i % FILTER_BUF_SIZE];
-      sum_x += s.x;
-      sum_y += s.y;
-    }
-    float x_ave = sum_x / (float)count;
-    float y_ave = sum_y / (float)count;
-    return std::max(abs(x_ave), abs(y_ave)) / 127.0f;
+  // brighter the more motion is in the filter
+  inline void show_filter_level() {
+    int32_t sum = std::max(abs(filter_x.get_sum()), abs(filter_y.get_sum()));
+    int32_t full =
+        (127 * (int32_t)filter_x.get_window() * FUZZ_LED_FULL_PERCENT) / 100;
+    int32_t range = FUZZ_LED_MAX - FUZZ_LED_MIN;
+    int32_t level = FUZZ_LED_MIN + std::min(range, (sum * range) / full);
+    led.set_level((uint8_t)level);
+  }
+
+  // flicker up by how much noise went in, then back down to led_low
+  inline void flicker(float noise_value, uint32_t time_ms) {
+    if (led.get_mode() != LED_ANIM_LEVEL && !led.is_done(time_ms)) return;
+    uint8_t level = 168 + (uint8_t)(noise_value * 49.0f);
+    led_keyframe_t keyframes[] = {{0, level},
+                                  {FUZZ_LED_FLICKER_MS, level},
+                                  {0, led_low},
+                                  {FUZZ_LED_FLICKER_MS, led_low}};
+    led.play(keyframes, 4, time_ms, false);
   }
 
  public:
 
-  void initialize(uint32_t time_ms, float param_percentage) {
-    (void)time_ms;
+  void initialize(fx_time_t time_us, float param_percentage) {
+    (void)time_us;
     update_parameter(param_percentage);
     log_line("Mouse fuzz/filter initialized");
   }
 
-  uint32_t get_current_pixel_value(uint32_t time_ms) {
-    (void)time_ms;
-    static bool sent_flicker_last_tick = false;
-    if (add_noise) {
-      if (last_noise_value > 0.0f && !sent_flicker_last_tick) {
-        float brightness = (last_noise_value * 0.3f) + 0.4f;
-        sent_flicker_last_tick = true;
-        last_noise_value = 0.0f;
-        return color_at_brightness(indicator_color, brightness);
-      } else {
-        // low value is inversely related to noise_param to emphasize flickering
-        // when noise_param is higher
-        sent_flicker_last_tick = false;
-        return color_at_brightness(indicator_color,
-                                   ((1.0f - noise_param) / 3.5) + 0.05f);
-      }
-    } else {
-      float brightness = (get_filtered_average() * 1.2f) + 0.05f;
-      brightness = std::min(0.9f, brightness);
-      return color_at_brightness(indicator_color, brightness);
-    }
-  }
-
   void update_parameter(float percentage) {
     add_noise = percentage > 0.5f;
     if (add_noise) {
       noise_param = (percentage - 0.5f) * 2;
+      // low value is inversely related to noise_param to emphasize flickering
+      // when noise_param is higher
+      led_low = FUZZ_LED_MIN + (uint8_t)((1.0f - noise_param) * 91.0f);
+      led.set_level(led_low);
     } else {
       filter_param = 1.0f - (percentage * 2.0f);
+      size_t count = (size_t)(filter_param * (float)FILTER_BUF_SIZE);
+      if (count != filter_x.get_window()) {
+        filter_x.set_window(count);
+        filter_y.set_window(count);
+      }
+      show_filter_level();
     }
   }
 
-  void tick(uint32_t time_ms) {
-    static uint32_t last_dummy_sample = 0;
-    uint32_t delta_time = time_ms - last_mouse_report_time;
-    if (!add_noise && delta_time > 25 && delta_time < 250) {
-      if (time_ms - last_dummy_sample > 5) {
-        last_report.x = 0;
-        last_report.y = 0;
-        last_report.wheel = 0;
-        last_report.pan = 0;
-        process_with_filter(&last_report, time_ms);
-        last_dummy_sample = time_ms;
-      }
+  void tick(fx_time_t time_us) {
+    // once the mouse goes quiet, decay the filter by however much time has
+    // passed so the cursor glides to a stop instead of freezing mid-average
+    if (add_noise || time_us - last_mouse_report_time <= FILTER_IDLE_US) {
+      return;
+    }
+    uint32_t periods = (uint32_t)((time_us - last_drain_time) / FILTER_DRAIN_US);
+    if (periods == 0) return;
+    last_drain_time += (fx_time_t)periods * FILTER_DRAIN_US;
+    if (filter_x.get_sum() == 0 && filter_y.get_sum() == 0) return;
+    int8_t x = clamp_report(filter_x.decay(periods));
+    int8_t y = clamp_report(filter_y.decay(periods));
+    if (x != 0 || y != 0) {
+      hid_output->send_mouse_report(last_report.buttons, x, y, 0, 0);
     }
+    show_filter_level();
   }
 
   void deinit() {}
 
-  void process_with_noise(ha_mouse_report_t const *report, uint32_t time_ms) {
-    (void)time_ms;
+  void process_with_noise(ha_mouse_report_t const *report, fx_time_t time_us) {
     float adj_noise = noise_param / 3.0f;
-    float x_noise = (float)(int8_t)get_random_byte() * adj_noise;
-    float y_noise = (float)(int8_t)get_random_byte() * adj_noise;
+    int8_t noise[2];
+    fill_random((uint8_t *)noise, sizeof(noise));
+    float x_noise = (float)noise[0] * adj_noise;
+    float y_noise = (float)noise[1] * adj_noise;
     int8_t x = (int8_t)round(x_noise + (float)report->x);
     int8_t y = (int8_t)round(y_noise + (float)report->y);
-    last_noise_value = std::min(abs(x_noise), abs(y_noise)) / 127.0f;
+    float noise_value = std::min(fabsf(x_noise), fabsf(y_noise)) / 127.0f;
+    if (noise_value > 0.0f) flicker(noise_value, fx_ms(time_us));
     hid_output->send_mouse_report(report->buttons, x, y, report->wheel, report->pan);
   }
 
-  void process_with_filter(ha_mouse_report_t const *report, uint32_t time_ms) {
-    (void)time_ms;
+  void process_with_filter(ha_mouse_report_t const *report, fx_time_t time_us) {
+    (void)time_us;
     last_report = *report;
-    add_filter_sample(report->x, report->y);
+    filter_x.push(report->x);
+    filter_y.push(report->y);
     sample_t filtered = get_filtered_samples();
+    show_filter_level();
     hid_output->send_mouse_report(report->buttons, filtered.x, filtered.y, report->wheel,
                       report->pan);
   }
 
-  void process_mouse_report(ha_mouse_report_t const *report, uint32_t time_ms) {
-    last_mouse_report_time = time_ms;
+  void process_mouse_report(ha_mouse_report_t const *report, fx_time_t time_us) {
+    last_mouse_report_time = time_us;
+    last_drain_time = time_us;
     if (add_noise) {
-      process_with_noise(report, time_ms);
+      process_with_noise(report, time_us);
     } else {
-      process_with_filter(report, time_ms);
+      process_with_filter(report, time_us);
     }
   }
 };
@@ -1,105 +1,436 @@
+#include <math.h>
+
 #include <algorithm>
 
 #include "custom_hid.hpp"
 #include "hid_fx.hpp"
+#include "loop_store.hpp"
 
-#define MOUSE_LOOP_BUFFER_SIZE 4096
+// the buffer only exists while the looper runs (see fx_arena.hpp), so it can
+// be bigger than a stored loop slot, loops longer than a slot just can't be
+// saved
+#define MOUSE_LOOP_BUFFER_SIZE 4608
 #define MOUSE_LOOP_MAX_SPEED 2.5
+// playback position is tracked in 1/256 us so speed changes never drift
+#define MOUSE_LOOP_SPEED_SHIFT 8
+#define MOUSE_LOOP_UNITY_SPEED (1 << MOUSE_LOOP_SPEED_SHIFT)
+// holding the middle button turns the knob into a stored loop selector, the
+// button only stops reaching the host once the knob's turned
+#define MOUSE_LOOP_SELECT_BUTTON 0b100
+
+// longest recorded gap a sample's motion will be spread across when playing
+// back slower than 1X, so motion after a long pause isn't smeared out
+#define MOUSE_LOOP_MAX_INTERP_US 16000
+
+// LED flashes while recording, then ramps over each pass of the loop
+#define MOUSE_LOOP_LED_IDLE 123
+#define MOUSE_LOOP_LED_RECORD 243
+#define MOUSE_LOOP_LED_FLASH_MS 25
 
 class MouseLooper : public IMouseFx {
   using IMouseFx::IMouseFx;
 
+ public:
+  typedef mouse_loop_sample_t sample_t;
+
+  // lives in the arena while the looper is running
+  struct State {
+    sample_t buffer[MOUSE_LOOP_BUFFER_SIZE];
+  };
+
  private:
-  typedef struct sample {
-    uint32_t time_ms_offset;
-    int8_t x;
-    int8_t y;
-  } sample_t;
-  sample_t buffer[MOUSE_LOOP_BUFFER_SIZE];
+  State *state = nullptr;
+  // what's being played back, either the recording buffer or a loop straight
+  // out of storage
+  const sample_t *samples = nullptr;
+  ILoopStore *loop_store = nullptr;
+  // stored loop currently being played, 0xFF when playing buffer
+  uint8_t stored_slot = 0xFF;
   size_t loop_len;
   size_t buf_index;
-  uint32_t record_start_time_ms;
-  uint32_t loop_playback_start_time_ms;
-  uint8_t latest_buttons_minus_right;
+  uint32_t loop_duration_us;
+  fx_time_t record_start_time_us;
+  // 0 when not playing
+  fx_time_t last_tick_time_us;
+  // position within the loop, in 1/256 us
+  uint64_t playhead;
+  // playback speed, MOUSE_LOOP_UNITY_SPEED == 1X
+  uint32_t speed;
+  // portion of buffer[buf_index] already emitted by interpolation
+  int16_t partial_x;
+  int16_t partial_y;
+  // motion that didn't fit into the last report
+  int32_t carry_x;
+  int32_t carry_y;
+  fx_time_t latest_time_us;
+  uint8_t latest_buttons;
+  uint8_t latest_playback_buttons;
+  // the knob was turned while the select button was held, it's kept from the
+  // host until it's let go
+  bool selecting = false;
   float direction;
+  // playhead wrapped since the LED ramp was last lined up with it
+  bool wrapped;
+  // Tempo sync: each pass of the loop is stretched to a whole number of beats
+  // and the playhead is driven by the tempo clock instead of elapsed ms, so
+  // the loop stays on the beat for as long as it plays.
+  bool tempo_sync = false;
+  uint32_t sync_beats = 0;
+  // clock position the playhead was last moved up to
+  uint64_t sync_ticks;
+  // playhead motion that didn't divide evenly, carried to the next tick
+  uint64_t sync_carry;
+  uint32_t tempo_generation;
+
+  // brightens over each pass of the loop, or fades when playing backwards
+  void show_progress(fx_time_t time_us) {
+    // recording has its own flashing
+    if (record_start_time_us > 0) return;
+    if (loop_len == 0 || last_tick_time_us == 0) {
+      led.set_level(MOUSE_LOOP_LED_IDLE);
+      return;
+    }
+    bool forward = direction >= 0.0f;
+    uint8_t from = forward ? MOUSE_LOOP_LED_IDLE : 255;
+    uint8_t to = forward ? 255 : MOUSE_LOOP_LED_IDLE;
+    uint64_t loop_end = (uint64_t)loop_duration_us << MOUSE_LOOP_SPEED_SHIFT;
+    uint32_t pass_ms =
+        speed > 0 ? (uint32_t)(loop_end / speed / FX_US_PER_MS) : 0;
+    if (pass_ms == 0) {
+      // stopped, or too short to ramp, hold where the playhead is
+      int32_t progress =
+          loop_end > 0 ? (int32_t)std::min<uint64_t>(
+                             255, (playhead * 255) / loop_end)
+                       : 0;
+      led.set_level((uint8_t)(from + (((to - from) * progress) / 255)));
+      return;
+    }
+    uint32_t into_ms = (uint32_t)(playhead / speed / FX_US_PER_MS);
+    led.ramp(from, to, pass_ms, fx_ms(time_us) - into_ms, true);
+  }
+
+  inline void set_direction(float d) {
+    direction = d;
+    speed = (uint32_t)lroundf(fabsf(direction) * MOUSE_LOOP_MAX_SPEED *
+                              (float)MOUSE_LOOP_UNITY_SPEED);
+    if (tempo_sync) lock_to_beats();
+    show_progress(latest_time_us);
+  }
+
+  // rounds a pass at the requested speed to whole beats
+  void lock_to_beats() {
+    sync_beats = 0;
+    if (loop_duration_us == 0 || speed == 0) return;
+    uint64_t pass_us =
+        ((uint64_t)loop_duration_us * MOUSE_LOOP_UNITY_SPEED) / speed;
+    uint32_t period_us = tempo->get_period_us();
+    sync_beats = (uint32_t)((pass_us + (period_us / 2)) / period_us);
+    if (sync_beats == 0) sync_beats = 1;
+    sync_speed();
+  }
+
+  // the speed the interpolation and LED go by, follows the tempo
+  void sync_speed() {
+    tempo_generation = tempo->get_generation();
+    if (sync_beats == 0) return;
+    speed = (uint32_t)(((uint64_t)loop_duration_us * MOUSE_LOOP_UNITY_SPEED) /
+                       ((uint64_t)sync_beats * tempo->get_period_us()));
+    if (speed == 0) speed = 1;
+  }
+
+  // moves the playhead by how far the clock has gone, exactly
+  // sync_beats * TEMPO_PPQN ticks per pass
+  void advance_with_tempo(fx_time_t time_us) {
+    if (tempo_generation != tempo->get_generation()) {
+      sync_speed();
+      show_progress(time_us);
+    }
+    uint64_t now_ticks = tempo->ticks_at(fx_ms(time_us));
+    // playback starts on the nearest beat, which can be just ahead
+    if (now_ticks <= sync_ticks) return;
+    uint64_t moved = now_ticks - sync_ticks;
+    sync_ticks = now_ticks;
+    if (sync_beats == 0) return;
+    uint64_t loop_end = (uint64_t)loop_duration_us << MOUSE_LOOP_SPEED_SHIFT;
+    uint64_t pass_ticks = (uint64_t)sync_beats * TEMPO_PPQN;
+    uint64_t travelled = (moved * loop_end) + sync_carry;
+    playhead += travelled / pass_ticks;
+    sync_carry = travelled % pass_ticks;
+  }
+
+  inline void start_playback(fx_time_t time_us) {
+    // 0 is reserved for "not playing"
+    last_tick_time_us = time_us == 0 ? 1 : time_us;
+    playhead = 0;
+    buf_index = 0;
+    partial_x = partial_y = 0;
+    carry_x = carry_y = 0;
+    wrapped = false;
+    // the loop starts on the beat nearest to now
+    sync_ticks = ((tempo->ticks_at(fx_ms(time_us)) + (TEMPO_PPQN / 2)) /
+                  TEMPO_PPQN) *
+                 TEMPO_PPQN;
+    sync_carry = 0;
+    // a recalled loop has its own length
+    if (tempo_sync) lock_to_beats();
+    show_progress(time_us);
+  }
+
+  static inline int8_t clamp_report(int32_t *value) {
+    int32_t out = *value > 127 ? 127 : (*value < -127 ? -127 : *value);
+    *value -= out;
+    return (int8_t)out;
+  }
+
+  // Gathers the motion of every sample that became due between the previous
+  // playhead and the current one. When playing slower than 1X, the next
+  // sample that isn't due yet contributes the fraction of its motion that
+  // corresponds to how far the playhead has travelled towards it.
+  bool gather_due_motion(int32_t *x, int32_t *y) {
+    bool emitted = false;
+    while (loop_len > 0) {
+      if (buf_index >= loop_len) {
+        uint64_t loop_end = (uint64_t)loop_duration_us
+                            << MOUSE_LOOP_SPEED_SHIFT;
+        if (playhead < loop_end) break;
+        // keep any overshoot so loop boundaries stay locked to wall-clock
+        playhead -= loop_end;
+        buf_index = 0;
+        wrapped = true;
+      }
+      sample_t s = samples[buf_index];
+      uint64_t due = (uint64_t)s.time_us_offset << MOUSE_LOOP_SPEED_SHIFT;
+      if (playhead >= due) {
+        *x += s.x - partial_x;
+        *y += s.y - partial_y;
+        partial_x = partial_y = 0;
+        buf_index++;
+        emitted = true;
+        continue;
+      }
+      if (speed < MOUSE_LOOP_UNITY_SPEED) {
+        uint32_t prev =
+            buf_index > 0 ? samples[buf_index - 1].time_us_offset : 0;
+        uint32_t span = s.time_us_offset - prev;
+        if (span > MOUSE_LOOP_MAX_INTERP_US) span = MOUSE_LOOP_MAX_INTERP_US;
+        uint64_t interp_start =
+            due - ((uint64_t)span << MOUSE_LOOP_SPEED_SHIFT);
+        if (span > 0 && playhead > interp_start) {
+          int32_t progress = (int32_t)(playhead - interp_start);
+          int32_t full = span << MOUSE_LOOP_SPEED_SHIFT;
+          int16_t px = (int16_t)((s.x * progress) / full);
+          int16_t py = (int16_t)((s.y * progress) / full);
+          *x += px - partial_x;
+          *y += py - partial_y;
+          emitted |= px != partial_x || py != partial_y;
+          partial_x = px;
+          partial_y = py;
+        }
+      }
+      break;
+    }
+    return emitted;
+  }
 
  public:
-  void initialize(uint32_t time_ms, float param_percentage) {
-    (void)time_ms;
-    loop_playback_start_time_ms = 0;
+  void initialize(fx_time_t time_us, float param_percentage) {
+    (void)time_us;
+    state = create_state<State>();
+    samples = state ? state->buffer : nullptr;
+    stored_slot = 0xFF;
+    loop_len = 0;
+    buf_index = 0;
+    record_start_time_us = 0;
+    last_tick_time_us = 0;
+    latest_buttons = latest_playback_buttons = 0;
+    selecting = false;
     update_parameter(param_percentage);
     log_line("Mouse looper initialized");
   }
 
-  uint32_t get_current_pixel_value(uint32_t time_ms) {
-    (void)time_ms;
-    if (record_start_time_ms > 0) {
-      bool flash = time_ms % 50 >= 25;
-      float flash_brightness = flash ? 0.9f : 0.2f;
-      return color_at_brightness(indicator_color, flash_brightness);
+  void update_parameter(float percentage) {
+    if (loop_store && (latest_buttons & MOUSE_LOOP_SELECT_BUTTON)) {
+      selecting = true;
+      latest_playback_buttons &= ~MOUSE_LOOP_SELECT_BUTTON;
+      uint8_t count = loop_store->getSlotCount();
+      uint8_t slot = (uint8_t)(percentage * (float)count);
+      if (slot >= count) slot = count - 1;
+      if (slot != stored_slot) recall_loop(slot);
+      return;
     }
-    if (loop_len == 0) {
-      return color_at_brightness(indicator_color, 0.2f);
+    set_direction((percentage * 2.0f) - 1.0f);
+  }
+
+  void set_loop_store(ILoopStore *store) { loop_store = store; }
+
+  // locks loop passes to whole beats of the tempo, see tempo_sync
+  void set_tempo_sync(bool sync) {
+    if (sync == tempo_sync) return;
+    tempo_sync = sync;
+    if (!state) return;
+    sync_ticks = tempo->ticks_at(fx_ms(latest_time_us));
+    sync_carry = 0;
+    set_direction(direction);
+  }
+
+  size_t get_state_size() { return sizeof(State); }
+
+  // a save reads straight out of the buffer, it has to stay put until done
+  bool can_release() { return !(state && loop_store && loop_store->isBusy()); }
+
+  // stages the loop that was recorded last into storage
+  bool save_loop(uint8_t slot) {
+    if (!loop_store || slot >= loop_store->getSlotCount()) return false;
+    if (!state) {
+      log_line("looper isn't running");
+      return false;
+    }
+    if (samples != state->buffer) {
+      log_line("re-record before saving, playing stored loop %u",
+               stored_slot + 1);
+      return false;
     }
+    if (loop_len == 0 || record_start_time_us > 0) {
+      log_line("nothing recorded to save");
+      return false;
+    }
+    if (loop_len > loop_store->getSlotCapacity()) {
+      log_line("loop too long to save, %u samples, slots hold %u",
+               (unsigned)loop_len, (unsigned)loop_store->getSlotCapacity());
+      return false;
+    }
+    if (!loop_store->saveLoop(slot, state->buffer, loop_len,
+                              loop_duration_us)) {
+      log_line("loop storage busy");
+      return false;
+    }
+    log_line("saving loop to slot %u", slot + 1);
+    return true;
+  }
 
-    // either brighten or fade as the loop progresses, depending on direction
-    float progress =
-        std::max(0.2f, powf((float)buf_index / (float)loop_len, 1.5f));
-    if (direction < 0.0) {
-      progress = 1.0f - progress;
+  // plays a stored loop directly out of storage, no copy is made
+  bool recall_loop(uint8_t slot) {
+    if (!loop_store || record_start_time_us > 0) return false;
+    if (!state) {
+      log_line("looper isn't running");
+      return false;
     }
-    return color_at_brightness(indicator_color, progress);
+    uint32_t count, duration_us;
+    const sample_t *stored = loop_store->getLoop(slot, &count, &duration_us);
+    if (!stored || count == 0) {
+      log_line("no loop stored in slot %u", slot + 1);
+      return false;
+    }
+    samples = stored;
+    stored_slot = slot;
+    loop_len = count;
+    loop_duration_us = duration_us;
+    start_playback(latest_time_us);
+    log_line("playing stored loop %u", slot + 1);
+    return true;
   }
 
-  void update_parameter(float percentage) {
-    direction = (percentage * 2.0f) - 1.0f;
-  }
-
-  void tick(uint32_t time_ms) {
-    if (record_start_time_ms > 0 || loop_playback_start_time_ms == 0) return;
-
-    sample_t next_sample = buffer[buf_index];
-    uint32_t time_delta =
-        (uint32_t)((float)(time_ms - loop_playback_start_time_ms) *
-                   abs(direction * MOUSE_LOOP_MAX_SPEED));
-    time_delta = time_delta < 2 ? 2 : time_delta;
-    if (time_delta >= next_sample.time_ms_offset) {
-      int8_t x = direction < 0.0f ? -next_sample.x : next_sample.x;
-      int8_t y = direction < 0.0f ? -next_sample.y : next_sample.y;
-      hid_output->send_mouse_report(latest_buttons_minus_right, x, y, 0, 0);
-      if (++buf_index >= loop_len) {
-        loop_playback_start_time_ms = time_ms;
-        buf_index = 0;
-      }
+  // stages removal of a stored loop, stopping playback if it's the one playing
+  bool clear_loop(uint8_t slot) {
+    if (!loop_store || !loop_store->eraseLoop(slot)) return false;
+    if (slot == stored_slot) {
+      samples = state ? state->buffer : nullptr;
+      stored_slot = 0xFF;
+      loop_len = 0;
+      last_tick_time_us = 0;
+      show_progress(latest_time_us);
     }
+    log_line("clearing loop slot %u", slot + 1);
+    return true;
   }
 
-  void deinit() {}
+  void tick(fx_time_t time_us) {
+    latest_time_us = time_us;
+    if (record_start_time_us > 0 || last_tick_time_us == 0) return;
+
+    if (tempo_sync) {
+      advance_with_tempo(time_us);
+    } else {
+      playhead += (time_us - last_tick_time_us) * speed;
+    }
+    last_tick_time_us = time_us;
 
-  void process_mouse_report(ha_mouse_report_t const *report, uint32_t time_ms) {
+    int32_t x = 0, y = 0;
+    bool emitted = gather_due_motion(&x, &y);
+    if (wrapped) {
+      // keeps the LED ramp from drifting away from the playhead
+      wrapped = false;
+      show_progress(time_us);
+    }
+    if (direction < 0.0f) {
+      x = -x;
+      y = -y;
+    }
+    carry_x += x;
+    carry_y += y;
+    if (emitted || carry_x != 0 || carry_y != 0) {
+      int8_t out_x = clamp_report(&carry_x);
+      int8_t out_y = clamp_report(&carry_y);
+      hid_output->send_mouse_report(latest_playback_buttons, out_x, out_y, 0,
+                                    0);
+    }
+  }
+
+  // the recording goes with the buffer, stored loops stay stored
+  void deinit() {
+    release_state();
+    state = nullptr;
+    samples = nullptr;
+    stored_slot = 0xFF;
+    loop_len = 0;
+    record_start_time_us = 0;
+    last_tick_time_us = 0;
+  }
+
+  void process_mouse_report(ha_mouse_report_t const *report, fx_time_t time_us) {
+    if (!state) {
+      hid_output->send_mouse_report(report->buttons, report->x, report->y,
+                                    report->wheel, 0);
+      return;
+    }
     bool recording_btn_held = (report->buttons & 0b10) > 0;
-    latest_buttons_minus_right = report->buttons & 0b11111101;
-    if (record_start_time_ms == 0 && recording_btn_held) {
-      record_start_time_ms = time_ms;
+    latest_time_us = time_us;
+    latest_buttons = report->buttons;
+    latest_playback_buttons = report->buttons & 0b11111101;
+    if (!(report->buttons & MOUSE_LOOP_SELECT_BUTTON)) selecting = false;
+    if (selecting) latest_playback_buttons &= ~MOUSE_LOOP_SELECT_BUTTON;
+    if (record_start_time_us == 0 && recording_btn_held) {
+      // don't overwrite samples that are still being written to storage
+      if (loop_store && loop_store->isBusy()) {
+        return;
+      }
+      samples = state->buffer;
+      stored_slot = 0xFF;
+      // 0 is reserved for "not recording"
+      record_start_time_us = time_us == 0 ? 1 : time_us;
+      last_tick_time_us = 0;
       buf_index = 0;
       loop_len = 0;
-    } else if (record_start_time_ms > 0 && !recording_btn_held) {
-      record_start_time_ms = 0;
-      loop_playback_start_time_ms = time_ms;
-      buf_index = 0;
+      led.blink(MOUSE_LOOP_LED_RECORD, MOUSE_LOOP_LED_IDLE,
+                MOUSE_LOOP_LED_FLASH_MS, 0, MOUSE_LOOP_LED_IDLE,
+                fx_ms(record_start_time_us));
+    } else if (record_start_time_us > 0 && !recording_btn_held) {
+      loop_duration_us = (uint32_t)(time_us - record_start_time_us);
+      record_start_time_us = 0;
+      start_playback(time_us);
       // after recording finishes, always start at 1X playback until user
       // touches knob
-      direction = 1.0f / MOUSE_LOOP_MAX_SPEED;
+      set_direction(1.0f / MOUSE_LOOP_MAX_SPEED);
     }
 
-    if (record_start_time_ms > 0) {
-      uint32_t offset_time = time_ms - record_start_time_ms;
-      buffer[buf_index++] = {offset_time, report->x, report->y};
-      if (buf_index >= MOUSE_LOOP_BUFFER_SIZE) {
-        buf_index = 0;
+    if (record_start_time_us > 0) {
+      // stop capturing once full, offsets must stay in order for playback
+      if (loop_len < MOUSE_LOOP_BUFFER_SIZE) {
+        uint32_t offset_time = (uint32_t)(time_us - record_start_time_us);
+        state->buffer[loop_len++] = {offset_time, report->x, report->y, 0};
+        buf_index = loop_len;
       }
-      if (loop_len < MOUSE_LOOP_BUFFER_SIZE) loop_len++;
-      hid_output->send_mouse_report(latest_buttons_minus_right, report->x,
+      hid_output->send_mouse_report(latest_playback_buttons, report->x,
                                     report->y, report->wheel, 0);
     }
   }
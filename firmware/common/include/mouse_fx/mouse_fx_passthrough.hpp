@@ -4,28 +4,23 @@
 class MousePassthrough : public IMouseFx {
   using IMouseFx::IMouseFx;
 
- private:
-  float brightness;
-
  public:
-  void initialize(uint32_t time_ms, float param_percentage) {
-    (void)time_ms;
+  void initialize(fx_time_t time_us, float param_percentage) {
+    (void)time_us;
     (void)param_percentage;
   }
 
-  uint32_t get_current_pixel_value(uint32_t time_ms) {
-    (void)time_ms;
-    return color_at_brightness(indicator_color, brightness);
+  // the knob just sets the LED level
+  void update_parameter(float percentage) {
+    led.set_level((uint8_t)(percentage * 255.0f));
   }
 
-  void update_parameter(float percentage) { brightness = percentage; }
-
-  void tick(uint32_t time_ms) { (void)time_ms; }
+  void tick(fx_time_t time_us) { (void)time_us; }
 
   void deinit() {}
 
-  void process_mouse_report(ha_mouse_report_t const *report, uint32_t time_ms) {
-    (void)time_ms;
+  void process_mouse_report(ha_mouse_report_t const *report, fx_time_t time_us) {
+    (void)time_us;
     hid_output->send_mouse_report(report->buttons, report->x, report->y,
                                   report->wheel, 0);
   }
@@ -1,109 +1,217 @@
+#include <math.h>
+
+#include <algorithm>
+
 #include "custom_hid.hpp"
 #include "hid_fx.hpp"
 
-#define REVERB_BUF_SIZE 8
-#define REVERB_DEBOUNCE 12
+// the reverb runs at a fixed sample rate, one slot every REVERB_SLOT_US. Slots
+// are counted off in us, so they stay evenly spaced at any report rate.
+#define REVERB_SLOT_US 12000
+// must be a power of 2, bounds pre-delay + the longest tap
+#define REVERB_HISTORY_SIZE 64
+#define REVERB_HISTORY_MASK (REVERB_HISTORY_SIZE - 1)
+#define REVERB_TAP_COUNT 4
+#define REVERB_DEFAULT_PRE_DELAY 2
+#define REVERB_ALLPASS_DELAY 3
+// Q15 all-pass coefficient, 0.5
+#define REVERB_ALLPASS_GAIN 16384
+// motion is carried in Q8 so sub-pixel tails don't get truncated away
+#define REVERB_FRAC_BITS 8
 #define MIN_VELOCITY_SCALAR 0.86
 #define MAX_VELOCITY_SCALAR 0.994
+// LED follows output speed, full at this many counts per slot
+#define REVERB_LED_MIN 90
+#define REVERB_LED_MAX 230
+#define REVERB_LED_FULL_SPEED 16
+
+// comb delays in slots, mutually prime so the echoes don't pile up
+static const uint8_t reverb_tap_delays[REVERB_TAP_COUNT] = {3, 5, 7, 11};
 
 class MouseReverb : public IMouseFx {
   using IMouseFx::IMouseFx;
 
- private:
-  struct vec2 {
-    uint8_t x;
-    uint8_t y;
+ public:
+  typedef struct {
+    int32_t x;
+    int32_t y;
   } vec2_t;
+
+  // lives in the arena while the reverb is running
+  struct State {
+    // dry input, comb outputs, and all-pass input/output histories, all Q8
+    vec2_t input_buf[REVERB_HISTORY_SIZE] = {{0, 0}};
+    vec2_t comb_buf[REVERB_TAP_COUNT][REVERB_HISTORY_SIZE] = {{{0, 0}}};
+    vec2_t diffuse_in_buf[REVERB_HISTORY_SIZE] = {{0, 0}};
+    vec2_t diffuse_out_buf[REVERB_HISTORY_SIZE] = {{0, 0}};
+    size_t head = 0;
+    // slots since the last non-zero input, the tail can't restart after this
+    uint16_t quiet_slots = REVERB_HISTORY_SIZE;
+    // sum of abs comb output, 0 once the tail has died out
+    int32_t tail_energy = 0;
+    vec2_t pending = {0, 0};
+    vec2_t carry = {0, 0};
+  };
+
+ private:
   float velocity_scalar = MIN_VELOCITY_SCALAR;
-  float current_velocity = 0.0;
-  uint32_t last_sample_time_ms = 0;
+  fx_time_t last_slot_time_us = 0;
   uint8_t last_buttons = 0;
-  int8_t x_buf[REVERB_BUF_SIZE] = {0};
-  int8_t y_buf[REVERB_BUF_SIZE] = {0};
-  size_t buf_index = 0;
+  uint8_t pre_delay = REVERB_DEFAULT_PRE_DELAY;
+  // Q15 feedback per tap, picked so every tap decays at the same rate in time
+  int32_t tap_feedback[REVERB_TAP_COUNT] = {0};
+  // Q15 output gain per tap, normalizes each tap to unity total motion
+  int32_t tap_gain[REVERB_TAP_COUNT] = {0};
+  State *state = nullptr;
 
-  inline void add_sample(int8_t x, int8_t y) {
-    if (++buf_index == REVERB_BUF_SIZE) {
-      buf_index = 0;
-    }
-    x_buf[buf_index] = x;
-    y_buf[buf_index] = y;
+  // Rounds towards zero so negative tails decay all the way to 0 too. Split
+  // into high and low halves so long tails can't overflow 32 bits.
+  static inline int32_t q15_mul(int32_t v, int32_t gain) {
+    uint32_t a = (uint32_t)abs(v);
+    int32_t r = (int32_t)(((a >> 15) * gain) + (((a & 0x7FFF) * gain) >> 15));
+    return v < 0 ? -r : r;
+  }
+
+  static inline int8_t take_whole_pixels(int32_t *v) {
+    int32_t px = *v / (1 << REVERB_FRAC_BITS);
+    px = px > 127 ? 127 : (px < -127 ? -127 : px);
+    *v -= px * (1 << REVERB_FRAC_BITS);
+    return (int8_t)px;
   }
 
-  inline float buf_average(int8_t *buf) {
-    float sum = 0.0;
-    // start from earliest sample
-    size_t start = buf_index + 1;
-    // skip last couple
-    size_t end = start + REVERB_BUF_SIZE - 1;
-    float total_samples = 0;
-    for (size_t i = start; i < end; i++) {
-      int count = (i - start) + 1;
-      sum += buf[i % REVERB_BUF_SIZE] * count;
-      total_samples += count;
+  inline vec2_t at(const vec2_t *buf, size_t delay) {
+    return buf[(state->head - delay) & REVERB_HISTORY_MASK];
+  }
+
+  // advances the reverb by one slot, constant cost regardless of tail length
+  vec2_t step(vec2_t in) {
+    state->head = (state->head + 1) & REVERB_HISTORY_MASK;
+    state->input_buf[state->head] = in;
+    if (in.x || in.y) {
+      state->quiet_slots = 0;
+    } else if (state->quiet_slots < REVERB_HISTORY_SIZE) {
+      state->quiet_slots++;
+    }
+
+    vec2_t wet = {0, 0};
+    int32_t energy = 0;
+    for (size_t t = 0; t < REVERB_TAP_COUNT; t++) {
+      // feedback comb: y[n] = x[n - pre - d] + g * y[n - d]
+      size_t d = reverb_tap_delays[t];
+      vec2_t x = at(state->input_buf, pre_delay + d);
+      vec2_t fb = at(state->comb_buf[t], d);
+      vec2_t y = {x.x + q15_mul(fb.x, tap_feedback[t]),
+                  x.y + q15_mul(fb.y, tap_feedback[t])};
+      state->comb_buf[t][state->head] = y;
+      wet.x += q15_mul(y.x, tap_gain[t]);
+      wet.y += q15_mul(y.y, tap_gain[t]);
+      energy += abs(y.x) + abs(y.y);
     }
-    return sum / total_samples;
+    state->tail_energy = energy;
+
+    // all-pass diffuser: y[n] = -g * x[n] + x[n - D] + g * y[n - D]
+    state->diffuse_in_buf[state->head] = wet;
+    vec2_t x_d = at(state->diffuse_in_buf, REVERB_ALLPASS_DELAY);
+    vec2_t y_d = at(state->diffuse_out_buf, REVERB_ALLPASS_DELAY);
+    vec2_t out = {
+        -q15_mul(wet.x, REVERB_ALLPASS_GAIN) + x_d.x +
+            q15_mul(y_d.x, REVERB_ALLPASS_GAIN),
+        -q15_mul(wet.y, REVERB_ALLPASS_GAIN) + x_d.y +
+            q15_mul(y_d.y, REVERB_ALLPASS_GAIN)};
+    state->diffuse_out_buf[state->head] = out;
+    return out;
+  }
+
+  inline bool is_idle() {
+    return state->tail_energy == 0 && state->pending.x == 0 &&
+           state->pending.y == 0 && state->carry.x == 0 &&
+           state->carry.y == 0 && state->quiet_slots >= REVERB_HISTORY_SIZE;
   }
 
  public:
-  void initialize(uint32_t time_ms, float param_percentage) {
-    (void)time_ms;
+  void initialize(fx_time_t time_us, float param_percentage) {
+    state = create_state<State>();
+    last_slot_time_us = time_us;
     update_parameter(param_percentage);
+    led.set_level(REVERB_LED_MIN);
     log_line("Mouse reverb initialized");
   }
 
-  uint32_t get_current_pixel_value(uint32_t time_ms) {
-    (void)time_ms;
-    float brightness = (current_velocity * 0.7f) + 0.1f;
-    return color_at_brightness(indicator_color, brightness);
-  }
-
   void update_parameter(float percentage) {
     velocity_scalar =
         MIN_VELOCITY_SCALAR + ((1.0 - MIN_VELOCITY_SCALAR) * percentage);
     if (velocity_scalar > MAX_VELOCITY_SCALAR) {
       velocity_scalar = MAX_VELOCITY_SCALAR;
     }
+    // only runs when the knob moves, so the float math is fine here
+    for (size_t t = 0; t < REVERB_TAP_COUNT; t++) {
+      float g = powf(velocity_scalar, (float)reverb_tap_delays[t]);
+      tap_feedback[t] = (int32_t)(g * 32768.0f);
+      tap_gain[t] = (int32_t)(((1.0f - g) / REVERB_TAP_COUNT) * 32768.0f);
+    }
   }
 
-  void tick(uint32_t time_ms) {
-    static uint32_t last_reverb_time_ms = 0;
-    if (current_velocity <= 0.02) {
-      return;
-    } else if (time_ms - last_sample_time_ms < REVERB_DEBOUNCE) {
+  // number of slots between motion and the first echo of it
+  void set_pre_delay(uint8_t slots) {
+    uint8_t max =
+        REVERB_HISTORY_SIZE - 1 - reverb_tap_delays[REVERB_TAP_COUNT - 1];
+    pre_delay = slots > max ? max : slots;
+  }
+
+  // the same, to the nearest slot
+  void set_pre_delay_ms(uint16_t ms) {
+    uint32_t slots =
+        (((uint32_t)ms * FX_US_PER_MS) + (REVERB_SLOT_US / 2)) / REVERB_SLOT_US;
+    set_pre_delay(slots > 0xFF ? 0xFF : (uint8_t)slots);
+  }
+
+  size_t get_state_size() { return sizeof(State); }
+
+  void tick(fx_time_t time_us) {
+    if (!state || time_us - last_slot_time_us < REVERB_SLOT_US) {
       return;
-    } else if (time_ms - last_reverb_time_ms < REVERB_DEBOUNCE) {
+    } else if (is_idle()) {
+      last_slot_time_us = time_us;
+      led.set_level(REVERB_LED_MIN);
       return;
     }
+    // if the loop stalled for a long time, don't try to catch up on all of it
+    if (time_us - last_slot_time_us > REVERB_SLOT_US * REVERB_HISTORY_SIZE) {
+      last_slot_time_us = time_us - REVERB_SLOT_US;
+    }
 
-    last_reverb_time_ms = time_ms;
-    current_velocity = current_velocity * velocity_scalar;
-    int8_t x = (int8_t)(buf_average(x_buf) * current_velocity);
-    int8_t y = (int8_t)(buf_average(y_buf) * current_velocity);
+    while (time_us - last_slot_time_us >= REVERB_SLOT_US) {
+      last_slot_time_us += REVERB_SLOT_US;
+      vec2_t in = {state->pending.x * (1 << REVERB_FRAC_BITS),
+                   state->pending.y * (1 << REVERB_FRAC_BITS)};
+      state->pending = {0, 0};
+      vec2_t wet = step(in);
+      state->carry.x += wet.x;
+      state->carry.y += wet.y;
+    }
 
+    int8_t x = take_whole_pixels(&state->carry.x);
+    int8_t y = take_whole_pixels(&state->carry.y);
+    int32_t speed = std::min(REVERB_LED_FULL_SPEED, abs(x) + abs(y));
+    led.set_level(REVERB_LED_MIN + ((speed * (REVERB_LED_MAX - REVERB_LED_MIN)) /
+                                    REVERB_LED_FULL_SPEED));
     if (x != 0 || y != 0) {
       hid_output->send_mouse_report(last_buttons, x, y, 0, 0);
-    } else if (current_velocity < 0.1) {
-      for (size_t i = 0; i < REVERB_BUF_SIZE; i++) {
-        add_sample(0, 0);
-      }
     }
   }
 
-  void deinit() {}
+  void deinit() {
+    release_state();
+    state = nullptr;
+  }
 
-  void process_mouse_report(ha_mouse_report_t const *report, uint32_t time_ms) {
-    static int8_t pending_x = 0;
-    static int8_t pending_y = 0;
-    current_velocity = 1.0;
+  void process_mouse_report(ha_mouse_report_t const *report, fx_time_t time_us) {
+    (void)time_us;
     last_buttons = report->buttons;
-    pending_x += report->x;
-    pending_y += report->y;
-    if (time_ms - last_sample_time_ms > REVERB_DEBOUNCE) {
-      add_sample(pending_x, pending_y);
-      pending_x = 0;
-      pending_y = 0;
-      last_sample_time_ms = time_ms;
+    // without state it's just dry
+    if (state) {
+      state->pending.x += report->x;
+      state->pending.y += report->y;
     }
     hid_output->send_mouse_report(report->buttons, report->x, report->y,
                                   report->wheel, 0);
@@ -0,0 +1,66 @@
+#include "custom_hid.hpp"
+#include "fx_vm.hpp"
+#include "hid_fx.hpp"
+
+// Runs an uploaded script in place of a native mouse FX, see fx_vm.hpp. The
+// engine times it like any other FX, the verifier has already made sure a run
+// can't take more than VM_MAX_CYCLES instructions.
+class MouseScript : public IMouseFx {
+  using IMouseFx::IMouseFx;
+
+ private:
+  FxScriptRunner runner;
+
+  void send(vm_io_t const *io) {
+    int32_t const *f = io->fields;
+    hid_output->send_mouse_report(FxScriptRunner::to_byte(f[VM_FIELD_BUTTONS]),
+                                  FxScriptRunner::to_axis(f[VM_FIELD_X]),
+                                  FxScriptRunner::to_axis(f[VM_FIELD_Y]),
+                                  FxScriptRunner::to_axis(f[VM_FIELD_WHEEL]),
+                                  FxScriptRunner::to_axis(f[VM_FIELD_PAN]));
+  }
+
+  inline uint32_t beat_ms() { return tempo->ms_for(TEMPO_QUARTER); }
+
+ public:
+  // a verified mouse program, or nullptr to do nothing at all
+  inline void set_program(vm_program_t const *program) {
+    runner.set_program(program);
+  }
+
+  void initialize(fx_time_t time_us, float param_percentage) {
+    runner.begin(time_us, param_percentage);
+    led.set_level(255);
+    log_line("Mouse script initialized");
+  }
+
+  void update_parameter(float percentage) { runner.set_param(percentage); }
+
+  // starts from the last report's buttons, with no motion
+  void tick(fx_time_t time_us) {
+    if (!runner.tick_due(time_us)) return;
+    int32_t *f = runner.fields();
+    f[VM_FIELD_X] = 0;
+    f[VM_FIELD_Y] = 0;
+    f[VM_FIELD_WHEEL] = 0;
+    f[VM_FIELD_PAN] = 0;
+    runner.run(true, time_us, beat_ms(),
+               [&](vm_io_t const *io) { send(io); });
+  }
+
+  void deinit() {}
+
+  void process_mouse_report(ha_mouse_report_t const *report,
+                            fx_time_t time_us) {
+    int32_t *f = runner.fields();
+    f[VM_FIELD_BUTTONS] = report->buttons;
+    f[VM_FIELD_X] = report->x;
+    f[VM_FIELD_Y] = report->y;
+    f[VM_FIELD_WHEEL] = report->wheel;
+    f[VM_FIELD_PAN] = report->pan;
+    runner.run(false, time_us, beat_ms(),
+               [&](vm_io_t const *io) { send(io); });
+  }
+
+  inline uint32_t get_last_cycles() const { return runner.get_last_cycles(); }
+};
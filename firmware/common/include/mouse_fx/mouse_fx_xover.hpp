@@ -1,72 +1,57 @@
 #include "custom_hid.hpp"
 #include "hid_fx.hpp"
+#include "key_sequencer.hpp"
 
-#define MOUSE_XOVER_THROTTLE_MAX 13000
+// time each synthesized press is held, and between release and next press
+#define MOUSE_XOVER_SLOWEST_MS 48
+#define MOUSE_XOVER_FASTEST_MS 4
+// LED levels while idle and while typing
+#define MOUSE_XOVER_LED_IDLE 148
+#define MOUSE_XOVER_LED_TYPING 230
 
 class MouseXOver : public IMouseFx {
-  using IMouseFx::IMouseFx;
  private:
-  enum State {
-    idle,
-    backspace_press,
-    backspace_release,
-    key_press,
-    key_release
-  };
-  State state = idle;
-  uint16_t throttle;
+  KeySequencer sequencer;
   uint8_t current_key = HID_KEY_A;
   bool skip_backspace = true;
 
+  // backspaces over the last character unless told not to, then types
+  // current_key
+  void type_current_key() {
+    if (!skip_backspace) sequencer.tap(HID_KEY_BACKSPACE);
+    sequencer.tap(current_key);
+    skip_backspace = false;
+  }
+
+  inline bool is_typing() { return sequencer.get_queue_depth() > 0; }
+
  public:
+  explicit MouseXOver(IHIDOutput *hid_output)
+      : IMouseFx(hid_output), sequencer(hid_output) {}
 
-  void initialize(uint32_t time_ms, float param_percentage) {
-    (void)time_ms;
+  void initialize(fx_time_t time_us, float param_percentage) {
+    (void)time_us;
     update_parameter(param_percentage);
     log_line("Mouse crossover initialized");
   }
 
-  uint32_t get_current_pixel_value(uint32_t time_ms) {
-    (void)time_ms;
-    float brightness =
-        (state != idle && state != backspace_press) ? 0.8f : 0.3f;
-    return color_at_brightness(indicator_color, brightness);
-  }
-
   void update_parameter(float percentage) {
-    throttle = (uint16_t)(percentage * (float)MOUSE_XOVER_THROTTLE_MAX);
+    uint16_t step_ms =
+        MOUSE_XOVER_SLOWEST_MS -
+        (uint16_t)(percentage *
+                   (float)(MOUSE_XOVER_SLOWEST_MS - MOUSE_XOVER_FASTEST_MS));
+    sequencer.set_timing(step_ms, step_ms);
   }
 
-  void tick(uint32_t time_ms) {
-    (void)time_ms;
-    static uint16_t out_count = 0;
-    static uint8_t key_buf[6] = {0, 0, 0, 0, 0, 0};
-    if (out_count++ < 16000 - throttle) {
-      return;
-    }
-    out_count = 0;
-    if (state == idle) return;
-    skip_backspace = false;
-    if (state == backspace_press) {
-      key_buf[0] = HID_KEY_BACKSPACE;
-      state = backspace_release;
-    } else if (state == backspace_release) {
-      key_buf[0] = 0;
-      state = key_press;
-    } else if (state == key_press) {
-      key_buf[0] = current_key;
-      state = key_release;
-    } else if (state == key_release) {
-      key_buf[0] = 0;
-      state = idle;
-    }
-    hid_output->send_keyboard_report(0, 0, key_buf);
+  void tick(fx_time_t time_us) {
+    sequencer.task(fx_ms(time_us));
+    led.set_level(is_typing() ? MOUSE_XOVER_LED_TYPING : MOUSE_XOVER_LED_IDLE);
   }
 
-  void deinit() {}
+  void deinit() { sequencer.clear(); }
 
-  void process_mouse_report(ha_mouse_report_t const *report, uint32_t time_ms) {
-    (void)time_ms;
+  void process_mouse_report(ha_mouse_report_t const *report, fx_time_t time_us) {
+    (void)time_us;
     static bool left_button_last_pressed = false;
     static bool right_button_last_pressed = false;
     bool right_button_pressed = report->buttons & 0b10;
@@ -78,7 +63,7 @@ class MouseXOver : public IMouseFx {
 
     right_button_last_pressed = right_button_pressed;
 
-    if (state != idle) return;
+    if (is_typing()) return;
 
     // if user is holding left button, let them "navigate"/edit
     if (report->buttons & 0b01) {
@@ -98,7 +83,8 @@ class MouseXOver : public IMouseFx {
       }
 
       if (consumed) {
-        state = key_press;
+        skip_backspace = true;
+        type_current_key();
         left_button_last_pressed = true;
       }
       return;
@@ -117,10 +103,10 @@ class MouseXOver : public IMouseFx {
     uint8_t last_key = current_key;
     if (report->wheel < 0 || report->y < -1) {
       current_key--;
-      state = skip_backspace ? key_press : backspace_press;
     } else if (report->wheel > 0 || report->y > 1) {
       current_key++;
-      state = skip_backspace ? key_press : backspace_press;
+    } else {
+      return;
     }
 
     // this is stupid, just hardcode an array of valid values
@@ -131,5 +117,6 @@ class MouseXOver : public IMouseFx {
     } else if (current_key > HID_KEY_SLASH) {
       current_key = HID_KEY_A;
     }
+    type_current_key();
   }
 };
@@ -0,0 +1,513 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "custom_hid.hpp"
+#include "fx_deadline.hpp"
+#include "hid_fx.hpp"
+#include "led_compositor.hpp"
+#include "mouse_accel.hpp"
+#include "pedal_hal.hpp"
+#include "persistence.hpp"
+#include "profiler.hpp"
+#include "tempo_clock.hpp"
+#include "util.h"
+
+#ifndef COMMON_PEDAL_ENGINE
+#define COMMON_PEDAL_ENGINE
+
+// slots the knob picks from, FX arrays hold one more: passthrough, which
+// runs when the pedal is "off"
+#define MAX_FX 4
+
+#define SW_MODE_SET 0
+#define SW_MODE_MOM 1
+#define SW_MODE_LATCH 2
+
+#define ADC_DEAD_ZONE 0.015f
+
+// main loop task rates
+#define PEDAL_LED_FRAME_MS 30
+#define PEDAL_IO_FRAME_MS 20
+// mouse reports get buffered and handed to FX at a steady rate
+#define PEDAL_MOUSE_REPORT_MS 6
+
+// set mode blinks the slot's color on every beat of the tempo, on for this
+// much of the beat
+#define PEDAL_MODE_BLINK_ON_PERCENT 55
+// a failed command flashes red this many times
+#define PEDAL_ERROR_COLOR 0xFF0000
+#define PEDAL_ERROR_FLASHES 3
+#define PEDAL_ERROR_FLASH_MS 80
+
+typedef enum {
+  PEDAL_DEVICE_KEYBOARD = 0,
+  PEDAL_DEVICE_MOUSE,
+} pedal_device_t;
+
+// Switches, knob, FX slot selection, mouse pacing and the LED, everything the
+// main loop does that isn't USB plumbing. Talks to hardware only through the
+// pedal_hal.hpp interfaces so it runs the same on the pedal and on a host.
+//
+// On the pedal everything here runs on core0. The USB host callback on core1
+// only queues reports, the main loop hands them to on_mouse_report() and
+// on_keyboard_report().
+class PedalEngine {
+ public:
+  // mouse_fx/keyboard_fx hold MAX_FX + 1 entries, passthrough last
+  PedalEngine(IPersistence *settings, IMouseFx **mouse_fx,
+              IKeyboardFx **keyboard_fx, IClock *clock, IGpio *gpio,
+              IAdc *adc, IPixel *pixel)
+      : settings(settings),
+        mouse_fx(mouse_fx),
+        keyboard_fx(keyboard_fx),
+        clock(clock),
+        gpio(gpio),
+        adc(adc),
+        pixel(pixel) {
+    for (size_t i = 0; i <= MAX_FX; i++) {
+      mouse_fx[i]->set_tempo_clock(&tempo);
+      keyboard_fx[i]->set_tempo_clock(&tempo);
+    }
+  }
+
+  // Starts the FX in the saved slot, settings must be loaded already. Until
+  // then the engine is booting: reports go straight through the passthrough
+  // FX and the LED and switches are left alone, so input gets forwarded while
+  // the rest of the pedal is still coming up.
+  void initialize() {
+    refresh_settings();
+    float param_value = read_pot();
+    previous_adc_reading = param_value;
+    fx_time_t now = clock->now_us();
+    mode_beat.follow(&tempo, TEMPO_QUARTER, fx_ms(now));
+    uint8_t active_slot = settings->getActiveFxSlot();
+    mouse_fx[active_slot]->initialize(now, param_value);
+    keyboard_fx[active_slot]->initialize(now, param_value);
+    ready = true;
+  }
+
+  // picks up settings the engine caches, call after they change
+  void refresh_settings() {
+    compositor.set_brightness(settings->getLedBrightness());
+    // a tapped tempo that hasn't been saved yet wins
+    if (!tempo_unsaved &&
+        tempo.set_period_us(settings->getTempoPeriodUs(), clock->now_ms())) {
+      log_tempo();
+    }
+    if (mouse_accel.configure(MouseAccel::config_from(settings))) {
+      log_line("mouse accel curve: %u", settings->getMouseAccelCurve());
+    }
+  }
+
+  // every main loop task, in loop order. FX get the time in us, the LED and
+  // switches are fine in ms.
+  void task(fx_time_t time_us) {
+    uint32_t time_ms = fx_ms(time_us);
+    led_task(time_ms);
+    io_task(time_ms);
+    fx_task(time_us);
+    mouse_task(time_us);
+  }
+
+  void led_task(uint32_t time_ms) {
+    HA_PROFILE_SCOPE(PROFILE_LED_TASK);
+    if (!ready) return;
+    uint32_t frame = time_ms / PEDAL_LED_FRAME_MS;
+    if (frame == frame_of_last_pix_update) {
+      return;
+    }
+    frame_of_last_pix_update = frame;
+    uint8_t active_fx_slot = settings->getActiveFxSlot();
+    IFx *fx = mouse_fx[active_fx_slot];
+    if (active_device == PEDAL_DEVICE_KEYBOARD) {
+      fx = keyboard_fx[active_fx_slot];
+    }
+    bool flashing = settings->isFlashingEnabled();
+    update_mode_layer(fx, flashing, time_ms);
+    bool show_fx = fx_enabled && active_sw_mode != SW_MODE_SET;
+    compositor.set_fx_layer(show_fx ? fx->get_led_layer() : nullptr, flashing);
+    HA_PROFILE_SCOPE(PROFILE_FX_PIXEL);
+    pixel->set_pixel(compositor.render(time_ms));
+  }
+
+  // flashes the LED red over whatever it's showing
+  void flash_error() {
+    LedLayer *layer = compositor.get_layer(LED_LAYER_ERROR);
+    layer->set_color(PEDAL_ERROR_COLOR);
+    layer->blink(255, 0, PEDAL_ERROR_FLASH_MS, PEDAL_ERROR_FLASHES * 2, 0,
+                 clock->now_ms());
+    layer->show();
+  }
+
+  void io_task(uint32_t time_ms) {
+    HA_PROFILE_SCOPE(PROFILE_IO_TASK);
+    // the switches could turn FX on before there are any
+    if (!ready) return;
+    uint32_t frame = time_ms / PEDAL_IO_FRAME_MS;
+    if (frame == frame_of_last_io_update) {
+      return;
+    }
+    frame_of_last_io_update = frame;
+    read_toggle_switch();
+    read_foot_switch();
+    update_from_pot();
+    // one write once the tapping is done, not one per tap
+    if (tempo_unsaved && !tempo.is_tapping(time_ms)) {
+      tempo_unsaved = false;
+      settings->setTempoPeriodUs(tempo.get_period_us());
+    }
+  }
+
+  void fx_task(fx_time_t time_us) {
+    HA_PROFILE_SCOPE(PROFILE_FX_TASK);
+    release_bypassed(time_us);
+    if (fx_enabled) {
+      uint8_t active_slot = settings->getActiveFxSlot();
+      uint32_t time_ms = fx_ms(time_us);
+      HA_PROFILE_SCOPE(PROFILE_FX_TICK);
+      if (!mouse_deadline.is_bypassed(time_ms)) {
+        fx_time_t start_us = clock->now_us();
+        mouse_fx[active_slot]->tick(time_us);
+        check_deadline(&mouse_deadline, PEDAL_DEVICE_MOUSE, start_us);
+      }
+      if (!keyboard_deadline.is_bypassed(time_ms)) {
+        fx_time_t start_us = clock->now_us();
+        keyboard_fx[active_slot]->tick(time_us);
+        check_deadline(&keyboard_deadline, PEDAL_DEVICE_KEYBOARD, start_us);
+      }
+    }
+  }
+
+  void mouse_task(fx_time_t time_us) {
+    HA_PROFILE_SCOPE(PROFILE_MOUSE_TASK);
+    if (time_us - last_mouse_report_us < fx_us(PEDAL_MOUSE_REPORT_MS) ||
+        !mouse_report_ready) {
+      return;
+    }
+    ha_mouse_report_t *r = &pending_mouse_report;
+    mouse_report_ready = false;
+    last_mouse_report_us = time_us;
+    bool bypassed = mouse_deadline.is_bypassed(fx_ms(time_us));
+    uint8_t slot =
+        fx_enabled && !bypassed ? settings->getActiveFxSlot() : MAX_FX;
+    // the curve comes from settings, while booting motion goes through as is
+    if (ready) mouse_accel.apply(&r->x, &r->y);
+    HA_PROFILE_SCOPE(PROFILE_FX_MOUSE_REPORT);
+    if (slot == MAX_FX) {
+      mouse_fx[slot]->process_mouse_report(r, time_us);
+      return;
+    }
+    fx_time_t start_us = clock->now_us();
+    mouse_fx[slot]->process_mouse_report(r, time_us);
+    check_deadline(&mouse_deadline, PEDAL_DEVICE_MOUSE, start_us);
+  }
+
+  // Buffers mouse updates so they all get processed at a similar sample rate.
+  // Passthrough doesn't need one, so with the FX off a report goes straight
+  // out from here instead of waiting up to PEDAL_MOUSE_REPORT_MS for
+  // mouse_task(). Unless the host hasn't picked up the last one yet, then it's
+  // buffered like any other so no motion gets dropped.
+  void on_mouse_report(ha_mouse_report_t const *report) {
+    active_device = PEDAL_DEVICE_MOUSE;
+    held_mouse_buttons = report->buttons;
+    IMouseFx *passthrough = mouse_fx[MAX_FX];
+    if (!mouse_report_ready && is_mouse_passthrough() &&
+        passthrough->output_ready()) {
+      ha_mouse_report_t r = *report;
+      if (ready) mouse_accel.apply(&r.x, &r.y);
+      HA_PROFILE_SCOPE(PROFILE_FX_MOUSE_REPORT);
+      passthrough->process_mouse_report(&r, clock->now_us());
+      return;
+    }
+    if (!mouse_report_ready) {
+      pending_mouse_report.x = 0;
+      pending_mouse_report.y = 0;
+    }
+    pending_mouse_report.x += report->x;
+    pending_mouse_report.y += report->y;
+    pending_mouse_report.buttons = report->buttons;
+    pending_mouse_report.pan = report->pan;
+    pending_mouse_report.wheel = report->wheel;
+    mouse_report_ready = true;
+  }
+
+  void on_keyboard_report(ha_keyboard_report_t const *report,
+                          fx_time_t time_us) {
+    active_device = PEDAL_DEVICE_KEYBOARD;
+    held_keys = *report;
+    fx_time_t start_us = clock->now_us();
+    bool bypassed = keyboard_deadline.is_bypassed(fx_ms(start_us));
+    uint8_t slot =
+        fx_enabled && !bypassed ? settings->getActiveFxSlot() : MAX_FX;
+    HA_PROFILE_SCOPE(PROFILE_FX_KEYBOARD_REPORT);
+    keyboard_fx[slot]->process_keyboard_report(report, time_us);
+    if (slot != MAX_FX) {
+      check_deadline(&keyboard_deadline, PEDAL_DEVICE_KEYBOARD, start_us);
+    }
+  }
+
+  // a keyboard or mouse was plugged in, decides which FX the LED shows
+  inline void set_active_device(pedal_device_t device) {
+    active_device = device;
+  }
+
+  inline pedal_device_t get_active_device() { return active_device; }
+
+  inline bool is_fx_enabled() { return fx_enabled; }
+
+  // the active FX kept missing its deadline and is skipped for now
+  inline bool is_fx_bypassed(pedal_device_t device) {
+    FxDeadline *deadline =
+        device == PEDAL_DEVICE_MOUSE ? &mouse_deadline : &keyboard_deadline;
+    return deadline->is_bypassed(clock->now_ms());
+  }
+
+  // false until initialize(), everything is passed through until then
+  inline bool is_ready() { return ready; }
+
+  inline uint8_t get_sw_mode() { return active_sw_mode; }
+
+  inline TempoClock *get_tempo_clock() { return &tempo; }
+
+  // Puts fx in a slot in place of what's there, returns what was there or
+  // nullptr if that's the active FX and it can't be released yet. Used to swap
+  // scripts in, see fx_script_loader.hpp.
+  IMouseFx *replace_mouse_fx(uint8_t slot, IMouseFx *fx) {
+    IMouseFx *old = mouse_fx[slot];
+    if (!swap_fx(slot, old, fx, &mouse_deadline)) return nullptr;
+    mouse_fx[slot] = fx;
+    return old;
+  }
+
+  IKeyboardFx *replace_keyboard_fx(uint8_t slot, IKeyboardFx *fx) {
+    IKeyboardFx *old = keyboard_fx[slot];
+    if (!swap_fx(slot, old, fx, &keyboard_deadline)) return nullptr;
+    keyboard_fx[slot] = fx;
+    return old;
+  }
+
+ private:
+  IPersistence *settings;
+  IMouseFx **mouse_fx;
+  IKeyboardFx **keyboard_fx;
+  IClock *clock;
+  IGpio *gpio;
+  IAdc *adc;
+  IPixel *pixel;
+
+  pedal_device_t active_device = PEDAL_DEVICE_KEYBOARD;
+  bool fx_enabled = false;
+  bool ready = false;
+  uint8_t active_sw_mode = SW_MODE_SET;
+  bool use_increased_dead_zone = false;
+  bool previous_foot_sw_value = false;
+  float previous_adc_reading = 0.0f;
+  uint32_t frame_of_last_pix_update = 0;
+  uint32_t frame_of_last_io_update = 0;
+
+  ha_mouse_report_t pending_mouse_report = {0, 0, 0, 0, 0};
+  bool mouse_report_ready = false;
+  fx_time_t last_mouse_report_us = 0;
+  // m_speed level and acceleration curve
+  MouseAccel mouse_accel;
+  LedCompositor compositor;
+  // set mode + flashing the mode layer was last set up for, 0xFF for never
+  uint8_t mode_layer_state = 0xFF;
+  // what time based FX follow, the foot switch taps it in set mode
+  TempoClock tempo;
+  // tapped, not written to settings yet
+  bool tempo_unsaved = false;
+  // beats for the set mode blink
+  TempoStep mode_beat;
+  uint32_t mode_layer_generation = 0;
+  // the active FX's reports and ticks, per device
+  FxDeadline mouse_deadline;
+  FxDeadline keyboard_deadline;
+  // what's actually held on the attached devices, and whether the computer
+  // still has to be put back to it after a bypass
+  ha_keyboard_report_t held_keys = {0, 0, {0, 0, 0, 0, 0, 0}};
+  uint8_t held_mouse_buttons = 0;
+  bool keyboard_release_due = false;
+  bool mouse_release_due = false;
+
+  inline bool is_mouse_passthrough() {
+    return !fx_enabled || mouse_deadline.is_bypassed(clock->now_ms());
+  }
+
+  // the new FX takes over the old one's color, and its state if it's active
+  bool swap_fx(uint8_t slot, IFx *old, IFx *fx, FxDeadline *deadline) {
+    bool active = ready && slot == settings->getActiveFxSlot();
+    if (active && !old->can_release()) return false;
+    fx->set_indicator_color(old->get_indicator_color());
+    fx->set_tempo_clock(&tempo);
+    if (active) {
+      old->deinit();
+      fx->initialize(clock->now_us(), previous_adc_reading);
+      deadline->reset();
+    }
+    return true;
+  }
+
+  // times an FX call that started at start_us
+  void check_deadline(FxDeadline *deadline, pedal_device_t device,
+                      fx_time_t start_us) {
+    if (!deadline->check(start_us, clock->now_us())) return;
+    log_line("%s fx %u missed its deadline, passthrough for %lums",
+             device == PEDAL_DEVICE_MOUSE ? "mouse" : "keyboard",
+             settings->getActiveFxSlot(),
+             (unsigned long)deadline->get_backoff_ms());
+    flash_error();
+    if (device == PEDAL_DEVICE_MOUSE) {
+      mouse_release_due = true;
+    } else {
+      keyboard_release_due = true;
+    }
+    release_bypassed(clock->now_us());
+  }
+
+  // A bypassed FX doesn't get ticked, so keys and buttons it was holding
+  // (echoes, loop notes) would stay down on the computer and auto-repeat for
+  // the whole back-off. Passthrough sends what's really held instead, as soon
+  // as the computer can take it.
+  void release_bypassed(fx_time_t time_us) {
+    IKeyboardFx *keyboard = keyboard_fx[MAX_FX];
+    if (keyboard_release_due && keyboard->output_ready()) {
+      keyboard_release_due = false;
+      keyboard->process_keyboard_report(&held_keys, time_us);
+    }
+    IMouseFx *mouse = mouse_fx[MAX_FX];
+    if (mouse_release_due && mouse->output_ready()) {
+      mouse_release_due = false;
+      ha_mouse_report_t still = {held_mouse_buttons, 0, 0, 0, 0};
+      mouse->process_mouse_report(&still, time_us);
+    }
+  }
+
+  // only sets up the blink when set mode or flashing changes, or on the beat
+  void update_mode_layer(IFx *fx, bool flashing, uint32_t time_ms) {
+    LedLayer *layer = compositor.get_layer(LED_LAYER_MODE);
+    layer->set_color(fx->get_indicator_color());
+    bool set_mode = active_sw_mode == SW_MODE_SET;
+    uint8_t state = (set_mode ? 0b01 : 0) | (flashing ? 0b10 : 0);
+    // a tap moves the beat without necessarily starting a new one
+    bool beat = mode_beat.poll(time_ms) > 0 ||
+                mode_layer_generation != tempo.get_generation();
+    mode_layer_generation = tempo.get_generation();
+    if (state == mode_layer_state && !(beat && set_mode && flashing)) return;
+    mode_layer_state = state;
+    if (!set_mode) {
+      layer->hide();
+      return;
+    }
+    if (flashing) {
+      uint16_t on_ms =
+          (tempo.ms_for(TEMPO_QUARTER) * PEDAL_MODE_BLINK_ON_PERCENT) / 100;
+      led_keyframe_t keyframes[] = {{0, 255}, {on_ms, 255}, {0, 0}};
+      layer->play(keyframes, 3, mode_beat.get_step_start_ms(), false);
+    } else {
+      layer->set_level(255);
+    }
+    layer->show();
+  }
+
+  void log_tempo() {
+    uint32_t bpm_x10 = (600000000 + (tempo.get_period_us() / 2)) /
+                       tempo.get_period_us();
+    log_line("tempo: %lu.%lu BPM", (unsigned long)(bpm_x10 / 10),
+             (unsigned long)(bpm_x10 % 10));
+  }
+
+  inline float read_pot() {
+    // expand range so we'll def get 0 and 1 on the ends
+    float reading =
+        ((((float)adc->read_knob() / 4096.0f) * 1.03f) - 0.015f);
+    // clamp to range 0..1
+    reading = reading < 0.0f ? 0.0f : (reading > 1.0f ? 1.0f : reading);
+    return reading;
+  }
+
+  void on_fx_param_tweaked(float percentage) {
+    uint8_t active_slot = settings->getActiveFxSlot();
+    mouse_fx[active_slot]->update_parameter(percentage);
+    keyboard_fx[active_slot]->update_parameter(percentage);
+  }
+
+  void update_from_pot() {
+    float reading = read_pot();
+    float delta = previous_adc_reading - reading;
+    float dead_zone =
+        use_increased_dead_zone ? ADC_DEAD_ZONE * 4 : ADC_DEAD_ZONE;
+    // is there a less terrible way to write this? perhaps.
+    if (!(reading == 1.0f && previous_adc_reading != 1.0f) &&
+        !(reading == 0.0f && previous_adc_reading != 0.0f) &&
+        delta < dead_zone && delta > -dead_zone) {
+      return;
+    }
+    use_increased_dead_zone = false;
+    float last_reading = previous_adc_reading;
+    previous_adc_reading = reading;
+    if (active_sw_mode != SW_MODE_SET) {
+      on_fx_param_tweaked(reading);
+    } else {
+      uint8_t slot = reading * MAX_FX;
+      if (slot == MAX_FX) slot--;
+      uint8_t active_fx_slot = settings->getActiveFxSlot();
+      if (slot != active_fx_slot) {
+        // its state is still in use (a loop being saved out of it), so the
+        // arena can't change hands yet. Try again next time around.
+        if (!mouse_fx[active_fx_slot]->can_release() ||
+            !keyboard_fx[active_fx_slot]->can_release()) {
+          previous_adc_reading = last_reading;
+          return;
+        }
+        log_line("fx slot: %u", slot);
+        fx_time_t time_us = clock->now_us();
+        HA_PROFILE_SCOPE(PROFILE_FX_SWITCH);
+        mouse_fx[active_fx_slot]->deinit();
+        mouse_fx[slot]->initialize(time_us, reading);
+        keyboard_fx[active_fx_slot]->deinit();
+        keyboard_fx[slot]->initialize(time_us, reading);
+        settings->setActiveFxSlot(slot);
+        mouse_deadline.reset();
+        keyboard_deadline.reset();
+      }
+    }
+  }
+
+  void read_foot_switch() {
+    bool current_val = gpio->read(PEDAL_INPUT_FOOT_SWITCH);
+    current_val = settings->shouldInvertFootswitch() ? !current_val : current_val;
+    if (current_val == previous_foot_sw_value) {
+      return;
+    }
+    log_line("foot switch: %u", (uint8_t)current_val);
+    previous_foot_sw_value = current_val;
+    if (active_sw_mode == SW_MODE_LATCH && current_val) {
+      fx_enabled = !fx_enabled;
+    } else if (active_sw_mode == SW_MODE_MOM) {
+      fx_enabled = current_val;
+    } else if (active_sw_mode == SW_MODE_SET && current_val) {
+      // set mode has no use for the switch otherwise, it taps the tempo
+      if (tempo.tap(clock->now_ms())) {
+        tempo_unsaved = true;
+        log_tempo();
+      }
+    }
+  }
+
+  void read_toggle_switch() {
+    uint8_t current_val = (gpio->read(PEDAL_INPUT_TOGGLE_1) ? 0 : 0b01) |
+                          (gpio->read(PEDAL_INPUT_TOGGLE_2) ? 0 : 0b10);
+    if (current_val == active_sw_mode) {
+      return;
+    }
+    active_sw_mode = current_val;
+    log_line("toggle switch: %u", current_val);
+    // if we're switching modes, disable the fx and make the knob less
+    // sensitive
+    fx_enabled = false;
+    use_increased_dead_zone = true;
+  }
+};
+
+#endif
@@ -0,0 +1,46 @@
+#include <stdint.h>
+
+#include "fx_time.hpp"
+
+#ifndef COMMON_PEDAL_HAL
+#define COMMON_PEDAL_HAL
+
+// The little bits of hardware PedalEngine touches. HID output goes through
+// IHIDOutput, settings through IPersistence.
+
+class IClock {
+ public:
+  // us since boot, what FX get
+  virtual fx_time_t now_us() = 0;
+  inline uint32_t now_ms() { return fx_ms(now_us()); }
+  virtual ~IClock() = default;
+};
+
+typedef enum {
+  PEDAL_INPUT_FOOT_SWITCH = 0,
+  PEDAL_INPUT_TOGGLE_1,
+  PEDAL_INPUT_TOGGLE_2,
+} pedal_input_t;
+
+class IGpio {
+ public:
+  // raw pin level, every input is pulled up
+  virtual bool read(pedal_input_t input) = 0;
+  virtual ~IGpio() = default;
+};
+
+class IAdc {
+ public:
+  // 12 bit knob reading, 0 - 4095
+  virtual uint16_t read_knob() = 0;
+  virtual ~IAdc() = default;
+};
+
+class IPixel {
+ public:
+  // 0x00RRGGBB, already scaled to the LED brightness setting
+  virtual void set_pixel(uint32_t color) = 0;
+  virtual ~IPixel() = default;
+};
+
+#endif
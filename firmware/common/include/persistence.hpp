@@ -2,6 +2,13 @@
 
 #ifndef COMMON_PERSISTENCE
 #define COMMON_PERSISTENCE
+// control points of the custom mouse acceleration curve
+#define MOUSE_ACCEL_POINTS 4
+// delay_repeats values with a meaning of their own, anything in between is how
+// many echoes each key gets
+#define DELAY_REPEATS_KNOB 0
+#define DELAY_REPEATS_FOREVER 255
+
 class IPersistence {
  public:
   virtual void initialize() = 0;
@@ -23,6 +30,33 @@ class IPersistence {
   virtual void setShouldInvertFootswitch(bool invert) = 0;
   virtual uint8_t getMouseSpeedLevel() = 0;
   virtual void setMouseSpeedLevel(uint8_t level) = 0;
+  virtual bool isNkroEnabled() = 0;
+  virtual void setNkroEnabled(bool enabled) = 0;
+  virtual uint8_t getDelayCurve() = 0;
+  virtual void setDelayCurve(uint8_t curve) = 0;
+  virtual uint8_t getMouseAccelCurve() = 0;
+  virtual void setMouseAccelCurve(uint8_t curve) = 0;
+  virtual uint8_t getMouseAccelStrength() = 0;
+  virtual void setMouseAccelStrength(uint8_t strength) = 0;
+  // custom curve point: input speed in counts per report, gain * 10
+  virtual uint8_t getMouseAccelPointSpeed(uint8_t point) = 0;
+  virtual uint8_t getMouseAccelPointGain(uint8_t point) = 0;
+  virtual void setMouseAccelPoint(uint8_t point, uint8_t speed,
+                                  uint8_t gain) = 0;
+  // one beat, in us
+  virtual uint32_t getTempoPeriodUs() = 0;
+  virtual void setTempoPeriodUs(uint32_t period_us) = 0;
+  virtual bool isLoopSyncEnabled() = 0;
+  virtual void setLoopSyncEnabled(bool enabled) = 0;
+  // keyboard looper in place of the delay
+  virtual bool isKeyboardLooperEnabled() = 0;
+  virtual void setKeyboardLooperEnabled(bool enabled) = 0;
+  // between mouse motion and the reverb's first echo of it
+  virtual uint16_t getReverbPreDelayMs() = 0;
+  virtual void setReverbPreDelayMs(uint16_t ms) = 0;
+  // echoes per key for the keyboard delay, see DELAY_REPEATS_KNOB
+  virtual uint8_t getDelayRepeats() = 0;
+  virtual void setDelayRepeats(uint8_t repeats) = 0;
   virtual ~IPersistence() = default;
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,221 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef COMMON_PROFILER
+#define COMMON_PROFILER
+
+// SysTick is a 24 bit down counter, it wraps every ~140ms at 120MHz
+#define PROFILE_SYSTICK_MASK 0x00FFFFFF
+
+// main loop tasks first, in loop order, so a dump reads top to bottom
+typedef enum {
+  PROFILE_HOST_REPORTS = 0,
+  PROFILE_LED_TASK,
+  PROFILE_IO_TASK,
+  PROFILE_FX_TASK,
+  PROFILE_MOUSE_TASK,
+  PROFILE_FLUSH_LOG,
+  PROFILE_LOOP_STORE_TASK,
+  PROFILE_TUD_TASK,
+  PROFILE_CDC_INPUT,
+  // nested inside the tasks above
+  PROFILE_FX_TICK,
+  PROFILE_FX_MOUSE_REPORT,
+  PROFILE_FX_KEYBOARD_REPORT,
+  PROFILE_FX_PIXEL,
+  PROFILE_FX_SWITCH,
+  PROFILE_EEPROM_WRITE,
+  // slots from here on are recorded on core1 and left out of the
+  // per-iteration snapshot
+  PROFILE_CORE1_SLOTS,
+  PROFILE_HOST_RECEIVE = PROFILE_CORE1_SLOTS,
+  PROFILE_SLOT_COUNT
+} profile_slot_t;
+
+static const char *const profile_slot_names[PROFILE_SLOT_COUNT] = {
+    "host_reports", "led_task",  "io_task",    "fx_task",
+    "mouse_task",   "flush_log", "loop_store", "tud_task",
+    "cdc_input",    "fx_tick",   "fx_mouse",   "fx_keyboard",
+    "fx_pixel",     "fx_switch", "eeprom",     "host_receive"};
+
+typedef struct {
+  uint32_t count;
+  uint32_t min_us;
+  uint32_t max_us;
+  uint64_t total_us;
+  uint64_t total_cycles;
+  uint32_t max_cycles;
+} profile_stats_t;
+
+// Accumulates scoped timings in RAM. Only does arithmetic, ProfileScope below
+// reads the clocks and hands the numbers in.
+// Every slot has exactly one writer core, so there's no locking. A dump from
+// core0 may read a core1 slot halfway through an update, that's fine for a
+// debug readout.
+class Profiler {
+ public:
+  Profiler() { reset(); }
+
+  void reset() {
+    for (size_t i = 0; i < PROFILE_SLOT_COUNT; i++) {
+      stats[i] = {0, UINT32_MAX, 0, 0, 0, 0};
+      iteration_us[i] = 0;
+      worst_iteration_us[i] = 0;
+    }
+    iterations = 0;
+    worst_loop_us = 0;
+    total_loop_us = 0;
+  }
+
+  // cycles between two SysTick reads. Past one wrap the counter can't tell,
+  // so fall back on the microsecond timer.
+  static inline uint32_t elapsed_cycles(uint32_t start, uint32_t end,
+                                        uint32_t us, uint32_t cycles_per_us) {
+    uint64_t estimate = (uint64_t)us * cycles_per_us;
+    if (estimate >= PROFILE_SYSTICK_MASK) {
+      return estimate > UINT32_MAX ? UINT32_MAX : (uint32_t)estimate;
+    }
+    return (start - end) & PROFILE_SYSTICK_MASK;
+  }
+
+  void record(profile_slot_t slot, uint32_t us, uint32_t cycles) {
+    profile_stats_t &s = stats[slot];
+    s.count++;
+    s.total_us += us;
+    s.total_cycles += cycles;
+    if (us < s.min_us) s.min_us = us;
+    if (us > s.max_us) s.max_us = us;
+    if (cycles > s.max_cycles) s.max_cycles = cycles;
+    if (slot < PROFILE_CORE1_SLOTS) iteration_us[slot] += us;
+  }
+
+  // closes one main loop iteration, keeps a breakdown of the slowest one
+  void end_iteration(uint32_t loop_us) {
+    iterations++;
+    total_loop_us += loop_us;
+    if (loop_us > worst_loop_us) {
+      worst_loop_us = loop_us;
+      for (size_t i = 0; i < PROFILE_CORE1_SLOTS; i++) {
+        worst_iteration_us[i] = iteration_us[i];
+      }
+    }
+    for (size_t i = 0; i < PROFILE_CORE1_SLOTS; i++) iteration_us[i] = 0;
+  }
+
+  inline profile_stats_t const &get_stats(profile_slot_t slot) const {
+    return stats[slot];
+  }
+
+  inline uint32_t get_iterations() const { return iterations; }
+
+  inline uint32_t get_worst_loop_us() const { return worst_loop_us; }
+
+  inline uint32_t get_worst_iteration_us(profile_slot_t slot) const {
+    return slot < PROFILE_CORE1_SLOTS ? worst_iteration_us[slot] : 0;
+  }
+
+  // Dump output is one short line per call so it fits the log buffer.
+  // Line 0 is the loop summary, then one per slot that ran. Returns false
+  // once there's nothing left, line then goes back to 0.
+  bool format_line(size_t *line, uint32_t watchdog_us, char *buf,
+                   size_t len) {
+    if (*line == 0) {
+      (*line)++;
+      uint32_t avg = iterations ? (uint32_t)(total_loop_us / iterations) : 0;
+      uint32_t headroom =
+          watchdog_us > worst_loop_us ? watchdog_us - worst_loop_us : 0;
+      snprintf(buf, len, "loop n:%lu avg:%luus worst:%luus headroom:%luus",
+               (unsigned long)iterations, (unsigned long)avg,
+               (unsigned long)worst_loop_us, (unsigned long)headroom);
+      return true;
+    }
+    while (*line <= PROFILE_SLOT_COUNT) {
+      profile_slot_t slot = (profile_slot_t)(*line - 1);
+      (*line)++;
+      profile_stats_t const &s = stats[slot];
+      if (s.count == 0) continue;
+      snprintf(buf, len,
+               "%s n:%lu min:%lu avg:%lu max:%luus cyc avg:%lu max:%lu "
+               "worst_iter:%luus",
+               profile_slot_names[slot], (unsigned long)s.count,
+               (unsigned long)s.min_us,
+               (unsigned long)(s.total_us / s.count), (unsigned long)s.max_us,
+               (unsigned long)(s.total_cycles / s.count),
+               (unsigned long)s.max_cycles,
+               (unsigned long)get_worst_iteration_us(slot));
+      return true;
+    }
+    *line = 0;
+    return false;
+  }
+
+ private:
+  profile_stats_t stats[PROFILE_SLOT_COUNT];
+  // per slot time spent in the iteration that's running
+  uint32_t iteration_us[PROFILE_SLOT_COUNT];
+  uint32_t worst_iteration_us[PROFILE_SLOT_COUNT];
+  uint32_t iterations;
+  uint32_t worst_loop_us;
+  uint64_t total_loop_us;
+};
+
+// Scoped probes, built in with -DHA_PROFILE. Without it every probe compiles
+// to nothing. The platform provides the time sources, on the pedal that's the
+// RP2040 timer and SysTick (src/util.cpp).
+#ifdef HA_PROFILE
+
+#ifndef PROFILE_CYCLES_PER_US
+// clk_sys is set to 120MHz in main()
+#define PROFILE_CYCLES_PER_US 120
+#endif
+
+uint32_t profile_time_us();
+// cycle counter of the calling core, counts down
+uint32_t profile_cycles();
+// starts the cycle counter of the calling core, each core has its own
+void profile_init_core();
+
+extern Profiler profiler;
+
+class ProfileScope {
+ public:
+  explicit ProfileScope(profile_slot_t slot)
+      : slot(slot), start_us(profile_time_us()), start_cycles(profile_cycles()) {}
+
+  ~ProfileScope() {
+    uint32_t end_cycles = profile_cycles();
+    uint32_t us = profile_time_us() - start_us;
+    profiler.record(slot, us,
+                    Profiler::elapsed_cycles(start_cycles, end_cycles, us,
+                                             PROFILE_CYCLES_PER_US));
+  }
+
+ private:
+  profile_slot_t slot;
+  uint32_t start_us;
+  uint32_t start_cycles;
+};
+
+#define HA_PROFILE_CONCAT_(a, b) a##b
+#define HA_PROFILE_CONCAT(a, b) HA_PROFILE_CONCAT_(a, b)
+// times the rest of the enclosing block
+#define HA_PROFILE_SCOPE(slot) \
+  ProfileScope HA_PROFILE_CONCAT(profile_scope_, __LINE__)(slot)
+#define HA_PROFILE_INIT_CORE() profile_init_core()
+// brackets one main loop iteration
+#define HA_PROFILE_LOOP_START() \
+  uint32_t profile_loop_start_us = profile_time_us()
+#define HA_PROFILE_LOOP_END() \
+  profiler.end_iteration(profile_time_us() - profile_loop_start_us)
+
+#else
+
+#define HA_PROFILE_SCOPE(slot)
+#define HA_PROFILE_INIT_CORE()
+#define HA_PROFILE_LOOP_START()
+#define HA_PROFILE_LOOP_END()
+
+#endif
+
+#endif
@@ -0,0 +1,79 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef COMMON_REPORT_LATCH
+#define COMMON_REPORT_LATCH
+
+// longest report that gets forwarded as-is, consumer control is 2 bytes
+#define REPORT_LATCH_MAX_LEN 4
+// device report ids are below this
+#define REPORT_LATCH_IDS 8
+// reports kept per id while its endpoint's busy, a power of two
+#define REPORT_LATCH_DEPTH 4
+
+// Forwarded reports for each device report id, oldest first, until their
+// endpoint can take them. Consumer and system control reports carry the
+// whole state of their controls, so every change has to go out in order: a
+// media key tapped while the endpoint's busy is a press and a release, and
+// sending only the release loses the tap. If an id backs up past
+// REPORT_LATCH_DEPTH the newest report is replaced, the changes before it
+// and the latest state still go out.
+class ReportLatch {
+  static_assert((REPORT_LATCH_DEPTH & (REPORT_LATCH_DEPTH - 1)) == 0,
+                "latch depth must be a power of two");
+
+ public:
+  // false if it can't be latched
+  bool latch(uint8_t instance, uint8_t report_id, uint8_t const *payload,
+             uint16_t len) {
+    if (report_id >= REPORT_LATCH_IDS || len > REPORT_LATCH_MAX_LEN) {
+      return false;
+    }
+    queue_t &q = queues[report_id];
+    if (q.count < REPORT_LATCH_DEPTH) q.count++;
+    entry_t &e = q.entries[(q.head + q.count - 1) & (REPORT_LATCH_DEPTH - 1)];
+    e.len = (uint8_t)len;
+    memcpy(e.payload, payload, len);
+    q.instance = instance;
+    return true;
+  }
+
+  // Sends the oldest report of each id whose endpoint is ready.
+  // ready(instance) says whether an endpoint can take a report,
+  // send(instance, id, payload, len) is false if it didn't, and the report
+  // stays latched for the next flush.
+  template <typename R, typename S>
+  void flush(R ready, S send) {
+    for (uint8_t id = 0; id < REPORT_LATCH_IDS; id++) {
+      queue_t &q = queues[id];
+      if (q.count == 0 || !ready(q.instance)) continue;
+      entry_t const &e = q.entries[q.head];
+      if (send(q.instance, id, (uint8_t const *)e.payload, (uint16_t)e.len)) {
+        q.head = (q.head + 1) & (REPORT_LATCH_DEPTH - 1);
+        q.count--;
+      }
+    }
+  }
+
+  inline bool is_pending(uint8_t report_id) const {
+    return report_id < REPORT_LATCH_IDS && queues[report_id].count > 0;
+  }
+
+ private:
+  typedef struct {
+    uint8_t payload[REPORT_LATCH_MAX_LEN];
+    uint8_t len;
+  } entry_t;
+
+  typedef struct {
+    entry_t entries[REPORT_LATCH_DEPTH];
+    uint8_t head;
+    uint8_t count;
+    uint8_t instance;
+  } queue_t;
+
+  queue_t queues[REPORT_LATCH_IDS] = {};
+};
+
+#endif
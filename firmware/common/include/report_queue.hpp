@@ -0,0 +1,128 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "fx_time.hpp"
+
+#ifndef COMMON_REPORT_QUEUE
+#define COMMON_REPORT_QUEUE
+
+// the host stack's receive buffer size, nothing longer comes in
+#define REPORT_QUEUE_MAX_LEN 64
+// at 1 kHz, how long the main loop can stall before reports get dropped, ms
+#define REPORT_QUEUE_SIZE 32
+// how often ReportRate works out a rate
+#define REPORT_RATE_WINDOW_MS 1000
+
+typedef enum {
+  QUEUED_REPORT = 0,
+  // a device was plugged in, data is what the host callback worked out
+  QUEUED_MOUNT,
+  QUEUED_UNMOUNT,
+} queued_report_type_t;
+
+typedef struct {
+  // when it came in, FX get this rather than when it's processed
+  fx_time_t time_us;
+  uint8_t dev_addr;
+  uint8_t instance;
+  uint16_t len;
+  // queued_report_type_t
+  uint8_t type;
+  uint8_t data[REPORT_QUEUE_MAX_LEN];
+} queued_report_t;
+
+// Reports from the host callback on core1 to the main loop on core0. One
+// producer, one consumer, nothing blocks: the callback copies the report in
+// and hands the endpoint straight back to the device, so how long FX take
+// doesn't hold up polling it. Full means the main loop has fallen behind, the
+// newest report is dropped and counted. Mounts and unmounts come through too,
+// so the main loop sees them in order with the reports and nothing the host
+// callbacks work out is shared between the cores.
+template <size_t N>
+class ReportQueue {
+  static_assert((N & (N - 1)) == 0, "queue size must be a power of two");
+
+ public:
+  // producer, false if it was dropped
+  bool push(uint8_t dev_addr, uint8_t instance, uint8_t const *report,
+            uint16_t len, fx_time_t time_us, uint8_t type = QUEUED_REPORT) {
+    uint32_t head = write_head.load(std::memory_order_relaxed);
+    if (head - read_head.load(std::memory_order_acquire) >= N) {
+      dropped++;
+      return false;
+    }
+    queued_report_t *slot = &slots[head & (N - 1)];
+    if (len > REPORT_QUEUE_MAX_LEN) len = REPORT_QUEUE_MAX_LEN;
+    slot->time_us = time_us;
+    slot->dev_addr = dev_addr;
+    slot->instance = instance;
+    slot->len = len;
+    slot->type = type;
+    memcpy(slot->data, report, len);
+    write_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // consumer, the oldest report or nullptr. Stays put until pop().
+  queued_report_t const *peek() {
+    uint32_t tail = read_head.load(std::memory_order_relaxed);
+    if (tail == write_head.load(std::memory_order_acquire)) return nullptr;
+    return &slots[tail & (N - 1)];
+  }
+
+  // consumer, done with what peek() returned
+  inline void pop() {
+    read_head.store(read_head.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+  }
+
+  inline size_t size() const {
+    return write_head.load(std::memory_order_acquire) -
+           read_head.load(std::memory_order_acquire);
+  }
+
+  // every report that came in, dropped ones too
+  inline uint32_t get_received() const {
+    return write_head.load(std::memory_order_acquire) + dropped;
+  }
+
+  inline uint32_t get_dropped() const { return dropped; }
+
+ private:
+  queued_report_t slots[N];
+  // only ever count up, the difference is how many are queued
+  std::atomic<uint32_t> write_head{0};
+  std::atomic<uint32_t> read_head{0};
+  // producer only
+  volatile uint32_t dropped = 0;
+};
+
+// Reports per second out of a running count, worked out once per window so
+// checking it costs a subtraction the rest of the time.
+class ReportRate {
+ public:
+  void task(uint32_t count, uint32_t time_ms) {
+    uint32_t elapsed = time_ms - window_start_ms;
+    if (elapsed < REPORT_RATE_WINDOW_MS) return;
+    rate = (uint32_t)(((uint64_t)(count - window_count) * 1000) / elapsed);
+    if (rate > peak) peak = rate;
+    window_start_ms = time_ms;
+    window_count = count;
+  }
+
+  // over the last window
+  inline uint32_t get_rate() const { return rate; }
+
+  inline uint32_t get_peak() const { return peak; }
+
+ private:
+  uint32_t window_start_ms = 0;
+  uint32_t window_count = 0;
+  uint32_t rate = 0;
+  uint32_t peak = 0;
+};
+
+#endif
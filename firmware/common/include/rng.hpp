@@ -0,0 +1,72 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef COMMON_RNG
+#define COMMON_RNG
+
+// xoshiro128++ (Blackman & Vigna), 32 bit so it stays cheap on the M0+.
+// Not cryptographic, just fast and statistically decent for FX.
+class Rng {
+ public:
+  explicit Rng(uint32_t seed = 1) { reseed(seed); }
+
+  // expands a single 32 bit seed into the full state with splitmix32
+  void reseed(uint32_t seed) {
+    for (size_t i = 0; i < 4; i++) {
+      seed += 0x9E3779B9;
+      uint32_t z = seed;
+      z = (z ^ (z >> 16)) * 0x85EBCA6B;
+      z = (z ^ (z >> 13)) * 0xC2B2AE35;
+      s[i] = z ^ (z >> 16);
+    }
+    byte_pool_len = 0;
+  }
+
+  uint32_t next_u32() {
+    uint32_t result = rotl(s[0] + s[3], 7) + s[0];
+    uint32_t t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 11);
+    return result;
+  }
+
+  // hands out the bytes of one 32 bit draw before generating another
+  uint8_t next_byte() {
+    if (byte_pool_len == 0) {
+      byte_pool = next_u32();
+      byte_pool_len = 4;
+    }
+    uint8_t b = (uint8_t)byte_pool;
+    byte_pool >>= 8;
+    byte_pool_len--;
+    return b;
+  }
+
+  void fill(uint8_t *buf, size_t len) {
+    while (len >= 4) {
+      uint32_t r = next_u32();
+      buf[0] = (uint8_t)r;
+      buf[1] = (uint8_t)(r >> 8);
+      buf[2] = (uint8_t)(r >> 16);
+      buf[3] = (uint8_t)(r >> 24);
+      buf += 4;
+      len -= 4;
+    }
+    while (len-- > 0) *buf++ = next_byte();
+  }
+
+ private:
+  uint32_t s[4];
+  uint32_t byte_pool = 0;
+  uint8_t byte_pool_len = 0;
+
+  static inline uint32_t rotl(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+  }
+};
+
+#endif
@@ -0,0 +1,24 @@
+#include <stdint.h>
+
+#ifndef COMMON_SCRIPT_STORE
+#define COMMON_SCRIPT_STORE
+
+// Keeps the one uploaded FX script across power cycles, see fx_vm.hpp
+class IScriptStore {
+ public:
+  virtual void initialize() = 0;
+  // Stages a script image to be written. It must stay untouched until isBusy()
+  // returns false. Returns false if a write is already in progress or it's too
+  // big.
+  virtual bool saveScript(const uint8_t *image, uint32_t len) = 0;
+  // Stages the removal of the script, returns false if a write is in progress.
+  virtual bool eraseScript() = 0;
+  // Returns a pointer straight into storage, or NULL if there's no script or
+  // it's being written. Valid until the next saveScript/eraseScript.
+  virtual const uint8_t *getScript(uint32_t *len) = 0;
+  virtual bool isBusy() = 0;
+  // Performs at most one unit of pending work, call from the main loop.
+  virtual void task() = 0;
+  virtual ~IScriptStore() = default;
+};
+#endif
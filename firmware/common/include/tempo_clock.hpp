@@ -0,0 +1,199 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef COMMON_TEMPO_CLOCK
+#define COMMON_TEMPO_CLOCK
+
+// Positions are counted in ticks, TEMPO_PPQN to the beat. 960 divides evenly
+// by 2, 3, 4, 5, 6 and 8, so every subdivision below is a whole number of
+// ticks and stepping through them never rounds.
+#define TEMPO_PPQN 960
+// 120 BPM
+#define TEMPO_DEFAULT_PERIOD_US 500000
+// 300 BPM
+#define TEMPO_MIN_PERIOD_US 200000
+// 30 BPM
+#define TEMPO_MAX_PERIOD_US 2000000
+// a tap this long after the previous one starts a new tap sequence
+#define TEMPO_TAP_TIMEOUT_MS 2500
+// times up to a minute before the last tempo change are taken as before it
+#define TEMPO_BEFORE_ANCHOR_MS (0xFFFFFFFFu - 60000)
+
+// step lengths, in ticks
+#define TEMPO_THIRTY_SECOND (TEMPO_PPQN / 8)
+#define TEMPO_SIXTEENTH (TEMPO_PPQN / 4)
+#define TEMPO_EIGHTH_TRIPLET (TEMPO_PPQN / 3)
+#define TEMPO_EIGHTH (TEMPO_PPQN / 2)
+#define TEMPO_DOTTED_EIGHTH ((TEMPO_PPQN * 3) / 4)
+#define TEMPO_QUARTER TEMPO_PPQN
+#define TEMPO_HALF (TEMPO_PPQN * 2)
+#define TEMPO_WHOLE (TEMPO_PPQN * 4)
+
+// One tempo for every FX. Where the beat is gets worked out from the last
+// tempo change (the anchor) every time, instead of being added up frame by
+// frame, so nothing drifts no matter how long the pedal runs. A tempo change
+// moves the anchor to "now" at the current position, the phase carries on
+// from where it was instead of jumping.
+class TempoClock {
+ public:
+  // false if nothing changed
+  bool set_period_us(uint32_t period_us, uint32_t time_ms) {
+    if (period_us < TEMPO_MIN_PERIOD_US) period_us = TEMPO_MIN_PERIOD_US;
+    if (period_us > TEMPO_MAX_PERIOD_US) period_us = TEMPO_MAX_PERIOD_US;
+    if (period_us == this->period_us) return false;
+    anchor_ticks = ticks_at(time_ms);
+    anchor_ms = time_ms;
+    this->period_us = period_us;
+    generation++;
+    return true;
+  }
+
+  inline uint32_t get_period_us() const { return period_us; }
+
+  inline float get_bpm() const { return 60000000.0f / (float)period_us; }
+
+  // Taps land on the beat. From the second tap on, the tempo is the average
+  // gap of the whole sequence and the beat is moved onto the latest tap.
+  // Returns true if the tempo or phase changed.
+  bool tap(uint32_t time_ms) {
+    if (tap_count > 0 && time_ms - last_tap_ms > TEMPO_TAP_TIMEOUT_MS) {
+      tap_count = 0;
+    }
+    if (tap_count == 0) first_tap_ms = time_ms;
+    last_tap_ms = time_ms;
+    if (tap_count < 0xFF) tap_count++;
+    if (tap_count < 2) return false;
+    uint32_t period_us =
+        (uint32_t)(((uint64_t)(time_ms - first_tap_ms) * 1000) /
+                   (tap_count - 1));
+    set_period_us(period_us, time_ms);
+    // round to the nearest beat, then put that beat on the tap
+    uint64_t beat = (ticks_at(time_ms) + (TEMPO_PPQN / 2)) / TEMPO_PPQN;
+    anchor_ticks = beat * TEMPO_PPQN;
+    anchor_ms = time_ms;
+    generation++;
+    return true;
+  }
+
+  // a tap sequence is still going, its tempo may change again
+  inline bool is_tapping(uint32_t time_ms) const {
+    return tap_count > 0 && time_ms - last_tap_ms <= TEMPO_TAP_TIMEOUT_MS;
+  }
+
+  // position at a time, rounded down
+  uint64_t ticks_at(uint32_t time_ms) const {
+    // a little before the anchor (a report stamped before a tap) counts
+    // backwards, anything else is after it
+    uint32_t since = time_ms - anchor_ms;
+    int64_t elapsed_ms = since >= TEMPO_BEFORE_ANCHOR_MS
+                             ? (int64_t)(int32_t)since
+                             : (int64_t)since;
+    int64_t ticks = (elapsed_ms * 1000 * TEMPO_PPQN) / period_us;
+    if (ticks * period_us > elapsed_ms * 1000 * TEMPO_PPQN) ticks--;
+    int64_t position = (int64_t)anchor_ticks + ticks;
+    return position > 0 ? (uint64_t)position : 0;
+  }
+
+  // earliest ms at or after a position, so ticks_at(time_at(t)) >= t
+  uint32_t time_at(uint64_t ticks) const {
+    int64_t from_anchor = (int64_t)(ticks - anchor_ticks);
+    int64_t scaled = from_anchor * period_us;
+    int64_t per_ms = 1000 * TEMPO_PPQN;
+    int64_t ms = scaled / per_ms;
+    if (ms * per_ms < scaled) ms++;
+    return anchor_ms + (uint32_t)ms;
+  }
+
+  // how long a number of ticks lasts at the current tempo, rounded
+  inline uint32_t ms_for(uint32_t ticks) const {
+    return (uint32_t)((((uint64_t)ticks * period_us) + (500 * TEMPO_PPQN)) /
+                      (1000 * TEMPO_PPQN));
+  }
+
+  // ticks in a number of ms at the current tempo, rounded
+  inline uint32_t ticks_for(uint32_t ms) const {
+    return (uint32_t)((((uint64_t)ms * 1000 * TEMPO_PPQN) + (period_us / 2)) /
+                      period_us);
+  }
+
+  // changes every time the tempo or phase does, so followers know to resync
+  inline uint32_t get_generation() const { return generation; }
+
+ private:
+  uint32_t period_us = TEMPO_DEFAULT_PERIOD_US;
+  uint32_t anchor_ms = 0;
+  uint64_t anchor_ticks = 0;
+  uint32_t generation = 0;
+  uint32_t first_tap_ms = 0;
+  uint32_t last_tap_ms = 0;
+  uint8_t tap_count = 0;
+};
+
+// for FX that haven't been handed the engine's clock, stays at the default
+// tempo
+inline TempoClock const *default_tempo_clock() {
+  static const TempoClock clock;
+  return &clock;
+}
+
+// Follows one subdivision of a TempoClock, for FX that do something on every
+// step. Steps sit on the clock's grid, so every FX following the same clock
+// lines up with every other one. Checking costs one comparison until the
+// next step is due or the tempo changes.
+class TempoStep {
+ public:
+  // starts following, picks up the step the clock is in right now
+  void follow(TempoClock const *clock, uint32_t step_ticks, uint32_t time_ms) {
+    this->clock = clock;
+    this->step_ticks = step_ticks > 0 ? step_ticks : 1;
+    sync(time_ms);
+  }
+
+  // takes effect on the next poll, which counts in the new steps from then on
+  inline void set_step_ticks(uint32_t ticks) {
+    if (ticks == step_ticks || ticks == 0) return;
+    step_ticks = ticks;
+    stale = true;
+  }
+
+  inline uint32_t get_step_ticks() const { return step_ticks; }
+
+  // steps that started since the last poll, 0 most of the time
+  uint32_t poll(uint32_t time_ms) {
+    if (!clock) return 0;
+    if (!stale && generation == clock->get_generation() &&
+        (int32_t)(time_ms - next_ms) < 0) {
+      return 0;
+    }
+    // steps of a different length can't be compared
+    uint64_t previous = stale ? UINT64_MAX : step;
+    sync(time_ms);
+    return step > previous ? (uint32_t)(step - previous) : 0;
+  }
+
+  // the step the last poll landed in, counted from the start of the clock
+  inline uint64_t get_step() const { return step; }
+
+  // when the current step started and when the next one does
+  inline uint32_t get_step_start_ms() const {
+    return clock ? clock->time_at(step * step_ticks) : 0;
+  }
+  inline uint32_t get_next_ms() const { return next_ms; }
+
+ private:
+  TempoClock const *clock = nullptr;
+  uint32_t step_ticks = TEMPO_QUARTER;
+  uint64_t step = 0;
+  uint32_t next_ms = 0;
+  uint32_t generation = 0;
+  bool stale = true;
+
+  void sync(uint32_t time_ms) {
+    step = clock->ticks_at(time_ms) / step_ticks;
+    next_ms = clock->time_at((step + 1) * step_ticks);
+    generation = clock->get_generation();
+    stale = false;
+  }
+};
+
+#endif
@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef UTIL_H
@@ -5,17 +6,31 @@
 void log_line(const char *format, ...);
 const char *get_serial_number();
 uint8_t get_random_byte();
+void fill_random(uint8_t *buf, size_t len);
+// a fixed seed makes every following random value reproducible
+void seed_random(uint32_t seed);
+void init_random();
 void refresh_settings();
 void reboot_to_uf2(unsigned int gpio, uint32_t events);
+bool save_mouse_loop(uint8_t slot);
+bool recall_mouse_loop(uint8_t slot);
+bool clear_mouse_loop(uint8_t slot);
+// false if the firmware was built without HA_PROFILE
+bool dump_profile();
+bool reset_profile();
+// logs what each FX and the FX arenas take up
+void dump_memory();
+// logs when each boot phase happened, see boot_timeline.hpp
+void dump_boot_timeline();
+// logs how many reports/s each attached HID device is sending
+void dump_host_rate();
+// uploading an FX script in hex chunks, see fx_script_loader.hpp
+void begin_fx_script();
+bool add_fx_script_data(const char *hex);
+bool end_fx_script();
+bool clear_fx_script();
 
 static inline uint32_t urgb_u32(uint8_t r, uint8_t g, uint8_t b) {
   return ((uint32_t)(g) << 8) | ((uint32_t)(r) << 16) | (uint32_t)(b);
 }
-
-static inline uint32_t color_at_brightness(uint32_t color, float brightness) {
-  uint8_t r = (uint8_t)((float)(uint8_t)(color >> 16) * brightness);
-  uint8_t g = (uint8_t)((float)(uint8_t)((color & 0xFF00) >> 8) * brightness);
-  uint8_t b = (uint8_t)((float)(uint8_t)((color & 0x00FF)) * brightness);
-  return urgb_u32(r, g, b);
-}
 #endif
\ No newline at end of file
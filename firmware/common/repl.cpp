@@ -1,12 +1,13 @@
 #include "repl.hpp"
 
 #include <ctype.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "util.h"
 
-#define REPL_PARAM_SLOTS 4
+#define REPL_PARAM_SLOTS 5
 #define REPL_TOKEN ":"
 
 void Repl::process(char* input) {
@@ -124,6 +125,201 @@ void Repl::process(char* input) {
       log_line("invalid input, usage: cmd:flash:[on|off]");
     }
     consumed = true;
+    // check for n-key rollover output
+  } else if (i >= 2 && strcmp(slots[1], "nkro") == 0 && slots[2]) {
+    if (strcmp(slots[2], "on") == 0) {
+      persistence->setNkroEnabled(true);
+      log_line("n-key rollover enabled");
+    } else if (strcmp(slots[2], "off") == 0) {
+      persistence->setNkroEnabled(false);
+      log_line("n-key rollover disabled");
+    } else {
+      log_line("invalid input, usage: cmd:nkro:[on|off]");
+    }
+    consumed = true;
+    // check for keyboard delay spacing curve
+  } else if (i >= 2 && strcmp(slots[1], "delay_curve") == 0 && slots[2]) {
+    const char* curves[] = {"flat", "pingpong", "accel", "decel"};
+    int curve = -1;
+    for (size_t c = 0; c < sizeof(curves) / sizeof(curves[0]); c++) {
+      if (strcmp(slots[2], curves[c]) == 0) curve = c;
+    }
+    if (curve >= 0) {
+      persistence->setDelayCurve(curve);
+      log_line("set delay curve to: %s", curves[curve]);
+    } else {
+      log_line(
+          "invalid input, usage: "
+          "cmd:delay_curve:[flat|pingpong|accel|decel]");
+    }
+    consumed = true;
+    // check for keyboard delay repeats
+  } else if (i >= 2 && strcmp(slots[1], "delay_repeats") == 0 && slots[2]) {
+    char* end = NULL;
+    long repeats = strtol(slots[2], &end, 10);
+    if (strcmp(slots[2], "knob") == 0) {
+      persistence->setDelayRepeats(DELAY_REPEATS_KNOB);
+      log_line("delay repeats follow the knob");
+    } else if (strcmp(slots[2], "forever") == 0) {
+      persistence->setDelayRepeats(DELAY_REPEATS_FOREVER);
+      log_line("delay repeats forever");
+    } else if (end != slots[2] && *end == 0 && repeats > DELAY_REPEATS_KNOB &&
+               repeats < DELAY_REPEATS_FOREVER) {
+      persistence->setDelayRepeats((uint8_t)repeats);
+      log_line("delay repeats: %ld", repeats);
+    } else {
+      log_line("invalid input, usage: cmd:delay_repeats:[knob|forever|1-254]");
+    }
+    consumed = true;
+    // check for tempo, in BPM
+  } else if (i >= 2 && strcmp(slots[1], "tempo") == 0 && slots[2]) {
+    char* end = NULL;
+    float bpm = strtof(slots[2], &end);
+    if (end != slots[2] && *end == 0 && bpm >= 30.0f && bpm <= 300.0f) {
+      persistence->setTempoPeriodUs((uint32_t)lroundf(60000000.0f / bpm));
+    } else {
+      log_line("invalid input, usage: cmd:tempo:[30-300]");
+    }
+    consumed = true;
+    // check for reverb pre-delay, in ms
+  } else if (i >= 2 && strcmp(slots[1], "pre_delay") == 0 && slots[2]) {
+    char* end = NULL;
+    long ms = strtol(slots[2], &end, 10);
+    if (end != slots[2] && *end == 0 && ms >= 0 && ms <= 600) {
+      persistence->setReverbPreDelayMs((uint16_t)ms);
+      log_line("reverb pre-delay: %ldms", ms);
+    } else {
+      log_line("invalid input, usage: cmd:pre_delay:[0-600]");
+    }
+    consumed = true;
+    // check for looper tempo sync
+  } else if (i >= 2 && strcmp(slots[1], "loop_sync") == 0 && slots[2]) {
+    if (strcmp(slots[2], "on") == 0) {
+      persistence->setLoopSyncEnabled(true);
+      log_line("looper follows the tempo");
+    } else if (strcmp(slots[2], "off") == 0) {
+      persistence->setLoopSyncEnabled(false);
+      log_line("looper runs free");
+    } else {
+      log_line("invalid input, usage: cmd:loop_sync:[on|off]");
+    }
+    consumed = true;
+    // check for keyboard looper in place of the delay
+  } else if (i >= 2 && strcmp(slots[1], "kbd_looper") == 0 && slots[2]) {
+    if (strcmp(slots[2], "on") == 0) {
+      persistence->setKeyboardLooperEnabled(true);
+      log_line("keyboard looper replaces the delay");
+    } else if (strcmp(slots[2], "off") == 0) {
+      persistence->setKeyboardLooperEnabled(false);
+      log_line("keyboard delay is back");
+    } else {
+      log_line("invalid input, usage: cmd:kbd_looper:[on|off]");
+    }
+    consumed = true;
+    // check for mouse acceleration curve
+  } else if (i >= 2 && strcmp(slots[1], "accel") == 0 && slots[2]) {
+    const char* curves[] = {"linear", "power", "sigmoid", "custom"};
+    int curve = -1;
+    for (size_t c = 0; c < sizeof(curves) / sizeof(curves[0]); c++) {
+      if (strcmp(slots[2], curves[c]) == 0) curve = c;
+    }
+    int strength = slots[3] ? atoi(slots[3]) : -1;
+    if (curve >= 0 && strength <= 100 && (!slots[3] || isdigit(slots[3][0]))) {
+      persistence->setMouseAccelCurve(curve);
+      if (strength >= 0) persistence->setMouseAccelStrength(strength);
+      log_line("set mouse accel to: %s, strength %u", curves[curve],
+               persistence->getMouseAccelStrength());
+    } else {
+      log_line(
+          "invalid input, usage: "
+          "cmd:accel:[linear|power|sigmoid|custom]:[0-100 (optional)]");
+    }
+    consumed = true;
+    // check for custom mouse acceleration curve points
+  } else if (i >= 4 && strcmp(slots[1], "accel_point") == 0 && slots[2] &&
+             slots[3] && slots[4]) {
+    int point = atoi(slots[2]);
+    int speed = atoi(slots[3]);
+    int gain = atoi(slots[4]);
+    if (point > 0 && point <= MOUSE_ACCEL_POINTS && speed >= 0 &&
+        speed < 128 && gain >= 0 && gain < 256) {
+      persistence->setMouseAccelPoint(point - 1, speed, gain);
+      log_line("set accel point %d to: speed %d, gain %d.%dx", point, speed,
+               gain / 10, gain % 10);
+    } else {
+      log_line(
+          "invalid input, usage: "
+          "cmd:accel_point:[1-4]:[speed 0-127]:[gain x10, 0-255]");
+    }
+    consumed = true;
+    // check for fixed random seed, makes noisy FX repeatable
+  } else if (i >= 2 && strcmp(slots[1], "seed") == 0 && slots[2]) {
+    char* end = NULL;
+    uint32_t seed = strtoul(slots[2], &end, 10);
+    if (end != slots[2] && *end == 0) {
+      seed_random(seed);
+      log_line("random seed set to: %lu", (unsigned long)seed);
+    } else {
+      log_line("invalid input, usage: cmd:seed:[integer]");
+    }
+    consumed = true;
+    // check for profiler readout
+  } else if (i >= 2 && strcmp(slots[1], "profile") == 0 && slots[2]) {
+    bool built_in = true;
+    if (strcmp(slots[2], "dump") == 0) {
+      built_in = dump_profile();
+    } else if (strcmp(slots[2], "reset") == 0) {
+      built_in = reset_profile();
+      if (built_in) log_line("profiler reset");
+    } else {
+      log_line("invalid input, usage: cmd:profile:[dump|reset]");
+    }
+    if (!built_in) log_line("profiler not built in, build with -DHA_PROFILE=ON");
+    consumed = true;
+    // check for memory report
+  } else if (strcmp(slots[1], "mem") == 0) {
+    dump_memory();
+    consumed = true;
+    // check for boot timing
+  } else if (strcmp(slots[1], "boot_time") == 0) {
+    dump_boot_timeline();
+    consumed = true;
+    // check for upstream report rates
+  } else if (strcmp(slots[1], "host_rate") == 0) {
+    dump_host_rate();
+    consumed = true;
+    // check for FX script upload
+  } else if (i >= 2 && strcmp(slots[1], "script") == 0 && slots[2]) {
+    if (strcmp(slots[2], "begin") == 0) {
+      begin_fx_script();
+    } else if (strcmp(slots[2], "data") == 0 && slots[3]) {
+      add_fx_script_data(slots[3]);
+    } else if (strcmp(slots[2], "end") == 0) {
+      end_fx_script();
+    } else if (strcmp(slots[2], "clear") == 0) {
+      clear_fx_script();
+    } else {
+      log_line("invalid input, usage: cmd:script:[begin|data:[hex]|end|clear]");
+    }
+    consumed = true;
+    // check for mouse loop storage
+  } else if (i >= 3 && strcmp(slots[1], "loop") == 0 && slots[2] &&
+             slots[3]) {
+    int slot = atoi(slots[3]);
+    if (slot > 0) {
+      if (strcmp(slots[2], "save") == 0) {
+        save_mouse_loop(slot - 1);
+      } else if (strcmp(slots[2], "load") == 0) {
+        recall_mouse_loop(slot - 1);
+      } else if (strcmp(slots[2], "clear") == 0) {
+        clear_mouse_loop(slot - 1);
+      } else {
+        log_line("invalid input, usage: cmd:loop:[save|load|clear]:[slot]");
+      }
+    } else {
+      log_line("invalid input, usage: cmd:loop:[save|load|clear]:[slot]");
+    }
+    consumed = true;
     // check for setting of LED color
   } else if (i >= 3 && strcmp(slots[1], "set_color") == 0 && slots[2] &&
              slots[3]) {
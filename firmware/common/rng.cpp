@@ -0,0 +1,13 @@
+#include "rng.hpp"
+
+#include "util.h"
+
+// shared by every FX, seeded from hardware entropy at boot on the device and
+// from a fixed seed on the host so noisy FX replay deterministically
+static Rng rng;
+
+void seed_random(uint32_t seed) { rng.reseed(seed); }
+
+uint8_t get_random_byte() { return rng.next_byte(); }
+
+void fill_random(uint8_t *buf, size_t len) { rng.fill(buf, len); }
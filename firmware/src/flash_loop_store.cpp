@@ -0,0 +1,241 @@
+#include "flash_loop_store.hpp"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "hardware/flash.h"
+#include "hardware/regs/addressmap.h"
+#include "hardware/structs/watchdog.h"
+#include "hardware/sync.h"
+#include "mouse_fx/mouse_fx_looper.hpp"
+#include "pico/multicore.h"
+#include "util.h"
+
+#ifndef PICO_FLASH_SIZE_BYTES
+#define PICO_FLASH_SIZE_BYTES (2 * 1024 * 1024)
+#endif
+
+#define FLASH_LOOP_SLOT_SIZE                                          \
+  (((FLASH_LOOP_SLOT_SAMPLES * sizeof(mouse_loop_sample_t)) +         \
+    FLASH_SECTOR_SIZE - 1) &                                          \
+   ~(FLASH_SECTOR_SIZE - 1))
+// nothing could fill a slot bigger than the looper's buffer
+static_assert(MOUSE_LOOP_BUFFER_SIZE >= FLASH_LOOP_SLOT_SAMPLES,
+              "looper buffer is smaller than a loop slot");
+
+#define FLASH_LOOP_INDEX_SIZE (FLASH_LOOP_INDEX_SECTORS * FLASH_SECTOR_SIZE)
+#define FLASH_LOOP_REGION_SIZE \
+  (FLASH_LOOP_INDEX_SIZE + (FLASH_LOOP_SLOT_COUNT * FLASH_LOOP_SLOT_SIZE))
+#define FLASH_LOOP_REGION_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_LOOP_REGION_SIZE)
+#define FLASH_LOOP_INDEX_PAGES (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+// QSPI parts allow up to 400ms for a 4K sector erase
+#define FLASH_ERASE_WATCHDOG_MS 500
+// the single page index from before there were records, slots haven't moved
+#define FLASH_LOOP_LEGACY_SECTOR 1
+
+static_assert(sizeof(flash_loop_index_record_t) <= FLASH_PAGE_SIZE,
+              "loop index record must fit in one flash page");
+static_assert(FLASH_LOOP_INDEX_PAGES <= 0xFF, "index page must fit a byte");
+
+// page staged in RAM, sources may live in XIP which is unreadable mid-program
+static uint8_t page_buffer[FLASH_PAGE_SIZE];
+
+static inline uint32_t slot_offset(uint8_t slot) {
+  return FLASH_LOOP_REGION_OFFSET + FLASH_LOOP_INDEX_SIZE +
+         (slot * FLASH_LOOP_SLOT_SIZE);
+}
+
+static inline uint32_t index_page_offset(uint8_t sector, uint8_t page) {
+  return FLASH_LOOP_REGION_OFFSET + (sector * FLASH_SECTOR_SIZE) +
+         (page * FLASH_PAGE_SIZE);
+}
+
+static inline const uint8_t *index_page_xip(uint8_t sector, uint8_t page) {
+  return (const uint8_t *)(XIP_BASE + index_page_offset(sector, page));
+}
+
+// FNV-1a
+static uint32_t record_checksum(const flash_loop_index_record_t *record) {
+  const uint8_t *bytes = (const uint8_t *)record;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < offsetof(flash_loop_index_record_t, checksum); i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static bool page_blank(const uint8_t *page) {
+  for (size_t i = 0; i < FLASH_PAGE_SIZE; i++) {
+    if (page[i] != 0xFF) return false;
+  }
+  return true;
+}
+
+// first page that's never been programmed since the sector was erased
+static uint8_t next_blank_page(uint8_t sector) {
+  uint8_t page = FLASH_LOOP_INDEX_PAGES;
+  while (page > 0 && page_blank(index_page_xip(sector, page - 1))) page--;
+  return page;
+}
+
+static inline uint32_t size_in(uint32_t bytes, uint32_t unit) {
+  return (bytes + unit - 1) / unit;
+}
+
+uint32_t flash_loop_region_offset() { return FLASH_LOOP_REGION_OFFSET; }
+
+// core1 runs the host stack from flash, park it in RAM for the duration.
+// A 4K sector erase usually takes ~50ms but can outlast the main loop's
+// watchdog timeout, so the watchdog is loaded with enough for the slowest one.
+// It stays armed, and the next watchdog_update() puts the usual timeout back.
+// Page programs are a few ms at most and go on under the usual timeout.
+void flash_erase_sector(uint32_t offset) {
+  // the RP2040 counts the watchdog down twice per us tick (erratum RP2040-E1)
+  watchdog_hw->load = FLASH_ERASE_WATCHDOG_MS * 1000 * 2;
+  multicore_lockout_start_blocking();
+  uint32_t ints = save_and_disable_interrupts();
+  flash_range_erase(offset, FLASH_SECTOR_SIZE);
+  restore_interrupts(ints);
+  multicore_lockout_end_blocking();
+}
+
+void flash_program_page(uint32_t offset, const uint8_t *page) {
+  multicore_lockout_start_blocking();
+  uint32_t ints = save_and_disable_interrupts();
+  flash_range_program(offset, page, FLASH_PAGE_SIZE);
+  restore_interrupts(ints);
+  multicore_lockout_end_blocking();
+}
+
+void FlashLoopStore::initialize() {
+  bool found = false;
+  for (uint8_t sector = 0; sector < FLASH_LOOP_INDEX_SECTORS; sector++) {
+    for (uint8_t page = 0; page < FLASH_LOOP_INDEX_PAGES; page++) {
+      const flash_loop_index_record_t *record =
+          (const flash_loop_index_record_t *)index_page_xip(sector, page);
+      if (record->magic != FLASH_LOOP_INDEX_MAGIC ||
+          record->checksum != record_checksum(record)) {
+        continue;
+      }
+      if (found && (int32_t)(record->sequence - index_sequence) <= 0) continue;
+      found = true;
+      index_sequence = record->sequence;
+      index_sector = sector;
+      memcpy(index, record->entries, sizeof(index));
+    }
+  }
+  if (!found) {
+    index_sequence = 0;
+    index_sector = FLASH_LOOP_LEGACY_SECTOR;
+    memcpy(index, index_page_xip(FLASH_LOOP_LEGACY_SECTOR, 0), sizeof(index));
+  }
+  // past anything written after the newest record, even a torn page
+  index_page = next_blank_page(index_sector);
+  uint8_t stored = 0;
+  for (size_t i = 0; i < FLASH_LOOP_SLOT_COUNT; i++) {
+    if (index[i].magic != FLASH_LOOP_MAGIC ||
+        index[i].count > FLASH_LOOP_SLOT_SAMPLES) {
+      index[i].magic = 0xFFFFFFFF;
+      index[i].count = 0;
+    } else {
+      stored++;
+    }
+  }
+  log_line("%u stored loops", stored);
+}
+
+bool FlashLoopStore::begin_job(uint8_t slot,
+                               const mouse_loop_sample_t *samples,
+                               uint32_t count, uint32_t duration_us) {
+  if (step != idle || slot >= FLASH_LOOP_SLOT_COUNT) return false;
+  job_slot = slot;
+  job_samples = samples;
+  job_count = count;
+  job_duration_us = duration_us;
+  job_progress = 0;
+  // invalidate the slot in the index first, so a power loss mid-write never
+  // leaves a valid entry pointing at half written samples
+  index[slot].magic = 0xFFFFFFFF;
+  index[slot].count = 0;
+  step = index_step();
+  after_index = samples ? slot_erase : idle;
+  return true;
+}
+
+FlashLoopStore::Step FlashLoopStore::index_step() {
+  return index_page < FLASH_LOOP_INDEX_PAGES ? index_program : index_erase;
+}
+
+const mouse_loop_sample_t *FlashLoopStore::getLoop(uint8_t slot,
+                                                   uint32_t *count,
+                                                   uint32_t *duration_us) {
+  if (slot >= FLASH_LOOP_SLOT_COUNT) return nullptr;
+  if (step != idle && slot == job_slot) return nullptr;
+  if (index[slot].magic != FLASH_LOOP_MAGIC) return nullptr;
+  *count = index[slot].count;
+  *duration_us = index[slot].duration_us;
+  return (const mouse_loop_sample_t *)(XIP_BASE + slot_offset(slot));
+}
+
+void FlashLoopStore::task() {
+  switch (step) {
+    case idle:
+      break;
+
+    case index_erase:
+      // the full sector keeps the newest record until one lands in this one
+      index_sector = (index_sector + 1) % FLASH_LOOP_INDEX_SECTORS;
+      flash_erase_sector(index_page_offset(index_sector, 0));
+      index_page = 0;
+      step = index_program;
+      break;
+
+    case index_program: {
+      flash_loop_index_record_t record;
+      record.magic = FLASH_LOOP_INDEX_MAGIC;
+      record.sequence = ++index_sequence;
+      memcpy(record.entries, index, sizeof(index));
+      record.checksum = record_checksum(&record);
+      memset(page_buffer, 0xFF, FLASH_PAGE_SIZE);
+      memcpy(page_buffer, &record, sizeof(record));
+      flash_program_page(index_page_offset(index_sector, index_page),
+                         page_buffer);
+      index_page++;
+      step = after_index;
+      after_index = idle;
+      if (step == idle) log_line("loop slot %u updated", job_slot + 1);
+      break;
+    }
+
+    case slot_erase: {
+      uint32_t bytes = job_count * sizeof(mouse_loop_sample_t);
+      flash_erase_sector(slot_offset(job_slot) +
+                         (job_progress * FLASH_SECTOR_SIZE));
+      if (++job_progress >= size_in(bytes, FLASH_SECTOR_SIZE)) {
+        job_progress = 0;
+        step = slot_program;
+      }
+      break;
+    }
+
+    case slot_program: {
+      uint32_t bytes = job_count * sizeof(mouse_loop_sample_t);
+      uint32_t start = job_progress * FLASH_PAGE_SIZE;
+      uint32_t len = bytes - start;
+      if (len > FLASH_PAGE_SIZE) len = FLASH_PAGE_SIZE;
+      memset(page_buffer, 0xFF, FLASH_PAGE_SIZE);
+      memcpy(page_buffer, (const uint8_t *)job_samples + start, len);
+      flash_program_page(slot_offset(job_slot) + start, page_buffer);
+      if (++job_progress >= size_in(bytes, FLASH_PAGE_SIZE)) {
+        // samples are in place, now publish them in the index
+        index[job_slot].magic = FLASH_LOOP_MAGIC;
+        index[job_slot].count = job_count;
+        index[job_slot].duration_us = job_duration_us;
+        index[job_slot].reserved = 0;
+        step = index_step();
+        after_index = idle;
+      }
+      break;
+    }
+  }
+}
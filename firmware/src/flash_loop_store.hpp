@@ -0,0 +1,111 @@
+#include <stdint.h>
+
+#include "loop_store.hpp"
+
+#ifndef HA_FLASH_LOOP_STORE_H
+#define HA_FLASH_LOOP_STORE_H
+
+#define FLASH_LOOP_SLOT_COUNT 8
+// loops saved before sample times were in us had "LOOP" and read as empty
+#define FLASH_LOOP_MAGIC 0x554F4F4C  // "LOOU"
+// IMPORTANT!!! sets the flash layout, changing it will lose saved loops. The
+// looper's RAM buffer can be bigger, longer loops just can't be saved.
+#define FLASH_LOOP_SLOT_SAMPLES 4096
+// the index is rewritten into these in turn, see FlashLoopStore
+#define FLASH_LOOP_INDEX_SECTORS 2
+#define FLASH_LOOP_INDEX_MAGIC 0x5844494C  // "LIDX"
+
+// where the loop region starts, anything else kept in flash goes below it
+uint32_t flash_loop_region_offset();
+// One erase sector / program page, with core1 parked and interrupts off for
+// just that long. The page has to be in RAM. An erase stalls both USB stacks
+// for up to 400ms, so it's only done while nothing is going through them, see
+// isErasing().
+void flash_erase_sector(uint32_t offset);
+void flash_program_page(uint32_t offset, const uint8_t *page);
+
+typedef struct {
+  uint32_t magic;
+  uint32_t count;
+  uint32_t duration_us;
+  uint32_t reserved;
+} flash_loop_index_entry_t;
+
+// one page of an index sector
+typedef struct {
+  uint32_t magic;
+  // the newest record wins, wrap-safe
+  uint32_t sequence;
+  flash_loop_index_entry_t entries[FLASH_LOOP_SLOT_COUNT];
+  // of everything before it, so a page torn by a power loss reads as empty
+  uint32_t checksum;
+} flash_loop_index_record_t;
+
+// Stores loops in a reserved region at the very end of flash:
+//   [index sector 0][index sector 1][slot 0 sectors][slot 1 sectors]...
+// Each slot holds FLASH_LOOP_SLOT_SAMPLES samples and starts on an erase
+// sector boundary. Loops are played back straight out of XIP.
+//
+// Every change to the index is appended as a whole new record in the next
+// blank page of the current index sector, and the newest valid record is the
+// index. Only once a sector is full does the other one get erased and written
+// to, so there is always an intact record to fall back on, whenever the power
+// goes. Index sector 1 is where the index lived when it was a single page,
+// which is still read if neither sector has a record in it.
+//
+// Erasing and programming flash stalls XIP for both cores, so writes are
+// staged and performed one sector erase or page program per call to task(),
+// with core1 parked in RAM and interrupts disabled only for that one step.
+// Whoever calls task() holds it back while isErasing() and USB is in use.
+class FlashLoopStore : public ILoopStore {
+ private:
+  enum Step {
+    idle,
+    index_erase,
+    index_program,
+    slot_erase,
+    slot_program,
+  };
+  flash_loop_index_entry_t index[FLASH_LOOP_SLOT_COUNT];
+  uint32_t index_sequence = 0;
+  // where the next index record goes, index_page is past the end when the
+  // sector's full
+  uint8_t index_sector = 0;
+  uint8_t index_page = 0;
+  Step step = idle;
+  Step after_index = idle;
+  uint8_t job_slot = 0;
+  const mouse_loop_sample_t *job_samples = nullptr;
+  uint32_t job_count = 0;
+  uint32_t job_duration_us = 0;
+  uint32_t job_progress = 0;
+
+  bool begin_job(uint8_t slot, const mouse_loop_sample_t *samples,
+                 uint32_t count, uint32_t duration_us);
+  // how the next index record gets written
+  Step index_step();
+
+ public:
+  void initialize();
+  inline uint8_t getSlotCount() { return FLASH_LOOP_SLOT_COUNT; }
+  inline uint32_t getSlotCapacity() { return FLASH_LOOP_SLOT_SAMPLES; }
+  inline bool saveLoop(uint8_t slot, const mouse_loop_sample_t *samples,
+                       uint32_t count, uint32_t duration_us) {
+    if (samples == nullptr || count == 0) return false;
+    if (count > FLASH_LOOP_SLOT_SAMPLES) return false;
+    return begin_job(slot, samples, count, duration_us);
+  }
+  inline bool eraseLoop(uint8_t slot) {
+    return begin_job(slot, nullptr, 0, 0);
+  }
+  const mouse_loop_sample_t *getLoop(uint8_t slot, uint32_t *count,
+                                     uint32_t *duration_us);
+  inline bool isBusy() { return step != idle; }
+  // the next task() erases a sector
+  inline bool isErasing() {
+    return step == index_erase || step == slot_erase;
+  }
+  void task();
+};
+
+#endif
@@ -0,0 +1,120 @@
+#include "flash_script_store.hpp"
+
+#include <string.h>
+
+#include "flash_loop_store.hpp"
+#include "hardware/flash.h"
+#include "hardware/regs/addressmap.h"
+#include "util.h"
+
+#define FLASH_SCRIPT_SIZE (sizeof(flash_script_entry_t) + VM_MAX_IMAGE_SIZE)
+static_assert(FLASH_SCRIPT_SIZE <= FLASH_SECTOR_SIZE,
+              "a script must fit in one flash sector");
+
+static uint8_t page_buffer[FLASH_PAGE_SIZE];
+
+static inline uint32_t script_offset() {
+  return flash_loop_region_offset() - FLASH_SECTOR_SIZE;
+}
+
+static inline const flash_script_entry_t *stored_entry() {
+  return (const flash_script_entry_t *)(XIP_BASE + script_offset());
+}
+
+// Where the script was kept before the loop index took a second sector, that
+// sector is the bottom of the loop region now.
+static inline const flash_script_entry_t *legacy_entry() {
+  return (const flash_script_entry_t *)(XIP_BASE + flash_loop_region_offset());
+}
+
+static inline bool entry_valid(const flash_script_entry_t *entry) {
+  return entry->magic == FLASH_SCRIPT_MAGIC && entry->len <= VM_MAX_IMAGE_SIZE;
+}
+
+void FlashScriptStore::initialize() {
+  const flash_script_entry_t *entry = stored_entry();
+  stored = entry_valid(entry) && entry->len > 0;
+  if (stored) log_line("stored script: %lu bytes", (unsigned long)entry->len);
+  // once anything's been written here, even a clear, the old place is stale
+  const flash_script_entry_t *legacy = legacy_entry();
+  if (entry->magic == FLASH_SCRIPT_MAGIC || !entry_valid(legacy) ||
+      legacy->len == 0) {
+    return;
+  }
+  // written straight out of the old place, which is read until it's done
+  log_line("moving stored script: %lu bytes", (unsigned long)legacy->len);
+  saveScript((const uint8_t *)(legacy + 1), legacy->len);
+  migrating = true;
+}
+
+bool FlashScriptStore::saveScript(const uint8_t *image, uint32_t len) {
+  if (step != idle || len == 0 || len > VM_MAX_IMAGE_SIZE) return false;
+  job_image = image;
+  job_len = len;
+  job_pages = (sizeof(flash_script_entry_t) + len + FLASH_PAGE_SIZE - 1) /
+              FLASH_PAGE_SIZE;
+  stored = false;
+  step = erase;
+  return true;
+}
+
+// leaves an empty entry behind, so a script in the old place isn't moved back
+bool FlashScriptStore::eraseScript() {
+  if (step != idle) return false;
+  job_image = nullptr;
+  job_len = 0;
+  job_pages = 1;
+  stored = false;
+  step = erase;
+  return true;
+}
+
+const uint8_t *FlashScriptStore::getScript(uint32_t *len) {
+  if (migrating) {
+    *len = legacy_entry()->len;
+    return (const uint8_t *)(legacy_entry() + 1);
+  }
+  if (step != idle || !stored) return nullptr;
+  *len = stored_entry()->len;
+  return (const uint8_t *)(stored_entry() + 1);
+}
+
+void FlashScriptStore::task() {
+  switch (step) {
+    case idle:
+      break;
+
+    case erase:
+      flash_erase_sector(script_offset());
+      step = program;
+      break;
+
+    case program: {
+      // last page first, the one with the entry in it goes last
+      uint32_t page = --job_pages;
+      uint32_t start = page * FLASH_PAGE_SIZE;
+      memset(page_buffer, 0xFF, FLASH_PAGE_SIZE);
+      if (page == 0) {
+        flash_script_entry_t entry = {FLASH_SCRIPT_MAGIC, job_len, {0, 0}};
+        memcpy(page_buffer, &entry, sizeof(entry));
+      }
+      // the image bytes this page holds, the entry is in front of them
+      uint32_t header = sizeof(flash_script_entry_t);
+      uint32_t first = start > header ? start - header : 0;
+      uint32_t last = start + FLASH_PAGE_SIZE - header;
+      if (last > job_len) last = job_len;
+      if (first < last) {
+        memcpy(page_buffer + header + first - start, job_image + first,
+               last - first);
+      }
+      flash_program_page(script_offset() + start, page_buffer);
+      if (page == 0) {
+        stored = job_len > 0;
+        migrating = false;
+        step = idle;
+        log_line("script store updated");
+      }
+      break;
+    }
+  }
+}
@@ -0,0 +1,53 @@
+#include <stdint.h>
+
+#include "fx_vm.hpp"
+#include "script_store.hpp"
+
+#ifndef HA_FLASH_SCRIPT_STORE_H
+#define HA_FLASH_SCRIPT_STORE_H
+
+#define FLASH_SCRIPT_MAGIC 0x54504353  // "SCPT"
+
+// IMPORTANT!!! the on-flash layout, changing it will lose the saved script
+typedef struct {
+  uint32_t magic;
+  uint32_t len;
+  uint32_t reserved[2];
+} flash_script_entry_t;
+
+// Keeps the FX script in the one sector just below the loop region:
+//   [flash_script_entry_t][image]
+// Staged like FlashLoopStore, one erase or page program per call to task().
+// The page holding the entry goes last, so a power loss mid-write leaves no
+// script rather than half of one. A script saved before the loop region grew
+// a second index sector is found where that sector is now, and moved.
+class FlashScriptStore : public IScriptStore {
+ private:
+  enum Step {
+    idle,
+    erase,
+    program,
+  };
+  Step step = idle;
+  const uint8_t *job_image = nullptr;
+  uint32_t job_len = 0;
+  // pages left to program, counting down to the entry's
+  uint32_t job_pages = 0;
+  bool stored = false;
+  // the script is still being moved out of the loop region, see initialize()
+  bool migrating = false;
+
+ public:
+  void initialize();
+  bool saveScript(const uint8_t *image, uint32_t len);
+  bool eraseScript();
+  const uint8_t *getScript(uint32_t *len);
+  inline bool isBusy() { return step != idle; }
+  // the next task() erases the sector
+  inline bool isErasing() { return step == erase; }
+  // the loop store mustn't erase its index until this is false
+  inline bool isMigrating() { return migrating; }
+  void task();
+};
+
+#endif
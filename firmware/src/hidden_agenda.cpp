@@ -30,78 +30,117 @@
 
 #include <cmath>
 
+#include "boot_timeline.hpp"
 #include "bsp/board.h"
-#include "hardware/adc.h"
 #include "hardware/watchdog.h"
+#include "flash_loop_store.hpp"
+#include "flash_script_store.hpp"
+#include "fx_arena.hpp"
+#include "fx_script_loader.hpp"
 #include "i2c_persistence.hpp"
 #include "kbd_fx/kbd_fx_delay.hpp"
 #include "kbd_fx/kbd_fx_harmonizer.hpp"
+#include "kbd_fx/kbd_fx_looper.hpp"
 #include "kbd_fx/kbd_fx_passthrough.hpp"
+#include "kbd_fx/kbd_fx_script.hpp"
 #include "kbd_fx/kbd_fx_tremolo.hpp"
 #include "kbd_fx/kbd_fx_xover.hpp"
 #include "mouse_fx/mouse_fx_fuzz.hpp"
 #include "mouse_fx/mouse_fx_looper.hpp"
 #include "mouse_fx/mouse_fx_passthrough.hpp"
 #include "mouse_fx/mouse_fx_reverb.hpp"
+#include "mouse_fx/mouse_fx_script.hpp"
 #include "mouse_fx/mouse_fx_xover.hpp"
+#include "pedal_engine.hpp"
 #include "pico/multicore.h"
 #include "pico/stdlib.h"
 #include "pico/time.h"
+#include "pico_pedal_hal.hpp"
 #include "pio_usb.h"
+#include "profiler.hpp"
 #include "repl.hpp"
+#include "report_latch.hpp"
+#include "report_queue.hpp"
 #include "tud_hid_output.hpp"
 #include "tusb.h"
 #include "usb_descriptors.h"
 #include "util.h"
-#include "ws2812.pio.h"
 
 #define GENERIC_DESKTOP_USAGE_PAGE 0x01
 #define USAGE_MOUSE 0x02
 #define USAGE_KEYBOARD 0x06
+#define USAGE_SYSTEM_CONTROL 0x80
+#define CONSUMER_USAGE_PAGE 0x0C
+#define USAGE_CONSUMER_CONTROL 0x01
 
-#define MS_SINCE_BOOT to_ms_since_boot(get_absolute_time())
+#define US_SINCE_BOOT time_us_64()
 #define SOFT_BOOT_BTN_GPIO 0
-#define PIX_DATA_GPIO 29
-#define FOOT_SW_GPIO 28
-#define TOGGLE_1_GPIO 2
-#define TOGGLE_2_GPIO 1
-#define KNOB_ADC_GPIO 26
 
-#define PIX_PIO pio0
-#define PIX_PIO_SM 2
-
-#define MAX_FX 4
 #define MAX_REPORT 4
 
-#define SW_MODE_SET 0
-#define SW_MODE_MOM 1
-#define SW_MODE_LATCH 2
-
-#define ADC_DEAD_ZONE 0.015f
+#define WATCHDOG_TIMEOUT_MS 300
+// how long input has to have stopped before a flash erase may stall USB
+#define FLASH_ERASE_QUIET_MS 1000
+// gives the PIO USB clock a moment to settle before the host stack starts
+#define HOST_STACK_SETTLE_MS 10
 
 #define LOG_BUFFER_SIZE 1024
 #define NO_OFFICIAL_INSTANCE 0xFF
 
+// where a report FX don't handle gets forwarded to on the device side
+typedef struct {
+  uint8_t device_instance;
+  // 0 if there's nowhere to send it
+  uint8_t report_id;
+  // payload length the device side report expects
+  uint8_t len;
+} raw_route_t;
+
 static struct {
   uint8_t report_count;
   tuh_hid_report_info_t report_info[MAX_REPORT];
+  // resolved on mount, parallel to report_info
+  raw_route_t raw_routes[MAX_REPORT];
 } hid_info[CFG_TUH_HID];
 
+// what tuh_hid_mount_cb() works out on core1, host_report_task() copies it
+// into hid_info on core0
+typedef struct {
+  uint8_t itf_protocol;
+  uint8_t report_count;
+  tuh_hid_report_info_t report_info[MAX_REPORT];
+  raw_route_t raw_routes[MAX_REPORT];
+} host_mount_t;
+
 static void process_sidedoor_mouse_report(uint8_t buttons, int8_t x, int8_t y);
 
 I2cPersistence settings;
+FlashLoopStore loop_store;
+FlashScriptStore script_store;
 TinyHIDOutput hid_output(process_sidedoor_mouse_report);
 Repl repl(&settings, &hid_output);
+// only the active slot's FX holds its state, see fx_arena.hpp
+static StaticFxArena<fx_arena_size<MouseLooper::State, MouseReverb::State>()>
+    mouse_arena;
+static StaticFxArena<
+    fx_arena_size<KeyboardDelay::State, KeyboardLooper::State>()>
+    keyboard_arena;
 MouseFuzz mouse_fuzz(&hid_output);
-MouseLooper mouse_looper(&hid_output);
+MouseLooper mouse_looper(&hid_output, &mouse_arena);
 MousePassthrough mouse_passthrough(&hid_output);
-MouseReverb mouse_reverb(&hid_output);
+MouseReverb mouse_reverb(&hid_output, &mouse_arena);
 MouseXOver mouse_xover(&hid_output);
 KeyboardTremolo keyboard_tremolo(&hid_output);
 KeyboardXOver keyboard_xover(&hid_output);
 KeyboardPassthrough keyboard_passthrough(&hid_output);
-KeyboardDelay keyboard_delay(&hid_output);
+KeyboardDelay keyboard_delay(&hid_output, &keyboard_arena);
 KeyboardHarmonizer keyboard_harmonizer(&hid_output);
+// takes the delay's slot when turned on, see refresh_settings()
+KeyboardLooper keyboard_looper(&hid_output, &keyboard_arena);
+#define KEYBOARD_LOOPER_SLOT 1
+// take the place of a native FX while a script is installed
+MouseScript mouse_script(&hid_output);
+KeyboardScript keyboard_script(&hid_output);
 // LAST FX (at index MAX_FX) should always be passthrough! This is what gets run
 // when pedal is "off"
 static IMouseFx* mouse_fx[] = {&mouse_reverb, &mouse_looper, &mouse_fuzz,
@@ -109,10 +148,26 @@ static IMouseFx* mouse_fx[] = {&mouse_reverb, &mouse_looper, &mouse_fuzz,
 static IKeyboardFx* keyboard_fx[] = {&keyboard_tremolo, &keyboard_delay,
                                      &keyboard_harmonizer, &keyboard_xover,
                                      &keyboard_passthrough};
-static uint8_t active_device_type = HID_ITF_PROTOCOL_KEYBOARD;
-static bool fx_enabled = false;
-static uint8_t active_sw_mode = SW_MODE_SET;
-static bool use_increased_dead_zone = 0;
+PicoClock pedal_clock;
+PicoGpio pedal_gpio;
+PicoAdc pedal_adc;
+PicoPixel pedal_pixel;
+PedalEngine engine(&settings, mouse_fx, keyboard_fx, &pedal_clock, &pedal_gpio,
+                   &pedal_adc, &pedal_pixel);
+ScriptLoader script_loader(&engine, &script_store, &mouse_script,
+                           &keyboard_script);
+BootTimeline boot_timeline;
+// reports from the host callback (core1) to the main loop (core0)
+static ReportQueue<REPORT_QUEUE_SIZE> host_reports;
+// media keys etc. waiting for their endpoint, see raw_report_task()
+static ReportLatch raw_reports;
+static_assert(REPORT_ID_COUNT <= REPORT_LATCH_IDS,
+              "every device report id needs a latch");
+// per HID instance, counted as they come in on core1
+static volatile uint32_t host_report_counts[CFG_TUH_HID];
+static ReportRate host_report_rates[CFG_TUH_HID];
+// when host_report_task() last had anything, ms
+static uint32_t last_input_ms = 0;
 
 static char log_buffer[LOG_BUFFER_SIZE];
 static size_t log_write_head = 0;
@@ -120,12 +175,17 @@ static size_t log_read_head = 0;
 
 static char cdc_read_buffer[LOG_BUFFER_SIZE];
 static size_t cdc_read_head = 0;
-static ha_mouse_report_t pending_mouse_report;
-static bool mouse_report_ready = false;
 
 static uint8_t official_mouse_instance = NO_OFFICIAL_INSTANCE;
 static uint8_t official_kb_instance = NO_OFFICIAL_INSTANCE;
 
+#ifdef HA_PROFILE
+Profiler profiler;
+// next line of a dump in progress, see profile_task()
+static size_t profile_dump_line = 0;
+static bool profile_dump_pending = false;
+#endif
+
 void log_line(const char* format, ...) {
   // shouldn't happen, but throw it away to be safe
   if (log_write_head >= (LOG_BUFFER_SIZE - 255)) {
@@ -144,6 +204,7 @@ void log_line(const char* format, ...) {
 }
 
 void flush_log() {
+  HA_PROFILE_SCOPE(PROFILE_FLUSH_LOG);
   if (log_write_head) {
     size_t len = strlen(log_buffer + log_read_head);
     if (len > 0) {
@@ -158,6 +219,7 @@ void flush_log() {
 }
 
 void process_cdc_input() {
+  HA_PROFILE_SCOPE(PROFILE_CDC_INPUT);
   if (cdc_read_head) {
     if (cdc_read_buffer[cdc_read_head - 1] == '\r') {
       cdc_read_buffer[cdc_read_head - 1] = 0;
@@ -168,198 +230,252 @@ void process_cdc_input() {
   }
 }
 
-void on_fx_param_tweaked(float percentage) {
-  uint8_t active_slot = settings.getActiveFxSlot();
-  mouse_fx[active_slot]->update_parameter(percentage);
-  keyboard_fx[active_slot]->update_parameter(percentage);
+void init_soft_boot() {
+  gpio_init(SOFT_BOOT_BTN_GPIO);
+  gpio_set_dir(SOFT_BOOT_BTN_GPIO, GPIO_IN);
+  gpio_pull_up(SOFT_BOOT_BTN_GPIO);
+  gpio_set_irq_enabled_with_callback(SOFT_BOOT_BTN_GPIO, GPIO_IRQ_EDGE_FALL,
+                                     true, &reboot_to_uf2);
 }
 
-inline float read_pot() {
-  // expand range so we'll def get 0 and 1 on the ends
-  float adc = ((((float)adc_read() / 4096.0f) * 1.03f) - 0.015);
-  // clamp to range 0..1
-  adc = adc < 0.0f ? 0.0f : (adc > 1.0f ? 1.0f : adc);
-  return adc;
+// failed loop commands flash the LED, the pedal may not be near a terminal
+static bool flash_on_failure(bool ok) {
+  if (!ok) engine.flash_error();
+  return ok;
 }
 
-void update_from_pot() {
-  static float previous_adc_reading = read_pot();
-  float adc = read_pot();
-  float delta = previous_adc_reading - adc;
-  float dead_zone = use_increased_dead_zone ? ADC_DEAD_ZONE * 4 : ADC_DEAD_ZONE;
-  // is there a less terrible way to write this? perhaps.
-  if (!(adc == 1.0f && previous_adc_reading != 1.0f) &&
-      !(adc == 0.0f && previous_adc_reading != 0.0f) && delta < dead_zone &&
-      delta > -dead_zone) {
-    return;
-  }
-  use_increased_dead_zone = 0;
-  previous_adc_reading = adc;
-  if (active_sw_mode != SW_MODE_SET) {
-    on_fx_param_tweaked(adc);
-  } else {
-    uint8_t slot = adc * MAX_FX;
-    if (slot == MAX_FX) slot--;
-    uint8_t active_fx_slot = settings.getActiveFxSlot();
-    if (slot != active_fx_slot) {
-      log_line("fx slot: %u", slot);
-      uint32_t time_ms = MS_SINCE_BOOT;
-      mouse_fx[active_fx_slot]->deinit();
-      mouse_fx[slot]->initialize(time_ms, adc);
-      keyboard_fx[active_fx_slot]->deinit();
-      keyboard_fx[slot]->initialize(time_ms, adc);
-      settings.setActiveFxSlot(slot);
-    }
-  }
+bool save_mouse_loop(uint8_t slot) {
+  return flash_on_failure(mouse_looper.save_loop(slot));
 }
 
-void read_foot_switch() {
-  static bool previous_foot_sw_value = 0;
-  bool current_val = gpio_get(FOOT_SW_GPIO);
-  current_val = settings.shouldInvertFootswitch() ? !current_val : current_val;
-  if (current_val == previous_foot_sw_value) {
-    return;
-  }
-  log_line("foot switch: %u", (uint8_t)current_val);
-  previous_foot_sw_value = current_val;
-  if (active_sw_mode == SW_MODE_LATCH && current_val) {
-    fx_enabled = !fx_enabled;
-  } else if (active_sw_mode == SW_MODE_MOM) {
-    fx_enabled = current_val;
-  }
+bool recall_mouse_loop(uint8_t slot) {
+  return flash_on_failure(mouse_looper.recall_loop(slot));
 }
 
-void read_toggle_switch() {
-  uint8_t current_val = (gpio_get(TOGGLE_1_GPIO) ? 0 : 0b01) |
-                        (gpio_get(TOGGLE_2_GPIO) ? 0 : 0b10);
-  if (current_val == active_sw_mode) {
-    return;
-  }
-  active_sw_mode = current_val;
-  log_line("toggle switch: %u", current_val);
-  // if we're switching modes, disable the fx and make the knob less sensitive
-  fx_enabled = false;
-  use_increased_dead_zone = 1;
+bool clear_mouse_loop(uint8_t slot) {
+  return flash_on_failure(mouse_looper.clear_loop(slot));
 }
 
-void init_soft_boot() {
-  gpio_init(SOFT_BOOT_BTN_GPIO);
-  gpio_set_dir(SOFT_BOOT_BTN_GPIO, GPIO_IN);
-  gpio_pull_up(SOFT_BOOT_BTN_GPIO);
-  gpio_set_irq_enabled_with_callback(SOFT_BOOT_BTN_GPIO, GPIO_IRQ_EDGE_FALL,
-                                     true, &reboot_to_uf2);
+void begin_fx_script() { script_loader.begin(); }
+
+bool add_fx_script_data(const char* hex) {
+  return flash_on_failure(script_loader.append_hex(hex));
 }
 
-void init_pix() {
-  uint offset = pio_add_program(PIX_PIO, &ws2812_program);
+bool end_fx_script() { return flash_on_failure(script_loader.finish()); }
 
-  ws2812_program_init(PIX_PIO, PIX_PIO_SM, offset, PIX_DATA_GPIO, 800000,
-                      false);
+bool clear_fx_script() { return flash_on_failure(script_loader.clear()); }
+
+bool dump_profile() {
+#ifdef HA_PROFILE
+  profile_dump_line = 0;
+  profile_dump_pending = true;
+  return true;
+#else
+  return false;
+#endif
 }
 
-void init_io() {
-  gpio_init(TOGGLE_1_GPIO);
-  gpio_set_dir(TOGGLE_1_GPIO, GPIO_IN);
-  gpio_pull_up(TOGGLE_1_GPIO);
+bool reset_profile() {
+#ifdef HA_PROFILE
+  profiler.reset();
+  return true;
+#else
+  return false;
+#endif
+}
 
-  gpio_init(TOGGLE_2_GPIO);
-  gpio_set_dir(TOGGLE_2_GPIO, GPIO_IN);
-  gpio_pull_up(TOGGLE_2_GPIO);
+// what every FX costs, in the same order as the fx arrays
+static const struct {
+  const char* name;
+  size_t object_size;
+  IFx* fx;
+} fx_footprints[] = {
+    {"reverb", sizeof(mouse_reverb), &mouse_reverb},
+    {"looper", sizeof(mouse_looper), &mouse_looper},
+    {"fuzz", sizeof(mouse_fuzz), &mouse_fuzz},
+    {"m xover", sizeof(mouse_xover), &mouse_xover},
+    {"m passthru", sizeof(mouse_passthrough), &mouse_passthrough},
+    {"tremolo", sizeof(keyboard_tremolo), &keyboard_tremolo},
+    {"delay", sizeof(keyboard_delay), &keyboard_delay},
+    {"harmonizer", sizeof(keyboard_harmonizer), &keyboard_harmonizer},
+    {"k xover", sizeof(keyboard_xover), &keyboard_xover},
+    {"k passthru", sizeof(keyboard_passthrough), &keyboard_passthrough},
+    {"k looper", sizeof(keyboard_looper), &keyboard_looper},
+    {"m script", sizeof(mouse_script), &mouse_script},
+    {"k script", sizeof(keyboard_script), &keyboard_script},
+};
+
+void dump_memory() {
+  log_line("fx: bytes, + state while active");
+  for (auto const& f : fx_footprints) {
+    log_line("%s: %u, +%u", f.name, (unsigned)f.object_size,
+             (unsigned)f.fx->get_state_size());
+  }
+  log_line("mouse arena: %u used, %u peak, %u total",
+           (unsigned)mouse_arena.get_used(),
+           (unsigned)mouse_arena.get_high_water(),
+           (unsigned)mouse_arena.get_capacity());
+  log_line("keyboard arena: %u used, %u peak, %u total",
+           (unsigned)keyboard_arena.get_used(),
+           (unsigned)keyboard_arena.get_high_water(),
+           (unsigned)keyboard_arena.get_capacity());
+}
 
-  gpio_init(FOOT_SW_GPIO);
-  gpio_set_dir(FOOT_SW_GPIO, GPIO_IN);
-  gpio_pull_up(FOOT_SW_GPIO);
+// A full dump doesn't fit the log buffer, so it goes out a line at a time,
+// whenever the previous log lines have been flushed.
+void profile_task() {
+#ifdef HA_PROFILE
+  static char line_buf[128];
+  if (!profile_dump_pending || log_write_head != 0) return;
+  profile_dump_pending =
+      profiler.format_line(&profile_dump_line, WATCHDOG_TIMEOUT_MS * 1000,
+                           line_buf, sizeof(line_buf));
+  if (profile_dump_pending) log_line("%s", line_buf);
+#endif
+}
 
-  adc_init();
-  adc_gpio_init(KNOB_ADC_GPIO);
-  adc_select_input(0);
+void refresh_settings() {
+  settings.initialize();
+  for (size_t i = 0; i < MAX_FX; i++) {
+    uint32_t color = settings.getLedColor(i);
+    mouse_fx[i]->set_indicator_color(color);
+    keyboard_fx[i]->set_indicator_color(color);
+  }
+  keyboard_delay.set_spacing_curve(settings.getDelayCurve());
+  keyboard_delay.set_repeats(settings.getDelayRepeats());
+  mouse_looper.set_tempo_sync(settings.isLoopSyncEnabled());
+  mouse_reverb.set_pre_delay_ms(settings.getReverbPreDelayMs());
+  // only swaps one for the other, a script in the slot stays put and gives
+  // back the right one once it's cleared
+  bool looper = settings.isKeyboardLooperEnabled();
+  IKeyboardFx* from = looper ? (IKeyboardFx*)&keyboard_delay : &keyboard_looper;
+  IKeyboardFx* to = looper ? (IKeyboardFx*)&keyboard_looper : &keyboard_delay;
+  if (keyboard_fx[KEYBOARD_LOOPER_SLOT] == from) {
+    engine.replace_keyboard_fx(KEYBOARD_LOOPER_SLOT, to);
+  } else {
+    script_loader.swap_replaced_keyboard_fx(from, to);
+  }
+  engine.refresh_settings();
+  hid_output.set_nkro_enabled(settings.isNkroEnabled());
 }
 
-static inline void set_pixel(uint32_t pixel_grb) {
-  pio_sm_put_blocking(PIX_PIO, PIX_PIO_SM, pixel_grb << 8u);
+void dump_host_rate() {
+  for (size_t i = 0; i < CFG_TUH_HID; i++) {
+    if (host_report_rates[i].get_peak() == 0) continue;
+    log_line("HID%u: %lu reports/s, %lu peak", (unsigned)i,
+             (unsigned long)host_report_rates[i].get_rate(),
+             (unsigned long)host_report_rates[i].get_peak());
+  }
+  log_line("dropped: %lu", (unsigned long)host_reports.get_dropped());
 }
 
-void led_task(uint32_t time_ms) {
-  static uint32_t frame_of_last_pix_update = 0;
-  uint32_t frame = time_ms / 30;
-  if (frame == frame_of_last_pix_update) {
-    return;
+static void host_rate_task(uint32_t time_ms) {
+  for (size_t i = 0; i < CFG_TUH_HID; i++) {
+    host_report_rates[i].task(host_report_counts[i], time_ms);
   }
-  frame_of_last_pix_update = frame;
-  uint32_t color = 0;
-  uint8_t active_fx_slot = settings.getActiveFxSlot();
-  if (active_sw_mode == SW_MODE_SET) {
-    // blink if flashing is enabled
-    if (frame % 20 > 10 && settings.isFlashingEnabled()) {
-      color = 0;
-    } else if (active_device_type == HID_ITF_PROTOCOL_KEYBOARD) {
-      color = keyboard_fx[active_fx_slot]->get_indicator_color();
-    } else {
-      color = mouse_fx[active_fx_slot]->get_indicator_color();
-    }
-  } else if (fx_enabled) {
-    IFx* fx = mouse_fx[active_fx_slot];
-    if (active_device_type == HID_ITF_PROTOCOL_KEYBOARD) {
-      fx = keyboard_fx[active_fx_slot];
-    }
-    if (settings.isFlashingEnabled()) {
-      color = fx->get_current_pixel_value(time_ms);
+}
+
+static void process_host_report(uint8_t dev_addr, uint8_t instance,
+                                uint8_t const* report, uint16_t len,
+                                fx_time_t time_us);
+static void apply_host_mount(queued_report_t const* r);
+static void apply_host_unmount(queued_report_t const* r);
+
+// hands over what came in since the last loop, oldest first
+static void host_report_task() {
+  HA_PROFILE_SCOPE(PROFILE_HOST_REPORTS);
+  queued_report_t const* r;
+  while ((r = host_reports.peek()) != nullptr) {
+    if (r->type == QUEUED_MOUNT) {
+      apply_host_mount(r);
+    } else if (r->type == QUEUED_UNMOUNT) {
+      apply_host_unmount(r);
     } else {
-      color = fx->get_indicator_color();
+      process_host_report(r->dev_addr, r->instance, r->data, r->len,
+                          r->time_us);
     }
+    host_reports.pop();
+    last_input_ms = time_us_32() / 1000;
   }
-  set_pixel(color_at_brightness(color, settings.getLedBrightness()));
 }
 
-void io_task(uint32_t time_ms) {
-  static uint32_t frame_of_last_io_update = 0;
-  uint32_t frame = time_ms / 20;
-  if (frame == frame_of_last_io_update) {
-    return;
+// Page programs take a few ms and go ahead right away. An erase parks core1
+// with interrupts off for up to 400ms, stalling both USB stacks, so it waits
+// until the pedal's off and nothing has come in for a while. Stored loops
+// and scripts stay staged until then.
+static void flash_store_task() {
+  static bool waiting = false;
+  bool quiet = !engine.is_fx_enabled() &&
+               (time_us_32() / 1000) - last_input_ms >= FLASH_ERASE_QUIET_MS;
+  bool erasing = loop_store.isErasing() || script_store.isErasing();
+  if (erasing && !quiet) {
+    if (!waiting) log_line("flash write waits for the pedal to be off and idle");
+    waiting = true;
+  } else {
+    waiting = false;
   }
-  frame_of_last_io_update = frame;
-  read_toggle_switch();
-  read_foot_switch();
-  update_from_pot();
+  // an old script is moved out of the loop index before that can be erased
+  bool loop_erase_ok = quiet && !script_store.isMigrating();
+  if (loop_erase_ok || !loop_store.isErasing()) loop_store.task();
+  if (quiet || !script_store.isErasing()) script_store.task();
 }
 
-void fx_task(uint32_t time_ms) {
-  if (fx_enabled) {
-    uint8_t active_slot = settings.getActiveFxSlot();
-    mouse_fx[active_slot]->tick(time_ms);
-    keyboard_fx[active_slot]->tick(time_ms);
-  }
+// Forwarded reports go out after everything else in the loop, so one sharing
+// the keyboard endpoint never takes it from a keyboard report. While an
+// endpoint's busy they wait in order, one goes out per id each time it's free.
+static void raw_report_task() {
+  raw_reports.flush(
+      [](uint8_t instance) { return tud_hid_n_ready(instance); },
+      [](uint8_t instance, uint8_t id, uint8_t const* payload, uint16_t len) {
+        return hid_output.forward_report(instance, id, payload, len);
+      });
 }
 
-void mouse_task(uint32_t time_ms) {
-  static uint32_t last_report = 0;
-  static uint8_t cached_speed_level = 0xFF;
-  static float cached_speed = 1.0f;
-  if (time_ms - last_report < 6 || !mouse_report_ready) return;
-  ha_mouse_report_t* r = &pending_mouse_report;
-  mouse_report_ready = false;
-  last_report = time_ms;
-  if (cached_speed_level != settings.getMouseSpeedLevel()) {
-    cached_speed_level = settings.getMouseSpeedLevel();
-    cached_speed = (cached_speed_level * 0.25f) + 0.5f;
+void dump_boot_timeline() {
+  char line_buf[64];
+  size_t line = 0;
+  while (boot_timeline.format_line(&line, line_buf, sizeof(line_buf))) {
+    log_line("%s", line_buf);
   }
-  uint8_t slot = fx_enabled ? settings.getActiveFxSlot() : MAX_FX;
-  r->x = (int8_t)roundf((float)r->x * cached_speed);
-  r->y = (int8_t)roundf((float)r->y * cached_speed);
-  mouse_fx[slot]->process_mouse_report(r, time_ms);
 }
 
-void refresh_settings() {
-  settings.initialize();
-  for (size_t i = 0; i < MAX_FX; i++) {
-    uint32_t color = settings.getLedColor(i);
-    mouse_fx[i]->set_indicator_color(color);
-    keyboard_fx[i]->set_indicator_color(color);
+// The rest of the pedal comes up one step per main loop, after both USB stacks
+// are running. Until the engine is initialized, reports go through in
+// passthrough, so a replug or watchdog reset doesn't hold up input while the
+// EEPROM is read. Returns false once everything is up.
+static bool boot_task() {
+  static uint8_t step = 0;
+  switch (step++) {
+    case 0:
+      init_random();
+      return true;
+    case 1:
+      refresh_settings();
+      boot_timeline.mark(BOOT_SETTINGS, time_us_32());
+      return true;
+    case 2:
+      loop_store.initialize();
+      mouse_looper.set_loop_store(&loop_store);
+      return true;
+    case 3:
+      // before the engine starts the saved slot, which may be the script's
+      script_loader.initialize();
+      return true;
+    case 4:
+      engine.initialize();
+      boot_timeline.mark(BOOT_FX_READY, time_us_32());
+      return false;
+    default:
+      return false;
   }
 }
 
 void core1_main() {
-  sleep_ms(150);
+  // lets core0 park this core in RAM while it writes to flash
+  multicore_lockout_victim_init();
+  HA_PROFILE_INIT_CORE();
+  sleep_ms(HOST_STACK_SETTLE_MS);
 
   // Use tuh_configure() to pass pio configuration to the host stack
   // Note: tuh_configure() must be called before
@@ -370,6 +486,7 @@ void core1_main() {
   // To run USB SOF interrupt in core1, init host stack for pio_usb (roothub
   // port1) on core1
   tuh_init(1);
+  boot_timeline.mark(BOOT_HOST_STACK, time_us_32());
 
   while (true) {
     tuh_task();  // tinyusb host task
@@ -382,32 +499,40 @@ int main(void) {
   set_sys_clock_khz(120000, true);
 
   init_soft_boot();
-  watchdog_enable(300, 1);
+  watchdog_enable(WATCHDOG_TIMEOUT_MS, 1);
   multicore_reset_core1();
   // all USB task run in core1
   multicore_launch_core1(core1_main);
 
   tud_init(BOARD_TUD_RHPORT);
-  init_pix();
-  init_io();
-  refresh_settings();
-
-  float param_value = read_pot();
-  uint32_t now = MS_SINCE_BOOT;
-  uint8_t active_slot = settings.getActiveFxSlot();
-  mouse_fx[active_slot]->initialize(now, param_value);
-  keyboard_fx[active_slot]->initialize(now, param_value);
+  boot_timeline.mark(BOOT_DEVICE_STACK, time_us_32());
+  hid_output.set_boot_timeline(&boot_timeline);
+  HA_PROFILE_INIT_CORE();
+  pedal_pixel.initialize();
+  pedal_gpio.initialize();
+  pedal_adc.initialize();
+  bool booting = true;
 
   while (1) {
-    uint32_t time_ms = MS_SINCE_BOOT;
-    led_task(time_ms);
-    io_task(time_ms);
-    fx_task(time_ms);
-    mouse_task(time_ms);
+    HA_PROFILE_LOOP_START();
+    if (booting) booting = boot_task();
+    host_report_task();
+    engine.task(US_SINCE_BOOT);
+    raw_report_task();
+    host_rate_task(time_us_32() / 1000);
     flush_log();
-    tud_task();  // tinyusb device task
+    {
+      HA_PROFILE_SCOPE(PROFILE_LOOP_STORE_TASK);
+      flash_store_task();
+    }
+    {
+      HA_PROFILE_SCOPE(PROFILE_TUD_TASK);
+      tud_task();  // tinyusb device task
+    }
     process_cdc_input();
+    profile_task();
     watchdog_update();
+    HA_PROFILE_LOOP_END();
   }
 
   return 0;
@@ -417,44 +542,82 @@ int main(void) {
 // Host HID
 //--------------------------------------------------------------------+
 
+// Reports are forwarded byte for byte, so only ones laid out like the device
+// side's can go. The report descriptor is never parsed past usage page/usage,
+// so length is the only sanity check:
+//  - consumer control as a single 16 bit usage, what most keyboards' media
+//    keys send. Bitmap layouts (1 bit per key) don't match and are dropped.
+//  - system control (power, sleep, wake) in one byte.
+// Gamepads aren't forwarded, real pads' reports rarely match TinyUSB's
+// gamepad layout and would need translating from the descriptor.
+static raw_route_t resolve_raw_route(tuh_hid_report_info_t const& info) {
+  if (info.usage_page == CONSUMER_USAGE_PAGE &&
+      info.usage == USAGE_CONSUMER_CONTROL) {
+    // TUD_HID_REPORT_DESC_CONSUMER
+    return {HID_INSTANCE_KEYBOARD, REPORT_ID_CONSUMER_CONTROL, 2};
+  } else if (info.usage_page == GENERIC_DESKTOP_USAGE_PAGE &&
+             info.usage == USAGE_SYSTEM_CONTROL) {
+    return {HID_INSTANCE_KEYBOARD, REPORT_ID_SYSTEM_CONTROL, 1};
+  }
+  return {0, 0, 0};
+}
+
+// Latches reports that no FX handle (media keys, etc.) for the matching
+// device report, raw_report_task() sends them. Runs whether or not FX are
+// engaged.
+static void forward_raw_report(uint8_t instance, uint8_t const* report,
+                               uint16_t len) {
+  uint8_t count = hid_info[instance].report_count;
+  if (count == 0) return;
+  // either every report on an interface has an id prefix, or none do
+  uint8_t id = 0;
+  if (hid_info[instance].report_info[0].report_id != 0) {
+    if (len == 0) return;
+    id = report[0];
+    report++;
+    len--;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (hid_info[instance].report_info[i].report_id != id) continue;
+    raw_route_t route = hid_info[instance].raw_routes[i];
+    if (route.report_id != 0 && route.len == len) {
+      raw_reports.latch(route.device_instance, route.report_id, report, len);
+    }
+    return;
+  }
+}
+
 // Invoked when device with hid interface is mounted
 // Report descriptor is also available for use.
 // tuh_hid_parse_report_descriptor() can be used to parse common/simple enough
 // descriptor. Note: if report descriptor length > CFG_TUH_ENUMERATION_BUFSIZE,
 // it will be skipped therefore report_desc = NULL, desc_len = 0
+// Runs on core1 with the host stack, so it only parses the descriptor and
+// queues the result, apply_host_mount() takes it from there on core0.
 void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance,
                       uint8_t const* desc_report, uint16_t desc_len) {
   // Interface protocol (hid_interface_protocol_enum_t)
   const char* protocol_str[] = {"None", "Keyboard", "Mouse"};
-  uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
-
-  hid_info[instance].report_count = tuh_hid_parse_report_descriptor(
-      hid_info[instance].report_info, MAX_REPORT, desc_report, desc_len);
-  log_line("%u reports", hid_info[instance].report_count);
-  for (size_t i = 0; i < hid_info[instance].report_count; i++) {
-    tuh_hid_report_info_t r = hid_info[instance].report_info[i];
-    log_line("id: %u, page: %u, usage: %u", r.report_id, r.usage_page, r.usage);
+  host_mount_t mount;
+  mount.itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
+  mount.report_count = tuh_hid_parse_report_descriptor(
+      mount.report_info, MAX_REPORT, desc_report, desc_len);
+  for (size_t i = 0; i < mount.report_count; i++) {
+    mount.raw_routes[i] = resolve_raw_route(mount.report_info[i]);
   }
 
   uint16_t vid, pid;
   tuh_vid_pid_get(dev_addr, &vid, &pid);
   log_line("[%04x:%04x][%u] HID%u, proto=%s", vid, pid, dev_addr, instance,
-           protocol_str[itf_protocol]);
+           protocol_str[mount.itf_protocol]);
 
-  // Receive report from boot keyboard & mouse only
-  // tuh_hid_report_received_cb() will be invoked when report is available
-  if (itf_protocol == HID_ITF_PROTOCOL_KEYBOARD ||
-      itf_protocol == HID_ITF_PROTOCOL_MOUSE) {
-    active_device_type = itf_protocol;
-    if (itf_protocol == HID_ITF_PROTOCOL_KEYBOARD) {
-      official_kb_instance = instance;
-      log_line("using instance %u for keyboard.", instance);
-    } else if (itf_protocol == HID_ITF_PROTOCOL_MOUSE) {
-      official_mouse_instance = instance;
-      log_line("using instance %u for mouse.", instance);
-    }
+  // ahead of the device's first report
+  if (!host_reports.push(dev_addr, instance, (uint8_t const*)&mount,
+                         sizeof(mount), US_SINCE_BOOT, QUEUED_MOUNT)) {
+    log_line("Error: HID%u mount dropped", instance);
   }
 
+  // tuh_hid_report_received_cb() will be invoked when report is available
   if (!tuh_hid_receive_report(dev_addr, instance)) {
     log_line("Error: cannot request report");
   }
@@ -462,46 +625,74 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance,
 
 // Invoked when device with hid interface is un-mounted
 void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance) {
-  if (official_kb_instance == instance)
+  uint8_t none = 0;
+  if (!host_reports.push(dev_addr, instance, &none, 0, US_SINCE_BOOT,
+                         QUEUED_UNMOUNT)) {
+    log_line("Error: HID%u unmount dropped", instance);
+  }
+  log_line("[%u] HID%u unmounted", dev_addr, instance);
+}
+
+static void apply_host_mount(queued_report_t const* r) {
+  static_assert(sizeof(host_mount_t) <= REPORT_QUEUE_MAX_LEN,
+                "a mount has to fit in a queued report");
+  uint8_t instance = r->instance;
+  if (instance >= CFG_TUH_HID) return;
+  host_mount_t mount;
+  memcpy(&mount, r->data, sizeof(mount));
+  hid_info[instance].report_count = mount.report_count;
+  memcpy(hid_info[instance].report_info, mount.report_info,
+         sizeof(mount.report_info));
+  memcpy(hid_info[instance].raw_routes, mount.raw_routes,
+         sizeof(mount.raw_routes));
+  log_line("%u reports", mount.report_count);
+  for (size_t i = 0; i < mount.report_count; i++) {
+    tuh_hid_report_info_t info = mount.report_info[i];
+    log_line("id: %u, page: %u, usage: %u", info.report_id, info.usage_page,
+             info.usage);
+  }
+
+  // Receive report from boot keyboard & mouse only
+  if (mount.itf_protocol == HID_ITF_PROTOCOL_KEYBOARD ||
+      mount.itf_protocol == HID_ITF_PROTOCOL_MOUSE) {
+    boot_timeline.mark(BOOT_HOST_MOUNT, (uint32_t)r->time_us);
+    engine.set_active_device(mount.itf_protocol == HID_ITF_PROTOCOL_KEYBOARD
+                                 ? PEDAL_DEVICE_KEYBOARD
+                                 : PEDAL_DEVICE_MOUSE);
+    if (mount.itf_protocol == HID_ITF_PROTOCOL_KEYBOARD) {
+      official_kb_instance = instance;
+      log_line("using instance %u for keyboard.", instance);
+    } else if (mount.itf_protocol == HID_ITF_PROTOCOL_MOUSE) {
+      official_mouse_instance = instance;
+      log_line("using instance %u for mouse.", instance);
+    }
+  }
+}
+
+static void apply_host_unmount(queued_report_t const* r) {
+  if (official_kb_instance == r->instance)
     official_kb_instance = NO_OFFICIAL_INSTANCE;
-  if (official_mouse_instance == instance)
+  if (official_mouse_instance == r->instance)
     official_mouse_instance = NO_OFFICIAL_INSTANCE;
-  log_line("[%u] HID%u unmounted", dev_addr, instance);
 }
 
 static void process_kbd_report(uint8_t instance,
                                hid_keyboard_report_t const* report,
-                               uint32_t time_ms) {
+                               fx_time_t time_us) {
   if (official_kb_instance != NO_OFFICIAL_INSTANCE &&
       instance != official_kb_instance)
     return;
-  active_device_type = HID_ITF_PROTOCOL_KEYBOARD;
-  uint8_t slot = fx_enabled ? settings.getActiveFxSlot() : MAX_FX;
-  keyboard_fx[slot]->process_keyboard_report((ha_keyboard_report_t*)report,
-                                             time_ms);
+  engine.on_keyboard_report((ha_keyboard_report_t const*)report, time_us);
 }
 
-// send mouse report to usb device CDC
 static void process_mouse_report(uint8_t instance,
                                  hid_mouse_report_t const* report,
-                                 uint32_t time_ms) {
-  (void)time_ms;
+                                 fx_time_t time_us) {
+  (void)time_us;
   if (official_mouse_instance != NO_OFFICIAL_INSTANCE &&
       instance != official_mouse_instance)
     return;
-  // buffer mouse updates to make sure they all get processed at a similar
-  // sample rate
-  active_device_type = HID_ITF_PROTOCOL_MOUSE;
-  if (!mouse_report_ready) {
-    pending_mouse_report.x = 0;
-    pending_mouse_report.y = 0;
-  }
-  pending_mouse_report.x += report->x;
-  pending_mouse_report.y += report->y;
-  pending_mouse_report.buttons = report->buttons;
-  pending_mouse_report.pan = report->pan;
-  pending_mouse_report.wheel = report->wheel;
-  mouse_report_ready = true;
+  engine.on_mouse_report((ha_mouse_report_t const*)report);
 }
 
 inline uint8_t get_protocol_by_report_id(uint8_t id, uint8_t instance) {
@@ -517,27 +708,43 @@ inline uint8_t get_protocol_by_report_id(uint8_t id, uint8_t instance) {
           return HID_ITF_PROTOCOL_KEYBOARD;
         }
       }
-      // TODO handle other usage pages, Consumer Control, etc.
       break;
     }
   }
   return HID_ITF_PROTOCOL_NONE;
 }
 
+// Copies the report out of the host stack's buffer and asks the device for the
+// next one straight away, the main loop processes it. That way a 1 kHz mouse
+// gets polled at 1 kHz however long the active FX takes.
 void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance,
                                 uint8_t const* report, uint16_t len) {
+  HA_PROFILE_SCOPE(PROFILE_HOST_RECEIVE);
+  fx_time_t time_us = US_SINCE_BOOT;
+  boot_timeline.mark(BOOT_FIRST_REPORT, (uint32_t)time_us);
+  if (instance < CFG_TUH_HID) host_report_counts[instance]++;
+  host_reports.push(dev_addr, instance, report, len, time_us);
+
+  // continue to request to receive report
+  if (!tuh_hid_receive_report(dev_addr, instance)) {
+    log_line("Error: cannot request report");
+  }
+}
+
+static void process_host_report(uint8_t dev_addr, uint8_t instance,
+                                uint8_t const* report, uint16_t len,
+                                fx_time_t time_us) {
   static char hid_log_buff[128];
-  static uint32_t last_report_time = 0;
-  uint32_t time_ms = MS_SINCE_BOOT;
+  static fx_time_t last_report_time = 0;
   if (settings.areRawHidLogsEnabled()) {
-    size_t log_i = sprintf(hid_log_buff, "id: %u, Δ: %lu, hid:", instance,
-                           time_ms - last_report_time);
+    size_t log_i = sprintf(hid_log_buff, "id: %u, Δ: %luus, hid:", instance,
+                           (unsigned long)(time_us - last_report_time));
     for (size_t i = 0; i < len; i++) {
       log_i += sprintf(hid_log_buff + log_i, " %02x", report[i]);
     }
     log_line((const char*)hid_log_buff);
   }
-  last_report_time = time_ms;
+  last_report_time = time_us;
 
   uint8_t itf_protocol = HID_ITF_PROTOCOL_NONE;
   uint8_t const* report_offset = report;
@@ -568,22 +775,18 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance,
   switch (itf_protocol) {
     case HID_ITF_PROTOCOL_KEYBOARD:
       process_kbd_report(instance, (hid_keyboard_report_t const*)report_offset,
-                         time_ms);
+                         time_us);
       break;
 
     case HID_ITF_PROTOCOL_MOUSE:
       process_mouse_report(instance, (hid_mouse_report_t const*)report_offset,
-                           time_ms);
+                           time_us);
       break;
 
     default:
+      if (!used_synthesized_report) forward_raw_report(instance, report, len);
       break;
   }
-
-  // continue to request to receive report
-  if (!used_synthesized_report && !tuh_hid_receive_report(dev_addr, instance)) {
-    log_line("Error: cannot request report");
-  }
 }
 
 // process any report that does not come from a "real" mouse.
@@ -592,8 +795,8 @@ static void process_sidedoor_mouse_report(uint8_t buttons, int8_t x, int8_t y) {
   report.buttons = buttons;
   report.x = x;
   report.y = y;
-  tuh_hid_report_received_cb(0, NO_OFFICIAL_INSTANCE, (const uint8_t*)&report,
-                             sizeof(report));
+  process_host_report(0, NO_OFFICIAL_INSTANCE, (const uint8_t*)&report,
+                      sizeof(report), US_SINCE_BOOT);
 }
 
 void tud_cdc_rx_cb(uint8_t itf) {
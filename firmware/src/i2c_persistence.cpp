@@ -1,10 +1,12 @@
 #include "i2c_persistence.hpp"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "hardware/i2c.h"
 #include "pico/stdlib.h"
+#include "profiler.hpp"
 
 #define PERSISTENCE_EEPROM_ADDR 0x50
 #define PERSISTENCE_EEPROM_SDA_PIN 6
@@ -16,14 +18,25 @@ static bool initialized = false;
 
 static settings_t default_settings = {
     // VERSION MUST ALWAYS STAY FIRST!!!!!
-    .version = 2,
+    .version = 7,
     .active_fx_slot = 0,
     .report_parse_mode = 0,
     .flags = FLAG_FLASHING_ENABLED,
     // 0-4
     .mouse_speed_level = 2,
     .led_brightness = 0.7,
-    .slot_colors = {0xFFFF4000, 0xFF4000FF, 0xFF00FF40, 0xFFAA0070}};
+    .slot_colors = {0xFFFF4000, 0xFF4000FF, 0xFF00FF40, 0xFFAA0070},
+    .delay_curve = 0,
+    .mouse_accel_curve = 0,
+    .mouse_accel_strength = 50,
+    // 1x when slow, up to 4x for fast flicks
+    .mouse_accel_points = {{0, 10}, {8, 10}, {24, 20}, {64, 40}},
+    // 120 BPM
+    .tempo_period_us = 500000,
+    // ms before the first reverb tap
+    .reverb_pre_delay_ms = 24,
+    // the knob picks
+    .delay_repeats = 0};
 
 settings_t active_settings = default_settings;
 
@@ -175,13 +188,38 @@ settings_t read_settings_internal() {
 
 settings_t get_defaults() { return default_settings; }
 
+// New settings only ever get appended to settings_t, so an older version is
+// a prefix of the current layout. Returns how many bytes a version persisted,
+// or 0 if it can't be migrated.
+static size_t settings_size_for_version(uint8_t version) {
+  switch (version) {
+    case 2:
+      return offsetof(settings_t, delay_curve);
+    case 3:
+      return offsetof(settings_t, mouse_accel_curve);
+    case 4:
+      return offsetof(settings_t, tempo_period_us);
+    case 5:
+      return offsetof(settings_t, reverb_pre_delay_ms);
+    case 6:
+      return offsetof(settings_t, delay_repeats);
+    case 7:
+      return sizeof(settings_t);
+    default:
+      return 0;
+  }
+}
+
 settings_t migrate(uint8_t from, uint8_t to, void *persisted) {
-  // hopefully I never actually use this
-  (void)from;
-  (void)to;
-  (void)persisted;
   log_line("migrating settings from version %u to %u", from, to);
-  return default_settings;
+  settings_t migrated = default_settings;
+  size_t size = from < to ? settings_size_for_version(from) : 0;
+  if (size > 0) {
+    // keep what the user had, new fields get their defaults
+    memcpy(&migrated, persisted, size);
+    migrated.version = to;
+  }
+  return migrated;
 }
 
 settings_t read_settings_from_persistence() {
@@ -195,6 +233,7 @@ settings_t read_settings_from_persistence() {
 }
 
 int write_settings_to_persistence(settings_t settings) {
+  HA_PROFILE_SCOPE(PROFILE_EEPROM_WRITE);
   return (int)eeprom_write_multi(PERSISTENCE_EEPROM_START_REG,
                                  (uint8_t *)&settings, sizeof(settings));
 }
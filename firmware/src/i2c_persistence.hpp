@@ -11,6 +11,9 @@
 #define FLAG_RAW_LOGS 0b1
 #define FLAG_FLASHING_ENABLED 0b10
 #define FLAG_INVERT_FOOTSWITCH 0b100
+#define FLAG_NKRO_ENABLED 0b1000
+#define FLAG_LOOP_SYNC 0b10000
+#define FLAG_KEYBOARD_LOOPER 0b100000
 
 typedef struct ha_settings {
   // VERSION ALWAYS FIRST!!
@@ -21,6 +24,19 @@ typedef struct ha_settings {
   uint8_t mouse_speed_level;
   float led_brightness;
   uint32_t slot_colors[4];
+  // added in version 3
+  uint8_t delay_curve;
+  // added in version 4
+  uint8_t mouse_accel_curve;
+  uint8_t mouse_accel_strength;
+  // {speed, gain * 10}
+  uint8_t mouse_accel_points[MOUSE_ACCEL_POINTS][2];
+  // added in version 5
+  uint32_t tempo_period_us;
+  // added in version 6
+  uint16_t reverb_pre_delay_ms;
+  // added in version 7
+  uint8_t delay_repeats;
 } settings_t;
 
 settings_t read_settings_from_persistence();
@@ -80,6 +96,11 @@ class I2cPersistence : public IPersistence {
   inline bool shouldInvertFootswitch() {
     return delegate.flags & FLAG_INVERT_FOOTSWITCH;
   }
+  inline void setNkroEnabled(bool enabled) {
+    set_bit_flag(enabled, FLAG_NKRO_ENABLED);
+    write();
+  }
+  inline bool isNkroEnabled() { return delegate.flags & FLAG_NKRO_ENABLED; }
   inline void setMouseSpeedLevel(uint8_t level) {
     delegate.mouse_speed_level = level;
     write();
@@ -87,6 +108,63 @@ class I2cPersistence : public IPersistence {
   inline uint8_t getMouseSpeedLevel() {
     return delegate.mouse_speed_level;
   }
+  inline void setDelayCurve(uint8_t curve) {
+    delegate.delay_curve = curve;
+    write();
+  }
+  inline uint8_t getDelayCurve() { return delegate.delay_curve; }
+  inline void setMouseAccelCurve(uint8_t curve) {
+    delegate.mouse_accel_curve = curve;
+    write();
+  }
+  inline uint8_t getMouseAccelCurve() { return delegate.mouse_accel_curve; }
+  inline void setMouseAccelStrength(uint8_t strength) {
+    delegate.mouse_accel_strength = strength;
+    write();
+  }
+  inline uint8_t getMouseAccelStrength() {
+    return delegate.mouse_accel_strength;
+  }
+  inline uint8_t getMouseAccelPointSpeed(uint8_t point) {
+    return delegate.mouse_accel_points[point][0];
+  }
+  inline uint8_t getMouseAccelPointGain(uint8_t point) {
+    return delegate.mouse_accel_points[point][1];
+  }
+  void setMouseAccelPoint(uint8_t point, uint8_t speed, uint8_t gain) {
+    delegate.mouse_accel_points[point][0] = speed;
+    delegate.mouse_accel_points[point][1] = gain;
+    write();
+  }
+  inline uint32_t getTempoPeriodUs() { return delegate.tempo_period_us; }
+  inline void setTempoPeriodUs(uint32_t period_us) {
+    delegate.tempo_period_us = period_us;
+    write();
+  }
+  inline bool isLoopSyncEnabled() { return delegate.flags & FLAG_LOOP_SYNC; }
+  inline void setLoopSyncEnabled(bool enabled) {
+    set_bit_flag(enabled, FLAG_LOOP_SYNC);
+    write();
+  }
+  inline bool isKeyboardLooperEnabled() {
+    return delegate.flags & FLAG_KEYBOARD_LOOPER;
+  }
+  inline void setKeyboardLooperEnabled(bool enabled) {
+    set_bit_flag(enabled, FLAG_KEYBOARD_LOOPER);
+    write();
+  }
+  inline uint16_t getReverbPreDelayMs() {
+    return delegate.reverb_pre_delay_ms;
+  }
+  inline void setReverbPreDelayMs(uint16_t ms) {
+    delegate.reverb_pre_delay_ms = ms;
+    write();
+  }
+  inline uint8_t getDelayRepeats() { return delegate.delay_repeats; }
+  inline void setDelayRepeats(uint8_t repeats) {
+    delegate.delay_repeats = repeats;
+    write();
+  }
   inline uint32_t getLedColor(uint8_t slot) {
     return delegate.slot_colors[slot];
   }
@@ -0,0 +1,73 @@
+#include "hardware/adc.h"
+#include "hardware/gpio.h"
+#include "hardware/pio.h"
+#include "pedal_hal.hpp"
+#include "pico/time.h"
+#include "ws2812.pio.h"
+
+#ifndef PICO_PEDAL_HAL
+#define PICO_PEDAL_HAL
+
+#define PIX_DATA_GPIO 29
+#define FOOT_SW_GPIO 28
+#define TOGGLE_1_GPIO 2
+#define TOGGLE_2_GPIO 1
+#define KNOB_ADC_GPIO 26
+
+#define PIX_PIO pio0
+#define PIX_PIO_SM 2
+
+class PicoClock : public IClock {
+ public:
+  fx_time_t now_us() { return time_us_64(); }
+};
+
+class PicoGpio : public IGpio {
+ public:
+  void initialize() {
+    const uint pins[] = {FOOT_SW_GPIO, TOGGLE_1_GPIO, TOGGLE_2_GPIO};
+    for (size_t i = 0; i < sizeof(pins) / sizeof(pins[0]); i++) {
+      gpio_init(pins[i]);
+      gpio_set_dir(pins[i], GPIO_IN);
+      gpio_pull_up(pins[i]);
+    }
+  }
+
+  bool read(pedal_input_t input) {
+    switch (input) {
+      case PEDAL_INPUT_FOOT_SWITCH:
+        return gpio_get(FOOT_SW_GPIO);
+      case PEDAL_INPUT_TOGGLE_1:
+        return gpio_get(TOGGLE_1_GPIO);
+      case PEDAL_INPUT_TOGGLE_2:
+        return gpio_get(TOGGLE_2_GPIO);
+    }
+    return true;
+  }
+};
+
+class PicoAdc : public IAdc {
+ public:
+  void initialize() {
+    adc_init();
+    adc_gpio_init(KNOB_ADC_GPIO);
+    adc_select_input(0);
+  }
+
+  uint16_t read_knob() { return adc_read(); }
+};
+
+class PicoPixel : public IPixel {
+ public:
+  void initialize() {
+    uint offset = pio_add_program(PIX_PIO, &ws2812_program);
+    ws2812_program_init(PIX_PIO, PIX_PIO_SM, offset, PIX_DATA_GPIO, 800000,
+                        false);
+  }
+
+  void set_pixel(uint32_t color) {
+    pio_sm_put_blocking(PIX_PIO, PIX_PIO_SM, color << 8u);
+  }
+};
+
+#endif
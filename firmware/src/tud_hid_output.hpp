@@ -1,4 +1,8 @@
+#include <string.h>
+
+#include "boot_timeline.hpp"
 #include "hid_fx.hpp"
+#include "pico/time.h"
 #include "tusb.h"
 #include "usb_descriptors.h"
 
@@ -18,7 +22,8 @@ class TinyHIDOutput : public IHIDOutput {
     if (process && mouse_sidedoor) {
       mouse_sidedoor(buttons, x, y);
     } else {
-      tud_hid_mouse_report(REPORT_ID_MOUSE, buttons, x, y, wheel, pan);
+      mark_forward(tud_hid_n_mouse_report(HID_INSTANCE_MOUSE, REPORT_ID_MOUSE,
+                                          buttons, x, y, wheel, pan));
     }
   }
   void send_keyboard_report(uint8_t modifier, uint8_t reserved,
@@ -26,11 +31,75 @@ class TinyHIDOutput : public IHIDOutput {
     (void)reserved;
     // log_line("k report %u %u %u %u %u %u", keycode[0], keycode[1],
     // keycode[2], keycode[3], keycode[4], keycode[5]);
-    tud_hid_keyboard_report(REPORT_ID_KEYBOARD, modifier, (uint8_t*)keycode);
+    if (!nkro_active()) {
+      mark_forward(tud_hid_n_keyboard_report(
+          HID_INSTANCE_KEYBOARD, REPORT_ID_KEYBOARD, modifier,
+          (uint8_t*)keycode));
+      return;
+    }
+    // keep everything on one report id, the host ORs the two together
+    KeySet keys;
+    for (size_t i = 0; i < REPORT_KEYCODE_COUNT; i++) {
+      if (keycode[i] > HID_KEY_ERROR_UNDEFINED) keys.set(keycode[i]);
+    }
+    send_nkro_report(modifier, keys);
+  }
+  void send_keys(uint8_t modifier, KeySet const& keys) {
+    if (nkro_active()) {
+      send_nkro_report(modifier, keys);
+    } else {
+      IHIDOutput::send_keys(modifier, keys);
+    }
+  }
+  bool keyboard_ready() { return tud_hid_n_ready(HID_INSTANCE_KEYBOARD); }
+  bool mouse_ready() { return tud_hid_n_ready(HID_INSTANCE_MOUSE); }
+  size_t max_keys() {
+    return nkro_active() ? NKRO_KEY_COUNT : REPORT_KEYCODE_COUNT;
+  }
+
+  // sends a report from an attached device as-is, for report types FX don't
+  // touch (media keys, system control, etc.)
+  bool forward_report(uint8_t instance, uint8_t report_id,
+                      uint8_t const* payload, uint16_t len) {
+    return tud_hid_n_report(instance, report_id, payload, len);
+  }
+
+  // the keyboard interface isn't a boot interface, so hosts always talk report
+  // protocol to it and NKRO is simply on or off
+  void set_nkro_enabled(bool enabled) {
+    if (enabled == nkro_enabled) return;
+    // release everything on the report we're leaving, or it stays stuck down
+    const uint8_t none[REPORT_KEYCODE_COUNT] = {0};
+    send_keyboard_report(0, 0, none);
+    nkro_enabled = enabled;
+  }
+
+  // marks the first report that makes it out to the computer
+  inline void set_boot_timeline(BootTimeline* timeline) {
+    boot_timeline = timeline;
   }
 
  private:
   void (*mouse_sidedoor)(uint8_t, int8_t, int8_t);
+  bool nkro_enabled = false;
+  BootTimeline* boot_timeline = nullptr;
+
+  inline void mark_forward(bool sent) {
+    if (sent && boot_timeline) {
+      boot_timeline->mark(BOOT_FIRST_FORWARD, time_us_32());
+    }
+  }
+
+  inline bool nkro_active() { return nkro_enabled; }
+
+  void send_nkro_report(uint8_t modifier, KeySet const& keys) {
+    uint8_t report[NKRO_REPORT_LEN];
+    report[0] = modifier;
+    memcpy(&report[1], keys.words, NKRO_REPORT_LEN - 1);
+    mark_forward(tud_hid_n_report(HID_INSTANCE_KEYBOARD,
+                                  REPORT_ID_KEYBOARD_NKRO, report,
+                                  sizeof(report)));
+  }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -36,8 +36,18 @@ enum
   REPORT_ID_MOUSE,
   REPORT_ID_CONSUMER_CONTROL,
   REPORT_ID_GAMEPAD,
+  REPORT_ID_KEYBOARD_NKRO,
+  REPORT_ID_SYSTEM_CONTROL,
   REPORT_ID_CDC,
   REPORT_ID_COUNT
 };
 
+// HID instances, in the order of their interfaces in the config descriptor
+#define HID_INSTANCE_KEYBOARD 0
+#define HID_INSTANCE_MOUSE 1
+
+// NKRO keyboard report: modifier byte, then one bit per usage 0x00 - 0xDF
+#define NKRO_KEY_COUNT 224
+#define NKRO_REPORT_LEN (1 + (NKRO_KEY_COUNT / 8))
+
 #endif /* USB_DESCRIPTORS_H_ */
@@ -2,8 +2,11 @@
 
 #include "util.h"
 #include "hardware/structs/rosc.h"
+#include "hardware/structs/systick.h"
+#include "hardware/timer.h"
 #include "pico/unique_id.h"
 #include "pico/bootrom.h"
+#include "profiler.hpp"
 
 #define RANDOM_BIT (rosc_hw->randombit ? 1 : 0)
 // 6 bytes for "HAXXX-"
@@ -22,13 +25,21 @@ const char *get_serial_number() {
   return serial_number_buffer;
 }
 
-uint8_t get_random_byte() {
-  uint8_t x = 0;
-  for (size_t i = 0; i < 8; i++) {
-    x |= RANDOM_BIT << i;
+// The ROSC random bit is slow to read and biased, so it's only used to seed
+// the shared generator once at boot.
+void init_random() {
+  uint32_t seed = 0;
+  for (size_t i = 0; i < 32; i++) {
+    // von Neumann debiasing, keep pairs of differing bits only
+    // (bounded, in case the ROSC is ever stopped)
+    uint8_t a, b, tries = 0;
+    do {
+      a = RANDOM_BIT;
+      b = RANDOM_BIT;
+    } while (a == b && ++tries < 64);
+    seed = (seed << 1) | a;
   }
-
-  return x;
+  seed_random(seed);
 }
 
 void reboot_to_uf2(unsigned int gpio, uint32_t events) {
@@ -36,3 +47,16 @@ void reboot_to_uf2(unsigned int gpio, uint32_t events) {
   (void)events;
   reset_usb_boot(0, 0);
 }
+
+#ifdef HA_PROFILE
+uint32_t profile_time_us() { return time_us_32(); }
+
+uint32_t profile_cycles() { return systick_hw->cvr; }
+
+void profile_init_core() {
+  systick_hw->rvr = PROFILE_SYSTICK_MASK;
+  systick_hw->cvr = 0;
+  // processor clock source, enabled, no interrupt
+  systick_hw->csr = 0x5;
+}
+#endif
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "filters.hpp"
+#include "key_state.hpp"
+#include "mouse_accel.hpp"
+#include "test_persistence.hpp"
+#include "rng.hpp"
+#include "test_util.hpp"
+
+#define BENCH_ITERATIONS 2000000
+
+static volatile int32_t sink = 0;
+
+// every heap allocation made while benchmarking, FX should never allocate
+static size_t alloc_count = 0;
+
+void *operator new(size_t n) {
+  alloc_count++;
+  void *p = malloc(n);
+  if (!p) abort();
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete(void *p, size_t n) noexcept {
+  (void)n;
+  free(p);
+}
+
+// machine readable: group,name,ns_per_op,p99_ns,worst_ns,allocs_per_op
+// p99_ns and worst_ns are left empty for throughput benchmarks that aren't
+// timed per op
+static void print_row(const char *group, const char *name, double ns,
+                      double p99_ns, double worst_ns, double allocs) {
+  if (worst_ns < 0) {
+    printf("%s,%s,%.2f,,,%.3f\n", group, name, ns, allocs);
+  } else {
+    printf("%s,%s,%.2f,%.0f,%.0f,%.3f\n", group, name, ns, p99_ns, worst_ns,
+           allocs);
+  }
+}
+
+// cheap deterministic input, roughly what a mouse axis looks like
+static inline int16_t next_input(uint32_t *seed) {
+  *seed = (*seed * 1664525u) + 1013904223u;
+  return (int16_t)((int8_t)(*seed >> 24) / 4);
+}
+
+template <typename F>
+static void bench(const char *group, const char *name, F fn) {
+  uint32_t seed = 1;
+  size_t allocs_before = alloc_count;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+    sink += fn(next_input(&seed));
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns =
+      std::chrono::duration<double, std::nano>(end - start).count() /
+      BENCH_ITERATIONS;
+  print_row(group, name, ns, -1, -1,
+            (double)(alloc_count - allocs_before) / BENCH_ITERATIONS);
+}
+
+#include "bench_fx.hpp"
+
+// what MouseFuzz used to do, sum the whole window on every sample
+static int16_t legacy_buf[50];
+static size_t legacy_index = 0;
+static int16_t legacy_moving_average(int16_t v, size_t count) {
+  legacy_buf[legacy_index] = v;
+  if (++legacy_index >= 50) legacy_index = 0;
+  int32_t sum = 0;
+  for (size_t i = legacy_index + (50 - count), j = 0; j < count; i++, j++) {
+    sum += legacy_buf[i % 50];
+  }
+  return (int16_t)(sum / (int32_t)count);
+}
+
+void bench_filters() {
+  MovingAverage<50> ma;
+  ma.set_window(50);
+  bench("filter", "legacy_moving_average_50",
+        [](int16_t v) { return legacy_moving_average(v, 50); });
+  bench("filter", "moving_average_50", [&](int16_t v) { return ma.push(v); });
+
+  Ema ema;
+  ema.set_time_constant(30, 6);
+  bench("filter", "ema", [&](int16_t v) { return ema.push(v); });
+
+  OneEuro one_euro;
+  one_euro.configure(30, 16, 10);
+  bench("filter", "one_euro", [&](int16_t v) { return one_euro.push(v, 6); });
+
+  Biquad biquad;
+  biquad.set_lowpass(20.0f, 166.0f, 0.707f);
+  bench("filter", "biquad_lowpass", [&](int16_t v) { return biquad.push(v); });
+}
+
+void bench_random() {
+  Rng rng(1);
+  bench("rng", "next_byte", [&](int16_t v) { return rng.next_byte() + v; });
+  uint8_t buf[64];
+  bench("rng", "fill_64", [&](int16_t v) {
+    rng.fill(buf, sizeof(buf));
+    return buf[v & 63];
+  });
+}
+
+// what the keyboard FX used to do, scan one keycode array for every entry
+// of the other
+static bool legacy_contains(uint8_t code, const uint8_t *keycode) {
+  for (size_t i = 0; i < REPORT_KEYCODE_COUNT; i++) {
+    if (keycode[i] == code) return true;
+  }
+  return false;
+}
+
+static int32_t legacy_diff(const uint8_t *last, const uint8_t *next) {
+  int32_t events = 0;
+  for (size_t i = 0; i < REPORT_KEYCODE_COUNT; i++) {
+    if (next[i] && !legacy_contains(next[i], last)) events++;
+    if (last[i] && !legacy_contains(last[i], next)) events++;
+  }
+  return events;
+}
+
+// fast typing: a few keys down at a time, rolling over each other
+static void next_report(ha_keyboard_report_t *report, int16_t v) {
+  for (size_t i = REPORT_KEYCODE_COUNT - 1; i > 0; i--) {
+    report->keycode[i] = report->keycode[i - 1];
+  }
+  report->keycode[0] = (v & 3) ? HID_KEY_A + (v & 31) : 0;
+  report->keycode[3] = 0;
+}
+
+// the tracker does more per report than the scan, it fills both 256-bit event
+// sets and keeps the held state, so it's no speed win: ahead in a Release
+// host build, behind in a BENCH_M0_LIKE one. These rows are here to keep its
+// cost in check, not to show it off.
+void bench_key_state() {
+  ha_keyboard_report_t report = {0, 0, {0, 0, 0, 0, 0, 0}};
+  uint8_t last[REPORT_KEYCODE_COUNT] = {0};
+  bench("key_state", "legacy_linear_diff", [&](int16_t v) {
+    memcpy(last, report.keycode, REPORT_KEYCODE_COUNT);
+    next_report(&report, v);
+    return legacy_diff(last, report.keycode);
+  });
+
+  KeyStateTracker tracker;
+  key_events_t events;
+  bench("key_state", "bitset_diff", [&](int16_t v) {
+    next_report(&report, v);
+    tracker.update(&report, &events);
+    return (int32_t)(events.pressed.words[0] ^ events.released.words[0]);
+  });
+}
+
+void bench_mouse_accel() {
+  // what mouse_task used to do, float multiply and roundf per axis
+  float speed = (1 * 0.25f) + 0.5f;
+  bench("mouse_accel", "legacy_float_scale", [&](int16_t v) {
+    int8_t x = (int8_t)roundf((float)v * speed);
+    int8_t y = (int8_t)roundf((float)(v >> 1) * speed);
+    return x + y;
+  });
+
+  InMemoryPersistence p;
+  p.initialize();
+  p.setMouseSpeedLevel(1);
+  p.setMouseAccelCurve(MOUSE_ACCEL_SIGMOID);
+  MouseAccel accel;
+  accel.configure(MouseAccel::config_from(&p));
+  bench("mouse_accel", "lut_sigmoid", [&](int16_t v) {
+    int8_t x = (int8_t)v;
+    int8_t y = (int8_t)(v >> 1);
+    accel.apply(&x, &y);
+    return x + y;
+  });
+
+  // only happens when a setting changes
+  uint8_t strength = 0;
+  bench("mouse_accel", "rebuild_sigmoid", [&](int16_t v) {
+    mouse_accel_config_t config = MouseAccel::config_from(&p);
+    config.strength = strength++ % 101;
+    accel.configure(config);
+    return (int32_t)accel.get_gain(v & 127);
+  });
+}
+
+int main(int argc, char const *argv[]) {
+  const char *mouse_trace = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--mouse-trace") == 0 && i + 1 < argc) {
+      mouse_trace = argv[++i];
+    } else {
+      fprintf(stderr, "usage: %s [--mouse-trace FILE]\n", argv[0]);
+      return 1;
+    }
+  }
+  printf("group,name,ns_per_op,p99_ns,worst_ns,allocs_per_op\n");
+  bench_filters();
+  bench_random();
+  bench_key_state();
+  bench_mouse_accel();
+  if (!bench_fx(mouse_trace)) return 1;
+  return 0;
+}
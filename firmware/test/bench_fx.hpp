@@ -0,0 +1,536 @@
+// Benchmarks for every FX, driven like the main loop in hidden_agenda.cpp
+// drives them. Included by bench.cpp, uses its print_row() and alloc_count.
+#include <algorithm>
+#include <vector>
+
+#include "kbd_fx/kbd_fx_delay.hpp"
+#include "kbd_fx/kbd_fx_harmonizer.hpp"
+#include "kbd_fx/kbd_fx_looper.hpp"
+#include "kbd_fx/kbd_fx_passthrough.hpp"
+#include "kbd_fx/kbd_fx_script.hpp"
+#include "kbd_fx/kbd_fx_tremolo.hpp"
+#include "kbd_fx/kbd_fx_xover.hpp"
+#include "mouse_fx/mouse_fx_fuzz.hpp"
+#include "mouse_fx/mouse_fx_looper.hpp"
+#include "mouse_fx/mouse_fx_passthrough.hpp"
+#include "mouse_fx/mouse_fx_reverb.hpp"
+#include "mouse_fx/mouse_fx_script.hpp"
+#include "mouse_fx/mouse_fx_xover.hpp"
+#include "fx_vm_asm.hpp"
+#include "pedal_engine.hpp"
+#include "test_pedal_hal.hpp"
+
+// simulated run time per FX
+#define FX_SESSION_MS 60000
+// main loop iterations per ms, each one ticks the active FX
+#define FX_TICKS_PER_MS 4
+// mouse_task() hands FX at most one report every 6 ms
+#define FX_MOUSE_REPORT_MS 6
+// led_task() renders a new pixel every 30 ms
+#define FX_PIXEL_MS 30
+// the looper records this long before it starts playing back
+#define FX_LOOP_RECORD_MS 2000
+// each session is repeated and the best run kept, so a preempted call on the
+// host doesn't show up as an FX's worst case
+#define FX_SESSION_RUNS 5
+// per call timings are bucketed this coarsely for percentiles
+#define FX_HISTOGRAM_BUCKET_NS 16
+#define FX_HISTOGRAM_BUCKETS 1024
+
+// Swallows everything, so only the FX itself gets measured.
+class NullHIDOutput : public IHIDOutput {
+ public:
+  void send_mouse_report(uint8_t buttons, int8_t x, int8_t y, int8_t wheel,
+                         int8_t pan, bool process = false) {
+    (void)process;
+    sink += buttons + x + y + wheel + pan;
+  }
+  void send_keyboard_report(uint8_t modifier, uint8_t reserved,
+                            const uint8_t keycode[6]) {
+    sink += modifier + reserved + keycode[0];
+  }
+  void send_keys(uint8_t modifier, KeySet const &keys) {
+    sink += modifier + keys.words[0];
+  }
+  size_t max_keys() { return REPORT_KEYCODE_COUNT; }
+};
+
+typedef struct {
+  uint16_t dt_ms;
+  ha_mouse_report_t report;
+} trace_entry_t;
+
+// Accumulates per-call timings for one FX entry point.
+class OpTimer {
+ public:
+  template <typename F>
+  inline void time(F fn) {
+    size_t allocs_before = alloc_count;
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    total_ns += ns;
+    if (ns > worst_ns) worst_ns = ns;
+    size_t bucket = (size_t)(ns / FX_HISTOGRAM_BUCKET_NS);
+    histogram[std::min(bucket, (size_t)FX_HISTOGRAM_BUCKETS - 1)]++;
+    allocs += alloc_count - allocs_before;
+    count++;
+  }
+
+  void print(const char *group, const char *fx_name, const char *op,
+             double overhead_ns) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s.%s", fx_name, op);
+    double mean = count ? (total_ns / count) - overhead_ns : 0;
+    double p99 = percentile(0.99) - overhead_ns;
+    double worst = worst_ns - overhead_ns;
+    print_row(group, name, mean < 0 ? 0 : mean, p99 < 0 ? 0 : p99,
+              worst < 0 ? 0 : worst, count ? (double)allocs / count : 0);
+  }
+
+  // upper edge of the bucket the percentile lands in
+  double percentile(double p) {
+    size_t target = (size_t)(p * count);
+    size_t seen = 0;
+    for (size_t i = 0; i < FX_HISTOGRAM_BUCKETS; i++) {
+      seen += histogram[i];
+      if (seen > target) {
+        return std::min(worst_ns, (double)((i + 1) * FX_HISTOGRAM_BUCKET_NS));
+      }
+    }
+    return worst_ns;
+  }
+
+  // keeps the lower mean, percentiles and worst case of the two
+  void keep_best(OpTimer const &other) {
+    if (count == 0 || other.total_ns < total_ns) {
+      total_ns = other.total_ns;
+      for (size_t i = 0; i < FX_HISTOGRAM_BUCKETS; i++) {
+        histogram[i] = other.histogram[i];
+      }
+    }
+    if (count == 0 || other.worst_ns < worst_ns) worst_ns = other.worst_ns;
+    // allocations don't depend on timing, any run that allocates counts
+    allocs = std::max(allocs, other.allocs);
+    count = other.count;
+  }
+
+  double total_ns = 0;
+  double worst_ns = 0;
+  size_t allocs = 0;
+  size_t count = 0;
+  uint32_t histogram[FX_HISTOGRAM_BUCKETS] = {0};
+};
+
+// timings for every FX entry point over one session
+typedef struct {
+  OpTimer process;
+  OpTimer tick;
+  OpTimer pixel;
+} fx_timers_t;
+
+static void print_fx_timers(const char *group, const char *device,
+                            const char *fx_name, fx_timers_t const &t,
+                            double overhead_ns) {
+  OpTimer process = t.process, tick = t.tick, pixel = t.pixel;
+  process.print(group, fx_name, "process", overhead_ns);
+  tick.print(group, fx_name, "tick", overhead_ns);
+  pixel.print(group, fx_name, "pixel", overhead_ns);
+  // what one ms of the main loop costs with this FX engaged
+  double frame_ns = process.total_ns + tick.total_ns + pixel.total_ns;
+  size_t ops = process.count + tick.count + pixel.count;
+  char name[64];
+  snprintf(name, sizeof(name), "%s_%s_per_ms", device, fx_name);
+  print_row("pipeline", name, (frame_ns - (ops * overhead_ns)) / FX_SESSION_MS,
+            -1, -1,
+            (double)(process.allocs + tick.allocs + pixel.allocs) /
+                FX_SESSION_MS);
+}
+
+// cost of timing an empty call, subtracted from every result. The fastest
+// one is used so the overhead never eats into what the FX actually cost.
+static double timer_overhead_ns() {
+  double fastest = 1e9;
+  for (int i = 0; i < 100000; i++) {
+    OpTimer t;
+    t.time([] {});
+    fastest = std::min(fastest, t.total_ns);
+  }
+  return fastest;
+}
+
+// CSV, one report per line: dt_ms,buttons,x,y,wheel
+static bool load_mouse_trace(const char *path,
+                             std::vector<trace_entry_t> *trace) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "can't open mouse trace %s\n", path);
+    return false;
+  }
+  int dt, buttons, x, y, wheel;
+  char line[128];
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%d,%d,%d,%d,%d", &dt, &buttons, &x, &y, &wheel) != 5) {
+      continue;
+    }
+    trace_entry_t e = {(uint16_t)dt,
+                       {(uint8_t)buttons, (int8_t)x, (int8_t)y, (int8_t)wheel,
+                        0}};
+    trace->push_back(e);
+  }
+  fclose(f);
+  if (trace->empty()) {
+    fprintf(stderr, "no reports in mouse trace %s\n", path);
+    return false;
+  }
+  return true;
+}
+
+// Synthetic hand movement: 300 ms strokes in changing directions with
+// 200 ms pauses, record button held for the first FX_LOOP_RECORD_MS.
+static void synth_mouse_trace(std::vector<trace_entry_t> *trace) {
+  uint32_t seed = 7;
+  for (uint32_t t = 0; t < FX_SESSION_MS; t += FX_MOUSE_REPORT_MS) {
+    uint32_t phase = t % 500;
+    int16_t dx = 0, dy = 0;
+    if (phase < 300) {
+      int16_t speed = (int16_t)(phase < 150 ? phase / 5 : (300 - phase) / 5);
+      dx = (int16_t)(((t / 500) & 1) ? speed : -speed) + next_input(&seed) / 8;
+      dy = (int16_t)(((t / 1000) & 1) ? speed / 2 : -speed / 2);
+    }
+    uint8_t buttons = t < FX_LOOP_RECORD_MS ? 0b10 : 0;
+    int8_t wheel = (t % 3000 == 0) ? 1 : 0;
+    trace_entry_t e = {FX_MOUSE_REPORT_MS,
+                       {buttons, (int8_t)dx, (int8_t)dy, wheel, 0}};
+    trace->push_back(e);
+  }
+}
+
+// a smoothing filter like fuzz's, the last 8 reports averaged out of state
+static const char *const bench_script_smooth =
+    ".device mouse\n.slot 1\n"
+    "ld r0, 16\n"        // next ring slot
+    "in r1, x\n"
+    "stx r0, r1\n"
+    "in r1, y\n"
+    "addi r0, 8\n"
+    "stx r0, r1\n"
+    "addi r0, -7\n"
+    "ldi r2, 7\n"
+    "and r0, r2\n"
+    "st 16, r0\n"
+    "ldi r0, 0\n"
+    "ldi r3, 0\n"
+    "ldi r4, 0\n"
+    "loop 8\n"
+    "  ldx r1, r0\n"
+    "  add r3, r1\n"
+    "  addi r0, 8\n"
+    "  ldx r1, r0\n"
+    "  add r4, r1\n"
+    "  addi r0, -7\n"
+    "end\n"
+    "shri r3, 3\n"
+    "shri r4, 3\n"
+    "out x, r3\n"
+    "out y, r4\n"
+    "send\n";
+
+// as close to VM_MAX_CYCLES as the verifier lets a script get
+static const char *const bench_script_worst =
+    ".device mouse\n.slot 1\n"
+    "in r0, x\n"
+    "loop 255\n"
+    "  loop 7\n"
+    "    addi r0, 1\n"
+    "  end\n"
+    "end\n"
+    "out x, r0\n"
+    "send\n";
+
+// the image and program have to outlive the FX
+static vm_program_t const *bench_script(const char *src, uint32_t *image) {
+  static vm_program_t programs[2];
+  static size_t count = 0;
+  size_t len = 0;
+  char err[128];
+  if (!vm_assemble(src, (uint8_t *)image, VM_MAX_IMAGE_SIZE, &len, err,
+                   sizeof(err)) ||
+      vm_verify((const uint8_t *)image, len, MAX_FX, &programs[count]) !=
+          VM_OK) {
+    fprintf(stderr, "bench script: %s\n", err);
+    abort();
+  }
+  return &programs[count++];
+}
+
+static fx_timers_t run_mouse_fx(IMouseFx *fx,
+                               std::vector<trace_entry_t> const &trace) {
+  OpTimer process, tick, pixel;
+  LedCompositor compositor;
+  compositor.set_brightness(0.7f);
+  compositor.set_fx_layer(fx->get_led_layer(), true);
+  fx->initialize(fx_us(1), 0.5f);
+  size_t trace_index = 0;
+  uint32_t next_report_ms = 1;
+  for (uint32_t now = 1; now < FX_SESSION_MS; now++) {
+    if (now >= next_report_ms) {
+      trace_entry_t const &e = trace[trace_index];
+      trace_index = (trace_index + 1) % trace.size();
+      next_report_ms = now + (e.dt_ms ? e.dt_ms : 1);
+      process.time([&] { fx->process_mouse_report(&e.report, fx_us(now)); });
+    }
+    for (int i = 0; i < FX_TICKS_PER_MS; i++) {
+      tick.time([&] { fx->tick(fx_us(now)); });
+    }
+    if (now % FX_PIXEL_MS == 0) {
+      pixel.time([&] { sink += compositor.render(now); });
+    }
+  }
+  fx->deinit();
+  return {process, tick, pixel};
+}
+
+static void bench_mouse_fx(const char *fx_name, IMouseFx *fx,
+                           std::vector<trace_entry_t> const &trace,
+                           double overhead_ns) {
+  fx_timers_t best;
+  for (int run = 0; run < FX_SESSION_RUNS; run++) {
+    fx_timers_t t = run_mouse_fx(fx, trace);
+    best.process.keep_best(t.process);
+    best.tick.keep_best(t.tick);
+    best.pixel.keep_best(t.pixel);
+  }
+  print_fx_timers("fx_mouse", "mouse", fx_name, best, overhead_ns);
+}
+
+// Synthetic typing: a key every 60 ms held for 30 ms, every 8th key is an
+// arrow so the crossover has something to steer with, and every 16th press
+// overlaps the previous key. A record_key is tapped at the start and again
+// FX_LOOP_RECORD_MS later, so the keyboard looper plays the rest of the session
+// back under the typing.
+static fx_timers_t run_keyboard_fx(IKeyboardFx *fx, uint8_t record_key) {
+  OpTimer process, tick, pixel;
+  LedCompositor compositor;
+  compositor.set_brightness(0.7f);
+  compositor.set_fx_layer(fx->get_led_layer(), true);
+  fx->initialize(fx_us(1), 0.5f);
+  uint8_t letter = 0;
+  ha_keyboard_report_t report = {0, 0, {0, 0, 0, 0, 0, 0}};
+  for (uint32_t now = 1; now < FX_SESSION_MS; now++) {
+    uint32_t phase = now % 60;
+    bool send = false;
+    if (phase == 0) {
+      letter++;
+      uint8_t key = (letter % 8 == 0) ? HID_KEY_ARROW_RIGHT + (letter % 4)
+                                      : HID_KEY_A + (letter % 26);
+      report.keycode[1] = (letter % 16 == 0) ? report.keycode[0] : 0;
+      report.keycode[0] = key;
+      report.modifier = (letter % 10 == 0) ? 0x02 : 0;
+      send = true;
+    } else if (phase == 30) {
+      report.keycode[0] = 0;
+      report.keycode[1] = 0;
+      report.modifier = 0;
+      send = true;
+    }
+    if (record_key && (now == 1 || now == FX_LOOP_RECORD_MS)) {
+      report.keycode[2] = record_key;
+      send = true;
+    } else if (record_key && (now == 20 || now == FX_LOOP_RECORD_MS + 20)) {
+      report.keycode[2] = 0;
+      send = true;
+    }
+    if (send) {
+      process.time([&] { fx->process_keyboard_report(&report, fx_us(now)); });
+    }
+    for (int i = 0; i < FX_TICKS_PER_MS; i++) {
+      tick.time([&] { fx->tick(fx_us(now)); });
+    }
+    if (now % FX_PIXEL_MS == 0) {
+      pixel.time([&] { sink += compositor.render(now); });
+    }
+  }
+  fx->deinit();
+  return {process, tick, pixel};
+}
+
+static void bench_keyboard_fx(const char *fx_name, IKeyboardFx *fx,
+                              double overhead_ns, uint8_t record_key = 0) {
+  fx_timers_t best;
+  for (int run = 0; run < FX_SESSION_RUNS; run++) {
+    fx_timers_t t = run_keyboard_fx(fx, record_key);
+    best.process.keep_best(t.process);
+    best.tick.keep_best(t.tick);
+    best.pixel.keep_best(t.pixel);
+  }
+  print_fx_timers("fx_keyboard", "keyboard", fx_name, best, overhead_ns);
+}
+
+// how far apart a 1 kHz mouse's reports come in, first one this far into the ms
+#define LATENCY_REPORT_US 1000
+#define LATENCY_REPORT_OFFSET_US 370
+
+// Microseconds, unlike TestClock, so reports can land between loop iterations.
+class SimClock : public IClock {
+ public:
+  fx_time_t now_us() { return now; }
+  fx_time_t now = 0;
+};
+
+// Records how long each mouse report took from coming in to going out to the
+// computer, in simulated time. mouse_ready() false forces every report
+// through mouse_task(), like before the engine forwarded them as they came.
+class LatencyHIDOutput : public NullHIDOutput {
+ public:
+  void send_mouse_report(uint8_t buttons, int8_t x, int8_t y, int8_t wheel,
+                         int8_t pan, bool process = false) {
+    NullHIDOutput::send_mouse_report(buttons, x, y, wheel, pan, process);
+    // one report out carries everything that came in since the last one
+    for (fx_time_t arrived : arrivals) {
+      latencies.push_back((uint32_t)(clock->now - arrived));
+    }
+    arrivals.clear();
+  }
+  bool mouse_ready() { return idle; }
+  SimClock *clock = nullptr;
+  bool idle = true;
+  std::vector<fx_time_t> arrivals;
+  std::vector<uint32_t> latencies;
+};
+
+// Mouse latency with the FX off, through the main loop's steady rate and
+// forwarded as reports come in. Simulated time, so the rows are what a report
+// waits on the pedal, not how fast the host runs the code.
+static void bench_mouse_latency(const char *name, bool throttled) {
+  InMemoryPersistence p;
+  p.initialize();
+  SimClock clock;
+  TestGpio gpio;
+  TestAdc adc;
+  TestPixel pixel;
+  LatencyHIDOutput hid;
+  hid.clock = &clock;
+  hid.idle = !throttled;
+  MousePassthrough mouse_passthrough(&hid);
+  KeyboardPassthrough keyboard_passthrough(&hid);
+  IMouseFx *mouse_fx[MAX_FX + 1];
+  IKeyboardFx *keyboard_fx[MAX_FX + 1];
+  for (size_t i = 0; i <= MAX_FX; i++) {
+    mouse_fx[i] = &mouse_passthrough;
+    keyboard_fx[i] = &keyboard_passthrough;
+  }
+  PedalEngine engine(&p, mouse_fx, keyboard_fx, &clock, &gpio, &adc, &pixel);
+  engine.initialize();
+  hid.latencies.reserve((FX_SESSION_MS * 1000) / LATENCY_REPORT_US);
+  uint32_t seed = 3;
+  const fx_time_t loop_us = FX_US_PER_MS / FX_TICKS_PER_MS;
+  for (fx_time_t ms = 1; ms < FX_SESSION_MS; ms++) {
+    fx_time_t report_us = (ms * FX_US_PER_MS) + LATENCY_REPORT_OFFSET_US;
+    bool reported = false;
+    for (int i = 0; i < FX_TICKS_PER_MS; i++) {
+      fx_time_t loop_at = (ms * FX_US_PER_MS) + (i * loop_us);
+      // the report comes in on core1 while core0 is somewhere in the loop
+      if (!reported && report_us < loop_at + loop_us) {
+        clock.now = report_us;
+        int16_t v = next_input(&seed);
+        ha_mouse_report_t r = {0, (int8_t)v, (int8_t)(v >> 1), 0, 0};
+        hid.arrivals.push_back(clock.now);
+        engine.on_mouse_report(&r);
+        reported = true;
+      }
+      clock.now = loop_at + loop_us - 1;
+      engine.task(clock.now);
+    }
+  }
+  std::vector<uint32_t> &l = hid.latencies;
+  std::sort(l.begin(), l.end());
+  double total = 0;
+  for (uint32_t us : l) total += us;
+  print_row("latency", name, (total / l.size()) * 1000,
+            (double)l[(size_t)(0.99 * l.size())] * 1000,
+            (double)l.back() * 1000, 0);
+}
+
+// host sizes, pointers are twice as wide here as on the pico. Goes to stderr
+// so the CSV stays clean.
+static void print_footprint(const char *device, const char *fx_name,
+                            size_t object_size, IFx *fx) {
+  fprintf(stderr, "footprint %s_%s: %zu bytes, %zu more while active\n",
+          device, fx_name, object_size, fx->get_state_size());
+}
+
+// false if the mouse trace couldn't be loaded
+bool bench_fx(const char *mouse_trace_path) {
+  std::vector<trace_entry_t> trace;
+  if (mouse_trace_path) {
+    if (!load_mouse_trace(mouse_trace_path, &trace)) return false;
+  } else {
+    synth_mouse_trace(&trace);
+  }
+  double overhead_ns = timer_overhead_ns();
+
+  static NullHIDOutput hid;
+  static StaticFxArena<fx_arena_size<MouseLooper::State, MouseReverb::State>()>
+      mouse_arena;
+  static StaticFxArena<
+      fx_arena_size<KeyboardDelay::State, KeyboardLooper::State>()>
+      keyboard_arena;
+  static MouseFuzz mouse_fuzz(&hid);
+  static MouseLooper mouse_looper(&hid, &mouse_arena);
+  static MousePassthrough mouse_passthrough(&hid);
+  static MouseReverb mouse_reverb(&hid, &mouse_arena);
+  static MouseXOver mouse_xover(&hid);
+  bench_mouse_fx("fuzz", &mouse_fuzz, trace, overhead_ns);
+  bench_mouse_fx("looper", &mouse_looper, trace, overhead_ns);
+  bench_mouse_fx("passthrough", &mouse_passthrough, trace, overhead_ns);
+  bench_mouse_fx("reverb", &mouse_reverb, trace, overhead_ns);
+  bench_mouse_fx("xover", &mouse_xover, trace, overhead_ns);
+  static uint32_t smooth_image[VM_MAX_IMAGE_SIZE / 4];
+  static uint32_t worst_image[VM_MAX_IMAGE_SIZE / 4];
+  static MouseScript mouse_script(&hid);
+  mouse_script.set_program(bench_script(bench_script_smooth, smooth_image));
+  bench_mouse_fx("script", &mouse_script, trace, overhead_ns);
+  mouse_script.set_program(bench_script(bench_script_worst, worst_image));
+  bench_mouse_fx("script_worst", &mouse_script, trace, overhead_ns);
+
+  static KeyboardDelay keyboard_delay(&hid, &keyboard_arena);
+  static KeyboardHarmonizer keyboard_harmonizer(&hid);
+  static KeyboardLooper keyboard_looper(&hid, &keyboard_arena);
+  static KeyboardPassthrough keyboard_passthrough(&hid);
+  static KeyboardTremolo keyboard_tremolo(&hid);
+  static KeyboardXOver keyboard_xover(&hid);
+  bench_keyboard_fx("delay", &keyboard_delay, overhead_ns);
+  bench_keyboard_fx("harmonizer", &keyboard_harmonizer, overhead_ns);
+  bench_keyboard_fx("looper", &keyboard_looper, overhead_ns,
+                    KBD_LOOP_RECORD_KEY);
+  bench_keyboard_fx("passthrough", &keyboard_passthrough, overhead_ns);
+  bench_keyboard_fx("tremolo", &keyboard_tremolo, overhead_ns);
+  bench_keyboard_fx("xover", &keyboard_xover, overhead_ns);
+
+  bench_mouse_latency("mouse_throttled", true);
+  bench_mouse_latency("mouse_bypass", false);
+
+  print_footprint("mouse", "fuzz", sizeof(mouse_fuzz), &mouse_fuzz);
+  print_footprint("mouse", "looper", sizeof(mouse_looper), &mouse_looper);
+  print_footprint("mouse", "passthrough", sizeof(mouse_passthrough),
+                  &mouse_passthrough);
+  print_footprint("mouse", "reverb", sizeof(mouse_reverb), &mouse_reverb);
+  print_footprint("mouse", "xover", sizeof(mouse_xover), &mouse_xover);
+  print_footprint("keyboard", "delay", sizeof(keyboard_delay),
+                  &keyboard_delay);
+  print_footprint("keyboard", "harmonizer", sizeof(keyboard_harmonizer),
+                  &keyboard_harmonizer);
+  print_footprint("keyboard", "looper", sizeof(keyboard_looper),
+                  &keyboard_looper);
+  print_footprint("keyboard", "passthrough", sizeof(keyboard_passthrough),
+                  &keyboard_passthrough);
+  print_footprint("keyboard", "tremolo", sizeof(keyboard_tremolo),
+                  &keyboard_tremolo);
+  print_footprint("keyboard", "xover", sizeof(keyboard_xover),
+                  &keyboard_xover);
+  fprintf(stderr, "footprint arenas: mouse %zu bytes, keyboard %zu bytes\n",
+          mouse_arena.get_capacity(), keyboard_arena.get_capacity());
+  return true;
+}
@@ -3,10 +3,42 @@
 #include "test_persistence.hpp"
 #include "test_util.hpp"
 #include "test_hid_output.hpp"
+#include "test_loop_store.hpp"
+#include "test_script_store.hpp"
+#include "test_pedal_hal.hpp"
 #include "repl.hpp"
+#include "filters.hpp"
+#include "mouse_fx/mouse_fx_looper.hpp"
+#include "mouse_fx/mouse_fx_reverb.hpp"
+#include "key_state.hpp"
+#include "key_sequencer.hpp"
+#include "key_loop.hpp"
+#include "profiler.hpp"
+#include "pedal_engine.hpp"
+#include "boot_timeline.hpp"
+#include "report_queue.hpp"
+#include "report_latch.hpp"
+#include "fx_vm.hpp"
+#include "fx_vm_asm.hpp"
+#include "fx_script_loader.hpp"
+#include "mouse_accel.hpp"
+#include "led_compositor.hpp"
+#include "mouse_fx/mouse_fx_xover.hpp"
+#include "mouse_fx/mouse_fx_fuzz.hpp"
+#include "mouse_fx/mouse_fx_passthrough.hpp"
+#include "kbd_fx/kbd_fx_delay.hpp"
+#include "kbd_fx/kbd_fx_harmonizer.hpp"
+#include "kbd_fx/kbd_fx_looper.hpp"
+#include "kbd_fx/kbd_fx_passthrough.hpp"
+#include "kbd_fx/kbd_fx_tremolo.hpp"
+#include "kbd_fx/kbd_fx_xover.hpp"
 
 char in_buf[512] = { 0 };
 
+// FX state lives here while an FX is running, like it does on the pedal
+static StaticFxArena<fx_arena_size<MouseLooper::State, MouseReverb::State>()> mouse_arena;
+static StaticFxArena<fx_arena_size<KeyboardDelay::State, KeyboardLooper::State>()> keyboard_arena;
+
 char *input(std::string s) {
     memcpy(in_buf, s.c_str(), s.size());
     in_buf[s.size()] = '\n';
@@ -93,6 +125,16 @@ void test_repl() {
     repl.process(input("cmd:m_speed:3"));
     assert("mouse speed level should be 2", p.getMouseSpeedLevel() == 2);
 
+    //LOOPS
+    repl.process(input("cmd:loop:save:0"));
+    assert("loop slot 0 should be rejected", saved_loop_slot == -1);
+    repl.process(input("cmd:loop:save:2"));
+    assert("loop should be saved to slot index 1", saved_loop_slot == 1);
+    repl.process(input("cmd:loop:load:3"));
+    assert("loop should be loaded from slot index 2", recalled_loop_slot == 2);
+    repl.process(input("cmd:loop:clear:1"));
+    assert("loop slot index 0 should be cleared", cleared_loop_slot == 0);
+
     //RESET DEFAULTS
     repl.process(input("cmd:reset"));
     assert("third led color should be reset to 0", p.getLedColor(2) == 0);
@@ -104,7 +146,2165 @@ void test_repl() {
     reset();
 }
 
+// records a loop, returns the summed motion of everything recorded
+static int64_t record_loop(MouseLooper *looper, uint32_t start_ms,
+                           uint32_t duration_ms) {
+    // pressing record doesn't move, so nothing is due at the loop boundary
+    ha_mouse_report_t r = {0b10, 0, 0, 0, 0};
+    looper->process_mouse_report(&r, fx_us(start_ms));
+    int64_t sum_x = 0;
+    for (uint32_t t = 8; t < duration_ms; t += 8) {
+        r.x = (t % 80 == 0) ? 120 : 3;
+        r.y = -2;
+        sum_x += r.x;
+        looper->process_mouse_report(&r, fx_us(start_ms + t));
+    }
+    r = {0, 0, 0, 0, 0};
+    looper->process_mouse_report(&r, fx_us(start_ms + duration_ms));
+    return sum_x;
+}
+
+void test_mouse_looper() {
+    std::cout << "start test_mouse_looper..." << std::endl;
+    TestHIDOutput hid;
+    MouseLooper looper(&hid, &mouse_arena);
+    const uint32_t duration = 800;
+    const int64_t sum_y = -2 * (int64_t)(duration / 8 - 1);
+
+    // 1X, jittery main loop
+    looper.initialize(fx_us(1), 0.5f);
+    uint32_t now = 1000;
+    int64_t sum_x = record_loop(&looper, now, duration);
+    now += duration;
+    hid.reset_counts();
+    uint32_t end = now + duration * 10;
+    uint32_t jitter = 7;
+    while (now < end) {
+        jitter = (jitter * 13 + 5) % 23;
+        now = std::min(end, now + jitter + 1);
+        looper.tick(fx_us(now));
+    }
+    assert("1X playback should emit 10 loops of x", hid.mouse_x_total == sum_x * 10);
+    assert("1X playback should emit 10 loops of y", hid.mouse_y_total == sum_y * 10);
+
+    // 2.5X with a busy main loop, every due sample must be coalesced
+    now = 20000;
+    record_loop(&looper, now, duration);
+    now += duration;
+    looper.update_parameter(1.0f);
+    hid.reset_counts();
+    end = now + duration * 4;
+    while (now < end) {
+        now += 20;
+        looper.tick(fx_us(now));
+    }
+    assert("2.5X playback should emit 10 loops of x", hid.mouse_x_total == sum_x * 10);
+    assert("2.5X playback should emit 10 loops of y", hid.mouse_y_total == sum_y * 10);
+    assert("2.5X playback should coalesce reports", hid.mouse_report_count <= duration * 4 / 20);
+
+    // 0.5X, motion gets interpolated into more reports than were recorded
+    now = 40000;
+    record_loop(&looper, now, duration);
+    now += duration;
+    looper.update_parameter(0.6f);
+    hid.reset_counts();
+    end = now + duration * 2;
+    while (now < end) {
+        now += 1;
+        looper.tick(fx_us(now));
+    }
+    assert("0.5X playback should emit 1 loop of x", hid.mouse_x_total == sum_x);
+    assert("0.5X playback should emit 1 loop of y", hid.mouse_y_total == sum_y);
+    assert("0.5X playback should be interpolated", hid.mouse_report_count > duration / 8);
+
+    // storing and recalling
+    static InMemoryLoopStore store;
+    store.initialize();
+    looper.set_loop_store(&store);
+    now = 60000;
+    looper.update_parameter(0.7f);
+    record_loop(&looper, now, duration);
+    now += duration;
+    assert("loop should be staged", looper.save_loop(1) && store.isBusy());
+    // recording is refused while the buffer is still being written
+    assert("stored loop shouldn't be visible yet", !looper.recall_loop(1));
+    record_loop(&looper, now, duration / 2);
+    now += duration / 2;
+    store.task();
+    assert("loop should be recalled", looper.recall_loop(1));
+    hid.reset_counts();
+    end = now + duration * 3;
+    while (now < end) {
+        now += 5;
+        looper.tick(fx_us(now));
+    }
+    assert("recalled loop should play the stored samples", hid.mouse_x_total == sum_x * 3);
+    // the middle button goes through until the knob's turned while it's held
+    auto play_for = [&](uint32_t us) {
+        for (end = now + us; now < end; now += 5) looper.tick(fx_us(now));
+    };
+    ha_mouse_report_t middle = {MOUSE_LOOP_SELECT_BUTTON, 0, 0, 0, 0};
+    ha_mouse_report_t none = {0, 0, 0, 0, 0};
+    looper.process_mouse_report(&middle, fx_us(now));
+    play_for(duration);
+    assert("middle button should reach the host", hid.last_mouse_buttons & MOUSE_LOOP_SELECT_BUTTON);
+    looper.update_parameter(0.2f);
+    play_for(duration);
+    assert("middle button should be kept back while picking a slot", !(hid.last_mouse_buttons & MOUSE_LOOP_SELECT_BUTTON));
+    looper.process_mouse_report(&middle, fx_us(now));
+    play_for(duration);
+    assert("and stay kept back until it's let go", !(hid.last_mouse_buttons & MOUSE_LOOP_SELECT_BUTTON));
+    looper.process_mouse_report(&none, fx_us(now));
+    looper.process_mouse_report(&middle, fx_us(now));
+    play_for(duration);
+    assert("next press should go through again", hid.last_mouse_buttons & MOUSE_LOOP_SELECT_BUTTON);
+    looper.process_mouse_report(&none, fx_us(now));
+    assert("cleared loop shouldn't be recallable", looper.clear_loop(1) && !looper.recall_loop(1));
+    looper.set_loop_store(nullptr);
+
+    std::cout << "test_mouse_looper PASS!" << std::endl;
+    reset();
+}
+
+void test_mouse_reverb() {
+    std::cout << "start test_mouse_reverb..." << std::endl;
+    TestHIDOutput hid;
+    MouseReverb reverb(&hid, &mouse_arena);
+    reverb.initialize(fx_us(0), 1.0f);
+
+    // a single burst of motion, dry is passed straight through
+    ha_mouse_report_t r = {0, 100, -60, 0, 0};
+    reverb.process_mouse_report(&r, fx_us(1));
+    assert("dry motion should pass through", hid.mouse_x_total == 100);
+    hid.reset_counts();
+
+    uint32_t now = 0;
+    uint32_t first_report_time = 0;
+    uint32_t last_report_time = 0;
+    while (now < 60000) {
+        now += 3;
+        uint32_t count = hid.mouse_report_count;
+        reverb.tick(fx_us(now));
+        if (hid.mouse_report_count == count) continue;
+        if (first_report_time == 0) first_report_time = now;
+        last_report_time = now;
+    }
+    // the tail carries roughly the same total motion as the dry signal
+    assert("wet x should be close to dry", abs(hid.mouse_x_total - 100) <= 4);
+    assert("wet y should be close to dry", abs(hid.mouse_y_total + 60) <= 4);
+    uint32_t first_echo = (REVERB_DEFAULT_PRE_DELAY + reverb_tap_delays[0]) * (REVERB_SLOT_US / FX_US_PER_MS);
+    assert("tail should start after the pre-delay", first_report_time >= first_echo);
+    assert("tail should die out", last_report_time < 30000);
+    uint32_t default_first_report = first_report_time;
+
+    // a longer pre-delay set over the repl holds the tail back further
+    InMemoryPersistence p;
+    p.initialize();
+    Repl repl(&p, &hid);
+    repl.process(input("cmd:pre_delay:120"));
+    assert("repl should set the pre-delay", p.getReverbPreDelayMs() == 120);
+    repl.process(input("cmd:pre_delay:900"));
+    assert("out of range pre-delay should be ignored", p.getReverbPreDelayMs() == 120);
+    reverb.deinit();
+    reverb.set_pre_delay_ms(p.getReverbPreDelayMs());
+    reverb.initialize(fx_us(0), 1.0f);
+    hid.reset_counts();
+    reverb.process_mouse_report(&r, fx_us(1));
+    hid.reset_counts();
+    first_report_time = 0;
+    for (now = 0; now < 2000 && first_report_time == 0; now += 3) {
+        uint32_t count = hid.mouse_report_count;
+        reverb.tick(fx_us(now));
+        if (hid.mouse_report_count != count) first_report_time = now;
+    }
+    // 120ms is 10 slots
+    uint32_t held_back = (10 - REVERB_DEFAULT_PRE_DELAY) * (REVERB_SLOT_US / FX_US_PER_MS);
+    assert("tail should start the extra pre-delay later", first_report_time == default_first_report + held_back);
+
+    std::cout << "test_mouse_reverb PASS!" << std::endl;
+    reset();
+}
+
+void test_filters() {
+    std::cout << "start test_filters..." << std::endl;
+    MovingAverage<8> ma;
+    int16_t in[] = {10, -4, 7, 100, -90, 3, 3, 3, 50, -50, 20, 1};
+    ma.set_window(4);
+    for (size_t i = 0; i < sizeof(in) / sizeof(in[0]); i++) {
+        ma.push(in[i]);
+        int32_t expected = 0;
+        for (size_t j = 0; j < 4 && j <= i; j++) expected += in[i - j];
+        assert("running sum should match a full sum", ma.get_sum() == expected);
+    }
+    ma.set_window(6);
+    assert("resized window should be re-summed", ma.get_sum() == 3 + 3 + 50 - 50 + 20 + 1);
+    ma.decay(100);
+    assert("moving average should decay to 0", ma.get_sum() == 0);
+
+    Ema ema;
+    ema.set_time_constant(30, 6);
+    for (size_t i = 0; i < 200; i++) ema.push(-40);
+    assert("ema should converge", ema.value() == -40 || ema.value() == -39);
+    ema.decay(1000);
+    assert("ema should decay to 0", ema.raw() == 0);
+
+    OneEuro one_euro;
+    one_euro.configure(30, 16, 10);
+    int16_t out = 0;
+    for (size_t i = 0; i < 200; i++) out = one_euro.push(25, 6);
+    assert("one euro should converge", out == 25 || out == 24);
+
+    Biquad biquad;
+    biquad.set_lowpass(20.0f, 166.0f, 0.707f);
+    for (size_t i = 0; i < 200; i++) out = biquad.push(60);
+    assert("biquad low pass should pass DC", abs(out - 60) <= 1);
+
+    std::cout << "test_filters PASS!" << std::endl;
+    reset();
+}
+
+void test_random() {
+    std::cout << "start test_random..." << std::endl;
+    InMemoryPersistence p;
+    TestHIDOutput hid;
+    Repl repl(&p, &hid);
+    uint8_t first[64], second[64];
+
+    repl.process(input("cmd:seed:1234"));
+    fill_random(first, sizeof(first));
+    seed_random(1234);
+    fill_random(second, sizeof(second));
+    assert("same seed should give the same bytes", memcmp(first, second, sizeof(first)) == 0);
+    repl.process(input("cmd:seed:1235"));
+    fill_random(second, sizeof(second));
+    assert("different seeds should differ", memcmp(first, second, sizeof(first)) != 0);
+
+    uint32_t buckets[16] = {0};
+    for (size_t i = 0; i < 16000; i++) buckets[get_random_byte() >> 4]++;
+    for (size_t i = 0; i < 16; i++) {
+        assert("bytes should be roughly uniform", buckets[i] > 850 && buckets[i] < 1150);
+    }
+
+    std::cout << "test_random PASS!" << std::endl;
+    reset();
+}
+
+void test_keyboard_delay() {
+    std::cout << "start test_keyboard_delay..." << std::endl;
+    TestHIDOutput hid;
+    InMemoryPersistence p;
+    Repl repl(&p, &hid);
+    KeyboardDelay delay(&hid, &keyboard_arena);
+    // a sixteenth between echoes (125ms at the default tempo), 3 echoes
+    delay.initialize(fx_us(0), 0.05f);
+
+    // type faster than the delay, far more keys than the old 6 slots
+    const uint8_t key_count = 20;
+    uint32_t now = 1;
+    ha_keyboard_report_t r = {0, 0, {0, 0, 0, 0, 0, 0}};
+    for (uint8_t k = 0; k < key_count; k++) {
+        r.keycode[0] = HID_KEY_A + k;
+        delay.process_keyboard_report(&r, fx_us(now));
+        delay.tick(fx_us(now));
+        now += 4;
+        r.keycode[0] = 0;
+        delay.process_keyboard_report(&r, fx_us(now));
+        delay.tick(fx_us(now));
+        now += 4;
+    }
+    assert("every keystroke should be pending", delay.get_pending_echo_count() == key_count);
+    for (uint32_t end = now + 2000; now < end; now++) delay.tick(fx_us(now));
+    for (uint8_t k = 0; k < key_count; k++) {
+        assert("every key should be typed once and echoed 3 times",
+               hid.key_press_counts[HID_KEY_A + k] == 4);
+    }
+    assert("all echoes should be done", delay.get_pending_echo_count() == 0);
+
+    // holding a key doesn't re-trigger it
+    hid.reset_counts();
+    r.keycode[0] = HID_KEY_A;
+    delay.process_keyboard_report(&r, fx_us(now));
+    r.keycode[1] = HID_KEY_A + 1;
+    delay.process_keyboard_report(&r, fx_us(now + 1));
+    assert("held key shouldn't be scheduled twice", delay.get_pending_echo_count() == 2);
+    r.keycode[0] = 0;
+    r.keycode[1] = 0;
+    delay.process_keyboard_report(&r, fx_us(now + 2));
+    for (uint32_t end = now + 2000; now < end; now++) delay.tick(fx_us(now));
+
+    // the repeat count setting goes past what the knob can pick
+    hid.reset_counts();
+    delay.set_repeats(20);
+    r.keycode[0] = HID_KEY_A;
+    delay.process_keyboard_report(&r, fx_us(now));
+    r.keycode[0] = 0;
+    delay.process_keyboard_report(&r, fx_us(now + 4));
+    for (uint32_t end = now + 5000; now < end; now++) delay.tick(fx_us(now));
+    assert("the key should be typed once and echoed 20 times",
+           hid.key_press_counts[HID_KEY_A] == 21);
+    delay.set_repeats(DELAY_REPEATS_KNOB);
+    hid.reset_counts();
+    r.keycode[0] = HID_KEY_A;
+    delay.process_keyboard_report(&r, fx_us(now));
+    r.keycode[0] = 0;
+    delay.process_keyboard_report(&r, fx_us(now + 4));
+    for (uint32_t end = now + 2000; now < end; now++) delay.tick(fx_us(now));
+    assert("the knob should pick the count again", hid.key_press_counts[HID_KEY_A] == 4);
+
+    repl.process(input("cmd:delay_repeats:20"));
+    assert("delay repeats should be 20", p.getDelayRepeats() == 20);
+    repl.process(input("cmd:delay_repeats:255"));
+    assert("delay repeats should still be 20", p.getDelayRepeats() == 20);
+    repl.process(input("cmd:delay_repeats:forever"));
+    assert("delay should repeat forever", p.getDelayRepeats() == DELAY_REPEATS_FOREVER);
+    repl.process(input("cmd:delay_repeats:knob"));
+    assert("delay repeats should follow the knob", p.getDelayRepeats() == DELAY_REPEATS_KNOB);
+
+    repl.process(input("cmd:delay_curve:accel"));
+    assert("delay curve should be accelerating", p.getDelayCurve() == DELAY_CURVE_ACCELERATING);
+    repl.process(input("cmd:delay_curve:sideways"));
+    assert("delay curve should still be accelerating", p.getDelayCurve() == DELAY_CURVE_ACCELERATING);
+
+    std::cout << "test_keyboard_delay PASS!" << std::endl;
+    reset();
+}
+
+void test_key_state() {
+    std::cout << "start test_key_state..." << std::endl;
+    KeyStateTracker tracker;
+    key_events_t e;
+
+    ha_keyboard_report_t r = {0, 0, {HID_KEY_A, HID_KEY_SPACE, 0, 0, 0, 0}};
+    assert("first report should change state", tracker.update(&r, &e));
+    assert("two keys should be pressed", e.pressed.count() == 2);
+    assert("space should be pressed", e.pressed.test(HID_KEY_SPACE));
+    assert("nothing should be released", !e.released.any());
+
+    // same keys, different slots, plus a duplicate
+    ha_keyboard_report_t r2 = {0, 0, {HID_KEY_SPACE, HID_KEY_A, HID_KEY_A, 0, 0, 0}};
+    assert("reordered report shouldn't change state", !tracker.update(&r2, &e));
+    assert("reorder shouldn't press anything", !e.pressed.any());
+
+    // top of the usage range lands in the last word
+    ha_keyboard_report_t r3 = {0x02, 0, {HID_KEY_SPACE, 0xE7, 0, 0, 0, 0}};
+    tracker.update(&r3, &e);
+    assert("0xE7 should be pressed", e.pressed.test(0xE7) && e.pressed.count() == 1);
+    assert("A should be released", e.released.test(HID_KEY_A) && e.released.count() == 1);
+    assert("shift should be pressed", e.modifiers_pressed == 0x02);
+
+    // phantom state, keyboard can't tell what's down
+    ha_keyboard_report_t rollover = {0x02, 0, {1, 1, 1, 1, 1, 1}};
+    tracker.update(&rollover, &e);
+    assert("rollover should be flagged", e.rollover);
+    assert("rollover shouldn't release anything", !e.released.any());
+    assert("rollover shouldn't press anything", !e.pressed.any());
+    assert("space should still be held", tracker.is_held(HID_KEY_SPACE));
+
+    ha_keyboard_report_t empty = {0, 0, {0, 0, 0, 0, 0, 0}};
+    tracker.update(&empty, &e);
+    assert("both keys should be released after rollover", e.released.count() == 2);
+    assert("shift should be released", e.modifiers_released == 0x02);
+    assert("nothing should be held", !tracker.get_held().any());
+
+    uint8_t codes[6];
+    KeySet set;
+    set.set(0x90);
+    set.set(HID_KEY_A);
+    assert("set should unpack to 2 codes", set.to_keycodes(codes, 6) == 2);
+    assert("codes should come out in order", codes[0] == HID_KEY_A && codes[1] == 0x90 && codes[2] == 0);
+
+    // harmonizer used to scan sizeof(pointer) bytes of a 3 key array
+    TestHIDOutput hid;
+    KeyboardHarmonizer harmonizer(&hid);
+    // single harmony, offset 1
+    harmonizer.initialize(fx_us(0), 1.5f / 98.0f);
+    ha_keyboard_report_t chord = {0, 0, {HID_KEY_A, HID_KEY_A + 2, HID_KEY_A + 4, HID_KEY_A + 6, 0, 0}};
+    harmonizer.process_keyboard_report(&chord, fx_us(0));
+    assert("first three keys should be harmonized",
+           hid.key_press_counts[HID_KEY_A + 1] == 1 && hid.key_press_counts[HID_KEY_A + 3] == 1 &&
+           hid.key_press_counts[HID_KEY_A + 5] == 1);
+    assert("fourth key shouldn't fit", hid.key_press_counts[HID_KEY_A + 7] == 0);
+    ha_keyboard_report_t swap = {0, 0, {HID_KEY_A + 2, HID_KEY_A + 4, HID_KEY_A + 6, 0, 0, 0}};
+    harmonizer.process_keyboard_report(&swap, fx_us(0));
+    assert("released key should free its slot", hid.key_press_counts[HID_KEY_A + 7] == 1);
+    assert("held keys shouldn't retrigger", hid.key_press_counts[HID_KEY_A + 3] == 1);
+
+    std::cout << "test_key_state PASS!" << std::endl;
+    reset();
+}
+
+void test_nkro() {
+    std::cout << "start test_nkro..." << std::endl;
+    TestHIDOutput hid;
+    InMemoryPersistence p;
+    p.initialize();
+    Repl repl(&p, &hid);
+
+    // three held keys, each one harmonized into a 3 key chord
+    KeyboardHarmonizer harmonizer(&hid);
+    harmonizer.initialize(fx_us(0), 67.5f / 98.0f);
+    ha_keyboard_report_t chord = {0, 0, {HID_KEY_A, HID_KEY_A + 5, HID_KEY_A + 10, 0, 0, 0}};
+    harmonizer.process_keyboard_report(&chord, fx_us(0));
+    assert("6KRO should only fit two whole chords", hid.last_keys.count() == 6);
+    assert("last chord shouldn't be half sent", !hid.last_keys.test(HID_KEY_A + 10));
+
+    hid.key_capacity = 224;
+    harmonizer.process_keyboard_report(&chord, fx_us(0));
+    assert("NKRO should fit all nine keys", hid.last_keys.count() == 9);
+    assert("last chord should go out", hid.last_keys.test(HID_KEY_A + 12));
+
+    // echoes shouldn't have to wait for free keycode slots
+    KeyboardDelay delay(&hid, &keyboard_arena);
+    delay.initialize(fx_us(0), 0.0f);
+    ha_keyboard_report_t first = {0, 0, {HID_KEY_A, HID_KEY_A + 1, HID_KEY_A + 2,
+                                         HID_KEY_A + 3, HID_KEY_A + 4, HID_KEY_A + 5}};
+    ha_keyboard_report_t next = {0, 0, {HID_KEY_A + 6, HID_KEY_A + 7, 0, 0, 0, 0}};
+    delay.process_keyboard_report(&first, fx_us(0));
+    delay.process_keyboard_report(&next, fx_us(10));
+    // a sixteenth at the default tempo
+    delay.tick(fx_us(125));
+    assert("held keys and echoes should share one report", hid.last_keys.count() == 8);
+
+    repl.process(input("cmd:nkro:on"));
+    assert("nkro should be enabled", p.isNkroEnabled());
+    repl.process(input("cmd:nkro:maybe"));
+    assert("nkro should still be enabled", p.isNkroEnabled());
+    repl.process(input("cmd:nkro:off"));
+    assert("nkro should be disabled", !p.isNkroEnabled());
+
+    std::cout << "test_nkro PASS!" << std::endl;
+    reset();
+}
+
+void test_key_sequencer() {
+    std::cout << "start test_key_sequencer..." << std::endl;
+    TestHIDOutput hid;
+    KeySequencer sequencer(&hid);
+    sequencer.set_timing(10, 5);
+
+    assert("tap should queue", sequencer.tap(HID_KEY_A));
+    assert("tap should queue", sequencer.tap(HID_KEY_A + 1));
+    assert("queue should hold 4 events", sequencer.get_queue_depth() == 4);
+
+    // output rate only depends on the clock, not on how often task() runs
+    uint32_t report_times[4] = {0};
+    size_t reports = 0;
+    for (uint32_t now = 100; now < 200; now++) {
+        for (int spin = 0; spin < 50; spin++) {
+            uint32_t before = hid.keyboard_report_count;
+            sequencer.task(now);
+            if (hid.keyboard_report_count != before && reports < 4) report_times[reports++] = now;
+        }
+    }
+    assert("every event should go out once", hid.keyboard_report_count == 4);
+    assert("press should be held for 10ms", report_times[1] - report_times[0] == 10);
+    assert("gap should be 5ms", report_times[2] - report_times[1] == 5);
+    assert("both keys should be typed",
+           hid.key_press_counts[HID_KEY_A] == 1 && hid.key_press_counts[HID_KEY_A + 1] == 1);
+    assert("queue should be empty", sequencer.get_queue_depth() == 0);
+
+    // host hasn't taken the last report, nothing goes out
+    hid.reset_counts();
+    hid.ready = false;
+    sequencer.tap(HID_KEY_SPACE);
+    for (uint32_t now = 200; now < 300; now++) sequencer.task(now);
+    assert("busy host should block output", hid.keyboard_report_count == 0);
+    hid.ready = true;
+    sequencer.task(300);
+    assert("ready host should get the press right away", hid.key_press_counts[HID_KEY_SPACE] == 1);
+
+    // queue never overwrites
+    sequencer.clear();
+    size_t taps = 0;
+    while (sequencer.tap(HID_KEY_A)) taps++;
+    assert("full queue should refuse taps", taps == (KEY_SEQUENCER_QUEUE_SIZE - 1) / 2);
+    sequencer.clear();
+    assert("clear should empty the queue", sequencer.get_queue_depth() == 0);
+
+    // synthesized keys sit on top of real ones
+    KeySet real;
+    real.set(HID_KEY_ENTER);
+    sequencer.set_base(0, real);
+    sequencer.press(HID_KEY_A);
+    sequencer.task(1000);
+    assert("real and synthesized keys should share a report",
+           hid.last_keys.test(HID_KEY_ENTER) && hid.last_keys.test(HID_KEY_A));
+
+    // mouse crossover types at a fixed rate no matter how fast the loop spins
+    hid.reset_counts();
+    MouseXOver xover(&hid);
+    xover.initialize(fx_us(0), 1.0f);
+    ha_mouse_report_t scroll = {0, 0, 0, 1, 0};
+    xover.process_mouse_report(&scroll, fx_us(0));
+    for (uint32_t now = 0; now < MOUSE_XOVER_FASTEST_MS * 2; now++) xover.tick(fx_us(now));
+    assert("first character should be pressed and released", hid.keyboard_report_count == 2);
+    assert("next letter should be typed", hid.key_press_counts[HID_KEY_A + 1] == 1);
+    xover.process_mouse_report(&scroll, fx_us(100));
+    for (uint32_t now = 100; now < 200; now++) xover.tick(fx_us(now));
+    assert("second character should replace the first", hid.key_press_counts[HID_KEY_BACKSPACE] == 1);
+    assert("second character should be typed", hid.key_press_counts[HID_KEY_A + 2] == 1);
+
+    std::cout << "test_key_sequencer PASS!" << std::endl;
+    reset();
+}
+
+void test_profiler() {
+    std::cout << "start test_profiler..." << std::endl;
+    Profiler profiler;
+
+    profiler.record(PROFILE_LED_TASK, 10, 1200);
+    profiler.record(PROFILE_LED_TASK, 30, 3600);
+    profiler.record(PROFILE_TUD_TASK, 5, 600);
+    profiler.end_iteration(50);
+    profile_stats_t const &led = profiler.get_stats(PROFILE_LED_TASK);
+    assert("led task should run twice", led.count == 2);
+    assert("min should be 10us", led.min_us == 10);
+    assert("max should be 30us", led.max_us == 30);
+    assert("average should be 20us", led.total_us / led.count == 20);
+    assert("max cycles should be 3600", led.max_cycles == 3600);
+
+    // slowest iteration keeps its breakdown
+    profiler.record(PROFILE_LED_TASK, 2, 240);
+    profiler.record(PROFILE_TUD_TASK, 90, 10800);
+    profiler.end_iteration(100);
+    profiler.record(PROFILE_LED_TASK, 1, 120);
+    profiler.end_iteration(20);
+    assert("worst loop should be 100us", profiler.get_worst_loop_us() == 100);
+    assert("worst iteration should blame tud", profiler.get_worst_iteration_us(PROFILE_TUD_TASK) == 90);
+    assert("worst iteration led time", profiler.get_worst_iteration_us(PROFILE_LED_TASK) == 2);
+
+    // core1 slots don't leak into core0 iterations
+    profiler.record(PROFILE_HOST_RECEIVE, 500, 60000);
+    profiler.end_iteration(200);
+    assert("core1 time shouldn't be in the snapshot",
+           profiler.get_worst_iteration_us(PROFILE_HOST_RECEIVE) == 0);
+
+    // SysTick counts down and wraps at 24 bits
+    assert("plain down count", Profiler::elapsed_cycles(1000, 400, 5, 120) == 600);
+    assert("wrapped down count", Profiler::elapsed_cycles(100, 0xFFFFFF - 99, 1, 120) == 200);
+    assert("long scopes fall back to the timer",
+           Profiler::elapsed_cycles(100, 200, 200000, 120) == 24000000);
+
+    // summary line, then only slots that ran
+    char buf[128];
+    size_t line = 0;
+    size_t lines = 0;
+    bool found_headroom = false;
+    while (profiler.format_line(&line, 300000, buf, sizeof(buf))) {
+        if (lines == 0) found_headroom = strstr(buf, "headroom:299800us") != NULL;
+        lines++;
+    }
+    assert("summary should show watchdog headroom", found_headroom);
+    assert("summary + 3 slots", lines == 4);
+    assert("cursor should rewind", line == 0);
+
+    profiler.reset();
+    assert("reset should clear counts", profiler.get_stats(PROFILE_LED_TASK).count == 0);
+    assert("reset should clear worst loop", profiler.get_worst_loop_us() == 0);
+
+    InMemoryPersistence p;
+    TestHIDOutput hid;
+    p.initialize();
+    Repl repl(&p, &hid);
+    repl.process(input("cmd:profile:dump"));
+    repl.process(input("cmd:profile:reset"));
+    repl.process(input("cmd:profile:junk"));
+    assert("repl should ask for one dump", profile_dump_count == 1);
+    assert("repl should ask for one reset", profile_reset_count == 1);
+
+    std::cout << "test_profiler PASS!" << std::endl;
+    reset();
+}
+
+// small deterministic generator so soak runs are repeatable
+static uint32_t soak_rand(uint32_t *state) {
+    *state = (*state * 1664525u) + 1013904223u;
+    return *state >> 16;
+}
+
+// Drives the engine through switch/knob changes while mouse and keyboard
+// reports keep coming in, simulated time, one loop iteration per ms.
+static void soak_pedal_engine(PedalEngine *engine, TestClock *clock, TestGpio *gpio,
+                              TestAdc *adc, uint32_t duration_ms, uint32_t seed) {
+    uint32_t rng = seed;
+    uint32_t end = clock->now + duration_ms;
+    for (uint32_t now = clock->now; now < end; now++) {
+        if (now % 750 == 0) {
+            switch (soak_rand(&rng) % 4) {
+                case 0:
+                    adc->set_slot(soak_rand(&rng) % MAX_FX);
+                    break;
+                case 1:
+                    // any mode, including both toggles "on"
+                    gpio->levels[PEDAL_INPUT_TOGGLE_1] = soak_rand(&rng) & 1;
+                    gpio->levels[PEDAL_INPUT_TOGGLE_2] = soak_rand(&rng) & 1;
+                    break;
+                default:
+                    gpio->levels[PEDAL_INPUT_FOOT_SWITCH] =
+                        !gpio->levels[PEDAL_INPUT_FOOT_SWITCH];
+                    break;
+            }
+        }
+        ha_mouse_report_t m = {(uint8_t)((now / 3000) % 2 ? 0b100 : 0),
+                               (int8_t)(soak_rand(&rng) % 21 - 10),
+                               (int8_t)(soak_rand(&rng) % 21 - 10),
+                               (int8_t)(now % 97 == 0 ? 1 : 0), 0};
+        engine->on_mouse_report(&m);
+        if (now % 8 == 0) {
+            ha_keyboard_report_t k = {0, 0, {0, 0, 0, 0, 0, 0}};
+            size_t held = soak_rand(&rng) % 4;
+            for (size_t i = 0; i < held; i++) {
+                k.keycode[i] = HID_KEY_A + (soak_rand(&rng) % 26);
+            }
+            engine->on_keyboard_report(&k, fx_us(now));
+        }
+        clock->now = now;
+        engine->task(fx_us(now));
+    }
+}
+
+void test_pedal_engine() {
+    std::cout << "start test_pedal_engine..." << std::endl;
+    InMemoryPersistence p;
+    p.initialize();
+    p.setLedBrightness(1.0f);
+    p.setMouseSpeedLevel(2);
+    p.setLedColor(2, 0x00FF00);
+    TestClock clock;
+    TestGpio gpio;
+    TestAdc adc;
+    TestPixel pixel;
+    CountingMouseFx mouse[MAX_FX + 1];
+    CountingKeyboardFx keyboard[MAX_FX + 1];
+    IMouseFx *mouse_fx[MAX_FX + 1];
+    IKeyboardFx *keyboard_fx[MAX_FX + 1];
+    for (size_t i = 0; i <= MAX_FX; i++) {
+        mouse_fx[i] = &mouse[i];
+        keyboard_fx[i] = &keyboard[i];
+        mouse[i].set_indicator_color(p.getLedColor(i < MAX_FX ? i : 0));
+    }
+    // passthrough is never initialized, it's always good to go
+    mouse[MAX_FX].initialized = true;
+    keyboard[MAX_FX].initialized = true;
+    PedalEngine engine(&p, mouse_fx, keyboard_fx, &clock, &gpio, &adc, &pixel);
+    engine.set_active_device(PEDAL_DEVICE_MOUSE);
+
+    adc.set_slot(0);
+    engine.initialize();
+    assert("saved slot should start", mouse[0].initialized && keyboard[0].initialized);
+
+    // knob picks the slot in set mode
+    adc.set_slot(2);
+    for (clock.now = 1; clock.now < 60; clock.now++) engine.task(fx_us(clock.now));
+    assert("knob should switch to slot 2", p.getActiveFxSlot() == 2);
+    assert("slot 0 should be shut down", !mouse[0].initialized && !keyboard[0].initialized);
+    assert("slot 2 should be running", mouse[2].initialized && keyboard[2].initialized);
+    assert("led should show slot 2's color", pixel.last_color == 0x00FF00);
+    assert("led should update once per frame", pixel.frame_count == (clock.now - 1) / PEDAL_LED_FRAME_MS);
+
+    // latch mode, foot switch toggles FX on each press
+    gpio.levels[PEDAL_INPUT_TOGGLE_2] = false;
+    for (; clock.now < 100; clock.now++) engine.task(fx_us(clock.now));
+    assert("should be in latch mode", engine.get_sw_mode() == SW_MODE_LATCH);
+    assert("mode change should leave FX off", !engine.is_fx_enabled());
+    gpio.levels[PEDAL_INPUT_FOOT_SWITCH] = false;
+    for (; clock.now < 140; clock.now++) engine.task(fx_us(clock.now));
+    gpio.levels[PEDAL_INPUT_FOOT_SWITCH] = true;
+    for (; clock.now < 180; clock.now++) engine.task(fx_us(clock.now));
+    assert("foot switch should engage FX", engine.is_fx_enabled());
+
+    // mouse reports pile up between mouse_task runs
+    int64_t before = mouse[2].x_total;
+    ha_mouse_report_t m = {0, 3, 0, 0, 0};
+    engine.on_mouse_report(&m);
+    engine.on_mouse_report(&m);
+    engine.mouse_task(fx_us(clock.now));
+    engine.on_mouse_report(&m);
+    engine.mouse_task(fx_us(clock.now + 1));
+    assert("buffered reports should arrive as one", mouse[2].x_total - before == 6);
+    engine.mouse_task(fx_us(clock.now + PEDAL_MOUSE_REPORT_MS));
+    assert("held report should go out after the throttle", mouse[2].x_total - before == 9);
+    clock.now += PEDAL_MOUSE_REPORT_MS + 1;
+
+    // accelerated soak, 20 simulated minutes of switching under load
+    soak_pedal_engine(&engine, &clock, &gpio, &adc, 20 * 60 * 1000, 1234);
+    size_t running = 0;
+    uint32_t violations = 0;
+    for (size_t i = 0; i <= MAX_FX; i++) {
+        if (i < MAX_FX && mouse[i].initialized) running++;
+        violations += mouse[i].violations + keyboard[i].violations;
+        assert("every slot should get used in the soak",
+               mouse[i].use_count > 0 && keyboard[i].use_count > 0);
+    }
+    assert("FX should never run uninitialized or init twice", violations == 0);
+    assert("exactly one slot should be running", running == 1);
+    assert("led should keep its frame rate",
+           pixel.frame_count == clock.now / PEDAL_LED_FRAME_MS);
+
+    // same again with the real FX
+    TestHIDOutput hid;
+    InMemoryLoopStore store;
+    store.initialize();
+    MouseReverb reverb(&hid, &mouse_arena);
+    MouseLooper looper(&hid, &mouse_arena);
+    MouseFuzz fuzz(&hid);
+    MouseXOver mouse_xover(&hid);
+    MousePassthrough mouse_passthrough(&hid);
+    KeyboardTremolo tremolo(&hid);
+    KeyboardDelay delay(&hid, &keyboard_arena);
+    KeyboardHarmonizer harmonizer(&hid);
+    KeyboardXOver keyboard_xover(&hid);
+    KeyboardPassthrough keyboard_passthrough(&hid);
+    looper.set_loop_store(&store);
+    IMouseFx *real_mouse_fx[] = {&reverb, &looper, &fuzz, &mouse_xover, &mouse_passthrough};
+    IKeyboardFx *real_keyboard_fx[] = {&tremolo, &delay, &harmonizer, &keyboard_xover,
+                                       &keyboard_passthrough};
+    p.initialize();
+    TestClock real_clock;
+    PedalEngine real_engine(&p, real_mouse_fx, real_keyboard_fx, &real_clock, &gpio, &adc,
+                            &pixel);
+    real_engine.initialize();
+    for (uint32_t minute = 0; minute < 5; minute++) {
+        soak_pedal_engine(&real_engine, &real_clock, &gpio, &adc, 60 * 1000, 99 + minute);
+        // the fake output logs every report, don't let that pile up
+        log_collection.clear();
+    }
+    assert("real FX should keep the mouse moving", hid.mouse_report_count > 0);
+    assert("real FX should keep typing", hid.keyboard_report_count > 0);
+
+    std::cout << "test_pedal_engine PASS!" << std::endl;
+    reset();
+}
+
+void test_mouse_accel() {
+    std::cout << "start test_mouse_accel..." << std::endl;
+    InMemoryPersistence p;
+    p.initialize();
+    MouseAccel accel;
+    p.setMouseSpeedLevel(2);
+    assert("first configure should build", accel.configure(MouseAccel::config_from(&p)));
+    assert("same config shouldn't rebuild", !accel.configure(MouseAccel::config_from(&p)));
+
+    // linear at 1x is a straight passthrough
+    int8_t x = -37, y = 5;
+    accel.apply(&x, &y);
+    assert("1x should pass motion through", x == -37 && y == 5);
+
+    // half speed keeps the half pixels instead of rounding them up
+    p.setMouseSpeedLevel(0);
+    accel.configure(MouseAccel::config_from(&p));
+    int32_t sum = 0;
+    for (int i = 0; i < 100; i++) {
+        x = 3;
+        y = 0;
+        accel.apply(&x, &y);
+        sum += x;
+    }
+    assert("0.5x of 300 counts should be 150", sum == 150);
+    sum = 0;
+    for (int i = 0; i < 100; i++) {
+        x = -3;
+        y = 0;
+        accel.apply(&x, &y);
+        sum += x;
+    }
+    assert("carry should work going left too", sum == -150);
+
+    // power curve, 1x at the pivot, finer below, coarser above
+    p.setMouseSpeedLevel(2);
+    p.setMouseAccelCurve(MOUSE_ACCEL_POWER);
+    p.setMouseAccelStrength(100);
+    accel.configure(MouseAccel::config_from(&p));
+    assert("power should be 1x at the pivot", accel.get_gain(MOUSE_ACCEL_POWER_PIVOT) == MOUSE_ACCEL_ONE);
+    assert("power should slow down slow motion", accel.get_gain(2) < MOUSE_ACCEL_ONE);
+    assert("power should speed up fast motion", accel.get_gain(32) == 4 * MOUSE_ACCEL_ONE);
+    assert("power should clamp at the max gain",
+           accel.get_gain(127) == MOUSE_ACCEL_MAX_GAIN * MOUSE_ACCEL_ONE);
+    x = 100;
+    y = 100;
+    accel.apply(&x, &y);
+    assert("saturated output should clamp", x == 127 && y == 127);
+    x = 1;
+    y = 0;
+    accel.apply(&x, &y);
+    assert("clamped motion shouldn't be banked", x == 0);
+
+    // sigmoid ramps up and never drops below 1x
+    p.setMouseAccelCurve(MOUSE_ACCEL_SIGMOID);
+    accel.configure(MouseAccel::config_from(&p));
+    bool rising = true;
+    for (uint8_t v = 1; v < MOUSE_ACCEL_LUT_SIZE; v++) {
+        rising = rising && accel.get_gain(v) >= accel.get_gain(v - 1);
+    }
+    assert("sigmoid should only rise", rising);
+    assert("sigmoid should start near 1x", accel.get_gain(0) >= MOUSE_ACCEL_ONE);
+    assert("sigmoid should top out near 4x", accel.get_gain(127) > 3 * MOUSE_ACCEL_ONE);
+
+    // custom points through the repl, given out of order
+    Repl repl(&p, NULL);
+    repl.process(input("cmd:accel:custom"));
+    repl.process(input("cmd:accel_point:1:64:40"));
+    repl.process(input("cmd:accel_point:2:24:20"));
+    repl.process(input("cmd:accel_point:3:8:10"));
+    repl.process(input("cmd:accel_point:4:0:10"));
+    repl.process(input("cmd:accel_point:5:0:10"));
+    repl.process(input("cmd:accel_point:1:200:10"));
+    assert("curve should be custom", p.getMouseAccelCurve() == MOUSE_ACCEL_CUSTOM);
+    assert("bad points should be ignored", p.getMouseAccelPointSpeed(0) == 64);
+    accel.configure(MouseAccel::config_from(&p));
+    assert("custom should be flat before the second point", accel.get_gain(4) == MOUSE_ACCEL_ONE);
+    assert("custom should interpolate", accel.get_gain(16) == MOUSE_ACCEL_ONE * 3 / 2);
+    assert("custom should be flat past the last point", accel.get_gain(100) == 4 * MOUSE_ACCEL_ONE);
+
+    repl.process(input("cmd:accel:power:30"));
+    assert("repl should set power", p.getMouseAccelCurve() == MOUSE_ACCEL_POWER);
+    assert("repl should set strength", p.getMouseAccelStrength() == 30);
+    repl.process(input("cmd:accel:power:300"));
+    repl.process(input("cmd:accel:warp"));
+    assert("bad accel input should be ignored",
+           p.getMouseAccelCurve() == MOUSE_ACCEL_POWER && p.getMouseAccelStrength() == 30);
+
+    std::cout << "test_mouse_accel PASS!" << std::endl;
+    reset();
+}
+
+void test_led_compositor() {
+    std::cout << "start test_led_compositor..." << std::endl;
+    LedCompositor compositor;
+    assert("full level at full brightness should be exact", compositor.get_scale(255) == LED_SCALE_ONE);
+    assert("level 0 should be off", compositor.get_scale(0) == 0);
+    assert("half level should be gamma corrected",
+           compositor.get_scale(128) > 0 && compositor.get_scale(128) < LED_SCALE_ONE / 3);
+    bool monotonic = true;
+    for (int i = 1; i < 256; i++) monotonic &= compositor.get_scale(i) >= compositor.get_scale(i - 1);
+    assert("table should never get dimmer as level goes up", monotonic);
+    assert("same brightness shouldn't rebuild", !compositor.set_brightness(1.0f));
+    assert("new brightness should rebuild", compositor.set_brightness(0.5f));
+    assert("brightness should scale full level", compositor.get_scale(255) == LED_SCALE_ONE / 2);
+    compositor.set_brightness(1.0f);
+
+    // ramps
+    LedAnimation anim;
+    anim.ramp(0, 200, 100, 1000, false);
+    assert("ramp should start at from", anim.level_at(1000) == 0);
+    assert("ramp should be halfway", anim.level_at(1050) == 100);
+    assert("one shot should hold its last level", anim.level_at(5000) == 200 && anim.is_done(1100));
+    anim.ramp(0, 200, 100, 1000, true);
+    assert("loop should wrap", anim.level_at(1150) == 100 && !anim.is_done(5000));
+    anim.ramp(250, 50, 100, 0, false);
+    assert("ramp down should be halfway", anim.level_at(50) == 150);
+    led_keyframe_t keyframes[] = {{0, 10}, {100, 10}, {0, 250}, {100, 250}};
+    anim.play(keyframes, 4, 0, false);
+    assert("hold should stay put", anim.level_at(99) == 10);
+    assert("0 ms keyframe should jump", anim.level_at(100) == 250);
+    anim.blink(200, 10, 50, 3, 77, 0);
+    assert("blink should start on", anim.level_at(0) == 200);
+    assert("blink should go off", anim.level_at(60) == 10);
+    assert("blink should come back on", anim.level_at(120) == 200);
+    assert("blink should settle on rest", anim.level_at(150) == 77 && anim.is_done(150));
+
+    // layers
+    LedLayer fx;
+    fx.set_color(0xFF0000FF);
+    compositor.set_fx_layer(&fx, true);
+    assert("fx layer should show its color", compositor.render(0) == 0x0000FF);
+    fx.set_level(0);
+    assert("fx layer level should apply", compositor.render(0) == 0);
+    compositor.set_fx_layer(&fx, false);
+    assert("without animation fx should be full", compositor.render(0) == 0x0000FF);
+    fx.set_level(255);
+    LedLayer *mode = compositor.get_layer(LED_LAYER_MODE);
+    mode->set_color(0xFF0000);
+    mode->show();
+    assert("opaque layer should cover fx", compositor.render(0) == 0xFF0000);
+    mode->set_opacity(128);
+    assert("half opacity should mix", compositor.render(0) == 0x80007F);
+    mode->set_opacity(255);
+    mode->set_blend(LED_BLEND_ADD);
+    assert("add should sum", compositor.render(0) == 0xFF00FF);
+    mode->hide();
+    LedLayer *error = compositor.get_layer(LED_LAYER_ERROR);
+    error->set_color(0x00FF00);
+    error->blink(255, 0, 10, 2, 0, 100);
+    error->show();
+    assert("error should flash on top", compositor.render(100) == 0x00FF00);
+    assert("error should blink off", compositor.render(110) == 0);
+    assert("finished overlay should hide itself",
+           compositor.render(120) == 0x0000FF && !error->is_visible());
+
+    // FX hand off animations instead of computing pixels
+    TestHIDOutput hid;
+    KeyboardDelay delay(&hid, &keyboard_arena);
+    delay.initialize(fx_us(0), 0.5f);
+    ha_keyboard_report_t k = {0, 0, {HID_KEY_A, 0, 0, 0, 0, 0}};
+    delay.process_keyboard_report(&k, fx_us(1000));
+    LedLayer *delay_led = delay.get_led_layer();
+    assert("delay should ramp up from a keypress",
+           delay_led->level_at(1000) == DELAY_LED_MIN && delay_led->level_at(1300) > DELAY_LED_MIN);
+
+    // engine: set mode blinks the slot's color, errors flash red
+    InMemoryPersistence p;
+    p.initialize();
+    p.setLedBrightness(1.0f);
+    p.setFlashingEnabled(true);
+    p.setLedColor(0, 0x0000FF);
+    TestClock clock;
+    TestGpio gpio;
+    TestAdc adc;
+    TestPixel pixel;
+    CountingMouseFx mouse[MAX_FX + 1];
+    CountingKeyboardFx keyboard[MAX_FX + 1];
+    IMouseFx *mouse_fx[MAX_FX + 1];
+    IKeyboardFx *keyboard_fx[MAX_FX + 1];
+    for (size_t i = 0; i <= MAX_FX; i++) {
+        mouse_fx[i] = &mouse[i];
+        keyboard_fx[i] = &keyboard[i];
+        keyboard[i].set_indicator_color(p.getLedColor(i < MAX_FX ? i : 0));
+    }
+    PedalEngine engine(&p, mouse_fx, keyboard_fx, &clock, &gpio, &adc, &pixel);
+    adc.set_slot(0);
+    engine.initialize();
+    for (clock.now = 1; clock.now <= 100; clock.now++) engine.task(fx_us(clock.now));
+    assert("set mode should show the slot color", pixel.last_color == 0x0000FF);
+    for (; clock.now <= 500; clock.now++) engine.task(fx_us(clock.now));
+    assert("set mode should blink off", pixel.last_color == 0);
+    engine.flash_error();
+    for (; clock.now <= 560; clock.now++) engine.task(fx_us(clock.now));
+    assert("error should flash red", pixel.last_color == PEDAL_ERROR_COLOR);
+    // the blink is on for the first 55% of each 500ms beat
+    for (; clock.now <= 1260; clock.now++) engine.task(fx_us(clock.now));
+    assert("blink should come back after the error", pixel.last_color == 0x0000FF);
+
+    std::cout << "test_led_compositor PASS!" << std::endl;
+    reset();
+}
+
+void test_fx_arena() {
+    std::cout << "start test_fx_arena..." << std::endl;
+    TestHIDOutput hid;
+    MouseReverb reverb(&hid, &mouse_arena);
+    MouseLooper looper(&hid, &mouse_arena);
+    assert("idle fx shouldn't hold the arena", mouse_arena.get_used() == 0);
+
+    // switching slots hands the same bytes from one FX to the next
+    reverb.initialize(fx_us(1), 0.5f);
+    assert("reverb should hold its state", mouse_arena.get_occupant() == &reverb &&
+        mouse_arena.get_used() == reverb.get_state_size());
+    reverb.deinit();
+    assert("deinit should free the arena", mouse_arena.get_used() == 0);
+    looper.initialize(fx_us(1), 0.5f);
+    assert("looper should get the arena", mouse_arena.get_occupant() == &looper &&
+        mouse_arena.get_used() == sizeof(MouseLooper::State));
+    assert("high water is the bigger state",
+        mouse_arena.get_high_water() == std::max(sizeof(MouseLooper::State), sizeof(MouseReverb::State)));
+
+    // a second FX can't take it, it passes reports through instead of crashing
+    reverb.initialize(fx_us(1), 0.5f);
+    assert("busy arena should stay with the looper", mouse_arena.get_occupant() == &looper);
+    ha_mouse_report_t r = {0, 5, 0, 0, 0};
+    hid.reset_counts();
+    reverb.process_mouse_report(&r, fx_us(10));
+    reverb.tick(fx_us(20));
+    assert("stateless reverb should pass through", hid.mouse_x_total == 5);
+    reverb.deinit();
+    assert("deinit without state shouldn't free someone else's", mouse_arena.get_occupant() == &looper);
+
+    // loops longer than a slot record fine, they just can't be saved
+    InMemoryLoopStore store;
+    store.initialize();
+    looper.set_loop_store(&store);
+    record_loop(&looper, 1000, (TEST_LOOP_MAX_SAMPLES + 16) * 8);
+    assert("too long to save", !looper.save_loop(0));
+    record_loop(&looper, 100000, 800);
+    assert("should save a short loop", looper.save_loop(0));
+    assert("can't release mid save", !looper.can_release());
+    store.task();
+    assert("can release once saved", looper.can_release());
+    looper.deinit();
+    assert("no state, nothing to save", !looper.save_loop(1));
+    looper.set_loop_store(nullptr);
+
+    // state that doesn't fit is refused
+    StaticFxArena<64> small;
+    MouseLooper cramped(&hid, &small);
+    cramped.initialize(fx_us(1), 0.5f);
+    assert("oversized state should be refused", small.get_used() == 0);
+    hid.reset_counts();
+    cramped.process_mouse_report(&r, fx_us(10));
+    assert("stateless looper should pass through", hid.mouse_x_total == 5);
+
+    InMemoryPersistence p;
+    p.initialize();
+    Repl repl(&p, &hid);
+    repl.process(input("cmd:mem"));
+    assert("repl should ask for a memory report", memory_dump_count == 1);
+
+    std::cout << "test_fx_arena PASS!" << std::endl;
+    reset();
+}
+
+void test_tempo_clock() {
+    std::cout << "start test_tempo_clock..." << std::endl;
+    TempoClock tempo;
+    assert("default is 120 BPM", tempo.ticks_at(500) == TEMPO_PPQN && tempo.time_at(TEMPO_PPQN) == 500);
+    assert("positions round down", tempo.ticks_at(499) == TEMPO_PPQN - 2);
+
+    // a tempo change carries the phase on from where it was
+    uint64_t before = tempo.ticks_at(1250);
+    assert("should change", tempo.set_period_us(400000, 1250));
+    assert("phase should be continuous", tempo.ticks_at(1250) == before);
+    assert("should move at the new rate", tempo.ticks_at(1650) == before + TEMPO_PPQN);
+    assert("same tempo isn't a change", !tempo.set_period_us(400000, 2000));
+
+    // an awkward tempo for an hour, every step still lands on the grid
+    tempo.set_period_us(486221, 2000);
+    TempoStep step;
+    step.follow(&tempo, TEMPO_EIGHTH, 2000);
+    uint64_t first = step.get_step();
+    uint32_t steps = 0;
+    bool on_time = true;
+    for (uint32_t now = 2000; now < 2000 + 3600000; now++) {
+        uint32_t n = step.poll(now);
+        steps += n;
+        if (n > 0) on_time &= now == tempo.time_at(step.get_step() * TEMPO_EIGHTH) && n == 1;
+    }
+    assert("every step should be seen once, on time", on_time);
+    assert("no steps should be lost or gained",
+           step.get_step() - first == steps &&
+           steps == (tempo.ticks_at(2000 + 3599999) / TEMPO_EIGHTH) - first);
+
+    // taps set the tempo from the average gap and land on the beat
+    TempoClock tapped;
+    assert("one tap isn't a tempo", !tapped.tap(10000));
+    tapped.tap(10400);
+    tapped.tap(10801);
+    assert("taps should set the tempo", tapped.tap(11199));
+    assert("average of the gaps", tapped.get_period_us() == 399666);
+    assert("last tap should be on a beat", tapped.ticks_at(11199) % TEMPO_PPQN == 0);
+    assert("still tapping", tapped.is_tapping(11199 + TEMPO_TAP_TIMEOUT_MS));
+    assert("a late tap starts over", !tapped.tap(20000) && tapped.get_period_us() == 399666);
+
+    // FX on the same clock line up
+    TestHIDOutput hid;
+    TempoClock shared;
+    shared.set_period_us(400000, 0);
+    KeyboardTremolo tremolo(&hid);
+    tremolo.set_tempo_clock(&shared);
+    tremolo.initialize(fx_us(0), 0.45f);
+    ha_keyboard_report_t r = {0, 0, {HID_KEY_A, 0, 0, 0, 0, 0}};
+    bool follows = true;
+    for (uint32_t now = 0; now < 4000; now += 50) {
+        tremolo.tick(fx_us(now));
+        tremolo.process_keyboard_report(&r, fx_us(now));
+        // quarters, shift is on every other beat
+        bool shifted = (hid.last_modifier & SHIFT_FLAG) != 0;
+        follows &= shifted == (((now / 400) & 1) != 0);
+    }
+    assert("tremolo should switch shift on the beat", follows);
+
+    KeyboardDelay delay(&hid, &keyboard_arena);
+    delay.set_tempo_clock(&shared);
+    // sixteenths, 100ms at 150 BPM
+    delay.initialize(fx_us(0), 0.05f);
+    hid.reset_counts();
+    delay.process_keyboard_report(&r, fx_us(1000));
+    r.keycode[0] = 0;
+    delay.process_keyboard_report(&r, fx_us(1010));
+    uint32_t now = 1010;
+    delay.tick(fx_us(now));
+    // the key itself went through as it was typed
+    uint32_t presses = hid.key_press_counts[HID_KEY_A];
+    for (; now < 1100; now++) delay.tick(fx_us(now));
+    assert("echo shouldn't be early", hid.key_press_counts[HID_KEY_A] == presses);
+    delay.tick(fx_us(now));
+    assert("echo should be a sixteenth later", hid.key_press_counts[HID_KEY_A] == presses + 1);
+    // slowing down stretches the echoes still to come, 200ms a sixteenth
+    shared.set_period_us(800000, now);
+    for (; now < 1300; now++) delay.tick(fx_us(now));
+    assert("next echo should wait for the slower sixteenth", hid.key_press_counts[HID_KEY_A] == presses + 1);
+    delay.tick(fx_us(now));
+    assert("next echo should land on the new grid", hid.key_press_counts[HID_KEY_A] == presses + 2);
+    delay.deinit();
+
+    // synced looper stretches passes to whole beats and stays on them
+    MouseLooper looper(&hid, &mouse_arena);
+    TempoClock loop_tempo;
+    looper.set_tempo_clock(&loop_tempo);
+    looper.initialize(fx_us(1), 0.5f);
+    looper.set_tempo_sync(true);
+    int64_t sum_x = record_loop(&looper, 1000, 800);
+    hid.reset_counts();
+    // 800ms rounds to 2 beats, playback starts on the beat at 2000
+    for (now = 1800; now <= 12000; now++) looper.tick(fx_us(now));
+    assert("10 passes of 2 beats", hid.mouse_x_total == sum_x * 10);
+    // still 2 beats a pass at 100 BPM
+    loop_tempo.set_period_us(600000, 12000);
+    for (; now <= 18000; now++) looper.tick(fx_us(now));
+    assert("passes should follow the tempo", hid.mouse_x_total == sum_x * 15);
+    looper.deinit();
+
+    // the engine taps tempo with the foot switch in set mode, saves it once
+    InMemoryPersistence p;
+    p.initialize();
+    TestClock clock;
+    TestGpio gpio;
+    TestAdc adc;
+    TestPixel pixel;
+    CountingMouseFx mouse[MAX_FX + 1];
+    CountingKeyboardFx keyboard[MAX_FX + 1];
+    IMouseFx *mouse_fx[MAX_FX + 1];
+    IKeyboardFx *keyboard_fx[MAX_FX + 1];
+    for (size_t i = 0; i <= MAX_FX; i++) {
+        mouse_fx[i] = &mouse[i];
+        keyboard_fx[i] = &keyboard[i];
+    }
+    PedalEngine engine(&p, mouse_fx, keyboard_fx, &clock, &gpio, &adc, &pixel);
+    adc.set_slot(0);
+    engine.initialize();
+    for (clock.now = 1; clock.now < 3000; clock.now++) {
+        // pressed for 100ms every 400ms
+        gpio.levels[PEDAL_INPUT_FOOT_SWITCH] = clock.now >= 1000 && clock.now <= 2300 &&
+                                               (clock.now % 400) < 100;
+        engine.task(fx_us(clock.now));
+    }
+    assert("taps should set 150 BPM", engine.get_tempo_clock()->get_period_us() == 400000);
+    assert("not saved while still tapping", p.getTempoPeriodUs() == TEMPO_DEFAULT_PERIOD_US);
+    for (; clock.now < 6000; clock.now++) engine.task(fx_us(clock.now));
+    assert("saved once tapping stops", p.getTempoPeriodUs() == 400000);
+
+    Repl repl(&p, &hid);
+    repl.process(input("cmd:tempo:90"));
+    assert("repl should set the tempo", p.getTempoPeriodUs() == 666667);
+    repl.process(input("cmd:tempo:400"));
+    assert("out of range tempo should be ignored", p.getTempoPeriodUs() == 666667);
+    repl.process(input("cmd:loop_sync:on"));
+    assert("repl should turn loop sync on", p.isLoopSyncEnabled());
+
+    std::cout << "test_tempo_clock PASS!" << std::endl;
+    reset();
+}
+
+void test_us_timebase() {
+    std::cout << "start test_us_timebase..." << std::endl;
+    TestHIDOutput hid;
+    MouseLooper looper(&hid, &mouse_arena);
+    looper.initialize(fx_us(1), 0.5f);
+
+    // 4 kHz, every report would share a ms with three others
+    fx_time_t start = fx_us(1000);
+    ha_mouse_report_t r = {0b10, 0, 0, 0, 0};
+    looper.process_mouse_report(&r, start);
+    for (fx_time_t t = 250; t < 100000; t += 250) {
+        r.x = 1;
+        looper.process_mouse_report(&r, start + t);
+    }
+    r = {0, 0, 0, 0, 0};
+    fx_time_t end = start + 100000;
+    looper.process_mouse_report(&r, end);
+    hid.reset_counts();
+
+    // played back at 1X, samples come due exactly as far apart as recorded
+    for (fx_time_t now = end; now < end + 50000; now += 250) looper.tick(now);
+    looper.tick(end + 49999);
+    assert("samples shouldn't be early", hid.mouse_x_total == 199);
+    looper.tick(end + 50000);
+    assert("samples should come due to the us", hid.mouse_x_total == 200);
+    for (fx_time_t now = end + 50000; now <= end + 100000; now += 250) looper.tick(now);
+    assert("a pass should play every sample", hid.mouse_x_total == 399);
+    looper.deinit();
+
+    // the reverb's slots are a fixed number of us apart, not of loop passes
+    MouseReverb reverb(&hid, &mouse_arena);
+    reverb.initialize(0, 0.0f);
+    r = {0, 100, 0, 0, 0};
+    reverb.process_mouse_report(&r, 1);
+    hid.reset_counts();
+    // motion goes in on the first slot, the shortest tap echoes it after that
+    fx_time_t first_echo =
+        (fx_time_t)(1 + REVERB_DEFAULT_PRE_DELAY + reverb_tap_delays[0]) * REVERB_SLOT_US;
+    for (fx_time_t now = 1; now < first_echo; now += 333) reverb.tick(now);
+    reverb.tick(first_echo - 1);
+    assert("reverb shouldn't echo early", hid.mouse_x_total == 0);
+    reverb.tick(first_echo);
+    assert("reverb should echo on its slot", hid.mouse_x_total != 0);
+    reverb.deinit();
+
+    std::cout << "test_us_timebase PASS!" << std::endl;
+    reset();
+}
+
+void test_boot() {
+    std::cout << "start test_boot..." << std::endl;
+    BootTimeline timeline;
+    char buf[64];
+    size_t line = 0;
+    assert("nothing marked, nothing to print", !timeline.format_line(&line, buf, sizeof(buf)));
+    timeline.mark(BOOT_DEVICE_STACK, 0);
+    timeline.mark(BOOT_FIRST_REPORT, 12345);
+    timeline.mark(BOOT_FIRST_REPORT, 99999);
+    assert("a mark at 0 still counts", timeline.has(BOOT_DEVICE_STACK));
+    assert("only the first mark counts", timeline.get(BOOT_FIRST_REPORT) == 12345);
+    assert("unmarked phases are 0", !timeline.has(BOOT_SETTINGS) && timeline.get(BOOT_SETTINGS) == 0);
+    assert("first line", timeline.format_line(&line, buf, sizeof(buf)) && strcmp(buf, "boot device_stack: 0.001ms") == 0);
+    assert("skips what didn't happen", timeline.format_line(&line, buf, sizeof(buf)) && strcmp(buf, "boot first_report: 12.345ms") == 0);
+    assert("then stops", !timeline.format_line(&line, buf, sizeof(buf)) && line == 0);
+
+    // before initialize() everything goes through passthrough
+    InMemoryPersistence p;
+    p.initialize();
+    TestClock clock;
+    TestGpio gpio;
+    TestAdc adc;
+    TestPixel pixel;
+    CountingMouseFx mouse[MAX_FX + 1];
+    CountingKeyboardFx keyboard[MAX_FX + 1];
+    IMouseFx *mouse_fx[MAX_FX + 1];
+    IKeyboardFx *keyboard_fx[MAX_FX + 1];
+    for (size_t i = 0; i <= MAX_FX; i++) {
+        mouse_fx[i] = &mouse[i];
+        keyboard_fx[i] = &keyboard[i];
+    }
+    mouse[MAX_FX].initialized = true;
+    keyboard[MAX_FX].initialized = true;
+    PedalEngine engine(&p, mouse_fx, keyboard_fx, &clock, &gpio, &adc, &pixel);
+    assert("not ready before initialize", !engine.is_ready());
+
+    // latch mode with the foot switch down would turn FX on if it was read
+    gpio.levels[PEDAL_INPUT_TOGGLE_2] = false;
+    gpio.levels[PEDAL_INPUT_FOOT_SWITCH] = false;
+    ha_mouse_report_t m = {0, 4, 0, 0, 0};
+    ha_keyboard_report_t k = {0, 0, {HID_KEY_A, 0, 0, 0, 0, 0}};
+    for (clock.now = 1; clock.now < 200; clock.now++) {
+        engine.on_mouse_report(&m);
+        if (clock.now % 10 == 0) engine.on_keyboard_report(&k, fx_us(clock.now));
+        engine.task(fx_us(clock.now));
+    }
+    assert("mouse should pass through", mouse[MAX_FX].x_total > 0 && mouse[MAX_FX].use_count > 0);
+    assert("keyboard should pass through", keyboard[MAX_FX].use_count == 19);
+    size_t touched = 0;
+    for (size_t i = 0; i < MAX_FX; i++) {
+        touched += mouse[i].use_count + mouse[i].init_count + keyboard[i].use_count + keyboard[i].init_count;
+    }
+    assert("FX slots should be left alone", touched == 0);
+    assert("switches should be ignored", !engine.is_fx_enabled() && engine.get_sw_mode() == SW_MODE_SET);
+    assert("led should be left alone", pixel.frame_count == 0);
+
+    // once up it behaves like it always did
+    engine.initialize();
+    assert("ready after initialize", engine.is_ready());
+    assert("saved slot should start", mouse[0].initialized && keyboard[0].initialized);
+    for (; clock.now < 300; clock.now++) engine.task(fx_us(clock.now));
+    assert("switches should be read", engine.get_sw_mode() == SW_MODE_LATCH);
+    assert("led should update", pixel.frame_count > 0);
+    size_t violations = 0;
+    for (size_t i = 0; i <= MAX_FX; i++) violations += mouse[i].violations + keyboard[i].violations;
+    assert("no FX used before it was initialized", violations == 0);
+
+    TestHIDOutput hid;
+    Repl repl(&p, &hid);
+    repl.process(input("cmd:boot_time"));
+    assert("repl should ask for the boot timeline", boot_dump_count == 1);
+
+    std::cout << "test_boot PASS!" << std::endl;
+    reset();
+}
+
+void test_fx_deadline() {
+    std::cout << "start test_fx_deadline..." << std::endl;
+    FxDeadline deadline;
+    uint64_t over = FX_DEADLINE_BUDGET_US + 1;
+    assert("on time is fine", !deadline.check(0, FX_DEADLINE_BUDGET_US));
+    assert("one overrun is forgiven", !deadline.check(0, over));
+    assert("on time calls in between don't pay it back", !deadline.check(0, 10) && !deadline.check(0, 10));
+    assert("two", !deadline.check(0, over));
+    assert("third strike bypasses", deadline.check(0, over));
+    FxDeadline spread;
+    bool spread_bypassed = false;
+    for (int i = 0; i < FX_DEADLINE_STRIKES * 3; i++) {
+        fx_time_t at = fx_us(FX_DEADLINE_WINDOW_MS * i);
+        spread_bypassed |= spread.check(at, at + over);
+    }
+    assert("overruns a window apart are forgiven", !spread_bypassed && spread.get_failovers() == 0);
+    // the overrun ended 2 ms in
+    assert("bypassed for the back-off", deadline.is_bypassed(0) && deadline.is_bypassed(FX_DEADLINE_BACKOFF_MS + 1));
+    assert("retried after it", !deadline.is_bypassed(FX_DEADLINE_BACKOFF_MS + 2));
+    fx_time_t later = fx_us(2000);
+    assert("strikes start over", !deadline.check(later, later + over) && !deadline.check(later, later + over));
+    assert("bypassed again", deadline.check(later, later + over));
+    assert("back-off doubles", deadline.get_backoff_ms() == FX_DEADLINE_BACKOFF_MS * 2);
+    assert("for longer", deadline.is_bypassed(2001 + FX_DEADLINE_BACKOFF_MS * 2) && !deadline.is_bypassed(2002 + FX_DEADLINE_BACKOFF_MS * 2));
+    assert("counts failovers", deadline.get_failovers() == 2);
+    for (int i = 0; i < 10; i++) {
+        uint32_t at = 100000 * (i + 1);
+        for (int s = 0; s < FX_DEADLINE_STRIKES; s++) deadline.check(fx_us(at), fx_us(at) + over);
+    }
+    assert("back-off tops out", deadline.get_backoff_ms() == FX_DEADLINE_MAX_BACKOFF_MS);
+    deadline.reset();
+    assert("reset lifts the bypass", !deadline.is_bypassed(1000000));
+
+    // a stuck FX in the engine
+    InMemoryPersistence p;
+    p.initialize();
+    p.setLedBrightness(1.0f);
+    TestClock clock;
+    TestGpio gpio;
+    TestAdc adc;
+    TestPixel pixel;
+    CountingMouseFx mouse[MAX_FX + 1];
+    CountingKeyboardFx keyboard[MAX_FX + 1];
+    IMouseFx *mouse_fx[MAX_FX + 1];
+    IKeyboardFx *keyboard_fx[MAX_FX + 1];
+    for (size_t i = 0; i <= MAX_FX; i++) {
+        mouse_fx[i] = &mouse[i];
+        keyboard_fx[i] = &keyboard[i];
+        mouse[i].clock = &clock;
+        keyboard[i].clock = &clock;
+    }
+    mouse[MAX_FX].initialized = true;
+    keyboard[MAX_FX].initialized = true;
+    PedalEngine engine(&p, mouse_fx, keyboard_fx, &clock, &gpio, &adc, &pixel);
+    adc.set_slot(0);
+    engine.initialize();
+    // latch mode, foot switch on
+    for (clock.now = 1; clock.now < 60; clock.now++) engine.task(fx_us(clock.now));
+    gpio.levels[PEDAL_INPUT_TOGGLE_2] = false;
+    for (; clock.now < 100; clock.now++) engine.task(fx_us(clock.now));
+    gpio.levels[PEDAL_INPUT_FOOT_SWITCH] = false;
+    for (; clock.now < 140; clock.now++) engine.task(fx_us(clock.now));
+    gpio.levels[PEDAL_INPUT_FOOT_SWITCH] = true;
+    for (; clock.now < 180; clock.now++) engine.task(fx_us(clock.now));
+    assert("fx should be on", engine.is_fx_enabled());
+
+    // the keyboard FX takes 5 ms a report
+    keyboard[0].stall_ms = 5;
+    ha_keyboard_report_t k = {0, 0, {HID_KEY_A, 0, 0, 0, 0, 0}};
+    for (int i = 0; i < FX_DEADLINE_STRIKES; i++) engine.on_keyboard_report(&k, fx_us(clock.now));
+    assert("keyboard FX should be bypassed", engine.is_fx_bypassed(PEDAL_DEVICE_KEYBOARD));
+    assert("mouse FX should be left alone", !engine.is_fx_bypassed(PEDAL_DEVICE_MOUSE));
+    uint32_t uses = keyboard[0].use_count;
+    uint32_t passed = keyboard[MAX_FX].use_count;
+    uint32_t bypassed_at = clock.now;
+    engine.task(fx_us(clock.now));
+    engine.on_keyboard_report(&k, fx_us(clock.now));
+    assert("reports should go through passthrough", keyboard[MAX_FX].use_count == passed + 1);
+    assert("the FX should be skipped, ticks too", keyboard[0].use_count == uses);
+    engine.led_task(clock.now + PEDAL_LED_FRAME_MS);
+    assert("the LED should flash", pixel.last_color == PEDAL_ERROR_COLOR);
+    assert("the FX should stay on", engine.is_fx_enabled());
+    bool logged = false;
+    for (auto const &line : log_collection) logged |= line.find("missed its deadline") != std::string::npos;
+    assert("should log the failover", logged);
+
+    // after the back-off the FX gets another go, and is fine now
+    keyboard[0].stall_ms = 0;
+    for (clock.now = bypassed_at; clock.now < bypassed_at + FX_DEADLINE_BACKOFF_MS + 1; clock.now++) engine.task(fx_us(clock.now));
+    assert("should retry after the back-off", !engine.is_fx_bypassed(PEDAL_DEVICE_KEYBOARD));
+    engine.on_keyboard_report(&k, fx_us(clock.now));
+    assert("FX should get reports again", keyboard[0].use_count > uses + 1);
+
+    // slow reports with fast ticks between them still add up
+    keyboard[0].report_stall_ms = 5;
+    bool report_bypassed = false;
+    for (int i = 0; i < FX_DEADLINE_STRIKES && !report_bypassed; i++) {
+        engine.on_keyboard_report(&k, fx_us(clock.now));
+        for (int t = 0; t < 50; t++, clock.now++) engine.task(fx_us(clock.now));
+        report_bypassed = engine.is_fx_bypassed(PEDAL_DEVICE_KEYBOARD);
+    }
+    assert("slow reports should bypass the FX with ticks between them", report_bypassed);
+    keyboard[0].report_stall_ms = 0;
+
+    // a slow mouse FX tick bypasses mouse reports too
+    mouse[0].stall_ms = 3;
+    for (int i = 0; i < FX_DEADLINE_STRIKES; i++) engine.fx_task(fx_us(clock.now));
+    assert("mouse FX should be bypassed", engine.is_fx_bypassed(PEDAL_DEVICE_MOUSE));
+    ha_mouse_report_t m = {0, 7, 0, 0, 0};
+    uint32_t mouse_uses = mouse[0].use_count;
+    int64_t before = mouse[MAX_FX].x_total;
+    engine.on_mouse_report(&m);
+    engine.mouse_task(fx_us(clock.now + PEDAL_MOUSE_REPORT_MS));
+    assert("mouse should go through passthrough", mouse[MAX_FX].x_total > before && mouse[0].use_count == mouse_uses);
+
+    size_t violations = 0;
+    for (size_t i = 0; i <= MAX_FX; i++) violations += mouse[i].violations + keyboard[i].violations;
+    assert("no FX used before it was initialized", violations == 0);
+
+    std::cout << "test_fx_deadline PASS!" << std::endl;
+    reset();
+}
+
+void test_fx_failover_release() {
+    std::cout << "start test_fx_failover_release..." << std::endl;
+    InMemoryPersistence p;
+    p.initialize();
+    TestClock clock;
+    TestGpio gpio;
+    TestAdc adc;
+    TestPixel pixel;
+    TestHIDOutput hid;
+    HoldingKeyboardFx holding(&hid);
+    CountingKeyboardFx keyboard[MAX_FX];
+    KeyboardPassthrough keyboard_passthrough(&hid);
+    CountingMouseFx mouse[MAX_FX];
+    MousePassthrough mouse_passthrough(&hid);
+    IMouseFx *mouse_fx[MAX_FX + 1];
+    IKeyboardFx *keyboard_fx[MAX_FX + 1];
+    for (size_t i = 0; i < MAX_FX; i++) {
+        mouse_fx[i] = &mouse[i];
+        keyboard_fx[i] = &keyboard[i];
+    }
+    keyboard_fx[0] = &holding;
+    mouse_fx[MAX_FX] = &mouse_passthrough;
+    keyboard_fx[MAX_FX] = &keyboard_passthrough;
+    holding.clock = &clock;
+    PedalEngine engine(&p, mouse_fx, keyboard_fx, &clock, &gpio, &adc, &pixel);
+    adc.set_slot(0);
+    engine.initialize();
+    // latch mode, foot switch on
+    for (clock.now = 1; clock.now < 60; clock.now++) engine.task(fx_us(clock.now));
+    gpio.levels[PEDAL_INPUT_TOGGLE_2] = false;
+    for (; clock.now < 100; clock.now++) engine.task(fx_us(clock.now));
+    gpio.levels[PEDAL_INPUT_FOOT_SWITCH] = false;
+    for (; clock.now < 140; clock.now++) engine.task(fx_us(clock.now));
+    gpio.levels[PEDAL_INPUT_FOOT_SWITCH] = true;
+    for (; clock.now < 180; clock.now++) engine.task(fx_us(clock.now));
+    assert("fx should be on", engine.is_fx_enabled());
+
+    // the FX holds an echo while A's down, then starts running over
+    const uint8_t echo = HID_KEY_A + 1;
+    holding.held_key = echo;
+    ha_keyboard_report_t k = {0, 0, {HID_KEY_A, 0, 0, 0, 0, 0}};
+    engine.on_keyboard_report(&k, fx_us(clock.now));
+    assert("FX should be holding the echo", hid.last_keys.test(echo) && hid.last_keys.test(HID_KEY_A));
+    holding.stall_ms = 5;
+    for (int i = 0; i < FX_DEADLINE_STRIKES - 1; i++) engine.on_keyboard_report(&k, fx_us(clock.now));
+    // the computer hasn't picked up the last report when it fails over
+    hid.ready = false;
+    engine.on_keyboard_report(&k, fx_us(clock.now));
+    assert("keyboard FX should be bypassed", engine.is_fx_bypassed(PEDAL_DEVICE_KEYBOARD));
+    assert("echo is still down while the computer's busy", hid.last_keys.test(echo));
+    hid.ready = true;
+    engine.task(fx_us(clock.now));
+    assert("echo should be let go once the computer can take it", !hid.last_keys.test(echo));
+    assert("what's really held should stay down", hid.last_keys.test(HID_KEY_A));
+    holding.stall_ms = 0;
+    for (uint32_t until = clock.now + 500; clock.now < until; clock.now++) engine.task(fx_us(clock.now));
+    assert("echo should stay up through the back-off", !hid.last_keys.test(echo));
+
+    std::cout << "test_fx_failover_release PASS!" << std::endl;
+    reset();
+}
+
+void test_mouse_bypass() {
+    std::cout << "start test_mouse_bypass..." << std::endl;
+    InMemoryPersistence p;
+    p.initialize();
+    p.setMouseSpeedLevel(3);
+    TestClock clock;
+    TestGpio gpio;
+    TestAdc adc;
+    TestPixel pixel;
+    TestHIDOutput hid;
+    CountingMouseFx mouse[MAX_FX];
+    CountingKeyboardFx keyboard[MAX_FX + 1];
+    MousePassthrough passthrough(&hid);
+    IMouseFx *mouse_fx[MAX_FX + 1];
+    IKeyboardFx *keyboard_fx[MAX_FX + 1];
+    for (size_t i = 0; i < MAX_FX; i++) mouse_fx[i] = &mouse[i];
+    mouse_fx[MAX_FX] = &passthrough;
+    for (size_t i = 0; i <= MAX_FX; i++) keyboard_fx[i] = &keyboard[i];
+    keyboard[MAX_FX].initialized = true;
+    PedalEngine engine(&p, mouse_fx, keyboard_fx, &clock, &gpio, &adc, &pixel);
+    adc.set_slot(0);
+    engine.initialize();
+    MouseAccel accel;
+    accel.configure(MouseAccel::config_from(&p));
+
+    // FX off, every report goes out as it comes in, scaled
+    ha_mouse_report_t m = {0, 10, -4, 0, 0};
+    clock.now = 100;
+    engine.on_mouse_report(&m);
+    assert("should go out without mouse_task", hid.mouse_report_count == 1);
+    engine.on_mouse_report(&m);
+    assert("should not be held back by the throttle", hid.mouse_report_count == 2);
+    int8_t x = 10, y = -4;
+    int64_t want_x = 0, want_y = 0;
+    for (int i = 0; i < 2; i++) {
+        x = 10;
+        y = -4;
+        accel.apply(&x, &y);
+        want_x += x;
+        want_y += y;
+    }
+    assert("speed should be applied", hid.mouse_x_total == want_x && hid.mouse_y_total == want_y && want_x != 20);
+    engine.mouse_task(fx_us(clock.now + PEDAL_MOUSE_REPORT_MS));
+    assert("nothing left for mouse_task", hid.mouse_report_count == 2);
+
+    // host still busy with the last one, buffer instead of dropping it
+    hid.mouse_idle = false;
+    engine.on_mouse_report(&m);
+    engine.on_mouse_report(&m);
+    assert("should be held while the endpoint is busy", hid.mouse_report_count == 2);
+    hid.mouse_idle = true;
+    engine.on_mouse_report(&m);
+    assert("should keep buffering behind a held report", hid.mouse_report_count == 2);
+    engine.mouse_task(fx_us(clock.now + 2 * PEDAL_MOUSE_REPORT_MS));
+    assert("held reports should go out together", hid.mouse_report_count == 3);
+    engine.on_mouse_report(&m);
+    assert("then straight out again", hid.mouse_report_count == 4);
+
+    // FX on, back to the steady rate
+    gpio.levels[PEDAL_INPUT_TOGGLE_1] = false;
+    gpio.levels[PEDAL_INPUT_FOOT_SWITCH] = false;
+    for (; clock.now < 200; clock.now++) engine.task(fx_us(clock.now));
+    gpio.levels[PEDAL_INPUT_FOOT_SWITCH] = true;
+    for (; clock.now < 240; clock.now++) engine.task(fx_us(clock.now));
+    assert("momentary should engage FX", engine.is_fx_enabled());
+    engine.on_mouse_report(&m);
+    assert("FX reports should wait for mouse_task", mouse[0].x_total == 0 && hid.mouse_report_count == 4);
+    engine.mouse_task(fx_us(clock.now + PEDAL_MOUSE_REPORT_MS));
+    assert("then go to the FX", mouse[0].x_total > 0);
+
+    std::cout << "test_mouse_bypass PASS!" << std::endl;
+    reset();
+}
+
+void test_report_queue() {
+    std::cout << "start test_report_queue..." << std::endl;
+    ReportQueue<4> queue;
+    assert("starts empty", queue.peek() == nullptr && queue.size() == 0);
+    uint8_t report[REPORT_QUEUE_MAX_LEN + 8];
+    for (size_t i = 0; i < sizeof(report); i++) report[i] = (uint8_t)i;
+
+    // oldest first, a copy of what was handed in
+    assert("push", queue.push(1, 0, report, 8, 100));
+    report[0] = 0xAA;
+    assert("push another", queue.push(1, 2, report, 4, 200));
+    queued_report_t const *r = queue.peek();
+    assert("oldest first", r && r->time_us == 100 && r->instance == 0 && r->dev_addr == 1);
+    assert("copied, not referenced", r->len == 8 && r->data[0] == 0 && r->data[7] == 7);
+    assert("peek doesn't take it", queue.peek() == r && queue.size() == 2);
+    queue.pop();
+    r = queue.peek();
+    assert("then the next", r && r->time_us == 200 && r->instance == 2 && r->data[0] == 0xAA && r->len == 4);
+    queue.pop();
+    assert("empty again", queue.peek() == nullptr);
+
+    // around the end of the ring and full
+    for (int i = 0; i < 4; i++) assert("fills up", queue.push(1, 0, report, 1, 300 + i));
+    assert("full drops the newest", !queue.push(1, 0, report, 1, 400) && queue.get_dropped() == 1);
+    assert("dropped ones still count as received", queue.get_received() == 7);
+    for (int i = 0; i < 4; i++) {
+        r = queue.peek();
+        assert("keeps its order", r && r->time_us == (fx_time_t)(300 + i));
+        queue.pop();
+    }
+    assert("too long gets cut", queue.push(1, 0, report, sizeof(report), 500) && queue.peek()->len == REPORT_QUEUE_MAX_LEN);
+    assert("reports by default", queue.peek()->type == QUEUED_REPORT);
+    queue.pop();
+
+    // mounts queue up in order with the reports
+    assert("mount", queue.push(1, 3, report, 6, 600, QUEUED_MOUNT));
+    assert("then a report", queue.push(1, 3, report, 8, 601));
+    r = queue.peek();
+    assert("mount first", r && r->type == QUEUED_MOUNT && r->instance == 3 && r->len == 6);
+    queue.pop();
+    assert("report after", queue.peek()->type == QUEUED_REPORT);
+
+    ReportRate rate;
+    uint32_t count = 0;
+    for (uint32_t ms = 1; ms <= 3000; ms++) {
+        count++;
+        rate.task(count, ms);
+    }
+    assert("1 kHz", rate.get_rate() == 1000);
+    for (uint32_t ms = 3001; ms <= 5000; ms++) {
+        if (ms % 4 == 0) count++;
+        rate.task(count, ms);
+    }
+    assert("slowed down", rate.get_rate() == 250 && rate.get_peak() == 1000);
+
+    InMemoryPersistence p;
+    p.initialize();
+    TestHIDOutput hid;
+    Repl repl(&p, &hid);
+    repl.process(input("cmd:host_rate"));
+    assert("repl should ask for the host rates", host_rate_dump_count == 1);
+
+    std::cout << "test_report_queue PASS!" << std::endl;
+    reset();
+}
+
+// assembles src into image, which has to hold VM_MAX_IMAGE_SIZE bytes
+static size_t assemble(const char *src, uint32_t *image) {
+    size_t len = 0;
+    char err[128];
+    if (!vm_assemble(src, (uint8_t *)image, VM_MAX_IMAGE_SIZE, &len, err, sizeof(err))) {
+        std::cout << "  asm: " << err << std::endl;
+        return 0;
+    }
+    return len;
+}
+
+// runs the report entry once, x comes back out of the fields
+static int32_t run_script(const char *src, vm_io_t *io) {
+    static uint32_t image[VM_MAX_IMAGE_SIZE / 4];
+    size_t len = assemble(src, image);
+    vm_program_t program;
+    if (vm_verify((const uint8_t *)image, len, MAX_FX, &program) != VM_OK) return INT32_MIN;
+    FxVm vm;
+    vm.run(&program, program.header.on_report, io, [](vm_io_t const *) {});
+    return io->fields[VM_FIELD_X];
+}
+
+static vm_error_t verify_script(const char *src) {
+    static uint32_t image[VM_MAX_IMAGE_SIZE / 4];
+    size_t len = assemble(src, image);
+    vm_program_t program;
+    return vm_verify((const uint8_t *)image, len, MAX_FX, &program);
+}
+
+void test_report_latch() {
+    std::cout << "start test_report_latch..." << std::endl;
+    ReportLatch latch;
+    const uint8_t keyboard = 0, mouse = 1, consumer = 3, system = 6, other = 5;
+    bool ready[2] = {false, false};
+    uint8_t sent_ids[16];
+    uint8_t sent_payloads[16];
+    size_t sent = 0;
+    auto flush = [&]() {
+        latch.flush([&](uint8_t instance) { return ready[instance]; },
+                    [&](uint8_t instance, uint8_t id, uint8_t const* payload, uint16_t len) {
+                        (void)len;
+                        sent_ids[sent] = id;
+                        sent_payloads[sent++] = payload[0];
+                        // one report per poll, like the device endpoint
+                        ready[instance] = false;
+                        return true;
+                    });
+    };
+
+    // volume up tapped while the keyboard endpoint is busy
+    uint8_t press[2] = {0xE9, 0};
+    uint8_t release[2] = {0, 0};
+    latch.latch(keyboard, consumer, press, 2);
+    flush();
+    assert("busy endpoint should hold the report", sent == 0 && latch.is_pending(consumer));
+    latch.latch(keyboard, consumer, release, 2);
+    ready[keyboard] = true;
+    flush();
+    assert("press should go out first", sent == 1 && sent_payloads[0] == 0xE9);
+    assert("release should still be waiting", latch.is_pending(consumer));
+    ready[keyboard] = true;
+    flush();
+    assert("then the release", sent == 2 && sent_payloads[1] == 0);
+    assert("nothing should be left waiting", !latch.is_pending(consumer));
+    ready[keyboard] = true;
+    flush();
+    assert("a report should only go out once", sent == 2);
+
+    // backed up past the depth, the latest state still goes out last
+    sent = 0;
+    for (uint8_t i = 1; i <= REPORT_LATCH_DEPTH + 2; i++) {
+        uint8_t level[2] = {i, 0};
+        latch.latch(keyboard, consumer, level, 2);
+    }
+    for (int i = 0; i < REPORT_LATCH_DEPTH + 2; i++) {
+        ready[keyboard] = true;
+        flush();
+    }
+    assert("a full latch should keep its depth", sent == REPORT_LATCH_DEPTH);
+    assert("oldest should go out first", sent_payloads[0] == 1);
+    assert("latest state should go out last", sent_payloads[REPORT_LATCH_DEPTH - 1] == REPORT_LATCH_DEPTH + 2);
+
+    // two reports on one endpoint take turns, another endpoint isn't held up
+    sent = 0;
+    uint8_t sleep[1] = {0x82};
+    uint8_t buttons[4] = {7};
+    latch.latch(keyboard, consumer, press, 2);
+    latch.latch(keyboard, system, sleep, 1);
+    latch.latch(mouse, other, buttons, 4);
+    ready[keyboard] = ready[mouse] = true;
+    flush();
+    assert("one report per endpoint per poll", sent == 2);
+    assert("system control should wait its turn", latch.is_pending(system));
+    ready[keyboard] = true;
+    flush();
+    assert("system control should go out next poll", sent == 3 && sent_ids[2] == system && sent_payloads[2] == 0x82);
+
+    // failed sends stay latched
+    latch.latch(keyboard, consumer, release, 2);
+    latch.flush([](uint8_t) { return true; },
+                [](uint8_t, uint8_t, uint8_t const*, uint16_t) { return false; });
+    assert("failed send should stay latched", latch.is_pending(consumer));
+
+    uint8_t big[REPORT_LATCH_MAX_LEN + 1] = {0};
+    assert("oversized report shouldn't be latched", !latch.latch(keyboard, system, big, sizeof(big)));
+    assert("out of range id shouldn't be latched", !latch.latch(keyboard, REPORT_LATCH_IDS, press, 2));
+
+    std::cout << "test_report_latch PASS!" << std::endl;
+    reset();
+}
+
+void test_fx_vm() {
+    std::cout << "start test_fx_vm..." << std::endl;
+    vm_io_t io = {};
+
+    io.fields[VM_FIELD_X] = 10;
+    assert("should invert x", run_script(".device mouse\n.slot 1\nin r0, x\nneg r0\nout x, r0\n", &io) == -10);
+    assert("should loop", run_script(".device mouse\n.slot 1\nldi r0, 0\nloop 10\naddi r0, 3\nend\nout x, r0\n", &io) == 30);
+    assert("should nest loops", run_script(
+        ".device mouse\n.slot 1\n"
+        "ldi r0, 0\n"
+        "loop 4\n"
+        "  loop 5\n"
+        "    addi r0, 1\n"
+        "  end\n"
+        "end\n"
+        "out x, r0\n", &io) == 20);
+    // continue: skip the rest of the body on odd iterations
+    assert("should jump to the end of a loop", run_script(
+        ".device mouse\n.slot 1\n"
+        "ldi r0, 0\n"
+        "ldi r1, 0\n"
+        "loop 6\n"
+        "  addi r1, 1\n"
+        "  mov r2, r1\n"
+        "  ldi r3, 2\n"
+        "  mod r2, r3\n"
+        "  jnz r2, next\n"
+        "  addi r0, 100\n"
+        "next:\n"
+        "end\n"
+        "out x, r0\n", &io) == 300);
+    assert("should halt inside a loop", run_script(
+        ".device mouse\n.slot 1\nldi r0, 0\nout x, r0\nloop 10\naddi r0, 1\nout x, r0\nhalt\nend\n", &io) == 1);
+    assert("dividing by 0 should give 0", run_script(
+        ".device mouse\n.slot 1\nldi r0, 50\nldi r1, 0\ndiv r0, r1\nout x, r0\n", &io) == 0);
+    assert("ldi should take 32 bits", run_script(
+        ".device mouse\n.slot 1\nldi r0, 0x12345678\nshri r0, 16\nout x, r0\n", &io) == 0x1234);
+    memset(&io, 0, sizeof(io));
+    run_script(".device mouse\n.slot 1\nldi r0, 5\nldi r1, 70\nstx r1, r0\nst 3, r0\n", &io);
+    assert("state indexes should wrap", io.state[70 & (VM_STATE_WORDS - 1)] == 5 && io.state[3] == 5);
+
+    // rejected
+    char err[128];
+    uint32_t image[VM_MAX_IMAGE_SIZE / 4];
+    size_t len = 0;
+    assert("assembler should refuse backward jumps",
+        !vm_assemble(".device mouse\n.slot 1\ntop:\njmp top\n", (uint8_t *)image, sizeof(image), &len, err, sizeof(err))
+        && strcmp(err, "line 4: jumps only go forward") == 0);
+    assert("assembler should refuse unknown instructions",
+        !vm_assemble(".device mouse\n.slot 1\nwhile r0\n", (uint8_t *)image, sizeof(image), &len, err, sizeof(err)));
+    assert("assembler should refuse writing read only fields",
+        !vm_assemble(".device mouse\n.slot 1\nout param, r0\n", (uint8_t *)image, sizeof(image), &len, err, sizeof(err)));
+    len = assemble(".device mouse\n.slot 1\nldi r0, 1\njmp out\nout:\nhalt\n", image);
+    vm_program_t program;
+    assert("should verify", vm_verify((const uint8_t *)image, len, MAX_FX, &program) == VM_OK);
+    // patched by hand, past what the assembler would write
+    uint32_t *code = image + (sizeof(vm_header_t) / 4);
+    code[1] = vm_encode(VM_JMP, 0, 0, -2);
+    assert("should reject backward jumps", vm_verify((const uint8_t *)image, len, MAX_FX, &program) == VM_ERR_JUMP);
+    code[1] = vm_encode(VM_OUT, 0, 0, VM_FIELD_PARAM);
+    assert("should reject writing read only fields", vm_verify((const uint8_t *)image, len, MAX_FX, &program) == VM_ERR_FIELD);
+    code[1] = vm_encode(VM_LD, 0, 0, VM_STATE_WORDS);
+    assert("should reject state past the end", vm_verify((const uint8_t *)image, len, MAX_FX, &program) == VM_ERR_STATE);
+    code[1] = 0xFF;
+    assert("should reject unknown opcodes", vm_verify((const uint8_t *)image, len, MAX_FX, &program) == VM_ERR_OPCODE);
+    code[1] = vm_encode(VM_LOOP, 0, 0, 1 | (5 << 8));
+    assert("should reject loops past the end", vm_verify((const uint8_t *)image, len, MAX_FX, &program) == VM_ERR_LOOP);
+    assert("should reject a truncated image", vm_verify((const uint8_t *)image, len - 1, MAX_FX, &program) == VM_ERR_SIZE);
+    image[0] = 0;
+    assert("should reject other data", vm_verify((const uint8_t *)image, len, MAX_FX, &program) == VM_ERR_MAGIC);
+    assert("should reject slots past MAX_FX", verify_script(".device mouse\n.slot 5\nhalt\n") == VM_ERR_SLOT);
+    assert("should reject jumps into a loop", verify_script(
+        ".device mouse\n.slot 1\njmp in\nloop 2\nin:\naddi r0, 1\nend\n") == VM_ERR_JUMP);
+    assert("should reject jumps out of a loop", verify_script(
+        ".device mouse\n.slot 1\nloop 2\njmp out\naddi r0, 1\nend\nsend\nout:\nhalt\n") == VM_ERR_JUMP);
+    assert("should reject entries inside a loop", verify_script(
+        ".device mouse\n.slot 1\n.on_tick t\nloop 2\nt:\naddi r0, 1\nend\n") == VM_ERR_ENTRY);
+    assert("should reject runs over the cycle budget", verify_script(
+        ".device mouse\n.slot 1\nloop 255\nloop 255\naddi r0, 1\nend\nend\n") == VM_ERR_CYCLES);
+    len = assemble(".device mouse\n.slot 1\nloop 50\nloop 20\naddi r0, 1\nend\nend\n", image);
+    assert("should count every iteration", vm_verify((const uint8_t *)image, len, MAX_FX, &program) == VM_OK
+        && program.max_cycles == 1 + 50 + (50 * 20));
+
+    // as an FX, keeping state between reports and on ticks
+    TestHIDOutput hid;
+    MouseScript script(&hid);
+    len = assemble(
+        ".device mouse\n.slot 1\n.on_tick tick\n"
+        "ld r0, 0\n"
+        "addi r0, 1\n"
+        "st 0, r0\n"
+        "out x, r0\n"
+        "send\n"
+        "halt\n"
+        "tick:\n"
+        "in r0, param\n"
+        "out y, r0\n"
+        "send\n", image);
+    assert("should verify the FX", vm_verify((const uint8_t *)image, len, MAX_FX, &program) == VM_OK);
+    script.set_program(&program);
+    script.initialize(fx_us(0), 0.05f);
+    ha_mouse_report_t m = {0, 40, 40, 0, 0};
+    for (int i = 0; i < 3; i++) script.process_mouse_report(&m, fx_us(i));
+    assert("state should count the reports", hid.mouse_x_total == 1 + 2 + 3 && hid.mouse_y_total == 120);
+    script.tick(fx_us(5));
+    script.tick(fx_us(5) + 10);
+    assert("ticks should see the knob, once per ms", hid.mouse_report_count == 4 && hid.mouse_y_total == 170 && hid.mouse_x_total == 6);
+    script.initialize(fx_us(10), 0.0f);
+    script.process_mouse_report(&m, fx_us(11));
+    assert("initialize should clear the state", hid.mouse_x_total == 7);
+
+    std::cout << "test_fx_vm PASS!" << std::endl;
+    reset();
+}
+
+// hex for cmd:script:data
+static std::string to_hex(const uint32_t *image, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t b = ((const uint8_t *)image)[i];
+        hex += digits[b >> 4];
+        hex += digits[b & 0xF];
+    }
+    return hex;
+}
+
+void test_fx_script() {
+    std::cout << "start test_fx_script..." << std::endl;
+    InMemoryPersistence p;
+    p.initialize();
+    TestClock clock;
+    TestGpio gpio;
+    TestAdc adc;
+    TestPixel pixel;
+    TestHIDOutput hid;
+    CountingMouseFx mouse[MAX_FX + 1];
+    CountingKeyboardFx keyboard[MAX_FX + 1];
+    IMouseFx *mouse_fx[MAX_FX + 1];
+    IKeyboardFx *keyboard_fx[MAX_FX + 1];
+    for (size_t i = 0; i <= MAX_FX; i++) {
+        mouse_fx[i] = &mouse[i];
+        keyboard_fx[i] = &keyboard[i];
+    }
+    mouse[MAX_FX].initialized = true;
+    keyboard[MAX_FX].initialized = true;
+    PedalEngine engine(&p, mouse_fx, keyboard_fx, &clock, &gpio, &adc, &pixel);
+    InMemoryScriptStore store;
+    MouseScript mouse_script(&hid);
+    KeyboardScript keyboard_script(&hid);
+    ScriptLoader loader(&engine, &store, &mouse_script, &keyboard_script);
+    loader.initialize();
+    assert("nothing stored, nothing installed", !loader.is_installed());
+    adc.set_slot(0);
+    engine.initialize();
+
+    uint32_t image[VM_MAX_IMAGE_SIZE / 4];
+    size_t len = assemble(".device mouse\n.slot 1\nldi r0, 7\nout x, r0\nsend\n", image);
+    std::string hex = to_hex(image, len);
+    loader.begin();
+    assert("should take hex in chunks", loader.append_hex(hex.substr(0, 10).c_str()) && loader.append_hex(hex.substr(10).c_str()));
+    assert("should install", loader.finish() && loader.is_installed());
+    assert("should take over the active slot", mouse_fx[0] == &mouse_script && !mouse[0].initialized);
+    assert("should keep the slot's color", mouse_script.get_indicator_color() == mouse[0].get_indicator_color());
+
+    // momentary on, the script gets the reports
+    gpio.levels[PEDAL_INPUT_TOGGLE_1] = false;
+    for (clock.now = 1; clock.now < 100; clock.now++) engine.task(fx_us(clock.now));
+    gpio.levels[PEDAL_INPUT_FOOT_SWITCH] = false;
+    for (; clock.now < 140; clock.now++) engine.task(fx_us(clock.now));
+    gpio.levels[PEDAL_INPUT_FOOT_SWITCH] = true;
+    for (; clock.now < 180; clock.now++) engine.task(fx_us(clock.now));
+    assert("fx should be on", engine.is_fx_enabled());
+    ha_mouse_report_t m = {0, 1, 0, 0, 0};
+    engine.on_mouse_report(&m);
+    engine.mouse_task(fx_us(clock.now + PEDAL_MOUSE_REPORT_MS));
+    assert("the script should run", hid.mouse_report_count == 1 && hid.mouse_x_total == 7);
+
+    // saved once the store gets to it, and back after a reboot
+    assert("should be saving", store.isBusy());
+    store.task();
+    CountingMouseFx rebooted[MAX_FX + 1];
+    IMouseFx *rebooted_fx[MAX_FX + 1];
+    for (size_t i = 0; i <= MAX_FX; i++) rebooted_fx[i] = &rebooted[i];
+    PedalEngine rebooted_engine(&p, rebooted_fx, keyboard_fx, &clock, &gpio, &adc, &pixel);
+    MouseScript rebooted_script(&hid);
+    ScriptLoader rebooted_loader(&rebooted_engine, &store, &rebooted_script, &keyboard_script);
+    rebooted_loader.initialize();
+    assert("should install the stored script", rebooted_loader.is_installed() && rebooted_fx[0] == &rebooted_script);
+    assert("not before the engine starts it", rebooted[0].init_count == 0);
+
+    // bad uploads leave the installed one alone
+    loader.begin();
+    assert("should refuse bad hex", !loader.append_hex("12x4"));
+    assert("should need a begin", !loader.finish());
+    len = assemble(".device keyboard\n.slot 2\nloop 255\nloop 255\nsend\nend\nend\n", image);
+    loader.begin();
+    loader.append_hex(to_hex(image, len).c_str());
+    assert("should refuse unbounded scripts", !loader.finish());
+    assert("should say why", log_collection.back() == "script rejected: too many cycles");
+    assert("should keep the installed one", mouse_fx[0] == &mouse_script);
+
+    // another device and slot, the first script's FX comes back
+    len = assemble(".device keyboard\n.slot 2\nin r0, key0\nout key1, r0\nsend\n", image);
+    loader.begin();
+    loader.append_hex(to_hex(image, len).c_str());
+    assert("should replace the script", loader.finish());
+    assert("the native FX should be back", mouse_fx[0] == &mouse[0] && mouse[0].initialized);
+    assert("in the other slot", keyboard_fx[1] == &keyboard_script && !keyboard[1].initialized);
+    // the slot's native FX gets swapped while the script is in it
+    CountingKeyboardFx looper;
+    loader.swap_replaced_keyboard_fx(&keyboard[1], &looper);
+    assert("the script should stay put", keyboard_fx[1] == &keyboard_script);
+    store.task();
+    assert("should clear", loader.clear() && !loader.is_installed());
+    assert("the swapped in FX should come back", keyboard_fx[1] == &looper && !keyboard[1].initialized);
+    uint32_t stored_len = 0;
+    assert("should erase the stored one", store.getScript(&stored_len) == nullptr);
+    uint32_t violations = looper.violations;
+    for (size_t i = 0; i <= MAX_FX; i++) violations += mouse[i].violations + keyboard[i].violations;
+    assert("swaps should pair initialize and deinit", violations == 0);
+
+    Repl repl(&p, &hid);
+    repl.process(input("cmd:script:begin"));
+    repl.process(input("cmd:script:data:0a0b"));
+    repl.process(input("cmd:script:data:0c"));
+    repl.process(input("cmd:script:end"));
+    repl.process(input("cmd:script:clear"));
+    assert("repl should pass the upload on", script_begin_count == 1 && script_data == "0a0b0c" &&
+        script_end_count == 1 && script_clear_count == 1);
+
+    std::cout << "test_fx_script PASS!" << std::endl;
+    reset();
+}
+
+void test_key_loop() {
+    std::cout << "start test_key_loop..." << std::endl;
+    // small enough that events wrap around the end of the ring
+    KeyLoop<64> loop;
+    loop.clear();
+    key_loop_event_t events[] = {
+        {10, KEY_LOOP_PRESS, HID_KEY_A, 0},
+        {70, KEY_LOOP_PRESS, HID_KEY_A + 1, 0x02},
+        {90, KEY_LOOP_RELEASE, HID_KEY_A, 0},
+        {95, KEY_LOOP_RELEASE, HID_KEY_A + 1, 0},
+        {5000, KEY_LOOP_PASS_END, 0, 0},
+    };
+    const size_t count = sizeof(events) / sizeof(events[0]);
+    for (size_t i = 0; i < count; i++) assert("events should fit", loop.push(events[i]));
+    assert("release of the last key pressed should go without its keycode", loop.get_used() == 2 + 4 + 3 + 1 + 3);
+    assert("loop should count its events", loop.get_event_count() == count);
+
+    // round and round, every pass comes out as it went in
+    for (int pass = 0; pass < 20; pass++) {
+        for (size_t i = 0; i < count; i++) {
+            key_loop_event_t e;
+            assert("loop shouldn't run dry", loop.peek(&e));
+            assert("offset should survive the ring", e.offset_ms == events[i].offset_ms);
+            assert("kind should survive the ring", e.kind == events[i].kind);
+            assert("keycode should survive the ring", e.code == events[i].code);
+            assert("modifier should survive the ring", e.modifier == events[i].modifier);
+            loop.pop();
+            assert("event should go back on the end", loop.push(e));
+        }
+    }
+
+    // never overwrites
+    size_t pushed = 0;
+    key_loop_event_t filler = {0, KEY_LOOP_PRESS, HID_KEY_A, 0x01};
+    while (loop.push(filler)) pushed++;
+    assert("full loop should refuse events", pushed > 0 && loop.get_free() < KEY_LOOP_MAX_EVENT_BYTES);
+
+    // a thousand keystrokes at typing speed in well under 8K
+    KeyLoop<KBD_LOOP_BUFFER_SIZE> big;
+    big.clear();
+    for (uint32_t k = 0; k < 1000; k++) {
+        uint8_t code = HID_KEY_A + (k % 26);
+        big.push({k * 100, KEY_LOOP_PRESS, code, 0});
+        big.push({(k * 100) + 60, KEY_LOOP_RELEASE, code, 0});
+    }
+    assert("keystroke should take 5 bytes", big.get_used() <= 5 * 1000);
+
+    std::cout << "test_key_loop PASS!" << std::endl;
+    reset();
+}
+
+void test_keyboard_looper() {
+    std::cout << "start test_keyboard_looper..." << std::endl;
+    TestHIDOutput hid;
+    InMemoryPersistence p;
+    Repl repl(&p, &hid);
+    KeyboardLooper looper(&hid, &keyboard_arena);
+    looper.initialize(fx_us(0), 0.0f);
+
+    uint32_t now = 1;
+    ha_keyboard_report_t r = {0, 0, {0, 0, 0, 0, 0, 0}};
+    auto key = [&](uint8_t code, uint8_t modifier) {
+        r.modifier = modifier;
+        r.keycode[0] = code;
+        looper.process_keyboard_report(&r, fx_us(now));
+    };
+    // first time each key goes down from here to until
+    uint32_t pressed_at[256];
+    auto run = [&](uint32_t until) {
+        for (size_t i = 0; i < 256; i++) pressed_at[i] = 0;
+        KeySet before = hid.last_keys;
+        for (; now < until; now++) {
+            looper.tick(fx_us(now));
+            for (size_t code = 0; code < 256; code++) {
+                if (hid.last_keys.test(code) && !before.test(code) && !pressed_at[code]) pressed_at[code] = now;
+            }
+            before = hid.last_keys;
+        }
+    };
+    // typed at at, released 50ms later
+    auto type = [&](uint8_t code, uint8_t modifier, uint32_t at) {
+        run(at);
+        key(code, modifier);
+        run(at + 50);
+        key(0, 0);
+    };
+
+    type(HID_KEY_SCROLL_LOCK, 0, 100);
+    assert("record key should start recording", looper.get_mode() == KBD_LOOP_RECORDING);
+    type(HID_KEY_A, 0, 200);
+    type(HID_KEY_A + 1, 0, 400);
+    type(HID_KEY_A + 2, 0x02, 600);
+    type(HID_KEY_SCROLL_LOCK, 0, 1000);
+    assert("record key should start playing", looper.get_mode() == KBD_LOOP_PLAYING);
+    assert("record key should never reach the host", hid.key_press_counts[HID_KEY_SCROLL_LOCK] == 0);
+    assert("typing should go through while recording",
+           hid.key_press_counts[HID_KEY_A] == 1 && hid.key_press_counts[HID_KEY_A + 2] == 1);
+    assert("loop should be as long as the recording", looper.get_loop_length_ms() == 900);
+    assert("loop should hold every press and release", looper.get_event_count() == 6);
+
+    // plays back as it was typed, from when recording stopped
+    run(1900);
+    assert("first key should play at its offset", pressed_at[HID_KEY_A] == 1100);
+    assert("second key should play at its offset", pressed_at[HID_KEY_A + 1] == 1300);
+    assert("third key should play at its offset", pressed_at[HID_KEY_A + 2] == 1500);
+    run(2050);
+    assert("next pass should start a loop later", pressed_at[HID_KEY_A] == 2000);
+
+    // overdub goes in at the same spot on the next pass
+    type(HID_KEY_SCROLL_LOCK, 0, 2050);
+    assert("record key should start overdubbing", looper.get_mode() == KBD_LOOP_OVERDUB);
+    type(HID_KEY_A + 3, 0, 2350);
+    type(HID_KEY_SCROLL_LOCK, 0, 2500);
+    assert("record key should stop overdubbing", looper.get_mode() == KBD_LOOP_PLAYING);
+    assert("overdub should add to the loop", looper.get_event_count() == 8);
+    run(3400);
+    assert("loop should carry on after an overdub", pressed_at[HID_KEY_A] == 2900);
+    assert("overdub should play where it was typed", pressed_at[HID_KEY_A + 3] == 3250);
+
+    // holding the record key throws the loop away
+    hid.reset_counts();
+    key(HID_KEY_SCROLL_LOCK, 0);
+    run(now + KBD_LOOP_CLEAR_HOLD_MS + 1);
+    key(0, 0);
+    assert("long hold should clear the loop", looper.get_mode() == KBD_LOOP_EMPTY);
+    uint32_t cleared_presses = hid.key_press_counts[HID_KEY_A];
+    run(now + 2000);
+    assert("cleared loop shouldn't play", hid.key_press_counts[HID_KEY_A] == cleared_presses);
+    assert("cleared loop should let go of every key", !hid.last_keys.any());
+
+    // a key pressed along with the record key is the first thing recorded
+    run(now + 100);
+    r.keycode[1] = HID_KEY_A;
+    key(HID_KEY_SCROLL_LOCK, 0);
+    r.keycode[1] = 0;
+    run(now + 50);
+    key(0, 0);
+    type(HID_KEY_SCROLL_LOCK, 0, now + 200);
+    assert("key pressed with the record key should be in the loop", looper.get_event_count() == 2);
+    key(HID_KEY_SCROLL_LOCK, 0);
+    run(now + KBD_LOOP_CLEAR_HOLD_MS + 1);
+    key(0, 0);
+    assert("should clear again", looper.get_mode() == KBD_LOOP_EMPTY);
+
+    // quantized to sixteenths, 125ms at the default tempo
+    looper.update_parameter(0.3f);
+    uint32_t start = now + 100;
+    type(HID_KEY_SCROLL_LOCK, 0, start);
+    type(HID_KEY_A, 0, start + 100);
+    type(HID_KEY_A + 1, 0, start + 300);
+    type(HID_KEY_SCROLL_LOCK, 0, start + 900);
+    uint32_t pass_start = start + 900;
+    run(pass_start + 875 + 200);
+    assert("press should snap to the grid", pressed_at[HID_KEY_A] == pass_start + 125);
+    assert("press should snap to the nearest step", pressed_at[HID_KEY_A + 1] == pass_start + 250);
+    run(pass_start + (2 * 875) + 200);
+    assert("pass should be a whole number of steps", pressed_at[HID_KEY_A] == pass_start + (2 * 875) + 125);
+
+    // a burst faster than the host takes reports, nothing is dropped
+    key(HID_KEY_SCROLL_LOCK, 0);
+    run(now + KBD_LOOP_CLEAR_HOLD_MS + 1);
+    key(0, 0);
+    looper.update_parameter(0.0f);
+    type(HID_KEY_SCROLL_LOCK, 0, now + 10);
+    const uint32_t burst = 100;
+    for (uint32_t k = 0; k < burst; k++) {
+        run(now + 1);
+        key(HID_KEY_A + (k % 26), 0);
+        run(now + 1);
+        key(0, 0);
+    }
+    // long enough for the slow host to get through a whole pass
+    type(HID_KEY_SCROLL_LOCK, 0, now + 800);
+    assert("burst should be recorded", looper.get_event_count() == 2 * burst);
+    assert("burst should pack into 3 bytes a keystroke", looper.get_loop_bytes() <= 3 * burst + 8);
+    hid.reset_counts();
+    for (uint32_t end = now + 1000; now < end; now++) {
+        // host polls every other ms
+        hid.ready = now % 2 == 0;
+        looper.tick(fx_us(now));
+    }
+    hid.ready = true;
+    uint32_t total = 0;
+    for (size_t code = 0; code < 256; code++) total += hid.key_press_counts[code];
+    assert("every looped keystroke should reach the host", total == burst);
+    assert("loop should still hold every event", looper.get_event_count() == 2 * burst);
+
+    repl.process(input("cmd:kbd_looper:on"));
+    assert("repl should turn the keyboard looper on", p.isKeyboardLooperEnabled());
+    repl.process(input("cmd:kbd_looper:off"));
+    assert("repl should turn the keyboard looper off", !p.isKeyboardLooperEnabled());
+
+    looper.deinit();
+    assert("looper should hand its state back", keyboard_arena.get_used() == 0);
+
+    std::cout << "test_keyboard_looper PASS!" << std::endl;
+    reset();
+}
+
 int main(int argc, char const *argv[]){
     test_repl();
+    test_mouse_looper();
+    test_mouse_reverb();
+    test_filters();
+    test_random();
+    test_keyboard_delay();
+    test_key_state();
+    test_nkro();
+    test_key_sequencer();
+    test_profiler();
+    test_pedal_engine();
+    test_mouse_accel();
+    test_led_compositor();
+    test_fx_arena();
+    test_tempo_clock();
+    test_us_timebase();
+    test_boot();
+    test_fx_deadline();
+    test_fx_failover_release();
+    test_mouse_bypass();
+    test_report_queue();
+    test_report_latch();
+    test_fx_vm();
+    test_fx_script();
+    test_key_loop();
+    test_keyboard_looper();
     return 0;
 }
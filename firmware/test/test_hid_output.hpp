@@ -8,11 +8,68 @@ class TestHIDOutput : public IHIDOutput {
   void send_mouse_report(uint8_t buttons, int8_t x, int8_t y, int8_t wheel,
                          int8_t pan, bool process = false) {
     log_line("m report %d %d %d", x, y, buttons);
+    last_mouse_buttons = buttons;
+    mouse_report_count++;
+    mouse_x_total += x;
+    mouse_y_total += y;
   }
   void send_keyboard_report(uint8_t modifier, uint8_t reserved,
                             const uint8_t keycode[6]) {
     (void)reserved;
+    last_modifier = modifier;
     log_line("k report %u %u %u %u %u %u", keycode[0], keycode[1], keycode[2],
              keycode[3], keycode[4], keycode[5]);
+    KeySet keys;
+    for (size_t i = 0; i < 6; i++) {
+      if (keycode[i]) keys.set(keycode[i]);
+    }
+    record_keys(keys);
   }
-};
\ No newline at end of file
+  void send_keys(uint8_t modifier, KeySet const &keys) {
+    last_modifier = modifier;
+    log_line("k set report, %u keys", (unsigned)keys.count());
+    // behave like a 6KRO output unless the test raised the capacity
+    if (keys.count() > key_capacity) {
+      IHIDOutput::send_keys(modifier, keys);
+      return;
+    }
+    record_keys(keys);
+  }
+  size_t max_keys() { return key_capacity; }
+  bool keyboard_ready() { return ready; }
+  bool mouse_ready() { return mouse_idle; }
+  void reset_counts() {
+    mouse_report_count = 0;
+    mouse_x_total = 0;
+    mouse_y_total = 0;
+    keyboard_report_count = 0;
+    for (size_t i = 0; i < 256; i++) key_press_counts[i] = 0;
+  }
+
+  uint32_t mouse_report_count = 0;
+  int64_t mouse_x_total = 0;
+  int64_t mouse_y_total = 0;
+  uint8_t last_mouse_buttons = 0;
+  uint32_t keyboard_report_count = 0;
+  uint32_t key_press_counts[256] = {0};
+  size_t key_capacity = REPORT_KEYCODE_COUNT;
+  bool ready = true;
+  // false while the host hasn't picked up the last mouse report
+  bool mouse_idle = true;
+  KeySet last_keys;
+  uint8_t last_modifier = 0;
+
+ private:
+  // count presses, keys that weren't down in the previous report
+  void record_keys(KeySet const &keys) {
+    keyboard_report_count++;
+    for (size_t w = 0; w < KEY_SET_WORDS; w++) {
+      uint32_t pressed = keys.words[w] & ~last_keys.words[w];
+      while (pressed) {
+        key_press_counts[(w << 5) | __builtin_ctz(pressed)]++;
+        pressed &= pressed - 1;
+      }
+    }
+    last_keys = keys;
+  }
+};
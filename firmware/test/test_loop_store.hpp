@@ -0,0 +1,59 @@
+#include <string.h>
+
+#include "loop_store.hpp"
+
+#define TEST_LOOP_SLOT_COUNT 4
+#define TEST_LOOP_MAX_SAMPLES 4096
+
+// mimics FlashLoopStore, writes only land once task() runs
+class InMemoryLoopStore : public ILoopStore {
+ public:
+  void initialize() {
+    for (size_t i = 0; i < TEST_LOOP_SLOT_COUNT; i++) counts[i] = 0;
+  }
+  uint8_t getSlotCount() { return TEST_LOOP_SLOT_COUNT; }
+  uint32_t getSlotCapacity() { return TEST_LOOP_MAX_SAMPLES; }
+  bool saveLoop(uint8_t slot, const mouse_loop_sample_t *samples,
+                uint32_t count, uint32_t duration_us) {
+    if (busy || slot >= TEST_LOOP_SLOT_COUNT) return false;
+    if (count > TEST_LOOP_MAX_SAMPLES) return false;
+    busy = true;
+    pending_slot = slot;
+    pending = samples;
+    pending_count = count;
+    pending_duration_us = duration_us;
+    counts[slot] = 0;
+    return true;
+  }
+  bool eraseLoop(uint8_t slot) {
+    if (busy || slot >= TEST_LOOP_SLOT_COUNT) return false;
+    counts[slot] = 0;
+    return true;
+  }
+  const mouse_loop_sample_t *getLoop(uint8_t slot, uint32_t *count,
+                                     uint32_t *duration_us) {
+    if (slot >= TEST_LOOP_SLOT_COUNT || counts[slot] == 0) return nullptr;
+    *count = counts[slot];
+    *duration_us = durations[slot];
+    return loops[slot];
+  }
+  bool isBusy() { return busy; }
+  void task() {
+    if (!busy) return;
+    memcpy(loops[pending_slot], pending,
+           pending_count * sizeof(mouse_loop_sample_t));
+    counts[pending_slot] = pending_count;
+    durations[pending_slot] = pending_duration_us;
+    busy = false;
+  }
+
+ private:
+  mouse_loop_sample_t loops[TEST_LOOP_SLOT_COUNT][TEST_LOOP_MAX_SAMPLES];
+  uint32_t counts[TEST_LOOP_SLOT_COUNT] = {0};
+  uint32_t durations[TEST_LOOP_SLOT_COUNT] = {0};
+  bool busy = false;
+  uint8_t pending_slot = 0;
+  const mouse_loop_sample_t *pending = nullptr;
+  uint32_t pending_count = 0;
+  uint32_t pending_duration_us = 0;
+};
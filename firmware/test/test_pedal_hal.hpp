@@ -0,0 +1,128 @@
+#include <stdint.h>
+
+#include "hid_fx.hpp"
+#include "pedal_hal.hpp"
+
+class TestClock : public IClock {
+ public:
+  fx_time_t now_us() { return fx_us(now); }
+  // ms, the engine tests step through whole ms
+  uint32_t now = 0;
+};
+
+class TestGpio : public IGpio {
+ public:
+  bool read(pedal_input_t input) { return levels[input]; }
+  // pulled up, every switch open
+  bool levels[3] = {true, true, true};
+};
+
+class TestAdc : public IAdc {
+ public:
+  uint16_t read_knob() { return value; }
+  // knob reading in the middle of an FX slot's range
+  void set_slot(uint8_t slot) {
+    value = (uint16_t)(((slot + 0.5f) / 4.0f) * 4096.0f);
+  }
+  uint16_t value = 0;
+};
+
+class TestPixel : public IPixel {
+ public:
+  void set_pixel(uint32_t color) {
+    last_color = color;
+    frame_count++;
+  }
+  uint32_t last_color = 0;
+  uint32_t frame_count = 0;
+};
+
+// Counts calls and flags any that hit an FX that isn't initialized. With a
+// clock and stall_ms set, every call takes that long, report_stall_ms is on
+// top of that for reports alone.
+class CountingFx {
+ public:
+  void on_initialize() {
+    if (initialized) violations++;
+    initialized = true;
+    init_count++;
+  }
+  void on_deinit() {
+    if (!initialized) violations++;
+    initialized = false;
+  }
+  void on_use() {
+    if (!initialized) violations++;
+    use_count++;
+    if (clock) clock->now += stall_ms;
+  }
+  TestClock *clock = nullptr;
+  uint32_t stall_ms = 0;
+  uint32_t report_stall_ms = 0;
+  bool initialized = false;
+  uint32_t init_count = 0;
+  uint32_t use_count = 0;
+  uint32_t violations = 0;
+};
+
+class CountingMouseFx : public IMouseFx, public CountingFx {
+ public:
+  CountingMouseFx() : IMouseFx(nullptr) {}
+  void initialize(fx_time_t time_us, float param_percentage) {
+    (void)time_us;
+    (void)param_percentage;
+    on_initialize();
+  }
+  void deinit() { on_deinit(); }
+  void update_parameter(float percentage) { (void)percentage; }
+  void tick(fx_time_t time_us) {
+    (void)time_us;
+    on_use();
+  }
+  void process_mouse_report(ha_mouse_report_t const *report,
+                            fx_time_t time_us) {
+    (void)time_us;
+    on_use();
+    if (clock) clock->now += report_stall_ms;
+    x_total += report->x;
+  }
+  int64_t x_total = 0;
+};
+
+class CountingKeyboardFx : public IKeyboardFx, public CountingFx {
+ public:
+  CountingKeyboardFx() : IKeyboardFx(nullptr) {}
+  void initialize(fx_time_t time_us, float param_percentage) {
+    (void)time_us;
+    (void)param_percentage;
+    on_initialize();
+  }
+  void deinit() { on_deinit(); }
+  void update_parameter(float percentage) { (void)percentage; }
+  void tick(fx_time_t time_us) {
+    (void)time_us;
+    on_use();
+  }
+  void process_keyboard_report(ha_keyboard_report_t const *report,
+                               fx_time_t time_us) {
+    (void)report;
+    (void)time_us;
+    on_use();
+    if (clock) clock->now += report_stall_ms;
+  }
+};
+
+// holds held_key down on top of every report it passes on, like an echo
+// that's still sounding
+class HoldingKeyboardFx : public CountingKeyboardFx {
+ public:
+  explicit HoldingKeyboardFx(IHIDOutput *output) { hid_output = output; }
+  void process_keyboard_report(ha_keyboard_report_t const *report,
+                               fx_time_t time_us) {
+    CountingKeyboardFx::process_keyboard_report(report, time_us);
+    ha_keyboard_report_t held = *report;
+    held.keycode[5] = held_key;
+    hid_output->send_keyboard_report(held.modifier, 0, held.keycode);
+  }
+  uint8_t held_key = 0;
+};
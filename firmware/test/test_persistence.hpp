@@ -21,13 +21,50 @@ class InMemoryPersistence : public IPersistence {
   bool shouldInvertFootswitch() { return invert_footswitch; }
   void setMouseSpeedLevel(uint8_t level) { mouse_speed_level = level; }
   uint8_t getMouseSpeedLevel() { return mouse_speed_level; }
+  void setNkroEnabled(bool enabled) { nkro_enabled = enabled; }
+  bool isNkroEnabled() { return nkro_enabled; }
+  void setDelayCurve(uint8_t curve) { delay_curve = curve; }
+  uint8_t getDelayCurve() { return delay_curve; }
+  void setMouseAccelCurve(uint8_t curve) { accel_curve = curve; }
+  uint8_t getMouseAccelCurve() { return accel_curve; }
+  void setMouseAccelStrength(uint8_t strength) { accel_strength = strength; }
+  uint8_t getMouseAccelStrength() { return accel_strength; }
+  uint8_t getMouseAccelPointSpeed(uint8_t point) { return accel_points[point][0]; }
+  uint8_t getMouseAccelPointGain(uint8_t point) { return accel_points[point][1]; }
+  void setMouseAccelPoint(uint8_t point, uint8_t speed, uint8_t gain) {
+    accel_points[point][0] = speed;
+    accel_points[point][1] = gain;
+  }
+  uint32_t getTempoPeriodUs() { return tempo_period_us; }
+  void setTempoPeriodUs(uint32_t period_us) { tempo_period_us = period_us; }
+  bool isLoopSyncEnabled() { return loop_sync_enabled; }
+  void setLoopSyncEnabled(bool enabled) { loop_sync_enabled = enabled; }
+  bool isKeyboardLooperEnabled() { return keyboard_looper_enabled; }
+  void setKeyboardLooperEnabled(bool enabled) { keyboard_looper_enabled = enabled; }
+  uint16_t getReverbPreDelayMs() { return reverb_pre_delay_ms; }
+  void setReverbPreDelayMs(uint16_t ms) { reverb_pre_delay_ms = ms; }
+  uint8_t getDelayRepeats() { return delay_repeats; }
+  void setDelayRepeats(uint8_t repeats) { delay_repeats = repeats; }
   void resetToDefaults() {
     active_slot = 0;
     report_mode = 0;
     mouse_speed_level = 0;
+    delay_curve = 0;
+    accel_curve = 0;
+    accel_strength = 50;
+    for (size_t i = 0; i < MOUSE_ACCEL_POINTS; i++) {
+      accel_points[i][0] = i * 16;
+      accel_points[i][1] = 10;
+    }
     raw_hid_logs_enabled = false;
     flashing_enabled = true;
     invert_footswitch = false;
+    nkro_enabled = false;
+    loop_sync_enabled = false;
+    keyboard_looper_enabled = false;
+    tempo_period_us = 500000;
+    reverb_pre_delay_ms = 24;
+    delay_repeats = 0;
     led_brightness = 0.0f;
     slots[0] = 0;
     slots[1] = 0;
@@ -39,9 +76,19 @@ class InMemoryPersistence : public IPersistence {
   uint8_t active_slot;
   uint8_t report_mode;
   uint8_t mouse_speed_level;
+  uint8_t delay_curve;
+  uint8_t accel_curve;
+  uint8_t accel_strength;
+  uint8_t accel_points[MOUSE_ACCEL_POINTS][2];
   bool raw_hid_logs_enabled;
   bool flashing_enabled;
   bool invert_footswitch;
+  bool nkro_enabled;
+  bool loop_sync_enabled;
+  bool keyboard_looper_enabled;
+  uint32_t tempo_period_us;
+  uint16_t reverb_pre_delay_ms;
+  uint8_t delay_repeats;
   float led_brightness;
   uint32_t slots[4] = {0, 0, 0, 0};
 };
\ No newline at end of file
@@ -0,0 +1,42 @@
+#include <string.h>
+
+#include "fx_vm.hpp"
+#include "script_store.hpp"
+
+// mimics FlashScriptStore, writes only land once task() runs
+class InMemoryScriptStore : public IScriptStore {
+ public:
+  void initialize() {}
+  bool saveScript(const uint8_t *image, uint32_t len) {
+    if (busy || len == 0 || len > VM_MAX_IMAGE_SIZE) return false;
+    busy = true;
+    pending = image;
+    pending_len = len;
+    len_stored = 0;
+    return true;
+  }
+  bool eraseScript() {
+    if (busy) return false;
+    len_stored = 0;
+    return true;
+  }
+  const uint8_t *getScript(uint32_t *len) {
+    if (busy || len_stored == 0) return nullptr;
+    *len = len_stored;
+    return (const uint8_t *)image;
+  }
+  bool isBusy() { return busy; }
+  void task() {
+    if (!busy) return;
+    memcpy(image, pending, pending_len);
+    len_stored = pending_len;
+    busy = false;
+  }
+
+ private:
+  uint32_t image[VM_MAX_IMAGE_SIZE / 4];
+  uint32_t len_stored = 0;
+  bool busy = false;
+  const uint8_t *pending = nullptr;
+  uint32_t pending_len = 0;
+};
@@ -22,10 +22,77 @@ void refresh_settings() {}
 
 const char *get_serial_number() { return "abc"; }
 
-uint8_t get_random_byte() { return 0b1010; }
-
 void reboot_to_uf2(unsigned int gpio, uint32_t events) { reboot_count++; }
 
+// most recent loop command from the repl, slot or -1
+static int saved_loop_slot = -1;
+static int recalled_loop_slot = -1;
+static int cleared_loop_slot = -1;
+
+bool save_mouse_loop(uint8_t slot) {
+  saved_loop_slot = slot;
+  return true;
+}
+
+bool recall_mouse_loop(uint8_t slot) {
+  recalled_loop_slot = slot;
+  return true;
+}
+
+bool clear_mouse_loop(uint8_t slot) {
+  cleared_loop_slot = slot;
+  return true;
+}
+
+// how many times the repl asked for a profiler dump/reset
+static uint16_t profile_dump_count = 0;
+static uint16_t profile_reset_count = 0;
+static uint16_t memory_dump_count = 0;
+static uint16_t boot_dump_count = 0;
+static uint16_t host_rate_dump_count = 0;
+
+bool dump_profile() {
+  profile_dump_count++;
+  return true;
+}
+
+bool reset_profile() {
+  profile_reset_count++;
+  return true;
+}
+
+void dump_memory() { memory_dump_count++; }
+
+void dump_boot_timeline() { boot_dump_count++; }
+
+void dump_host_rate() { host_rate_dump_count++; }
+
+// what the repl passed on of a script upload
+static std::string script_data;
+static uint16_t script_begin_count = 0;
+static uint16_t script_end_count = 0;
+static uint16_t script_clear_count = 0;
+
+void begin_fx_script() {
+  script_begin_count++;
+  script_data.clear();
+}
+
+bool add_fx_script_data(const char *hex) {
+  script_data += hex;
+  return true;
+}
+
+bool end_fx_script() {
+  script_end_count++;
+  return true;
+}
+
+bool clear_fx_script() {
+  script_clear_count++;
+  return true;
+}
+
 void dump_logs() {
   std::cout << "LOGS:" << std::endl;
   size_t lc = log_collection.size();
@@ -37,4 +104,16 @@ void dump_logs() {
 void reset() {
   log_collection.clear();
   reboot_count = 0;
+  saved_loop_slot = -1;
+  recalled_loop_slot = -1;
+  cleared_loop_slot = -1;
+  profile_dump_count = 0;
+  profile_reset_count = 0;
+  memory_dump_count = 0;
+  boot_dump_count = 0;
+  host_rate_dump_count = 0;
+  script_data.clear();
+  script_begin_count = 0;
+  script_end_count = 0;
+  script_clear_count = 0;
 }
\ No newline at end of file
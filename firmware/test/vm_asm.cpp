@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fx_vm_asm.hpp"
+#include "pedal_engine.hpp"
+
+// bytes per cmd:script:data line, well inside the REPL's line buffer
+#define VM_ASM_CHUNK 64
+
+// Assembles an FX script and prints the REPL commands that upload it, paste
+// or pipe them into the pedal's serial port:
+//   vm_asm script.s > /dev/ttyACM0
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s script.s\n", argv[0]);
+    return 2;
+  }
+  FILE *f = fopen(argv[1], "rb");
+  if (!f) {
+    perror(argv[1]);
+    return 1;
+  }
+  static char src[64 * 1024];
+  size_t src_len = fread(src, 1, sizeof(src) - 1, f);
+  fclose(f);
+  src[src_len] = 0;
+
+  static uint8_t image[VM_MAX_IMAGE_SIZE];
+  size_t len = 0;
+  char err[128];
+  if (!vm_assemble(src, image, sizeof(image), &len, err, sizeof(err))) {
+    fprintf(stderr, "%s: %s\n", argv[1], err);
+    return 1;
+  }
+  vm_program_t program;
+  vm_error_t verified = vm_verify(image, len, MAX_FX, &program);
+  if (verified != VM_OK) {
+    fprintf(stderr, "%s: %s\n", argv[1], vm_error_names[verified]);
+    return 1;
+  }
+  fprintf(stderr, "%u instructions, %lu cycles max\n",
+          (unsigned)program.header.code_len,
+          (unsigned long)program.max_cycles);
+
+  printf("cmd:script:begin\r\n");
+  for (size_t i = 0; i < len; i += VM_ASM_CHUNK) {
+    printf("cmd:script:data:");
+    for (size_t j = i; j < len && j < i + VM_ASM_CHUNK; j++) {
+      printf("%02x", image[j]);
+    }
+    printf("\r\n");
+  }
+  printf("cmd:script:end\r\n");
+  return 0;
+}